@@ -1,4 +1,6 @@
 -- This schema uses Atom 1.0 nomenclature --
+pragma auto_vacuum = incremental;
+
 begin;
 
 pragma user_version = 3;
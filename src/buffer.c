@@ -46,6 +46,18 @@ void buffer_in(Buffer *b, const char * data, int in_size) {
   b->length += in_size;
 }
 
+/* Takes the contents out of the buffer, leaving it empty.
+ *
+ * The caller must free the returned contents.
+ */
+char * buffer_release(Buffer *b) {
+  char *buf = b->buf;
+  b->buf = NULL;
+  b->capacity = 0;
+  b->length = 0;
+  return buf;
+}
+
 void free_buffer(Buffer *b) {
   if (b) {
     free(b->buf);
@@ -39,6 +39,7 @@ typedef struct BUFFER {
 
 extern Buffer * new_buffer(int size);
 extern void buffer_in(Buffer *b, const char * data, int in_size);
+extern char * buffer_release(Buffer *b);
 extern void free_buffer(Buffer *b);
 
 #ifdef	__cplusplus
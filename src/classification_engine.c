@@ -156,6 +156,7 @@ static ClassificationJob * create_classification_job(const char * tag_url) {
     job->items_classified = 0;
     job->auto_cleanup     = false;
     job->first_time_tried = -1;
+    job->next_in_batch    = NULL;
     NOW(job->created_at);
   }
 
@@ -226,10 +227,36 @@ float cjob_duration(const ClassificationJob *job) {
 
 struct JobStuff {
   ClassificationJob *job;
+  TaggerCache *tagger_cache;
   Tagger *tagger;
   Array *taggings;
   double threshold;
   Credentials * credentials;
+  /* Set once the job has seen all the items it needs to */
+  int finished;
+  /* Set if an item couldn't be classified, the job's taggings are then incomplete */
+  int failed;
+  /* Number of threads that can classify the job's items */
+  int threads;
+};
+
+/* A job whose items are classified by several threads.
+ *
+ * Each worker adds taggings to its own array so the only
+ * shared state is the job's progress.
+ */
+struct ParallelJobStuff {
+  struct JobStuff *job_stuff;
+  Array **worker_taggings;
+  pthread_mutex_t progress_mutex;
+};
+
+/* A set of jobs classified in a single pass over the item cache. */
+struct BatchStuff {
+  struct JobStuff *jobs;
+  TaggerCache *tagger_cache;
+  int size;
+  int remaining;
 };
 
 static int classify_item_cb(const Item *item, void *memo) {
@@ -247,6 +274,7 @@ static int classify_item_cb(const Item *item, void *memo) {
       }
     } else {
       error("Error classifying item");
+      stuff->failed = true;
       rc = CLASSIFIER_FAIL;
     }
   }
@@ -275,25 +303,87 @@ static int handle_checked_out(ClassificationJob *job) {
 	return CLASSIFIER_FAIL;
 }
 
-static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache) {
+static int handle_unknown_tagger_state(ClassificationJob *job, int cache_rc) {
+	fatal("Got unknown value from get_tagger for %s: %i", job->tag_url, cache_rc);
+	job->state = CJOB_STATE_ERROR;
+	job->error = CJOB_ERROR_UNKNOWN_ERROR;
+  NOW(job->completed_at);
+	return CLASSIFIER_FAIL;
+}
+
+/* Scores a chunk of items for a job being classified in parallel.
+ *
+ * The job's progress is updated once per chunk so workers
+ * only contend for the progress lock every few hundred items.
+ */
+static int classify_chunk_cb(const Item **items, int num_items, int worker, void *memo) {
+  struct ParallelJobStuff *parallel = (struct ParallelJobStuff*) memo;
+  struct JobStuff *stuff = parallel->job_stuff;
+  Array *taggings = parallel->worker_taggings[worker];
+  int rc = CLASSIFIER_OK;
+  int i;
+
+  for (i = 0; i < num_items; i++) {
+    double probability;
+    if (TAGGER_OK == classify_item(stuff->tagger, items[i], &probability)) {
+      if (probability >= stuff->threshold) {
+        arr_add(taggings, create_tagging(item_get_id(items[i]), probability));
+      }
+    } else {
+      error("Error classifying item");
+      rc = CLASSIFIER_FAIL;
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&parallel->progress_mutex);
+  stuff->job->items_classified += i;
+  stuff->job->progress += i * stuff->job->progress_increment;
+  pthread_mutex_unlock(&parallel->progress_mutex);
+
+  return rc;
+}
+
+/* Starts classifying the job.
+ *
+ * num_items is the number of items the job will visit, once it has
+ * visited them all its progress reaches 80%.
+ */
+static void start_classification(struct JobStuff *job_stuff, int num_items) {
 	NOW(job_stuff->job->trained_at);
 
 	job_stuff->job->state = CJOB_STATE_CLASSIFYING;
 	job_stuff->job->progress = 20.0;
-	job_stuff->job->progress_increment = 60.0 / item_cache_cached_size(item_cache);
-
+	job_stuff->job->progress_increment = num_items > 0 ? 60.0 / num_items : 0.0;
 	job_stuff->taggings = create_array(1000);
-	item_cache_each_item(item_cache, &classify_item_cb, job_stuff);
-	NOW(job_stuff->job->classified_at);
+	job_stuff->finished = false;
+	job_stuff->failed = false;
+}
+
+/* Starts the job once the item cache knows how many items it will visit. */
+static void job_items_counted(int num_items, void *memo) {
+	start_classification((struct JobStuff*) memo, num_items);
+}
+
+static void parallel_job_items_counted(int num_items, void *memo) {
+	start_classification(((struct ParallelJobStuff*) memo)->job_stuff, num_items);
+}
+
+static void finish_classification(struct JobStuff *job_stuff) {
 	job_stuff->tagger->last_classified = time(NULL);
 
 	/* Save the results */
 	job_stuff->job->state = CJOB_STATE_INSERTING;
 
 	if (job_stuff->job->item_scope == ITEM_SCOPE_NEW) {
-		update_taggings(job_stuff->tagger, job_stuff->taggings, job_stuff->credentials, &(job_stuff->job->errmsg));
+		int rc = job_stuff->tagger_cache->taggings_updater(job_stuff->tagger, job_stuff->taggings, job_stuff->credentials, &(job_stuff->job->errmsg));
+
+		/* The snapshot keeps last_classified so a restart doesn't classify these items again. */
+		if (TAGGER_OK == rc && job_stuff->tagger_cache->snapshot_directory) {
+			save_tagger_snapshot(job_stuff->tagger, job_stuff->tagger_cache->snapshot_directory);
+		}
 	} else {
-		replace_taggings(job_stuff->tagger, job_stuff->taggings, job_stuff->credentials, &(job_stuff->job->errmsg));
+		job_stuff->tagger_cache->taggings_replacer(job_stuff->tagger, job_stuff->taggings, job_stuff->credentials, &(job_stuff->job->errmsg));
 	}
 
 	free_array(job_stuff->taggings);
@@ -301,21 +391,145 @@ static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache)
 	NOW(job_stuff->job->completed_at);
 	job_stuff->job->progress = 100.0;
 	job_stuff->job->state = CJOB_STATE_COMPLETE;
+}
+
+/* Saves a batch job's taggings and releases its tagger.
+ *
+ * This is done as soon as the job has seen its items so the
+ * tagger isn't held for the rest of the pass and other jobs
+ * for the same tag can check it out.
+ */
+static void finish_batch_job(struct BatchStuff *batch, struct JobStuff *job_stuff) {
+  job_stuff->finished = true;
+  batch->remaining--;
+  NOW(job_stuff->job->classified_at);
+
+  if (job_stuff->taggings && !job_stuff->failed) {
+    finish_classification(job_stuff);
+  } else {
+    free_array(job_stuff->taggings);
+    NOW(job_stuff->job->completed_at);
+    SET_JOB_ERROR(job_stuff->job, CJOB_ERROR_UNKNOWN_ERROR, "Classification failed for %s", job_stuff->job->tag_url);
+  }
 
-	return CLASSIFIER_OK;
+  release_tagger(batch->tagger_cache, job_stuff->tagger);
 }
 
-static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache, TaggerCache * tagger_cache, ClassificationEngineOptions * opts) {
-  int rc = CLASSIFIER_OK;
-  struct JobStuff job_stuff;
-  job_stuff.job = job;
-  job_stuff.threshold = opts->positive_threshold;
-  job_stuff.credentials = opts->credentials;
-  job_stuff.taggings = NULL;
+/* Scores a single item against every unfinished job in the batch.
+ *
+ * Items are visited in descending time order so once a job has
+ * seen all the items it needs to it is finished, dropped from
+ * the pass and the pass stops when no jobs remain.
+ */
+static int classify_item_for_batch_cb(const Item *item, void *memo) {
+  struct BatchStuff *batch = (struct BatchStuff*) memo;
+  int i;
 
-  /* If the job is cancelled bail out before doing anything */
-  if (job->state == CJOB_STATE_CANCELLED) return CLASSIFIER_OK;
+  for (i = 0; i < batch->size; i++) {
+    struct JobStuff *job_stuff = &batch->jobs[i];
+
+    if (!job_stuff->finished && CLASSIFIER_OK != classify_item_cb(item, job_stuff)) {
+      finish_batch_job(batch, job_stuff);
+    }
+  }
+
+  return batch->remaining > 0 ? CLASSIFIER_OK : CLASSIFIER_FAIL;
+}
+
+/* Classifies the job's items using job_stuff->threads threads.
+ *
+ * The items are handed out to the threads in chunks as they become free so
+ * a thread that gets items with few tokens just takes more chunks. Once every
+ * chunk is done the per-thread taggings are merged into the job's taggings.
+ */
+static int do_parallel_classification(struct JobStuff *job_stuff, ItemCache *item_cache, const int *candidate_tokens, int num_candidate_tokens) {
+	struct ParallelJobStuff parallel;
+	int rc = CLASSIFIER_OK;
+	int i;
+
+	parallel.job_stuff = job_stuff;
+	if (NULL == (parallel.worker_taggings = calloc(job_stuff->threads, sizeof(Array*)))) {
+		fatal("Malloc error allocating worker taggings");
+		return CLASSIFIER_FAIL;
+	}
+
+	for (i = 0; i < job_stuff->threads; i++) {
+		parallel.worker_taggings[i] = create_array(1000);
+	}
+
+	pthread_mutex_init(&parallel.progress_mutex, NULL);
+	rc = item_cache_each_item_in_parallel(item_cache, candidate_tokens, num_candidate_tokens, job_stuff->threads,
+	                                      &parallel_job_items_counted, &classify_chunk_cb, &parallel);
+	pthread_mutex_destroy(&parallel.progress_mutex);
+
+	/* Move the taggings over, they are now owned by job_stuff->taggings */
+	for (i = 0; i < job_stuff->threads; i++) {
+		Array *taggings = parallel.worker_taggings[i];
+
+		if (job_stuff->taggings) {
+			int j;
+
+			for (j = 0; j < taggings->size; j++) {
+				arr_add(job_stuff->taggings, taggings->elements[j]);
+			}
+
+			free(taggings->elements);
+			free(taggings);
+		} else {
+			free_array(taggings);
+		}
+	}
+
+	free(parallel.worker_taggings);
+
+	return rc;
+}
+
+/* Classifies the items the job needs to see.
+ *
+ * The job is started by the item cache with the number of items it will
+ * visit, counted under the same lock as the iteration, so its progress
+ * ends up at 80% no matter what is added to the cache in the meantime.
+ */
+static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache) {
+	int rc = CLASSIFIER_OK;
+	int num_candidate_tokens = 0;
+	const int *candidate_tokens = get_candidate_tokens(job_stuff->tagger, job_stuff->threshold, &num_candidate_tokens);
+
+	job_stuff->taggings = NULL;
+	job_stuff->failed = false;
+
+	/* New item jobs stop as soon as they reach an item older than the last
+	 * classification so only jobs over all items are split between threads. */
+	if (job_stuff->threads > 1 && job_stuff->job->item_scope == ITEM_SCOPE_ALL) {
+		rc = do_parallel_classification(job_stuff, item_cache, candidate_tokens, num_candidate_tokens);
+	} else {
+		/* Only items containing a candidate token can reach the threshold so only they need to be classified,
+		 * without candidate tokens every item is classified */
+		rc = item_cache_each_item_with_tokens(item_cache, candidate_tokens, num_candidate_tokens,
+		                                      &job_items_counted, &classify_item_cb, job_stuff);
+	}
 
+	NOW(job_stuff->job->classified_at);
+
+	if (CLASSIFIER_OK == rc && !job_stuff->failed && job_stuff->taggings) {
+		finish_classification(job_stuff);
+	} else {
+		/* Some items were never classified so the taggings are incomplete and mustn't replace the saved ones */
+		free_array(job_stuff->taggings);
+		NOW(job_stuff->job->completed_at);
+		SET_JOB_ERROR(job_stuff->job, CJOB_ERROR_UNKNOWN_ERROR, "Classification failed for %s", job_stuff->job->tag_url);
+		rc = CLASSIFIER_FAIL;
+	}
+
+	return rc;
+}
+
+/* Marks the job as started and checks out its tagger from the tagger cache.
+ *
+ * Returns the return code from get_tagger.
+ */
+static int checkout_job_tagger(ClassificationJob * job, TaggerCache * tagger_cache, Tagger ** tagger) {
   NOW(job->started_at);
   job->state = CJOB_STATE_TRAINING;
 
@@ -327,10 +541,28 @@ static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache
   }
 
   /* Try and get the tagger from the tagger_cache */
-  job_stuff.tagger = NULL;
-  int cache_rc = get_tagger(tagger_cache, job->tag_url, &(job_stuff.tagger), &job->errmsg);
+  *tagger = NULL;
+  int cache_rc = get_tagger(tagger_cache, job->tag_url, tagger, &job->errmsg);
   debug("return from get_tagger with %i", cache_rc);
 
+  return cache_rc;
+}
+
+static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache, TaggerCache * tagger_cache, ClassificationEngineOptions * opts) {
+  int rc = CLASSIFIER_OK;
+  struct JobStuff job_stuff;
+  job_stuff.job = job;
+  job_stuff.tagger_cache = tagger_cache;
+  job_stuff.threshold = opts->positive_threshold;
+  job_stuff.credentials = opts->credentials;
+  job_stuff.taggings = NULL;
+  job_stuff.threads = opts->threads_per_job;
+
+  /* If the job is cancelled bail out before doing anything */
+  if (job->state == CJOB_STATE_CANCELLED) return CLASSIFIER_OK;
+
+  int cache_rc = checkout_job_tagger(job, tagger_cache, &(job_stuff.tagger));
+
   switch (cache_rc) {
     case TAGGER_OK:
       rc = do_classification(&job_stuff, item_cache);
@@ -343,11 +575,273 @@ static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache
       rc = handle_checked_out(job);
       break;
     default:
-    	rc = CLASSIFIER_FAIL;
-    	fatal("Got unknown value from get_tagger: %i", cache_rc);
-    	break;
+      rc = handle_unknown_tagger_state(job, cache_rc);
+      break;
+  }
+
+  return rc;
+}
+
+/* A batch's taggers being checked out and prepared by several threads. */
+struct BatchPreparation {
+  struct BatchStuff *batch;
+  /* Guards next_job */
+  pthread_mutex_t mutex;
+  int next_job;
+};
+
+/* Gets the tagger for each job it takes from the batch until there are none left.
+ *
+ * A job whose tagger can't be had fails on its own and is left without a tagger.
+ */
+static void * prepare_batch_taggers_func(void *memo) {
+  struct BatchPreparation *preparation = (struct BatchPreparation*) memo;
+  struct BatchStuff *batch = preparation->batch;
+
+  while (true) {
+    int next;
+
+    pthread_mutex_lock(&preparation->mutex);
+    next = preparation->next_job++;
+    pthread_mutex_unlock(&preparation->mutex);
+
+    if (next >= batch->size) {
+      break;
+    }
+
+    struct JobStuff *job_stuff = &batch->jobs[next];
+    int cache_rc = checkout_job_tagger(job_stuff->job, batch->tagger_cache, &job_stuff->tagger);
+
+    switch (cache_rc) {
+      case TAGGER_OK:
+        break;
+      case TAG_NOT_FOUND:
+        handle_not_found(job_stuff->job);
+        break;
+      case TAGGER_CHECKED_OUT:
+        handle_checked_out(job_stuff->job);
+        break;
+      default:
+        handle_unknown_tagger_state(job_stuff->job, cache_rc);
+        break;
+    }
+
+    if (TAGGER_OK != cache_rc) {
+      job_stuff->tagger = NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/* Checks out and prepares the taggers for the jobs in the batch.
+ *
+ * Getting a tagger can mean fetching its tag document, retraining and
+ * precomputing it, so up to threads of them are prepared at once, each
+ * thread taking the next job as soon as it is done with one. A tag that
+ * is slow to fetch only holds up the thread preparing it, and the taggers
+ * that are ready aren't kept checked out while the rest are prepared one
+ * after the other.
+ */
+static void prepare_batch_taggers(struct BatchStuff *batch, int threads) {
+  struct BatchPreparation preparation;
+  int threads_started = 0;
+  int i;
+
+  if (threads > batch->size) {
+    threads = batch->size;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  pthread_t preparers[threads];
+
+  preparation.batch = batch;
+  preparation.next_job = 0;
+  pthread_mutex_init(&preparation.mutex, NULL);
+
+  /* The worker's own thread prepares taggers too */
+  for (i = 1; i < threads; i++) {
+    if (pthread_create(&preparers[i], NULL, prepare_batch_taggers_func, &preparation)) {
+      error("Could not start batch preparation thread %i, continuing with %i", i, i);
+      break;
+    }
+
+    threads_started++;
+  }
+
+  prepare_batch_taggers_func(&preparation);
+
+  for (i = 1; i <= threads_started; i++) {
+    pthread_join(preparers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&preparation.mutex);
+}
+
+/* Starts every job in the batch once the item cache knows how many items the pass will visit. */
+static void batch_items_counted(int num_items, void *memo) {
+  struct BatchStuff *batch = (struct BatchStuff*) memo;
+  int i;
+
+  for (i = 0; i < batch->size; i++) {
+    start_classification(&batch->jobs[i], num_items);
+  }
+}
+
+static int compare_token_ids(const void *a, const void *b) {
+  int token1 = *((const int*) a);
+  int token2 = *((const int*) b);
+  return token1 < token2 ? -1 : token1 > token2 ? 1 : 0;
+}
+
+/* Collects the candidate tokens of every tagger in the batch.
+ *
+ * An item that contains none of these can't reach the threshold for any of
+ * the batch's jobs. Tokens shared by several taggers are only included once
+ * so they aren't counted again when the item cache estimates how many items
+ * have them. Returns NULL if any job needs to classify every item.
+ */
+static int * batch_candidate_tokens(const struct BatchStuff *batch, int *num_tokens) {
+  int *tokens = NULL;
+  int capacity = 0;
+  int total = 0;
+  int i;
+
+  *num_tokens = 0;
+
+  for (i = 0; i < batch->size; i++) {
+    int num;
+    const int *job_tokens = get_candidate_tokens(batch->jobs[i].tagger, batch->jobs[i].threshold, &num);
+
+    if (NULL == job_tokens) {
+      free(tokens);
+      return NULL;
+    }
+
+    if (total + num > capacity) {
+      int *new_tokens;
+      capacity = (total + num) * 2;
+
+      if (NULL == (new_tokens = realloc(tokens, (capacity + 1) * sizeof(int)))) {
+        fatal("Malloc error allocating batch candidate tokens");
+        free(tokens);
+        return NULL;
+      }
+
+      tokens = new_tokens;
+    }
+
+    memcpy(tokens + total, job_tokens, num * sizeof(int));
+    total += num;
+  }
+
+  if (NULL == tokens && NULL == (tokens = malloc(sizeof(int)))) {
+    fatal("Malloc error allocating batch candidate tokens");
+    return NULL;
+  }
+
+  qsort(tokens, total, sizeof(int), compare_token_ids);
+
+  for (i = 0; i < total; i++) {
+    if (i == 0 || tokens[i] != tokens[i - 1]) {
+      tokens[(*num_tokens)++] = tokens[i];
+    }
+  }
+
+  return tokens;
+}
+
+/* Runs a batch of jobs linked by next_in_batch using a single pass over the item cache.
+ *
+ * Each job checks out its own tagger and collects its own taggings. The taggers are
+ * prepared in parallel by up to threads_per_job threads before the pass. A job whose
+ * tagger can't be checked out fails on its own without affecting the rest of the batch.
+ * Each tagger is released as soon as its job is finished rather than at the end of the batch.
+ *
+ * Returns CLASSIFIER_FAIL if any of the jobs failed, each failed job is in the error state.
+ */
+static int run_classification_batch(ClassificationJob * batch, ItemCache * item_cache, TaggerCache * tagger_cache, ClassificationEngineOptions * opts) {
+  int rc = CLASSIFIER_OK;
+  int batch_size = 0;
+  int i;
+  ClassificationJob *job;
+  struct BatchStuff batch_stuff;
+
+  for (job = batch; job; job = job->next_in_batch) {
+    batch_size++;
+  }
+
+  if (NULL == (batch_stuff.jobs = calloc(batch_size, sizeof(struct JobStuff)))) {
+    fatal("Malloc error allocating classification batch");
+
+    for (job = batch; job; job = job->next_in_batch) {
+      if (job->state != CJOB_STATE_CANCELLED) {
+        job->state = CJOB_STATE_ERROR;
+        job->error = CJOB_ERROR_UNKNOWN_ERROR;
+        NOW(job->completed_at);
+      }
+    }
+
+    return CLASSIFIER_FAIL;
+  }
+
+  batch_stuff.size = 0;
+  batch_stuff.tagger_cache = tagger_cache;
+
+  for (job = batch; job; job = job->next_in_batch) {
+    /* Cancelled jobs are cleaned up by the worker */
+    if (job->state == CJOB_STATE_CANCELLED) continue;
+
+    struct JobStuff *job_stuff = &batch_stuff.jobs[batch_stuff.size++];
+    job_stuff->job = job;
+    job_stuff->tagger_cache = tagger_cache;
+    job_stuff->threshold = opts->positive_threshold;
+    job_stuff->credentials = opts->credentials;
+  }
+
+  prepare_batch_taggers(&batch_stuff, opts->threads_per_job);
+
+  /* Only the jobs that got their tagger take part in the pass */
+  for (i = 0, batch_size = batch_stuff.size, batch_stuff.size = 0; i < batch_size; i++) {
+    if (batch_stuff.jobs[i].tagger) {
+      batch_stuff.jobs[batch_stuff.size++] = batch_stuff.jobs[i];
+    } else {
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  batch_stuff.remaining = batch_stuff.size;
+
+  if (batch_stuff.size > 0) {
+    int num_candidate_tokens = 0;
+    int *candidate_tokens = batch_candidate_tokens(&batch_stuff, &num_candidate_tokens);
+
+    /* Every job in the batch visits the candidates of the whole batch, or every item
+     * if any of them has no candidates */
+    if (CLASSIFIER_OK != item_cache_each_item_with_tokens(item_cache, candidate_tokens, num_candidate_tokens,
+                                                          &batch_items_counted, &classify_item_for_batch_cb, &batch_stuff)) {
+      rc = CLASSIFIER_FAIL;
+    }
+
+    free(candidate_tokens);
+  }
+
+  /* Jobs that are still going reached the end of the item cache */
+  for (i = 0; i < batch_stuff.size; i++) {
+    if (!batch_stuff.jobs[i].finished) {
+      finish_batch_job(&batch_stuff, &batch_stuff.jobs[i]);
+    }
+
+    if (CJOB_STATE_ERROR == batch_stuff.jobs[i].job->state) {
+      rc = CLASSIFIER_FAIL;
+    }
   }
 
+  debug("Classified batch of %i jobs with %i taggers", batch_size, batch_stuff.size);
+  free(batch_stuff.jobs);
+
   return rc;
 }
 
@@ -451,7 +945,8 @@ void free_classification_engine(ClassificationEngine *engine) {
  * Functions for adding, fetching and removing classification jobs.
  */
 
-static int _add_classification_job(ClassificationEngine *engine, ClassificationJob *job) {
+/* Adds the job to the engine's job index without queueing it. */
+static int register_classification_job(ClassificationEngine *engine, ClassificationJob *job) {
   int failure = true;
   PWord_t job_pointer;
 
@@ -467,7 +962,15 @@ static int _add_classification_job(ClassificationEngine *engine, ClassificationJ
     fatal("Error malloc'ing Judy array entry for classification job");
   }
 
-  q_enqueue(engine->classification_job_queue, job);
+  return failure;
+}
+
+static int _add_classification_job(ClassificationEngine *engine, ClassificationJob *job) {
+  int failure = register_classification_job(engine, job);
+
+  if (!failure) {
+    q_enqueue(engine->classification_job_queue, job);
+  }
 
   return failure;
 }
@@ -489,12 +992,20 @@ ClassificationJob * ce_add_classification_job(ClassificationEngine * engine, con
   return job;
 }
 
+static ClassificationJob * create_classify_new_items_job(const char * tag_url) {
+  ClassificationJob *job = create_classification_job(tag_url);
+  if (job) {
+    job->item_scope = ITEM_SCOPE_NEW;
+    job->auto_cleanup = true;
+  }
+
+  return job;
+}
+
 ClassificationJob * ce_add_classify_new_items_job_for_tag(ClassificationEngine * engine, const char * tag_url) {
   ClassificationJob *job = NULL;
   if (engine) {
-    job = create_classification_job(tag_url);
-    job->item_scope = ITEM_SCOPE_NEW;
-    job->auto_cleanup = true;
+    job = create_classify_new_items_job(tag_url);
 
     if (_add_classification_job(engine, job)) {
       free_classification_job(job);
@@ -505,6 +1016,65 @@ ClassificationJob * ce_add_classify_new_items_job_for_tag(ClassificationEngine *
   return job;
 }
 
+/* Adds a classify new items job for each tag.
+ *
+ * When the engine's tags_per_batch option is greater than 1 the jobs are
+ * linked into batches of that size and only the first job of each batch
+ * is queued. A worker then classifies the whole batch with a single pass
+ * over the item cache.
+ *
+ * Returns the number of jobs added.
+ */
+int ce_add_classify_new_items_jobs(ClassificationEngine * engine, const Array * tag_urls) {
+  int jobs_added = 0;
+
+  if (engine && tag_urls) {
+    int tags_per_batch = engine->options->tags_per_batch;
+    ClassificationJob *batch = NULL;
+    ClassificationJob *last = NULL;
+    int batch_size = 0;
+    int i;
+
+    for (i = 0; i < tag_urls->size; i++) {
+      const char *tag_url = (const char *) tag_urls->elements[i];
+
+      if (tags_per_batch <= 1) {
+        if (ce_add_classify_new_items_job_for_tag(engine, tag_url)) {
+          jobs_added++;
+        }
+      } else {
+        ClassificationJob *job = create_classify_new_items_job(tag_url);
+
+        if (register_classification_job(engine, job)) {
+          free_classification_job(job);
+          continue;
+        }
+
+        if (last) {
+          last->next_in_batch = job;
+        } else {
+          batch = job;
+        }
+
+        last = job;
+        jobs_added++;
+
+        if (++batch_size == tags_per_batch) {
+          q_enqueue(engine->classification_job_queue, batch);
+          batch = last = NULL;
+          batch_size = 0;
+        }
+      }
+    }
+
+    if (batch) {
+      q_enqueue(engine->classification_job_queue, batch);
+    }
+  }
+
+  return jobs_added;
+}
+
 ClassificationJob * ce_fetch_classification_job(const ClassificationEngine * engine, const char * job_id) {
   ClassificationJob *job = NULL;
 
@@ -752,6 +1322,41 @@ static int wait_if_suspended(ClassificationEngine * ce) {
   return exit;
 }
 
+/* Removes and frees an auto cleanup job once it is done.
+ *
+ * Failed jobs are left for purge_old_jobs so their error can still be seen.
+ */
+static void cleanup_job(ClassificationEngine * ce, ClassificationJob * job) {
+  if (job->auto_cleanup && job->state != CJOB_STATE_ERROR) {
+    ce_remove_classification_job(ce, job, true);
+    free_classification_job(job);
+  }
+}
+
+/* Records timings for and cleans up each job in a completed batch.
+ *
+ * This is the batch equivalent of what the worker does for a single job,
+ * cancelled jobs are removed and freed here.
+ */
+static void cleanup_batch(ClassificationEngine * ce, ClassificationJob * batch) {
+  ClassificationJob *job = batch;
+
+  while (job) {
+    ClassificationJob *next = job->next_in_batch;
+
+    if (CJOB_STATE_CANCELLED == job->state) {
+      job->state = CJOB_STATE_COMPLETE;
+      ce_remove_classification_job(ce, job, true);
+      free_classification_job(job);
+    } else {
+      ce_record_classification_job_timings(ce, job);
+      cleanup_job(ce, job);
+    }
+
+    job = next;
+  }
+}
+
 /* This is the function for classificaiton work threads.
  *
  * Each worker shares the ItemSource, Random Background and Queues of
@@ -776,6 +1381,15 @@ void *classification_worker_func(void *engine_vp) {
     if (job && ce->is_running) {
       debug("%i got job off queue: %s", pthread_self(), job->id);
 
+      if (job->next_in_batch) {
+        if (CLASSIFIER_OK != run_classification_batch(job, ce->item_cache, ce->tagger_cache, ce->options)) {
+          error("Some jobs in the batch starting with %s failed", job->tag_url);
+        }
+
+        cleanup_batch(ce, job);
+        continue;
+      }
+
       /* Only proceed if the job is not cancelled */
       NEXT_IF_CANCELLED(ce, job);
 
@@ -786,10 +1400,7 @@ void *classification_worker_func(void *engine_vp) {
         q_enqueue(job_queue, job);
       } else {
         ce_record_classification_job_timings(ce, job);
-        if (job->auto_cleanup) {
-          ce_remove_classification_job(ce, job, true);
-          free_classification_job(job);
-        }
+        cleanup_job(ce, job);
       }
     }
   }
@@ -843,13 +1454,8 @@ static void create_classify_new_item_jobs_for_all_tags(ClassificationEngine *ce)
     int rc = fetch_tags(ce->tagger_cache, &tag_urls, &errmsg);
 
     if (rc == TAG_INDEX_OK) {
-      int i;
-
-      for (i = 0; i < tag_urls->size; i++) {
-       ce_add_classify_new_items_job_for_tag(ce, (char *) tag_urls->elements[i]);
-      }
-
-      info("Created %i classify new items jobs", tag_urls->size);
+      int jobs_added = ce_add_classify_new_items_jobs(ce, tag_urls);
+      info("Created %i classify new items jobs", jobs_added);
     } else {
       error("Could not fetch tag urls: %s", errmsg);
       free(errmsg);
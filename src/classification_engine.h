@@ -38,6 +38,12 @@ typedef struct CLASSIFICATION_ENGINE_OPTIONS {
   double positive_threshold;
   char *performance_log;
   Credentials *credentials;
+  /* Maximum number of tags classified together in one pass over the item cache
+   * when new items arrive. 0 or 1 gives each tag its own pass. */
+  int tags_per_batch;
+  /* Number of threads used to classify the items for a single job
+   * over all items. 0 or 1 classifies them on the job's worker thread. */
+  int threads_per_job;
 } ClassificationEngineOptions;
 
 typedef enum CLASSIFICATION_JOB_STATE {
@@ -83,6 +89,8 @@ typedef struct CLASSIFICATION_JOB {
   struct timeval classified_at;
   struct timeval completed_at;
   time_t first_time_tried;
+  /* The next job to run in the same pass over the item cache as this one. */
+  struct CLASSIFICATION_JOB *next_in_batch;
 } ClassificationJob;
 
 extern ClassificationEngine * create_classification_engine(ItemCache *item_cache, TaggerCache *tagger_cache, ClassificationEngineOptions *options);
@@ -99,6 +107,7 @@ extern void                   ce_run(ClassificationEngine *engine);
 extern int                    ce_num_jobs_in_system(const ClassificationEngine *engine);
 extern int                    ce_num_waiting_jobs(const ClassificationEngine *engine);
 extern ClassificationJob    * ce_add_classification_job(ClassificationEngine *engine, const char * tag_url);
+extern int                    ce_add_classify_new_items_jobs(ClassificationEngine *engine, const Array *tag_urls);
 extern ClassificationJob    * ce_fetch_classification_job(const ClassificationEngine *engine, const char * job_id);
 extern int                    ce_remove_classification_job(ClassificationEngine *engine, const ClassificationJob *job, int force);
 extern float                  cjob_duration(const ClassificationJob *job);
@@ -26,12 +26,19 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
 #include "classifier.h"
 #include "logging.h"
 #include "misc.h"
 #include "clue.h"
 
-#define TINY_VAL_D 1e-200
+/* exp(-x) underflows a double for x above about 708 */
+#define CHI2_MAX_EXP 700.0
+
+/* Number of tokens naive_bayes_precompute computes probabilities for at a time */
+#define PRECOMPUTE_BATCH_SIZE 256
 
 /******************************************************************************************
  * The Peerworks implementation of a Bayesian Classifier.
@@ -344,6 +351,13 @@ double probability(const ProbToken *foregrounds[], int n_fg,
 /* Returns prob(chisq >= x2, with v degrees of freedom)
  *
  * Algorithm taken from http://spambayes.cvs.sourceforge.net/spambayes/spambayes/spambayes/chi2.py?view=markup
+ *
+ * For even v this is the sum of the first v/2 + 1 terms of a Poisson series
+ * with mean x2/2. Once the terms are past twice the mean each one is less than
+ * half the previous one, so we stop as soon as they can no longer change the sum.
+ *
+ * When x2 is so large that exp(-x2/2) underflows, the series is summed relative
+ * to its largest term instead, otherwise every term would be 0.
  */
 double chi2Q(double x2, int v) {
   double chi2;
@@ -359,12 +373,48 @@ double chi2Q(double x2, int v) {
     
     m = x2 / 2;
     max_i = v / 2;
-    sum = exp(-m);
-    term = sum;
 
-    for (i = 1; i <= max_i; i++) {
-      term *= m / i;
-      sum += term;
+    if (m < CHI2_MAX_EXP) {
+      sum = exp(-m);
+      term = sum;
+
+      for (i = 1; i <= max_i; i++) {
+        term *= m / i;
+        sum += term;
+
+        if (i > 2 * m && term < sum * DBL_EPSILON) {
+          break;
+        }
+      }
+    } else if (isinf(m)) {
+      sum = 0.0;
+    } else {
+      int peak = (int) MIN(max_i, floor(m));
+      double log_peak_term = -m + peak * log(m) - lgamma(peak + 1.0);
+
+      sum = 1.0;
+
+      /* Terms before the peak, these shrink by at least i / m each time */
+      for (i = peak, term = 1.0; i > 0; i--) {
+        term *= i / m;
+        sum += term;
+
+        if (term < sum * DBL_EPSILON) {
+          break;
+        }
+      }
+
+      /* Terms after the peak */
+      for (i = peak + 1, term = 1.0; i <= max_i; i++) {
+        term *= m / i;
+        sum += term;
+
+        if (i > 2 * m && term < sum * DBL_EPSILON) {
+          break;
+        }
+      }
+
+      sum = exp(log_peak_term + log(sum));
     }
 
     if (sum > 1.0) {
@@ -394,10 +444,122 @@ static int compare_clues(const void *clue1_p, const void *clue2_p) {
   }
 }
 
+/* Scratch space for the clues of the item being classified.
+ *
+ * Each thread that classifies items gets its own, it grows as needed
+ * and is reused for every item the thread classifies.
+ */
+typedef struct CLUE_SCRATCH {
+  int capacity;
+  const Clue **clues;
+} ClueScratch;
+
+static pthread_key_t clue_scratch_key;
+static pthread_once_t clue_scratch_key_once = PTHREAD_ONCE_INIT;
+
+static void free_clue_scratch(void *memo) {
+  ClueScratch *scratch = (ClueScratch*) memo;
+  free(scratch->clues);
+  free(scratch);
+}
+
+static void create_clue_scratch_key(void) {
+  pthread_key_create(&clue_scratch_key, free_clue_scratch);
+}
+
+/* Gets the calling thread's scratch space with room for at least size clues. */
+static const Clue ** clue_scratch(int size) {
+  ClueScratch *scratch;
+  pthread_once(&clue_scratch_key_once, create_clue_scratch_key);
+
+  if (NULL == (scratch = pthread_getspecific(clue_scratch_key))) {
+    if (NULL == (scratch = calloc(1, sizeof(ClueScratch)))) {
+      fatal("Could not allocate clue scratch space");
+      return NULL;
+    }
+
+    pthread_setspecific(clue_scratch_key, scratch);
+  }
+
+  if (scratch->capacity < size) {
+    int capacity = MAX(size, 2 * scratch->capacity);
+    const Clue **clues = realloc(scratch->clues, capacity * sizeof(Clue*));
+
+    if (NULL == clues) {
+      fatal("Could not grow clue scratch space to %i clues", capacity);
+      return NULL;
+    }
+
+    scratch->clues = clues;
+    scratch->capacity = capacity;
+  }
+
+  return scratch->clues;
+}
+
+/** Collects the item's clues that are strong enough to use into selected_clues.
+ *
+ *  selected_clues must have room for one clue per item token.
+ *  Returns the number of clues collected.
+ */
+static int collect_clues(const ClueList * clues, const Item *item, const Clue **selected_clues) {
+  int i = 0;
+  int num_item_tokens = item_get_num_tokens(item);
+  const Token *tokens = item_get_tokens(item);
+  int t;
+  
+  for (t = 0; t < num_item_tokens; t++) {
+    const Clue *clue = get_strong_clue(clues, tokens[t].id, MIN_PROB_STRENGTH);
+    if (NULL != clue) {      
+      selected_clues[i++] = clue;
+    }
+  }
+  
+  return i;
+}
+
+/** Partially orders clues so the k strongest come first, in no particular order.
+ *
+ *  This is a quickselect, it only needs to partition around the kth clue
+ *  instead of sorting all of them.
+ */
+static void select_strongest_clues(const Clue **clues, int n, int k) {
+  int left = 0;
+  int right = n - 1;
+  
+  while (left < right) {
+    double pivot = clue_strength(clues[left + (right - left) / 2]);
+    int i = left;
+    int j = right;
+    
+    while (i <= j) {
+      while (clue_strength(clues[i]) > pivot) i++;
+      while (clue_strength(clues[j]) < pivot) j--;
+      
+      if (i <= j) {
+        const Clue *tmp = clues[i];
+        clues[i++] = clues[j];
+        clues[j--] = tmp;
+      }
+    }
+    
+    if (k - 1 <= j) {
+      right = j;
+    } else if (k - 1 >= i) {
+      left = i;
+    } else {
+      break;
+    }
+  }
+}
+
 /** Selects the clues from a classifier to use when classifying an item.
+ *
+ *  The clues are returned in a newly allocated array sorted by strength.
+ *  This is used to report the clues for an item, classification uses the
+ *  scratch space and partial selection in naive_bayes_classify instead.
  */
 const Clue ** select_clues(const ClueList * clues, const Item *item, int *num_clues) {
-  int i = 0;
   int num_item_tokens = item_get_num_tokens(item);
   int max_clues = MAX(MAX_DISCRIMINATORS, MAX_CLUES_RATIO * num_item_tokens);
   
@@ -406,16 +568,7 @@ const Clue ** select_clues(const ClueList * clues, const Item *item, int *num_cl
   // NULL terminating the array. This will just hold pointers to
   // the actual clues that are stored in the classifier.
   const Clue **selected_clues = calloc(num_item_tokens, sizeof(Clue*));
-  
-  int token_id = 0;
-  short token_frequency = 0;
-  
-  while (item_next_token(item, &token_id, &token_frequency)) {
-    const Clue *clue = get_clue(clues, token_id);
-    if (NULL != clue && MIN_PROB_STRENGTH <= clue_strength(clue)) {      
-      selected_clues[i++] = clue;
-    }
-  }
+  int i = collect_clues(clues, item, selected_clues);
   
   qsort(selected_clues, i, sizeof(Clue*), compare_clues); 
   *num_clues = MIN(i, max_clues);
@@ -433,32 +586,20 @@ const Clue ** select_clues(const ClueList * clues, const Item *item, int *num_cl
  * http://spambayes.cvs.sourceforge.net/spambayes/spambayes/spambayes/classifier.py?revision=1.31&view=markup
  */
 static double chi2_combine(const Clue **clues, int num_clues) {
-  // Now we can combine all token scores into an item score
+  // Now we can combine all token scores into an item score.
+  //
+  // This works in the log domain so instead of multiplying the probabilities,
+  // and renormalizing to avoid underflow, we just sum their logs which
+  // are precomputed in each clue.
   double h, s;
-  int hExp, sExp, i;
-  h = s = 1.0;
-  hExp = sExp = 0;
+  int i;
+  h = s = 0.0;
 
   for (i = 0; i < num_clues; i++) {
-    s *= (1.0 - clue_probability(clues[i]));
-    h *= clue_probability(clues[i]);
-  
-    // Check for underflow
-    if (s < TINY_VAL_D) {
-      int e = 0;
-      s = frexp(s, &e);
-      sExp += e;
-    }
-  
-    if (h < TINY_VAL_D) {
-      int e = 0;
-      h = frexp(h, &e);
-      hExp += e;
-    }
+    s += clue_log_complement(clues[i]);
+    h += clue_log_probability(clues[i]);
   }
 
-  s = log(s) + sExp * M_LN2;
-  h = log(h) + hExp * M_LN2;
   s = 1.0 - chi2Q(-2.0 * s, num_clues * 2);
   h = 1.0 - chi2Q(-2.0 * h, num_clues * 2);
   return (s - h + 1.0) / 2.0;
@@ -492,6 +633,210 @@ double naive_bayes_probability(const Pool * positive_pool, const Pool * negative
   return probability(foregrounds, 1, backgrounds, 2, fg_total_tokens, bg_total_tokens);
 }
 
+/* A pool as flat arrays of token ids and frequencies in ascending token id order. */
+struct PoolArrays {
+  int *token_ids;
+  int *frequencies;
+  int size;
+  int position;
+};
+
+static int load_pool_arrays(const Pool *pool, struct PoolArrays *arrays) {
+  int num_tokens = pool_num_tokens(pool);
+  
+  arrays->position = 0;
+  arrays->size = 0;
+  arrays->token_ids = malloc((num_tokens + 1) * sizeof(int));
+  arrays->frequencies = malloc((num_tokens + 1) * sizeof(int));
+  
+  if (NULL == arrays->token_ids || NULL == arrays->frequencies) {
+    return CLASSIFIER_FAIL;
+  }
+  
+  arrays->size = pool_token_arrays(pool, arrays->token_ids, arrays->frequencies);
+  return CLASSIFIER_OK;
+}
+
+/* Returns the frequency of token_id and moves past it if it is the next token in the arrays. */
+static inline int take_frequency(struct PoolArrays *arrays, int token_id) {
+  if (arrays->position < arrays->size && arrays->token_ids[arrays->position] == token_id) {
+    return arrays->frequencies[arrays->position++];
+  }
+  
+  return 0;
+}
+
+static inline int next_token_id(const struct PoolArrays *arrays, int token_id) {
+  if (arrays->position < arrays->size && arrays->token_ids[arrays->position] < token_id) {
+    return arrays->token_ids[arrays->position];
+  }
+  
+  return token_id;
+}
+
+/* Counts the distinct tokens in three sorted token id arrays. */
+static int count_merged_tokens(const struct PoolArrays *a, const struct PoolArrays *b, const struct PoolArrays *c) {
+  int i = 0, j = 0, k = 0;
+  int count = 0;
+  
+  while (i < a->size || j < b->size || k < c->size) {
+    int token_id = INT_MAX;
+    if (i < a->size && a->token_ids[i] < token_id) token_id = a->token_ids[i];
+    if (j < b->size && b->token_ids[j] < token_id) token_id = b->token_ids[j];
+    if (k < c->size && c->token_ids[k] < token_id) token_id = c->token_ids[k];
+    
+    if (i < a->size && a->token_ids[i] == token_id) i++;
+    if (j < b->size && b->token_ids[j] == token_id) j++;
+    if (k < c->size && c->token_ids[k] == token_id) k++;
+    count++;
+  }
+  
+  return count;
+}
+
+/* Computes the probabilities for a batch of tokens.
+ *
+ * This is probability() specialized for one foreground and two backgrounds,
+ * with the same operations in the same order so the results are identical.
+ * Pool sizes are the same for every token so all the per-pool checks are
+ * done once and the loop body has no branches the compiler can't turn
+ * into selects, which lets it vectorize the loop.
+ */
+static void batch_probabilities(int n, const double *positive, const double *negative, const double *random,
+                                int fg_size, int negative_size, int random_size, double *probabilities) {
+  const int fg_total_tokens = MAX(1, fg_size);
+  const int bg_total_tokens = MAX(1, negative_size + random_size);
+  int i;
+  
+  for (i = 0; i < n; i++) {
+    double fg_ratio = fg_size > 0 ? positive[i] / fg_size : 0;
+    double negative_ratio = negative_size > 0 ? negative[i] / negative_size : 0;
+    double random_ratio = random_size > 0 ? random[i] / random_size : 0;
+    int bg_count = (negative_ratio > 0) + (random_ratio > 0);
+    double bg_ratio = bg_count ? (negative_ratio + random_ratio) / bg_count : 0;
+    double ratio = fg_ratio / (fg_ratio + bg_ratio);
+    
+    double fg_n = fg_size > 0 ? positive[i] * bg_total_tokens / fg_size : 0;
+    double negative_n = negative_size > 0 ? negative[i] * fg_total_tokens / negative_size : 0;
+    double random_n = random_size > 0 ? random[i] * fg_total_tokens / random_size : 0;
+    int bg_n_count = (negative_n > 0) + (random_n > 0);
+    double n_value = fg_n + (bg_n_count ? (negative_n + random_n) / bg_n_count : 0);
+    
+    probabilities[i] = (S_TIMES_X + n_value * ratio) / (UNKNOWN_WORD_STRENGTH + n_value);
+  }
+}
+
+/** Computes the clues for every token in the pools in a single pass.
+ *
+ *  This gives the same clues as calling naive_bayes_probability for each token
+ *  in any of the pools, but rather than looking every token up in every pool the
+ *  pools are copied to sorted arrays and merged, and the probabilities are computed
+ *  a batch at a time by batch_probabilities. This fulfils the precompute_function
+ *  interface of the Tagger module.
+ */
+void naive_bayes_precompute(ClueList *clues, const Pool *positive_pool, const Pool *negative_pool, const Pool *random_bg, double bias) {
+  struct PoolArrays positive = {NULL, NULL, 0, 0};
+  struct PoolArrays negative = {NULL, NULL, 0, 0};
+  struct PoolArrays random = {NULL, NULL, 0, 0};
+  
+  /* The same truncation of the scaled pool sizes as naive_bayes_probability */
+  const int fg_size = (int) (pool_total_tokens(positive_pool) / bias);
+  const int negative_size = (int) (pool_total_tokens(negative_pool) * bias);
+  const int random_size = (int) (pool_total_tokens(random_bg) * bias);
+  
+  if (CLASSIFIER_OK != load_pool_arrays(positive_pool, &positive) ||
+      CLASSIFIER_OK != load_pool_arrays(negative_pool, &negative) ||
+      CLASSIFIER_OK != load_pool_arrays(random_bg, &random)) {
+    fatal("Malloc error allocating pool arrays");
+  } else {
+    int token_ids[PRECOMPUTE_BATCH_SIZE];
+    double positive_counts[PRECOMPUTE_BATCH_SIZE];
+    double negative_counts[PRECOMPUTE_BATCH_SIZE];
+    double random_counts[PRECOMPUTE_BATCH_SIZE];
+    double probabilities[PRECOMPUTE_BATCH_SIZE];
+    
+    /* Size the table once rather than growing it as the clues are added */
+    reserve_clues(clues, clues->size + count_merged_tokens(&positive, &negative, &random));
+    
+    while (positive.position < positive.size || negative.position < negative.size || random.position < random.size) {
+      int batch_size = 0;
+      int i;
+      
+      while (batch_size < PRECOMPUTE_BATCH_SIZE && 
+             (positive.position < positive.size || negative.position < negative.size || random.position < random.size)) {
+        int token_id = INT_MAX;
+        token_id = next_token_id(&positive, token_id);
+        token_id = next_token_id(&negative, token_id);
+        token_id = next_token_id(&random, token_id);
+        
+        token_ids[batch_size] = token_id;
+        positive_counts[batch_size] = take_frequency(&positive, token_id);
+        negative_counts[batch_size] = take_frequency(&negative, token_id);
+        random_counts[batch_size] = take_frequency(&random, token_id);
+        batch_size++;
+      }
+      
+      if (fg_size > 0 || negative_size + random_size > 0) {
+        batch_probabilities(batch_size, positive_counts, negative_counts, random_counts,
+                            fg_size, negative_size, random_size, probabilities);
+      } else {
+        for (i = 0; i < batch_size; i++) {
+          probabilities[i] = UNKNOWN_WORD_PROB;
+        }
+      }
+      
+      for (i = 0; i < batch_size; i++) {
+        add_clue(clues, token_ids[i], probabilities[i]);
+      }
+    }
+  }
+  
+  free(positive.token_ids);
+  free(positive.frequencies);
+  free(negative.token_ids);
+  free(negative.frequencies);
+  free(random.token_ids);
+  free(random.frequencies);
+}
+
+static int compare_token_ids(const void *a, const void *b) {
+  return *((const int*) a) - *((const int*) b);
+}
+
+/** Selects the tokens an item must contain to be classified above UNKNOWN_WORD_PROB.
+ *
+ *  These are the tokens whose clues are strong enough to be picked by select_clues
+ *  and that point towards the tag.  If an item contains none of them, every clue
+ *  selected for it points away from the tag and chi2_combine can't give it a
+ *  probability above 0.5, so it doesn't need to be classified when the threshold
+ *  is higher than that.
+ *
+ *  Returns a malloc'ed array of token ids, in ascending order, which the caller must free.
+ */
+int * naive_bayes_candidate_tokens(const ClueList *clues, int *num_tokens) {
+  int *tokens = NULL;
+  *num_tokens = 0;
+  
+  if (NULL == clues) {
+    fatal("naive_bayes_candidate_tokens received NULL clues");
+  } else if (NULL == (tokens = malloc((clues->size + 1) * sizeof(int)))) {
+    fatal("Malloc error allocating candidate tokens");
+  } else {
+    int position = 0;
+    const Clue *clue;
+    
+    while (NULL != (clue = next_clue(clues, &position))) {
+      if (MIN_PROB_STRENGTH <= clue_strength(clue) && clue_probability(clue) > UNKNOWN_WORD_PROB) {
+        tokens[(*num_tokens)++] = clue_token_id(clue);
+      }
+    }
+    
+    qsort(tokens, *num_tokens, sizeof(int), compare_token_ids);
+  }
+  
+  return tokens;
+}
+
 /** Classifies the item using the given ClueList.
  *
  *  The ClueList provides a list of token - probability pairs where the probability
@@ -511,14 +856,23 @@ double naive_bayes_classify(const ClueList *clues, const Item * item) {
   }
   
   double prob = 0.5;
-  int num_clues;
-  const Clue **selected_clues = select_clues(clues, item, &num_clues);
+  int num_item_tokens = item_get_num_tokens(item);
+  int max_clues = MAX(MAX_DISCRIMINATORS, MAX_CLUES_RATIO * num_item_tokens);
+  const Clue **selected_clues = clue_scratch(num_item_tokens);
+  
+  if (NULL != selected_clues) {
+    int num_clues = collect_clues(clues, item, selected_clues);
     
-  if (num_clues > 0) {
-    prob = chi2_combine(selected_clues, num_clues);    
+    /* chi2_combine doesn't care about the order of the clues, it just needs the strongest max_clues of them. */
+    if (num_clues > max_clues) {
+      select_strongest_clues(selected_clues, num_clues, max_clues);
+      num_clues = max_clues;
+    }
+    
+    if (num_clues > 0) {
+      prob = chi2_combine(selected_clues, num_clues);    
+    }
   }
-  
-  free(selected_clues);
     
   return prob;
 }
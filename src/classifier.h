@@ -78,6 +78,8 @@ typedef struct PROB_TOKEN {
 
 extern double naive_bayes_classify    (const ClueList *clues, const Item *item);
 extern double naive_bayes_probability (const Pool * positive_pool, const Pool * negative_pool, const Pool * random_bg, int token_id, double bias);
+extern int *  naive_bayes_candidate_tokens (const ClueList *clues, int *num_tokens);
+extern void   naive_bayes_precompute  (ClueList *clues, const Pool * positive_pool, const Pool * negative_pool, const Pool * random_bg, double bias);
 
 /** Only in header for testing - shouldn't actual use it */
 extern double          chi2Q        (double x, int v);
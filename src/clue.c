@@ -25,16 +25,27 @@
 // contact@winnowtag.org
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "clue.h"
 #include "logging.h"
 
+#define EMPTY_SLOT -1
+#define INITIAL_CAPACITY 1024
+#define FILTER_BITS_PER_CLUE 8
+
+static void init_clue(Clue *clue, int token_id, double probability) {
+  clue->token_id = token_id;
+  clue->probability = probability;
+  clue->strength = fabs(0.5 - probability);
+  clue->log_probability = log(probability);
+  clue->log_complement = log1p(-probability);
+}
+
 Clue * new_clue(int token_id, double probability) {
   Clue *clue = malloc(sizeof(struct CLUE));
   if (NULL != clue) {
-    clue->token_id = token_id;
-    clue->probability = probability;
-    clue->strength = fabs(0.5 - probability);
+    init_clue(clue, token_id, probability);
   }
   return clue;
 }
@@ -43,38 +54,103 @@ void free_clue(Clue *clue) {
   free(clue);
 }
 
+/* Fibonacci hashing of the token id, the best mixed bits are at the top of the product. */
+static inline uint64_t hash_token(int token_id) {
+  return (uint64_t) (uint32_t) token_id * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline int slot_for(const ClueList * clues, int token_id) {
+  return (int) (hash_token(token_id) >> clues->hash_shift);
+}
+
+static Clue * find_slot(const ClueList * clues, int token_id) {
+  int slot = slot_for(clues, token_id);
+  
+  while (clues->table[slot].token_id != EMPTY_SLOT && clues->table[slot].token_id != token_id) {
+    slot = (slot + 1) & (clues->capacity - 1);
+  }
+  
+  return &clues->table[slot];
+}
+
+/* Resizes the table, rehashing all the clues into it. */
+static int resize_clue_list(ClueList * clues, int capacity) {
+  Clue *old_table = clues->table;
+  int old_capacity = clues->capacity;
+  int i;
+  
+  if (NULL == (clues->table = malloc(capacity * sizeof(struct CLUE)))) {
+    clues->table = old_table;
+    return 1;
+  }
+  
+  clues->capacity = capacity;
+  for (clues->hash_shift = 64; capacity > 1; capacity >>= 1) {
+    clues->hash_shift--;
+  }
+  
+  for (i = 0; i < clues->capacity; i++) {
+    clues->table[i].token_id = EMPTY_SLOT;
+  }
+  
+  for (i = 0; i < old_capacity; i++) {
+    if (old_table[i].token_id != EMPTY_SLOT) {
+      *find_slot(clues, old_table[i].token_id) = old_table[i];
+    }
+  }
+  
+  free(old_table);
+  return 0;
+}
+
 ClueList * new_clue_list(void) {
   ClueList *clues = calloc(1, sizeof(struct CLUE_LIST));
   if (NULL == clues) {
     fatal("Could not allocate clue list");
-  } else {
-    clues->size = 0;
-    clues->list = NULL;
   }
   
   return clues;
 }
 
+/* Makes room for num_clues clues so they can be added without the table being resized. */
+void reserve_clues(ClueList * clues, int num_clues) {
+  if (clues) {
+    int capacity = clues->capacity ? clues->capacity : INITIAL_CAPACITY;
+    
+    while (capacity < 2 * num_clues) {
+      capacity *= 2;
+    }
+    
+    if (capacity > clues->capacity && resize_clue_list(clues, capacity)) {
+      fatal("Could not allocate space for %i clues", num_clues);
+    }
+  }
+}
+
+/* Adds a clue to the list, unless the token already has a clue.
+ *
+ * Returns the token's clue. Since clues are stored inline this is only valid until the next
+ * clue is added, once the list is complete the clues stay where they are.
+ */
 Clue * add_clue(ClueList * clues, int token_id, double probability) {
   Clue * clue = NULL;
   
   if (clues) {
-    // Check if it exists
-    clue = get_clue(clues, token_id);
-    if (clue == NULL) {
-      clue = new_clue(token_id, probability);
-      if (NULL != clue) {
-        PWord_t clue_p;
-        JLI(clue_p, clues->list, token_id);
-        if (NULL == clue_p) {
-          fatal("Could not allocate spot in clue list");
-        } else {
-          *clue_p = (Word_t) clue;
-          clues->size++;    
-        }
-      } else {
-        fatal("Could not allocate clue");
-      }    
+    /* Keep the table at most half full so probe sequences stay short. */
+    if (2 * (clues->size + 1) > clues->capacity &&
+        resize_clue_list(clues, clues->capacity ? 2 * clues->capacity : INITIAL_CAPACITY)) {
+      fatal("Could not allocate spot in clue list");
+    } else {
+      clue = find_slot(clues, token_id);
+      
+      if (clue->token_id == EMPTY_SLOT) {
+        init_clue(clue, token_id, probability);
+        clues->size++;
+        
+        /* The filter no longer covers every strong clue */
+        free(clues->strong_filter);
+        clues->strong_filter = NULL;
+      }
     }
   }
   
@@ -84,12 +160,145 @@ Clue * add_clue(ClueList * clues, int token_id, double probability) {
 Clue * get_clue(const ClueList * clues, int token_id) {
   Clue * clue = NULL;
   
+  if (clues && clues->size > 0) {
+    clue = find_slot(clues, token_id);
+    if (clue->token_id == EMPTY_SLOT) {
+      clue = NULL;
+    }
+  }
+  
+  return clue;
+}
+
+/* Sets the probability of the token's clue, adding the clue if the token doesn't have one.
+ *
+ * Like add_clue this invalidates the strong clue filter.
+ */
+Clue * set_clue(ClueList * clues, int token_id, double probability) {
+  Clue * clue = get_clue(clues, token_id);
+  
+  if (NULL == clue) {
+    clue = add_clue(clues, token_id, probability);
+  } else if (clue->probability != probability) {
+    /* Updating in place never moves a clue, so this is safe while iterating with next_clue */
+    init_clue(clue, token_id, probability);
+    free(clues->strong_filter);
+    clues->strong_filter = NULL;
+  }
+  
+  return clue;
+}
+
+/* Removes the token's clue, if it has one.
+ *
+ * The clues following it in its probe sequence are shifted back into the
+ * gap so lookups never need to skip over deleted slots.
+ */
+void remove_clue(ClueList * clues, int token_id) {
+  Clue * clue = get_clue(clues, token_id);
+  
+  if (clue) {
+    int gap = clue - clues->table;
+    int slot;
+    
+    for (slot = (gap + 1) & (clues->capacity - 1); clues->table[slot].token_id != EMPTY_SLOT; slot = (slot + 1) & (clues->capacity - 1)) {
+      /* A clue can fill the gap if the gap lies between its home slot and where it is now */
+      int home = slot_for(clues, clues->table[slot].token_id);
+      if (((slot - home) & (clues->capacity - 1)) >= ((slot - gap) & (clues->capacity - 1))) {
+        clues->table[gap] = clues->table[slot];
+        gap = slot;
+      }
+    }
+    
+    clues->table[gap].token_id = EMPTY_SLOT;
+    clues->size--;
+    
+    free(clues->strong_filter);
+    clues->strong_filter = NULL;
+  }
+}
+
+static inline uint32_t filter_bit_for(int token_id) {
+  return (uint32_t) (hash_token(token_id) >> 16);
+}
+
+/* Builds the strong clue filter for clues at least min_strength strong.
+ *
+ * This should be called once all the clues have been added.
+ */
+void index_strong_clues(ClueList * clues, double min_strength) {
+  if (clues) {
+    int num_strong = 0;
+    uint32_t bits = 64;
+    int i;
+    
+    for (i = 0; i < clues->capacity; i++) {
+      if (clues->table[i].token_id != EMPTY_SLOT && clues->table[i].strength >= min_strength) {
+        num_strong++;
+      }
+    }
+    
+    while (bits < (uint32_t) num_strong * FILTER_BITS_PER_CLUE && bits < (1U << 31)) {
+      bits <<= 1;
+    }
+    
+    free(clues->strong_filter);
+    if (NULL == (clues->strong_filter = calloc(bits / 64, sizeof(uint64_t)))) {
+      fatal("Could not allocate strong clue filter");
+    } else {
+      clues->strong_filter_mask = bits - 1;
+      clues->strong_clue_strength = min_strength;
+      
+      for (i = 0; i < clues->capacity; i++) {
+        if (clues->table[i].token_id != EMPTY_SLOT && clues->table[i].strength >= min_strength) {
+          uint32_t bit = filter_bit_for(clues->table[i].token_id) & clues->strong_filter_mask;
+          clues->strong_filter[bit / 64] |= (uint64_t) 1 << (bit % 64);
+        }
+      }
+    }
+  }
+}
+
+/* Gets the clue for the token if it is at least min_strength strong.
+ *
+ * If the list has a strong clue filter that covers min_strength, tokens
+ * without a strong enough clue are usually rejected by the filter alone.
+ */
+Clue * get_strong_clue(const ClueList * clues, int token_id, double min_strength) {
+  Clue *clue = NULL;
+  
+  if (clues) {
+    if (clues->strong_filter && min_strength >= clues->strong_clue_strength) {
+      uint32_t bit = filter_bit_for(token_id) & clues->strong_filter_mask;
+      if (!(clues->strong_filter[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+        return NULL;
+      }
+    }
+    
+    clue = get_clue(clues, token_id);
+    if (clue && clue->strength < min_strength) {
+      clue = NULL;
+    }
+  }
+  
+  return clue;
+}
+
+/* Iterates over the clues in no particular order.
+ *
+ * Start with *position set to 0. Returns NULL once every clue has been returned.
+ */
+const Clue * next_clue(const ClueList * clues, int * position) {
+  const Clue *clue = NULL;
+  
   if (clues) {
-    PWord_t clue_pointer;
-    JLG(clue_pointer, clues->list, token_id);
-    if (NULL != clue_pointer) {
-      clue = (Clue*)(*clue_pointer);
-    }    
+    while (NULL == clue && *position < clues->capacity) {
+      if (clues->table[*position].token_id != EMPTY_SLOT) {
+        clue = &clues->table[*position];
+      }
+      
+      (*position)++;
+    }
   }
   
   return clue;
@@ -97,20 +306,16 @@ Clue * get_clue(const ClueList * clues, int token_id) {
 
 void free_clue_list(ClueList * clues) {
   if (clues) {
-    int size;
-    int bytes;
-    PWord_t clue_pointer;
-    Word_t index = 0;
+    int bytes = clues->capacity * sizeof(struct CLUE) + sizeof(ClueList);
+    int size = clues->size;
     
-    JLF(clue_pointer, clues->list, index);
-    while (clue_pointer) {
-      free((Clue*)(*clue_pointer));
-      JLN(clue_pointer, clues->list, index);
+    if (clues->strong_filter) {
+      bytes += (clues->strong_filter_mask + 1) / 8;
     }
     
-    JLC(size, clues->list, 0, -1);
-    JLFA(bytes, clues->list);
+    free(clues->table);
+    free(clues->strong_filter);
     free(clues);
-    info("Freed %i bytes from clue list of %i clues", bytes + (size * sizeof(struct CLUE)) + sizeof(ClueList), size);
+    info("Freed %i bytes from clue list of %i clues", bytes, size);
   }  
 }
@@ -27,30 +27,57 @@
 #ifndef _CLUE_H_
 #define _CLUE_H_
 
-#include <Judy.h>
+#include <stdint.h>
 
 typedef struct CLUE {
   int token_id;
   double probability;
   double strength;
+  /* log(probability) and log(1 - probability) so items can be scored by summing them */
+  double log_probability;
+  double log_complement;
 } Clue;
 
+/* The clues for a tagger.
+ *
+ * Clues are stored inline in an open addressed hash table keyed by token id,
+ * so looking up a clue is a single probe into one flat array in the common case.
+ *
+ * Once the list is complete, index_strong_clues builds a small bitmap filter of
+ * the tokens whose clues are at least a given strength. Most of an item's tokens
+ * don't have a strong clue and get rejected by the filter without touching the table.
+ */
 typedef struct CLUE_LIST {
   int size;
-  Pvoid_t list;
+  /* The number of slots in the table, always 0 or a power of 2. */
+  int capacity;
+  int hash_shift;
+  Clue *table;
+  /* Bitmap of the tokens with clues at least strong_clue_strength strong. */
+  uint64_t *strong_filter;
+  uint32_t strong_filter_mask;
+  double strong_clue_strength;
 } ClueList;
 
 Clue * new_clue  (int token_id, double probability);
 void         free_clue (Clue *clue);
 
 ClueList * new_clue_list();
+void       reserve_clues(ClueList * clues, int num_clues);
 Clue *     add_clue(ClueList * clues, int token_id, double probability);
+Clue *     set_clue(ClueList * clues, int token_id, double probability);
+void       remove_clue(ClueList * clues, int token_id);
 Clue *     get_clue(const ClueList * clues, int token_id);
+Clue *     get_strong_clue(const ClueList * clues, int token_id, double min_strength);
+const Clue * next_clue(const ClueList * clues, int * position);
+void       index_strong_clues(ClueList * clues, double min_strength);
 void free_clue_list(ClueList * clues);
 
 #define clue_token_id(clue)        clue->token_id
 #define clue_probability(clue)     clue->probability
 #define clue_strength(clue)        clue->strength
+#define clue_log_probability(clue) clue->log_probability
+#define clue_log_complement(clue)  clue->log_complement
 
 #endif /* _CLUE_H_ */
 
@@ -242,7 +242,8 @@ static int about_handler(const HTTPRequest * request, HTTPResponse * response) {
 }
 
 static int add_entry(const HTTPRequest * request, HTTPResponse * response) {
-  xmlDocPtr doc = NULL;
+  ItemCacheEntry *entry = NULL;
+  int well_formed = false;
 
   if (POST != request->method) {
     response->code = MHD_HTTP_METHOD_NOT_ALLOWED;
@@ -251,30 +252,25 @@ static int add_entry(const HTTPRequest * request, HTTPResponse * response) {
   } else if (NULL == request->data) {
     info("NO DATA");
     HTTP_BAD_XML(response);
-  } else if (NULL == (doc = xmlReadMemory(request->data->buf, request->data->length, "", NULL, XML_PARSE_COMPACT))) {
+  } else if (NULL == (entry = item_cache_parse_entry(request->item_cache, request->data->buf, &well_formed)) && !well_formed) {
     info("BAD DATA: %s", request->data->buf);
     HTTP_BAD_XML(response);
+  } else if (!entry) {
+    HTTP_BAD_ENTRY(response);
   } else {
-    ItemCacheEntry *entry = create_entry_from_atom_xml_document(doc, request->data->buf);
-
-    if (!entry) {
-      HTTP_BAD_ENTRY(response);
+    if (CLASSIFIER_OK == item_cache_add_entry(request->item_cache, entry)) {
+      response->code = MHD_HTTP_CREATED;
+      /* The body is echoed back so the response takes it over instead of copying it. */
+      response->content = buffer_release(request->data);
+      response->content_type = CONTENT_TYPE;
+      response->location = calloc(64, sizeof(char));
+      response->free_content = true;
+      snprintf(response->location, 64, "/feed_items/%i", item_cache_entry_id(entry));
     } else {
-      if (CLASSIFIER_OK == item_cache_add_entry(request->item_cache, entry)) {
-        response->code = MHD_HTTP_CREATED;
-        response->content = strdup(request->data->buf);
-        response->content_type = CONTENT_TYPE;
-        response->location = calloc(64, sizeof(char));
-        response->free_content = true;
-        snprintf(response->location, 64, "/feed_items/%i", item_cache_entry_id(entry));
-      } else {
-        HTTP_BAD_ENTRY(response);
-      }
-      
-      free_entry(entry);
+      HTTP_BAD_ENTRY(response);
     }
-    
-    xmlFreeDoc(doc);
+
+    free_entry(entry);
   }
 
   return 0;
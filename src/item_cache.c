@@ -30,8 +30,13 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
@@ -49,27 +54,100 @@
 #include "xml.h"
 #include "array.h"
 #include "tokenizer.h"
-
-#define CURRENT_USER_VERSION 5
+#include "segment_store.h"
+#include "buffer.h"
+
+#define CURRENT_USER_VERSION 6
+/* Version 5 only differs in the format of the token blobs, which are still readable and get migrated in the background. */
+#define UPGRADABLE_USER_VERSION 5
+#define UPGRADE_USER_VERSION_SQL "PRAGMA user_version = 6"
+#define FETCH_TOKEN_BLOB_VERSION_SQL "PRAGMA token.user_version"
+#define SET_TOKEN_BLOB_VERSION_SQL "PRAGMA token.user_version = 1"
 #define FETCH_ITEM_SQL "select full_id, id, strftime('%s', updated) from entries where full_id = ?"
-#define FETCH_ALL_ITEMS_SQL "select full_id, id, strftime('%s', updated) from entries where updated > (julianday('now') - ?) order by updated desc"
-#define FETCH_RANDOM_BACKGROUND "select full_id, id from entries where id in (select entry_id from random_backgrounds)"
+#define FETCH_ALL_ITEMS_SQL "select entries.full_id, entries.id, strftime('%s', entries.updated), entry_tokens.tokens \
+                             from entries join token.entry_tokens on entry_tokens.id = entries.id \
+                             where entries.id between ? and ? and entries.updated > (julianday('now') - ?) order by entries.id"
+#define FETCH_KEY_RANGE_SQL "select min(id), max(id) from entries where updated > (julianday('now') - ?)"
+/* Every entry in the load window, without tokens, to find the ones a snapshot is missing. */
+#define FETCH_RECENT_ITEM_KEYS_SQL "select full_id, id, strftime('%s', updated) from entries where updated > (julianday('now') - ?)"
+#define FETCH_RANDOM_BACKGROUND "select random_backgrounds.entry_id, entry_tokens.tokens from random_backgrounds \
+                                 left join token.entry_tokens on entry_tokens.id = random_backgrounds.entry_id"
+/* With a segment store the tokens are read from it by entry id instead of being joined in. */
+#define FETCH_ALL_ITEM_KEYS_SQL "select full_id, id, strftime('%s', updated) from entries \
+                                 where id between ? and ? and updated > (julianday('now') - ?) order by id"
+#define FETCH_RANDOM_BACKGROUND_KEYS "select entry_id from random_backgrounds"
+#define FETCH_ALL_ENTRY_TOKENS "select id, tokens from token.entry_tokens"
+#define DELETE_ALL_ENTRY_TOKENS "delete from token.entry_tokens"
 #define INSERT_ENTRY_SQL "insert into entries (full_id, updated, created_at) \
                           VALUES (:full_id, julianday(:updated, 'unixepoch'), julianday(:created_at, 'unixepoch'))"
 #define UPDATE_ENTRY_SQL "update entries set updated = julianday(?, 'unixepoch') where full_id = ?"
 #define DELETE_ENTRY_SQL "delete from entries where id = ?"
-#define FIND_ATOM_SQL "select id from tokens where token = ?"
-#define INSERT_ATOM_SQL "insert into tokens (token) values (?)"
+#define FETCH_EXPIRED_ENTRIES_SQL "select id from entries \
+                                   where updated < (julianday('now') - ?) \
+                                   and (last_used_at is null or last_used_at < (julianday('now') - ?)) \
+                                   and id not in (select entry_id from random_backgrounds) limit ?"
+#define LOAD_ATOMS_SQL "select id, token from tokens"
+#define INSERT_ATOM_SQL "insert into tokens (id, token) values (?, ?)"
+/* Tokens whose hash collides with one already in the table keep the first one's string. */
+#define INSERT_HASHED_ATOM_SQL "insert or ignore into tokens (id, token) values (?, ?)"
+#define CREATE_TOKEN_HASHING_SQL "create table if not exists token_hashing (function text not null)"
+#define FETCH_TOKEN_HASHING_SQL "select function from token_hashing"
+#define INSERT_TOKEN_HASHING_SQL "insert into token_hashing values ('" TOKEN_HASH_FUNCTION "')"
+#define CREATE_TOKEN_STORAGE_SQL "create table if not exists token_storage (backend text not null)"
+#define FETCH_TOKEN_STORAGE_SQL "select backend from token_storage"
+#define INSERT_TOKEN_STORAGE_SQL "insert into token_storage values ('segments')"
+#define CREATE_SEGMENT_SWAP_SQL "create table if not exists segment_swap (pending integer not null)"
+#define INSERT_SEGMENT_SWAP_SQL "insert into segment_swap values (1)"
+#define FETCH_SEGMENT_SWAP_SQL "select count(*) from segment_swap"
+#define DELETE_SEGMENT_SWAP_SQL "delete from segment_swap"
+/* Counts the catalog changes that can make a snapshot of the in-memory cache stale.
+ * New entries aren't counted since a snapshot is checked against the largest entry id. */
+#define CREATE_CATALOG_CHANGES_SQL "create table if not exists catalog_changes (changes integer not null); \
+  insert into catalog_changes select 0 where not exists (select 1 from catalog_changes); \
+  create trigger if not exists catalog_changes_entry_delete after delete on entries \
+    begin update catalog_changes set changes = changes + 1; end; \
+  create trigger if not exists catalog_changes_entry_update after update of updated on entries when new.updated is not old.updated \
+    begin update catalog_changes set changes = changes + 1; end; \
+  create trigger if not exists catalog_changes_background_insert after insert on random_backgrounds \
+    begin update catalog_changes set changes = changes + 1; end; \
+  create trigger if not exists catalog_changes_background_delete after delete on random_backgrounds \
+    begin update catalog_changes set changes = changes + 1; end;"
+#define FETCH_CATALOG_STATE_SQL "select (select changes from catalog_changes), (select ifnull(max(id), 0) from entries)"
+#define FETCH_CACHE_IS_EMPTY_SQL "select not exists (select 1 from entries) and not exists (select 1 from tokens)"
 #define FIND_TOKEN_SQL "select token from tokens where id = ?"
+#define DELETE_ATOM_SQL "delete from tokens where id = ?"
+#define DELETE_ALL_ATOMS_SQL "delete from tokens"
+#define FETCH_ALL_TOKENS_SQL "select tokens from token.entry_tokens"
+#define FETCH_TOKENS_AFTER_SQL "select id, tokens from token.entry_tokens where id > ? order by id limit ?"
+#define UPDATE_ENTRY_TOKENS "update token.entry_tokens set tokens = ? where id = ?"
+/* This trigger refers to entry_tokens from before it moved to tokens.db so it stops any atom being deleted. */
+#define DROP_STALE_ATOM_TRIGGER_SQL "drop trigger if exists entry_tokens_token_id"
 #define CORRUPT_TOKEN_FILE "Token file %s did not have a multiple of %i bytes, it has %i bytes and is possibly corrupt."
-#define INSERT_ATOM_XML_SQL "insert into atom.entry_atom values (?, ?)"
+#define INSERT_ATOM_XML_SQL "insert or replace into atom.entry_atom values (?, ?)"
 #define DELETE_ATOM_XML_SQL "delete from atom.entry_atom where id = ?"
 #define FETCH_ENTRY_TOKENS  "select tokens from token.entry_tokens where id = ?"
 #define INSERT_ENTRY_TOKENS "insert into token.entry_tokens values (?, ?)"
 #define DELETE_ENTRY_TOKENS "delete from token.entry_tokens where id = ?"
 #define TOUCH_ITEM_SQL "update entries set last_used_at = julianday('now') where full_id = ?"
+#define FETCH_UNTOKENIZED_ENTRIES_SQL "select id from entries where id not in (select id from token.entry_tokens) order by id"
+/* With a segment store the entries are checked against the store instead. */
+#define FETCH_ENTRY_IDS_SQL "select id from entries order by id"
+#define FETCH_STORED_ENTRY_SQL "select entries.full_id, strftime('%s', entries.updated), entry_atom.atom \
+                                from entries join atom.entry_atom on entry_atom.id = entries.id where entries.id = ?"
 #define TOKEN_BYTES 6
+#define TOKEN_BLOB_MAGIC 'W'
+#define TOKEN_BLOB_VERSION 1
+#define TOKEN_BLOB_HEADER_BYTES 2
+#define TOKEN_BLOB_CHECKSUM_BYTES 4
 #define PROCESSING_LIMIT 200
+#define TOKEN_SLAB_SIZE 65536
+#define PARALLEL_CHUNK_SIZE 256
+#define PURGE_BATCH_SIZE 100
+#define PURGE_BATCH_PAUSE 100000
+#define PURGE_VACUUM_PAGES 1024
+#define DEFAULT_MAX_READERS 8
+#define TOKEN_REWRITE_CHUNK_SIZE 1000
+#define TOKENIZE_QUEUE_LIMIT 10000
 
 typedef struct ORDERED_ITEM_LIST OrderedItemList;
 struct ORDERED_ITEM_LIST {
@@ -89,10 +167,38 @@ struct ITEM {
    * it will be the time the item was added to the cache.
    */
   time_t time;
-  /* The tokens of the item. This is a Judy array of token_id -> frequency. */
-  Pvoid_t tokens;
+  /* The tokens of the item. This is an array of {token_id, frequency} sorted by token_id. */
+  Token *tokens;
+  /* The number of distinct tokens in the tokens array */
+  int num_tokens;
+  /* The number of tokens the tokens array has room for */
+  int token_capacity;
+  /* The slab the tokens array was carved from, or NULL if it was malloced on its own. */
+  struct TOKEN_SLAB *slab;
 };
 
+/* Token arrays for items loaded in bulk are carved from large contiguous
+ * slabs so that a scan of the cache walks memory in load order instead of
+ * chasing a separate allocation per item.
+ *
+ * A slab counts the items that still use it, plus one while the loader is
+ * still filling it, and is freed when that count reaches zero. Items are
+ * loaded in descending time order, so a slab's items tend to get purged
+ * together and the slab is returned to the system along with them.
+ *
+ * Items loaded from a snapshot use their tokens in place in the mapped
+ * snapshot file. The mapping is shared between them through a slab with
+ * no tokens of its own, which unmaps it when the last of them is freed.
+ */
+typedef struct TOKEN_SLAB {
+  int references;
+  int used;
+  int capacity;
+  void *mapping;
+  size_t mapping_size;
+  Token tokens[];
+} TokenSlab;
+
 typedef enum UPDATE_TYPE {
   ADD,
   DELETE
@@ -109,28 +215,64 @@ struct ITEM_CACHE_ENTRY {
   time_t updated;
   time_t created_at;
   char * atom;
+  /* Set when atom belongs to whoever created the entry and isn't freed with it. */
+  int borrowed_atom;
+  /* Features found when the atom was parsed, which saves tokenizing it again. */
+  Pvoid_t features;
 };
 
+/* A read-only connection to the database with its own prepared statements. */
+typedef struct READER {
+  sqlite3 *db;
+  sqlite3_stmt *fetch_item_stmt;
+  sqlite3_stmt *fetch_tokens_stmt;
+  sqlite3_stmt *find_token_stmt;
+  struct READER *next;
+} Reader;
+
+/* An entry waiting to be written by a group commit. */
+typedef struct ENTRY_WRITE {
+  ItemCacheEntry *entry;
+  /* The tokenized entry and its serialized tokens, or NULL if the entry's tokens don't need saving. */
+  Item *item;
+  char *token_data;
+  int token_data_size;
+  /* Set by the committing thread once the group containing this write is finished. */
+  int rc;
+  int done;
+  struct ENTRY_WRITE *next;
+  /* The entry was stored by an earlier write and only its tokens need saving. */
+  int tokens_only;
+} EntryWrite;
+
 /** This is the opaque type for the Item Cache */
 struct ITEM_CACHE {
   char *cache_directory;
 
+  /* File the in-memory cache is saved to and loaded from, or NULL for none. */
+  char *snapshot_file;
+
   /* Item cache's copy of ItemCacheOptions */
   int cache_update_wait_time;
   int load_items_since;
   int min_tokens;
+  int load_threads;
+  int keep_entries_for;
+  int use_segment_store;
+  int tokenizer_threads;
+  int hash_tokens;
+  int keep_token_strings;
 
   sqlite3 *db;
   sqlite3_stmt *fetch_item_stmt;
-  sqlite3_stmt *fetch_all_items_stmt;
+  sqlite3_stmt *fetch_recent_item_keys_stmt;
   sqlite3_stmt *random_background_stmt;
   sqlite3_stmt *insert_entry_stmt;
   sqlite3_stmt *update_entry_stmt;
   sqlite3_stmt *delete_entry_stmt;
+  sqlite3_stmt *fetch_expired_entries_stmt;
   sqlite3_stmt *insert_atom_xml_stmt;
   sqlite3_stmt *delete_atom_xml_stmt;
-  sqlite3_stmt *find_token_stmt;
-  sqlite3_stmt *find_atom_stmt;
   sqlite3_stmt *insert_atom_stmt;
   sqlite3_stmt *insert_tokens_stmt;
   sqlite3_stmt *fetch_tokens_stmt;
@@ -145,9 +287,89 @@ struct ITEM_CACHE {
    */
   pthread_mutex_t db_access_mutex;
 
+  /* Idle read-only connections.
+   *
+   * Reads that only need to see committed data take a connection from here
+   * instead of using db, so they never wait on the db_access_mutex. A new
+   * connection is opened when none are idle until there are max_readers of
+   * them, one for each thread that reads, after that a reader waits on
+   * reader_released for one to come back. Protected by reader_pool_mutex.
+   */
+  Reader *idle_readers;
+  int open_readers;
+  int max_readers;
+  pthread_mutex_t reader_pool_mutex;
+  pthread_cond_t reader_released;
+
+  /* JudySL set of the ids of items fetched since the last flush_touched_items.
+   *
+   * Fetching an item only adds it here, so the read path doesn't wait on the
+   * db_access_mutex, and their last_used_at is written in one transaction by
+   * the cache updater or before a purge. Protected by touched_items_mutex.
+   */
+  Pvoid_t touched_items;
+  pthread_mutex_t touched_items_mutex;
+
   int user_version;
   int version_mismatch;
 
+  /* Set when the cache's token ids are hashed and hash_tokens isn't, or the other way around. */
+  int token_id_mismatch;
+
+  /* Set once the token vectors have been moved out of tokens.db into the segment store. */
+  int tokens_in_segments;
+
+  /* Set when the token vectors are in the segment store but segment_store isn't. */
+  int token_storage_mismatch;
+
+  /* Append-only store the token vectors are kept in instead of tokens.db,
+   * or NULL if they are in tokens.db.
+   */
+  SegmentStore *segment_store;
+
+  /* The token blob format version recorded in tokens.db, any older blobs
+   * are rewritten by item_cache_migrate_token_blobs.
+   */
+  int token_blob_version;
+
+  /* In-memory copy of the token to atom mapping in the tokens table.
+   *
+   * atoms is a JudySL array keyed by token with the atom as the value, so
+   * atomizing a token doesn't touch the database. New atoms are numbered
+   * from next_atom and kept in pending_atoms until flush_atoms writes them
+   * to the tokens table, and in flushing_atoms while they are being written.
+   * This assumes nothing else adds to the tokens table while the cache is
+   * open. All of these are protected by atoms_lock.
+   */
+  Pvoid_t atoms;
+  int next_atom;
+  Array *pending_atoms;
+  Array *flushing_atoms;
+  pthread_rwlock_t atoms_lock;
+
+  /* With hash_tokens the id of a token is its hash so atoms is left empty.
+   * If keep_token_strings is set this JudyL array has every id that is in
+   * the tokens table or pending, so each new token's string is only written
+   * once. Also protected by atoms_lock.
+   */
+  Pvoid_t known_hashes;
+
+  /* How durable commits to the database are. */
+  ItemCacheDurability durability;
+
+  /* Entry writes waiting for the next group commit.
+   *
+   * Threads adding entries queue their writes here. Whichever thread finds
+   * no commit in progress takes the whole queue and writes it in a single
+   * transaction while the others wait on write_committed. These are all
+   * protected by write_queue_mutex.
+   */
+  EntryWrite *pending_writes;
+  EntryWrite *last_pending_write;
+  int committing;
+  pthread_mutex_t write_queue_mutex;
+  pthread_cond_t write_committed;
+
   /************************************
    *  In-memory cache members
    */
@@ -161,12 +383,28 @@ struct ITEM_CACHE {
   /* Number of items in the array */
   int cached_size;
 
+  /* Inverted index of the cached items.
+   *
+   * This is a Judy Array keyed by token id. Each value is another Judy
+   * Array keyed by the address of each cached item containing the token.
+   */
+  Pvoid_t items_by_token;
+
   /* A linked list of item ids in descending order of updated time. */
   OrderedItemList *items_in_order;
 
   /* The Random Background pool. */
   Pool *random_background;
 
+  /* The catalog_changes count the in-memory cache matches, -1 if it is unknown.
+   *
+   * The cache doesn't apply catalog updates or deletes to the items it holds,
+   * so this stays at the count from when it was loaded unless a change is known
+   * not to affect any cached item. A snapshot records it so that one written
+   * after a change the cache doesn't reflect is never loaded. Guarded by db_access_mutex.
+   */
+  int catalog_changes;
+
   /************************************
    *  In-memory cache updating members
    */
@@ -174,6 +412,17 @@ struct ITEM_CACHE {
   /* Queue for items to get added to the items_by_id and items_in_order lists. */
   Queue *update_queue;
 
+  /* Entries that have been stored but still need to be tokenized.
+   *
+   * Once the tokenizer threads are running add_entry puts copies of the
+   * entries it stores here instead of tokenizing them itself. The
+   * tokenizers take them off, save their tokens and pass the items on
+   * to the update_queue.
+   */
+  Queue *tokenize_queue;
+  pthread_t *tokenizers;
+  int num_tokenizers;
+
   /* Thread which handles the cache updating */
   pthread_t *cache_updating_thread;
 
@@ -256,26 +505,79 @@ static ItemCacheEntry * copy_entry(const ItemCacheEntry * entry) {
   return copy;
 }
 
+/* Parses the updated time of an entry, defaulting to now. */
+static time_t parse_updated_time(const char * updated) {
+  struct tm updated_tm;
+  memset(&updated_tm, 0, sizeof(updated_tm));
+  time_t updated_time = time(NULL);
+
+  if (updated && NULL != strptime(updated, "%Y-%m-%dT%H:%M:%S%Z", &updated_tm)) {
+    updated_time = timegm(&updated_tm);
+  } else if (updated && NULL != strptime(updated, "%Y-%m-%dT%H:%M:%S", &updated_tm)) {
+    updated_time = timegm(&updated_tm);
+  } else {
+    error("Couldn't parse datetime: %s", updated);
+  }
+
+  return updated_time;
+}
+
 ItemCacheEntry * create_entry_from_atom_xml(const char * xml) {
   ItemCacheEntry *entry = NULL;
+  AtomEntry parsed;
 
-  xmlDocPtr doc;
-
-  if (NULL == (doc = xmlReadMemory(xml, strlen(xml), "", NULL, XML_PARSE_COMPACT))) {
+  if (!atom_parse_entry(xml, strlen(xml), false, &parsed)) {
     error("BAD DATA: %s", xml);
+  } else if (!parsed.id) {
+    error("Missing id from atom (updated %s)", parsed.updated);
+    free(parsed.updated);
   } else {
     entry = calloc(1, sizeof(struct ITEM_CACHE_ENTRY));
-    xmlXPathContextPtr ctx = xmlXPathNewContext(doc);
-    xmlXPathRegisterNs(ctx, BAD_CAST "atom", BAD_CAST "http://www.w3.org/2005/Atom");
-
-    entry->full_id = get_element_value(ctx, "/atom:entry/atom:id/text()");
-    entry->updated = get_element_value_time(ctx, "/atom:entry/atom:updated/text()");
+    entry->full_id = parsed.id;
+    entry->updated = parsed.updated ? parse_updated_time(parsed.updated) : time(NULL);
     entry->atom = strdup(xml);
+    free(parsed.updated);
+  }
+
+  return entry;
+}
 
-    xmlXPathFreeContext(ctx);
-    xmlFreeDoc(doc);
+/** Create an entry by parsing its atom XML once, without building a document.
+ *
+ * The entry refers to xml rather than copying it, so xml must outlive the
+ * entry. Unless tokenizer threads will tokenize the entry once it is stored,
+ * its features are extracted in the same pass for item_cache_add_entry to use.
+ *
+ * @param well_formed Set to whether xml is well formed, if not NULL.
+ * @return the entry, or NULL if xml is not well formed or has no id.
+ */
+ItemCacheEntry * item_cache_parse_entry(const ItemCache * item_cache, const char * xml, int * well_formed) {
+  ItemCacheEntry *entry = NULL;
+  AtomEntry parsed;
+  int tokenize = item_cache && item_cache->num_tokenizers == 0;
+  int parsed_ok = atom_parse_entry(xml, xml ? strlen(xml) : 0, tokenize, &parsed);
+
+  if (well_formed) {
+    *well_formed = parsed_ok;
+  }
+
+  if (parsed.id && NULL != (entry = calloc(1, sizeof(struct ITEM_CACHE_ENTRY)))) {
+    entry->full_id = parsed.id;
+    entry->updated = parse_updated_time(parsed.updated);
+    entry->created_at = time(NULL);
+    entry->atom = (char*) xml;
+    entry->borrowed_atom = true;
+    entry->features = parsed.features;
+  } else {
+    Word_t freed_bytes;
+    if (parsed_ok && !parsed.id) {
+      error("Missing id from atom (updated %s)", parsed.updated);
+    }
+    free(parsed.id);
+    JSLFA(freed_bytes, parsed.features);
   }
 
+  free(parsed.updated);
   return entry;
 }
 
@@ -291,19 +593,7 @@ ItemCacheEntry * create_entry_from_atom_xml_document(xmlDocPtr doc, const char *
 
   // Must have an id to be able to create an item, everything else is optional.
   if (id) {
-    struct tm updated_tm;
-    memset(&updated_tm, 0, sizeof(updated_tm));
-    time_t updated_time = time(NULL);
-
-    if (updated && NULL != strptime(updated, "%Y-%m-%dT%H:%M:%S%Z", &updated_tm)) {
-      updated_time = timegm(&updated_tm);
-    } else if (updated && NULL != strptime(updated, "%Y-%m-%dT%H:%M:%S", &updated_tm)) {
-      updated_time = timegm(&updated_tm);
-    } else {
-      error("Couldn't parse datetime: %s", updated);
-    }
-
-    entry = create_item_cache_entry(id, updated_time, time(NULL), xml_source);
+    entry = create_item_cache_entry(id, parse_updated_time(updated), time(NULL), xml_source);
   } else {
     error("Missing id or updated from atom (%s, %s)", id, updated);
   }
@@ -329,8 +619,12 @@ const char * item_cache_entry_atom(const ItemCacheEntry * entry) {
 
 void free_entry(ItemCacheEntry *entry) {
   if (entry) {
+    Word_t freed_bytes;
     FREE_STRING(entry->full_id);
-    FREE_STRING(entry->atom);
+    if (!entry->borrowed_atom) {
+      FREE_STRING(entry->atom);
+    }
+    JSLFA(freed_bytes, entry->features);
     free(entry);
   }
 }
@@ -369,13 +663,13 @@ static int create_prepared_statements(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
 
   if (SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_ITEM_SQL,             -1, &item_cache->fetch_item_stmt,            NULL) ||
-      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_ALL_ITEMS_SQL,        -1, &item_cache->fetch_all_items_stmt,       NULL) ||
-      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_RANDOM_BACKGROUND,    -1, &item_cache->random_background_stmt,     NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_RECENT_ITEM_KEYS_SQL, -1, &item_cache->fetch_recent_item_keys_stmt, NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, item_cache->use_segment_store ? FETCH_RANDOM_BACKGROUND_KEYS : FETCH_RANDOM_BACKGROUND,
+                                                                                   -1, &item_cache->random_background_stmt,     NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ENTRY_SQL,           -1, &item_cache->insert_entry_stmt,          NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, UPDATE_ENTRY_SQL,           -1, &item_cache->update_entry_stmt,          NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, DELETE_ENTRY_SQL,           -1, &item_cache->delete_entry_stmt,          NULL) ||
-      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FIND_TOKEN_SQL,             -1, &item_cache->find_token_stmt,            NULL) ||
-      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FIND_ATOM_SQL,              -1, &item_cache->find_atom_stmt,             NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_EXPIRED_ENTRIES_SQL,  -1, &item_cache->fetch_expired_entries_stmt, NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ATOM_SQL,            -1, &item_cache->insert_atom_stmt,           NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ATOM_XML_SQL,        -1, &item_cache->insert_atom_xml_stmt,       NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, DELETE_ATOM_XML_SQL,        -1, &item_cache->delete_atom_xml_stmt,       NULL) ||
@@ -393,7 +687,11 @@ static int create_prepared_statements(ItemCache *item_cache) {
 static int check_user_version(ItemCache * item_cache) {
   int rc = CLASSIFIER_OK;
   if (CLASSIFIER_OK == get_user_version(item_cache)) {
-    if (item_cache->user_version != CURRENT_USER_VERSION) {
+    if (item_cache->user_version == UPGRADABLE_USER_VERSION &&
+        SQLITE_OK == sqlite3_exec(item_cache->db, UPGRADE_USER_VERSION_SQL, NULL, NULL, NULL)) {
+      info("Upgraded database from user version %i to %i", UPGRADABLE_USER_VERSION, CURRENT_USER_VERSION);
+      item_cache->user_version = CURRENT_USER_VERSION;
+    } else if (item_cache->user_version != CURRENT_USER_VERSION) {
       item_cache->version_mismatch = 1;
       rc = CLASSIFIER_FAIL;
     }
@@ -404,1307 +702,4781 @@ static int check_user_version(ItemCache * item_cache) {
   return rc;
 }
 
-static int attach_database(sqlite3 *db, const char * path, const char * alias) {
+static int get_token_blob_version(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
-  char sql[MAXPATHLEN];
-
-  if (MAXPATHLEN < snprintf(sql, MAXPATHLEN, "ATTACH DATABASE '%s' as %s", path, alias)) {
-    fatal("Path name too long: %s", path);
-    exit(1);
-  }
+  sqlite3_stmt *stmt;
 
-  if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, NULL)) {
+  if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, FETCH_TOKEN_BLOB_VERSION_SQL, -1, &stmt, NULL) &&
+      SQLITE_ROW == sqlite3_step(stmt)) {
+    item_cache->token_blob_version = sqlite3_column_int(stmt, 0);
+  } else {
+    fatal("Could not fetch the token blob version: %s", sqlite3_errmsg(item_cache->db));
     rc = CLASSIFIER_FAIL;
   }
 
+  sqlite3_finalize(stmt);
   return rc;
 }
 
-static int item_cache_open_database(ItemCache *item_cache) {
+/* Checks that the cache's token ids are hashed if, and only if, hash_tokens is set.
+ *
+ * A cache is marked as hashed by the token_hashing table. An empty cache is
+ * marked the first time it is opened with hash_tokens, anything else has to
+ * be converted with item_cache_hash_atoms.
+ */
+static int check_token_ids(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
-  char path[MAXPATHLEN];
-  char atom_path[MAXPATHLEN];
-  char token_path[MAXPATHLEN];
+  int hashed = false;
+  int empty = false;
+  sqlite3_stmt *stmt;
 
-  if (MAXPATHLEN < snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache->cache_directory)) {
-    fatal("Path to catalog.db too long: %s", item_cache->cache_directory);
-    exit(1);
-  }
+  /* The table doesn't exist in caches that have never been hashed. */
+  if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, FETCH_TOKEN_HASHING_SQL, -1, &stmt, NULL)) {
+    if (SQLITE_ROW == sqlite3_step(stmt)) {
+      const char *function = (const char*) sqlite3_column_text(stmt, 0);
 
-  if (MAXPATHLEN < snprintf(atom_path, MAXPATHLEN, "%s/atom.db", item_cache->cache_directory)) {
-    fatal("Path to atom.db too long: %s", item_cache->cache_directory);
-    exit(1);
-  }
+      if (function && strcmp(TOKEN_HASH_FUNCTION, function)) {
+        fatal("Token ids are hashed with %s but this classifier uses %s", function, TOKEN_HASH_FUNCTION);
+        rc = CLASSIFIER_FAIL;
+      }
 
-  if (MAXPATHLEN < snprintf(token_path, MAXPATHLEN, "%s/tokens.db", item_cache->cache_directory)) {
-    fatal("Path to tokens.db too long: %s", item_cache->cache_directory);
-    exit(1);
+      hashed = true;
+    }
+
+    sqlite3_finalize(stmt);
   }
 
-  info("Attempting to open item cache catalog file at %s", path);
-  if (SQLITE_OK != sqlite3_open_v2(path, &item_cache->db, SQLITE_OPEN_READWRITE, NULL)) {
-      rc = CLASSIFIER_FAIL;
-  } else {
-    if (CLASSIFIER_OK == (rc = check_user_version(item_cache)) &&
-        CLASSIFIER_OK == (rc = attach_database(item_cache->db, atom_path, "atom")) &&
-        CLASSIFIER_OK == (rc = attach_database(item_cache->db, token_path, "token"))) {
+  if (CLASSIFIER_OK == rc && item_cache->hash_tokens && !hashed) {
+    if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, FETCH_CACHE_IS_EMPTY_SQL, -1, &stmt, NULL) &&
+        SQLITE_ROW == sqlite3_step(stmt)) {
+      empty = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
 
-      rc = create_prepared_statements(item_cache);
-      sqlite3_busy_timeout(item_cache->db, 1000);
+    if (!empty) {
+      item_cache->token_id_mismatch = 1;
+      rc = CLASSIFIER_FAIL;
+    } else if (SQLITE_OK != sqlite3_exec(item_cache->db, CREATE_TOKEN_HASHING_SQL, NULL, NULL, NULL) ||
+               SQLITE_OK != sqlite3_exec(item_cache->db, INSERT_TOKEN_HASHING_SQL, NULL, NULL, NULL)) {
+      fatal("Could not mark the item cache as using hashed token ids: %s", sqlite3_errmsg(item_cache->db));
+      rc = CLASSIFIER_FAIL;
+    } else {
+      info("Item cache now uses hashed token ids");
     }
+  } else if (CLASSIFIER_OK == rc && !item_cache->hash_tokens && hashed) {
+    item_cache->token_id_mismatch = 1;
+    rc = CLASSIFIER_FAIL;
   }
 
   return rc;
 }
 
-static int serialize_tokens(Item * item, int *size, char ** token_data) {
+/* Checks whether the token vectors have been moved to the segment store,
+ * in which case the cache can only be opened with one.
+ *
+ * Once a cache has used the segment store nothing looks at tokens.db, so
+ * tokens written there by a run without the store would never be seen.
+ */
+static int check_token_storage(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
-  int num_tokens = item_get_num_tokens(item);
-  *size = num_tokens * 6;
+  sqlite3_stmt *stmt;
 
-  if (NULL == (*token_data = calloc(num_tokens, 6))) {
-    fatal("Could not allocate data for token array");
-    rc = CLASSIFIER_FAIL;
-  } else {
-    int token = 0;
-    short frequency = 0;
-    char * position = token_data[0];
-
-    while (item_next_token(item, &token, &frequency)) {
-      /* Always write the tokens out in network byte order. */
-      int out_token = htonl(token);
-      short out_frequency = htons(frequency);
-
-      // Make sure we haven't overflowed
-      if (position - token_data[0] > *size) {
-        error("Error allocating enough memory for tokens.");
-        free(*token_data);
-        rc = CLASSIFIER_FAIL;
-        break;
-      }
+  /* The table doesn't exist in caches that have never used the segment store. */
+  if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, FETCH_TOKEN_STORAGE_SQL, -1, &stmt, NULL)) {
+    item_cache->tokens_in_segments = SQLITE_ROW == sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
 
-      memcpy(position, &out_token, 4);     position += 4;
-      memcpy(position, &out_frequency, 2); position += 2;
-    }
+  if (item_cache->tokens_in_segments && !item_cache->use_segment_store) {
+    item_cache->token_storage_mismatch = 1;
+    rc = CLASSIFIER_FAIL;
   }
 
   return rc;
 }
 
-static int save_tokens(ItemCache *item_cache, int entry_id, const char * token_data, int size) {
+/* Creates the catalog_changes counter and the triggers that maintain it if they don't exist yet. */
+static int create_catalog_changes(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
 
-  if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_tokens_stmt, 1, entry_id)) {
-    error("Error binding entry id to %s", INSERT_ENTRY_TOKENS);
-    rc = CLASSIFIER_FAIL;
-  } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_tokens_stmt, 2, token_data, size, SQLITE_TRANSIENT)) {
-    error("Error binding blob to %s", INSERT_ENTRY_TOKENS);
-    rc = CLASSIFIER_FAIL;
-  } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_tokens_stmt)) {
-    error("Error inserting token data for item %i: %s", entry_id, item_cache_errmsg(item_cache));
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, CREATE_CATALOG_CHANGES_SQL, NULL, NULL, NULL)) {
+    fatal("Could not create the catalog change counter: %s", sqlite3_errmsg(item_cache->db));
     rc = CLASSIFIER_FAIL;
   }
 
-  sqlite3_clear_bindings(item_cache->insert_tokens_stmt);
-  sqlite3_reset(item_cache->insert_tokens_stmt);
-
   return rc;
 }
 
-/* Fetches the tokens for the given item.
+/* Reads the catalog's change count and largest entry id.
  *
- * @returns the number of tokens fetched for the the item.
+ * Together these identify the state of the catalog a snapshot was written
+ * against. Both are -1 if they can't be read.
  */
-static int read_tokens(const char * token_data, int size, Item * item) {
-  int tokens_read = 0;
+static int fetch_catalog_state(sqlite3 *db, int *changes, int *max_key) {
+  int rc = CLASSIFIER_FAIL;
+  sqlite3_stmt *stmt;
 
-  if (!token_data) {
-    error("No token data for item");
-    tokens_read = -1;
-  } else if (0 != (size % TOKEN_BYTES)) {
-    error("Token data is corrupt for item $i (size = %i)", item->key, size);
-    tokens_read = -1;
-  } else {
-    int i, num_tokens = size / TOKEN_BYTES;
-    const char *token_p = token_data;
+  *changes = -1;
+  *max_key = -1;
 
-    for (i = 0; i < num_tokens; i++) {
-      int token;
-      short frequency;
-      memcpy(&token,     token_p, 4); token_p += 4;
-      memcpy(&frequency, token_p, 2); token_p += 2;
-      /* Tokens are stored in network byte order so switch them to host byte order */
-      item_add_token(item, ntohl(token), ntohs(frequency));
-      tokens_read++;
+  if (SQLITE_OK != sqlite3_prepare_v2(db, FETCH_CATALOG_STATE_SQL, -1, &stmt, NULL)) {
+    error("Could not prepare catalog state query: %s", sqlite3_errmsg(db));
+  } else {
+    if (SQLITE_ROW == sqlite3_step(stmt)) {
+      *changes = sqlite3_column_int(stmt, 0);
+      *max_key = sqlite3_column_int(stmt, 1);
+      rc = CLASSIFIER_OK;
+    } else {
+      error("Could not read the catalog state: %s", sqlite3_errmsg(db));
     }
+
+    sqlite3_finalize(stmt);
   }
 
-  return tokens_read;
+  return rc;
 }
 
-static int fetch_tokens_for(ItemCache * item_cache, Item * item) {
-  int tokens_loaded = 0;
+static int attach_database(sqlite3 *db, const char * path, const char * alias) {
+  int rc = CLASSIFIER_OK;
+  char sql[MAXPATHLEN];
 
-  if (item_cache && item) {
-    if (SQLITE_OK != sqlite3_bind_int(item_cache->fetch_tokens_stmt, 1, item->key)) {
-      error("Could not bind item->key to stmt: %s", item_cache_errmsg(item_cache));
-      tokens_loaded = -1;
-    } else if (SQLITE_ROW != sqlite3_step(item_cache->fetch_tokens_stmt)) {
-      tokens_loaded = -1;
-    } else {
-      int blob_size = sqlite3_column_bytes(item_cache->fetch_tokens_stmt, 0);
-      const char *token_data = (char*) sqlite3_column_blob(item_cache->fetch_tokens_stmt, 0);
-      tokens_loaded = read_tokens(token_data, blob_size, item);
-    }
+  if (MAXPATHLEN < snprintf(sql, MAXPATHLEN, "ATTACH DATABASE '%s' as %s", path, alias)) {
+    fatal("Path name too long: %s", path);
+    exit(1);
+  }
 
-    sqlite3_clear_bindings(item_cache->fetch_tokens_stmt);
-    sqlite3_reset(item_cache->fetch_tokens_stmt);
+  if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, NULL)) {
+    rc = CLASSIFIER_FAIL;
   }
 
-  return tokens_loaded;
+  return rc;
 }
 
-/* Fetches the item metadata from the catalog database.
+/* Puts each database into write-ahead log mode with the configured durability.
  *
- * Caller must hold the db_access_mutex.
+ * In WAL mode a commit is a single append to the log and readers don't block
+ * the writer. If a database can't be switched it is left in its current
+ * journal mode, which is slower but still correct.
+ *
+ * This also asks for incremental auto-vacuum so purged pages can be given
+ * back to the file system a few at a time. That only takes effect on new
+ * databases, or on existing ones after their next full VACUUM.
  */
-static Item * fetch_item_from_catalog(ItemCache * item_cache, const char * id) {
-	Item *item = NULL;
-	trace("thread(%p) has locked db_access_mutex to fetch %s", pthread_self(), id);
-
-	int sqlite3_rc = sqlite3_bind_text(item_cache->fetch_item_stmt, 1, id, -1, NULL);
-	if (SQLITE_OK != sqlite3_rc) {
-		fatal("fetch_item_stmt bind error = %s", item_cache_errmsg(item_cache));
-		item = NULL;
-	} else {
-		sqlite3_rc = sqlite3_step(item_cache->fetch_item_stmt);
+static int configure_databases(ItemCache *item_cache) {
+  static const char *databases[] = {"main", "atom", "token"};
+  static const char *synchronous[] = {"FULL", "NORMAL", "OFF"};
+  int rc = CLASSIFIER_OK;
+  char sql[128];
+  int i;
 
-		if (SQLITE_ROW == sqlite3_rc) {
-			item = create_item(sqlite3_column_text(item_cache->fetch_item_stmt, 0),
-                         sqlite3_column_int(item_cache->fetch_item_stmt, 1),
-                         sqlite3_column_int64(item_cache->fetch_item_stmt, 2));
-		} else if (SQLITE_DONE != sqlite3_rc) {
-			error("Error fetching item %d: %s", id, item_cache_errmsg(item_cache));
-		}
-	}
+  for (i = 0; CLASSIFIER_OK == rc && i < sizeof(databases) / sizeof(databases[0]); i++) {
+    snprintf(sql, sizeof(sql), "PRAGMA %s.journal_mode = WAL", databases[i]);
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL)) {
+      error("Could not put %s into WAL mode: %s", databases[i], item_cache_errmsg(item_cache));
+    }
 
-	sqlite3_clear_bindings(item_cache->fetch_item_stmt);
-	sqlite3_reset(item_cache->fetch_item_stmt);
+    snprintf(sql, sizeof(sql), "PRAGMA %s.auto_vacuum = INCREMENTAL", databases[i]);
+    sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL);
 
-	trace("thread(%p) has unlocked db_access_mutex after fetching %s", pthread_self(), id);
+    snprintf(sql, sizeof(sql), "PRAGMA %s.synchronous = %s", databases[i], synchronous[item_cache->durability]);
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL)) {
+      error("Could not set synchronous mode for %s: %s", databases[i], item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    }
+  }
 
-	return item;
+  return rc;
 }
 
-static int get_entry_key(ItemCache * item_cache, const char * entry_id) {
-  int entry_key = -1;
+/******************************************************************************
+ * Atom dictionary functions
+ ******************************************************************************/
 
-  if (item_cache && entry_id) {
-    if (SQLITE_OK != sqlite3_bind_text(item_cache->fetch_item_stmt, 1, entry_id, -1, NULL)) {
-      error("Unable to bind %s to fetch_item_stmt: %s", entry_id, item_cache_errmsg(item_cache));
-    } else if (SQLITE_ROW != sqlite3_step(item_cache->fetch_item_stmt)) {
-      error("Entry does not exist: %s", entry_id);
-    } else {
-      entry_key = sqlite3_column_int(item_cache->fetch_item_stmt, 1);
+/* An atom that hasn't been written to the tokens table yet. */
+typedef struct PENDING_ATOM {
+  int atom;
+  char token[];
+} PendingAtom;
+
+/* Loads every atom in the tokens table into the in-memory dictionary.
+ *
+ * With hashed token ids only the ids are needed, and only if new token
+ * strings are being kept.
+ */
+static int load_atoms(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+  int num_atoms = 0;
+  sqlite3_stmt *stmt;
+
+  item_cache->next_atom = 1;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, LOAD_ATOMS_SQL, -1, &stmt, NULL)) {
+    fatal("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
+
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    int atom = sqlite3_column_int(stmt, 0);
+    const unsigned char *token = sqlite3_column_text(stmt, 1);
+    PWord_t atom_pointer;
+
+    if (item_cache->hash_tokens) {
+      if (item_cache->keep_token_strings) {
+        JLI(atom_pointer, item_cache->known_hashes, atom);
+        if (NULL == atom_pointer) {
+          fatal("Error malloc'ing known token hashes");
+          rc = CLASSIFIER_FAIL;
+          break;
+        }
+        *atom_pointer = true;
+        num_atoms++;
+      }
+    } else if (token) {
+      JSLI(atom_pointer, item_cache->atoms, token);
+      if (NULL == atom_pointer) {
+        fatal("Error malloc'ing atom dictionary");
+        rc = CLASSIFIER_FAIL;
+        break;
+      }
+
+      *atom_pointer = atom;
+      num_atoms++;
     }
 
-    sqlite3_clear_bindings(item_cache->fetch_item_stmt);
-    sqlite3_reset(item_cache->fetch_item_stmt);
+    if (atom >= item_cache->next_atom) {
+      item_cache->next_atom = atom + 1;
+    }
   }
 
-  return entry_key;
-}
+  sqlite3_finalize(stmt);
+  info("Loaded %i atoms", num_atoms);
 
-/* This will also update the entry's id. But side-effecty I guess */
-static int _is_new_entry(ItemCache * item_cache, ItemCacheEntry * entry) {
-  int is_new_entry = true;
+  return rc;
+}
 
-  sqlite3_bind_text(item_cache->fetch_item_stmt, 1, entry->full_id, -1, NULL);
-  if (SQLITE_ROW == sqlite3_step(item_cache->fetch_item_stmt)) {
-    is_new_entry = false;
-    entry->id = sqlite3_column_int(item_cache->fetch_item_stmt, 1);
+/* Takes the pending atoms off the dictionary so they can be written.
+ *
+ * The batch stays visible to item_cache_globalize as flushing_atoms until
+ * finish_flushing_atoms is called with it. Returns NULL if there are none.
+ */
+static Array * take_pending_atoms(ItemCache *item_cache) {
+  Array *batch = NULL;
+  Array *empty;
+
+  pthread_rwlock_wrlock(&item_cache->atoms_lock);
+  if (item_cache->pending_atoms->size > 0 && NULL != (empty = create_array(64))) {
+    batch = item_cache->pending_atoms;
+    item_cache->pending_atoms = empty;
+    item_cache->flushing_atoms = batch;
   }
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
 
-  sqlite3_clear_bindings(item_cache->fetch_item_stmt);
-  sqlite3_reset(item_cache->fetch_item_stmt);
-  return is_new_entry;
+  return batch;
 }
 
-static int save_entry_xml(ItemCache *item_cache, ItemCacheEntry *entry) {
-  int rc = CLASSIFIER_OK;
+/* Finishes writing a batch from take_pending_atoms.
+ *
+ * If the batch was committed it is freed, otherwise the atoms are put back
+ * on the pending list so the next flush tries them again.
+ */
+static void finish_flushing_atoms(ItemCache *item_cache, Array *batch, int committed) {
+  int i;
 
-  if (!(entry->atom && entry->id > 0)) {
-    error("No xml or id for entry %s (%i)", entry->full_id, entry->id);
-    rc = CLASSIFIER_FAIL;
-  } else {
-    int size = strlen(entry->atom);
-    if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_stmt, 1, entry->id)) {
-      error("Unable to bind atom id: %s", item_cache_errmsg(item_cache));
-      rc = CLASSIFIER_FAIL;
-    } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_atom_xml_stmt, 2, entry->atom, size, SQLITE_TRANSIENT)) {
-      error("Unable to bind atom xml: %s", item_cache_errmsg(item_cache));
-      rc = CLASSIFIER_FAIL;
-    } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_xml_stmt)) {
-      error("Unable to insert atom xml: %s", item_cache_errmsg(item_cache));
-      rc = CLASSIFIER_FAIL;
-    }
+  pthread_rwlock_wrlock(&item_cache->atoms_lock);
+  item_cache->flushing_atoms = NULL;
 
-    sqlite3_clear_bindings(item_cache->insert_atom_xml_stmt);
-    sqlite3_reset(item_cache->insert_atom_xml_stmt);
+  if (!committed) {
+    for (i = 0; i < batch->size; i++) {
+      arr_add(item_cache->pending_atoms, batch->elements[i]);
+    }
   }
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
 
-  return rc;
+  if (committed) {
+    free_array(batch);
+  } else {
+    free(batch->elements);
+    free(batch);
+  }
 }
 
-static int insert_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+/* Inserts a batch of atoms into the tokens table.
+ *
+ * The caller is responsible for the transaction.
+ */
+static int write_atoms(ItemCache *item_cache, const Array *batch) {
   int rc = CLASSIFIER_OK;
+  int i;
 
-  if (SQLITE_OK != sqlite3_bind_text(item_cache->insert_entry_stmt, 1, entry->full_id, -1, NULL)) {
-    error("Error binding %s to parameter %i", entry->full_id, 1);
-    rc = CLASSIFIER_FAIL;
-  } else {
-    sqlite3_bind_double(item_cache->insert_entry_stmt, 2, entry->updated);
-    sqlite3_bind_double(item_cache->insert_entry_stmt, 3, entry->created_at);
+  for (i = 0; CLASSIFIER_OK == rc && i < batch->size; i++) {
+    const PendingAtom *pending = batch->elements[i];
 
-    if (SQLITE_DONE != sqlite3_step(item_cache->insert_entry_stmt)) {
-      error("Error inserting item %s: %s", entry->full_id, item_cache_errmsg(item_cache));
+    if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_stmt, 1, pending->atom) ||
+        SQLITE_OK != sqlite3_bind_text(item_cache->insert_atom_stmt, 2, pending->token, -1, NULL)) {
+      error("Error binding atom %i (%s)", pending->atom, pending->token);
+      rc = CLASSIFIER_FAIL;
+    } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_stmt)) {
+      error("Error executing atom insertion: %s", item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
-    } else {
-      entry->id = sqlite3_last_insert_rowid(item_cache->db);
     }
+
+    sqlite3_clear_bindings(item_cache->insert_atom_stmt);
+    sqlite3_reset(item_cache->insert_atom_stmt);
   }
 
-  sqlite3_clear_bindings(item_cache->insert_entry_stmt);
-  sqlite3_reset(item_cache->insert_entry_stmt);
   return rc;
 }
 
-static int update_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+/* Writes the pending atoms to the tokens table in a single transaction.
+ *
+ * This must happen before any tokens using the atoms are saved, so that the
+ * database never refers to an atom it doesn't have. If the write fails the
+ * atoms stay pending and the next flush tries again.
+ *
+ * Caller must hold the db_access_mutex.
+ */
+static int flush_atoms(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
-  sqlite3_bind_double(item_cache->update_entry_stmt, 1, entry->updated);
-  sqlite3_bind_text(item_cache->update_entry_stmt, 2, entry->full_id, -1, NULL);
+  Array *batch = take_pending_atoms(item_cache);
 
-  if (SQLITE_DONE != sqlite3_step(item_cache->update_entry_stmt)) {
-    error("Error update item %s: %s", entry->full_id, item_cache_errmsg(item_cache));
-    rc = CLASSIFIER_FAIL;
+  if (NULL == batch) {
+    return rc;
   }
 
-  sqlite3_clear_bindings(item_cache->update_entry_stmt);
-  sqlite3_reset(item_cache->update_entry_stmt);
-  return rc;
-}
-
-static int entry_has_tokens(ItemCache *item_cache, ItemCacheEntry *entry) {
-  int has_tokens = false;
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, "BEGIN", NULL, NULL, NULL)) {
+    error("Could not begin atom transaction: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else if (CLASSIFIER_OK == (rc = write_atoms(item_cache, batch)) &&
+             SQLITE_OK != sqlite3_exec(item_cache->db, "COMMIT", NULL, NULL, NULL)) {
+    error("Could not commit atom transaction: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
 
-  if (SQLITE_OK != sqlite3_bind_int(item_cache->fetch_tokens_stmt, 1, entry->id)) {
-    fatal("Error bind int: %s", item_cache_errmsg(item_cache));
+  if (CLASSIFIER_OK == rc) {
+    debug("Wrote %i atoms", batch->size);
+    finish_flushing_atoms(item_cache, batch, true);
   } else {
-    has_tokens = SQLITE_ROW == sqlite3_step(item_cache->fetch_tokens_stmt);
-    sqlite3_clear_bindings(item_cache->fetch_tokens_stmt);
-    sqlite3_reset(item_cache->fetch_tokens_stmt);
+    sqlite3_exec(item_cache->db, "ROLLBACK", NULL, NULL, NULL);
+    finish_flushing_atoms(item_cache, batch, false);
   }
 
-  return has_tokens;
+  return rc;
 }
 
-static time_t get_purge_time(int days_to_keep) {
-  time_t now = time(NULL);
-  struct tm purge_time_tm;
-  gmtime_r(&now, &purge_time_tm);
-  purge_time_tm.tm_mon -= (days_to_keep / 30);
-  purge_time_tm.tm_mday -= (days_to_keep % 30);
-  return timegm(&purge_time_tm);
-}
+/* Writes last_used_at for the items fetched since the last flush in a single transaction.
+ *
+ * The touches are only used to decide what to purge, so if the write fails
+ * they are dropped rather than tried again.
+ *
+ * Caller must hold the db_access_mutex.
+ */
+static int flush_touched_items(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+  int touched = 0;
+  uint8_t id[256];
+  PWord_t value;
+  Word_t freed_bytes;
+  Pvoid_t batch;
+
+  pthread_mutex_lock(&item_cache->touched_items_mutex);
+  batch = item_cache->touched_items;
+  item_cache->touched_items = NULL;
+  pthread_mutex_unlock(&item_cache->touched_items_mutex);
+
+  if (NULL == batch) {
+    return rc;
+  }
 
-static void * item_cache_purge_thread_func(void *memo) {
-  ItemCache *item_cache = (ItemCache *) memo;
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, "BEGIN", NULL, NULL, NULL)) {
+    error("Could not begin touch transaction: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else {
+    id[0] = '\0';
+    JSLF(value, batch, id);
+    while (CLASSIFIER_OK == rc && NULL != value) {
+      sqlite3_bind_text(item_cache->touch_item_stmt, 1, (char*) id, -1, NULL);
+      if (SQLITE_DONE != sqlite3_step(item_cache->touch_item_stmt)) {
+        error("Error touching %s: %s", id, item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      }
+      sqlite3_clear_bindings(item_cache->touch_item_stmt);
+      sqlite3_reset(item_cache->touch_item_stmt);
+      touched++;
+      JSLN(value, batch, id);
+    }
 
-  while (!item_cache->shutting_down) {
-    sleep(item_cache->purge_interval);
-    item_cache_purge_old_items(item_cache);
+    if (CLASSIFIER_OK == rc && SQLITE_OK != sqlite3_exec(item_cache->db, "COMMIT", NULL, NULL, NULL)) {
+      error("Could not commit touch transaction: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    }
+
+    if (CLASSIFIER_OK == rc) {
+      debug("Touched %i items", touched);
+    } else {
+      sqlite3_exec(item_cache->db, "ROLLBACK", NULL, NULL, NULL);
+    }
   }
 
-  return NULL;
+  JSLFA(freed_bytes, batch);
+  return rc;
 }
 
-/** The cache updating thread.
- *
- * This is one of the hairier functions in the Item cache.  It is responsible
- * for saving new tokenized items in the database and adding new tokenized items
- * into the in-memory cache that is used for classification.
- *
- * UpdateJob are first placed into the update_queue by the feature extraction thread.
- * The updating thread then gets the jobs of the queue. The jobs contain an item that
- * is to be saved into the database and, if that is successful, it is saved into the
- * in-memory cache.  We use a write lock on the in-memory cache to ensure that
- * nothing is reading or writing to the in-memory cache at this time.  The lock is around
- * the smallest possible section, the item_cache_add_item function, to ensure we hold
- * the lock for as short a time as possible.
- *
- * One particularly trick aspect to this is that new classification jobs are triggered
- * by the addition of new items to the cache. This is handled by the calling of the
- * update_callback when new items are added.  However item can come in spurts and we
- * don't want to be creating a new classification job for every item if we are getting
- * say 100-200 items at a rate of one every second or so, this will flood the classifier
- * with thousands of small jobs that each classify a single item and then end.
- *
- * So what we want to try and do here is to add as many items as we can before calling
- * the callback, but we also want to make sure the callback is called fairly regularly
- * and you do don't have a small number of items waiting a long time to be classified.
- * To do this we keep track of the number of items processed in a "run", when that reaches
- * PROCESSING_LIMIT (default: 200) the callback is called and we continue processing new
- * items.  Before that limit is reached we will try an get another item off the queue,
- * if there are no items we wait 1 second, if there are still no items we then call the callback.
- *
- * So we have a couple of parameters that might need tuning:
+/* Opens a read-only connection to the catalog with the token database attached.
  *
- *   PROCESSING_LIMIT: The number of items that will be processed before the update_callback is triggered.
- *   QUEUE_WAIT: The time we wait for a new item in the queue before the update_callback is triggered.
+ * This lets threads read from the database without holding the db_access_mutex.
  */
-static void * cache_updating_func(void *memo) {
-  ItemCache *item_cache = (ItemCache*) memo;
+static int open_read_only_database(const ItemCache *item_cache, sqlite3 **db) {
+  int rc = CLASSIFIER_FAIL;
+  char path[MAXPATHLEN];
+  char token_path[MAXPATHLEN];
 
-  while (!item_cache->shutting_down) {
-    UpdateJob *job = q_dequeue_or_wait(item_cache->update_queue, item_cache->cache_update_wait_time);
-    int items_added = 0;
+  *db = NULL;
 
-    if (job) {
-      do {
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache->cache_directory) ||
+      MAXPATHLEN <= snprintf(token_path, MAXPATHLEN, "%s/tokens.db", item_cache->cache_directory)) {
+    error("Path to item cache database too long: %s", item_cache->cache_directory);
+  } else if (SQLITE_OK != sqlite3_open_v2(path, db, SQLITE_OPEN_READONLY, NULL)) {
+    error("Could not open read-only connection to %s: %s", path, sqlite3_errmsg(*db));
+  } else if (CLASSIFIER_OK != attach_database(*db, token_path, "token")) {
+    error("Could not attach %s to read-only connection: %s", token_path, sqlite3_errmsg(*db));
+  } else {
+    sqlite3_busy_timeout(*db, 1000);
+    rc = CLASSIFIER_OK;
+  }
 
-        switch (job->type) {
-          case ADD:
-            job->item->time = time(NULL);
-            if (CLASSIFIER_OK == item_cache_add_item(item_cache, job->item)) {
-	      items_added++;
-	    } else {
-	      debug("No enough tokens to add to the classification item cache: %s\n", job->item->id);
-	      free_item(job->item);
-	    }
-	   break;
-	 default:
-	   fatal("Got unknown cache updating job type");
-	   break;
-        }
+  if (CLASSIFIER_OK != rc) {
+    sqlite3_close(*db);
+    *db = NULL;
+  }
 
-        free(job);
+  return rc;
+}
 
-        /* When we have added 200 items to the queue
-         * skip to calling the callback. Otherwise
-         * try an get another job, possibly waiting
-         * one second for it to arrive.
-         */
-        if (items_added >= PROCESSING_LIMIT) {
-          debug("Hit PROCESSING_LIMIT(%i)", PROCESSING_LIMIT);
-          break;
-        } else {
-          job = q_dequeue_or_wait(item_cache->update_queue, item_cache->cache_update_wait_time);
-        }
+/******************************************************************************
+ * Reader pool functions
+ ******************************************************************************/
 
-        /* We keep doing this until we don't get any more jobs after a 1 second wait. */
-        /* Is one second long enough? This might need to be a parameter. */
-      } while (job != NULL);
+static void free_reader(Reader *reader) {
+  if (reader) {
+    sqlite3_finalize(reader->fetch_item_stmt);
+    sqlite3_finalize(reader->fetch_tokens_stmt);
+    sqlite3_finalize(reader->find_token_stmt);
+    sqlite3_close(reader->db);
+    free(reader);
+  }
+}
 
-      if (item_cache->update_callback && items_added > 0) {
-        debug("Trigger update callback for %i items", items_added);
-        item_cache->update_callback(item_cache, item_cache->update_callback_memo);
-      }
-    }
+static Reader * open_reader(const ItemCache *item_cache) {
+  Reader *reader = calloc(1, sizeof(Reader));
+
+  if (NULL == reader) {
+    fatal("Could not allocate reader");
+  } else if (CLASSIFIER_OK != open_read_only_database(item_cache, &reader->db)) {
+    free(reader);
+    reader = NULL;
+  } else if (SQLITE_OK != sqlite3_prepare_v2(reader->db, FETCH_ITEM_SQL,     -1, &reader->fetch_item_stmt,   NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(reader->db, FETCH_ENTRY_TOKENS, -1, &reader->fetch_tokens_stmt, NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(reader->db, FIND_TOKEN_SQL,     -1, &reader->find_token_stmt,   NULL)) {
+    error("Unable to prepare statements for reader: %s", sqlite3_errmsg(reader->db));
+    free_reader(reader);
+    reader = NULL;
   }
 
-  return NULL;
+  return reader;
 }
 
-/* Insert an item in the items by id cache.
+/* Takes an idle reader from the pool, or opens a new one if there are none.
  *
- * Caller must hold a write lock on the cache.
+ * Once max_readers are open this waits for one to be released instead.
+ * Returns NULL if a new reader could not be opened.
  */
-static int items_by_id_insert(ItemCache * item_cache, Item * item) {
-  int rc = CLASSIFIER_OK;
+static Reader * acquire_reader(ItemCache *item_cache) {
+  Reader *reader;
+  int open_new = false;
 
-  PWord_t item_pointer;
-  JSLI(item_pointer, item_cache->items_by_id, item->id);
-  if (NULL != item_pointer) {
-    *item_pointer = (Word_t) item;
-    item_cache->cached_size++;
+  pthread_mutex_lock(&item_cache->reader_pool_mutex);
+  while (NULL == item_cache->idle_readers && item_cache->open_readers >= item_cache->max_readers) {
+    pthread_cond_wait(&item_cache->reader_released, &item_cache->reader_pool_mutex);
+  }
+
+  if (NULL != (reader = item_cache->idle_readers)) {
+    item_cache->idle_readers = reader->next;
   } else {
-    fatal("Error malloc'ing item by id");
-    rc = CLASSIFIER_FAIL;
+    item_cache->open_readers++;
+    open_new = true;
   }
+  pthread_mutex_unlock(&item_cache->reader_pool_mutex);
 
-  return rc;
-}
+  if (open_new && NULL == (reader = open_reader(item_cache))) {
+    pthread_mutex_lock(&item_cache->reader_pool_mutex);
+    item_cache->open_readers--;
+    pthread_cond_signal(&item_cache->reader_released);
+    pthread_mutex_unlock(&item_cache->reader_pool_mutex);
+  }
 
-static Item * items_by_id_get(ItemCache * item_cache, const unsigned char * id) {
-	Item *item = NULL;
+  return reader;
+}
 
-	PWord_t item_pointer;
-	JSLG(item_pointer, item_cache->items_by_id, id);
-	if (NULL != item_pointer) {
-		item = (Item*)(*item_pointer);
-	}
+static void release_reader(ItemCache *item_cache, Reader *reader) {
+  if (reader) {
+    pthread_mutex_lock(&item_cache->reader_pool_mutex);
+    reader->next = item_cache->idle_readers;
+    item_cache->idle_readers = reader;
+    pthread_cond_signal(&item_cache->reader_released);
+    pthread_mutex_unlock(&item_cache->reader_pool_mutex);
+  }
+}
 
-	return item;
+static void free_readers(ItemCache *item_cache) {
+  while (item_cache->idle_readers) {
+    Reader *next = item_cache->idle_readers->next;
+    free_reader(item_cache->idle_readers);
+    item_cache->idle_readers = next;
+    item_cache->open_readers--;
+  }
 }
 
-static int items_by_id_remove(ItemCache * item_cache, Item * item) {
-  int judyrc;
+static int item_cache_open_database(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+  char path[MAXPATHLEN];
+  char atom_path[MAXPATHLEN];
+  char token_path[MAXPATHLEN];
 
-  JSLD(judyrc, item_cache->items_by_id, item->id);
-  if (judyrc) {
-    item_cache->cached_size--;
+  if (MAXPATHLEN < snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache->cache_directory)) {
+    fatal("Path to catalog.db too long: %s", item_cache->cache_directory);
+    exit(1);
   }
 
-  return judyrc == 1 ? CLASSIFIER_OK : CLASSIFIER_FAIL;
-}
+  if (MAXPATHLEN < snprintf(atom_path, MAXPATHLEN, "%s/atom.db", item_cache->cache_directory)) {
+    fatal("Path to atom.db too long: %s", item_cache->cache_directory);
+    exit(1);
+  }
 
+  if (MAXPATHLEN < snprintf(token_path, MAXPATHLEN, "%s/tokens.db", item_cache->cache_directory)) {
+    fatal("Path to tokens.db too long: %s", item_cache->cache_directory);
+    exit(1);
+  }
 
-static OrderedItemList * ordered_item_list_insert_after(OrderedItemList * insert_after, Item * item) {
-  OrderedItemList * new = malloc(sizeof(OrderedItemList));
-  if (!new) {
-    fatal("Could not malloc OrderedItemList");
+  info("Attempting to open item cache catalog file at %s", path);
+  if (SQLITE_OK != sqlite3_open_v2(path, &item_cache->db, SQLITE_OPEN_READWRITE, NULL)) {
+      rc = CLASSIFIER_FAIL;
   } else {
-    new->item = item;
-    new->next = NULL;
+    if (CLASSIFIER_OK == (rc = check_user_version(item_cache)) &&
+        CLASSIFIER_OK == (rc = attach_database(item_cache->db, atom_path, "atom")) &&
+        CLASSIFIER_OK == (rc = attach_database(item_cache->db, token_path, "token")) &&
+        CLASSIFIER_OK == (rc = get_token_blob_version(item_cache)) &&
+        CLASSIFIER_OK == (rc = check_token_ids(item_cache)) &&
+        CLASSIFIER_OK == (rc = check_token_storage(item_cache)) &&
+        CLASSIFIER_OK == (rc = create_catalog_changes(item_cache))) {
 
-    if (insert_after) {
-      new->next = insert_after->next;
-      insert_after->next = new;
+      sqlite3_busy_timeout(item_cache->db, 1000);
+
+      if (CLASSIFIER_OK == (rc = configure_databases(item_cache))) {
+        rc = create_prepared_statements(item_cache);
+      }
+
+      if (CLASSIFIER_OK == rc) {
+        rc = load_atoms(item_cache);
+      }
     }
   }
 
-  return new;
+  return rc;
 }
 
-/* Inserts item in list and returns the head of the list.
+/******************************************************************************
+ * Token array functions
+ ******************************************************************************/
+
+/* Drops a reference to the slab, freeing it once nothing uses it.
  *
- * Order is descending item time.
+ * Items holding slab tokens are only created and freed under the cache's
+ * write lock so the reference count needs no locking of its own.
  */
-static OrderedItemList * ordered_item_list_insert_in_order(OrderedItemList * list, Item * item) {
-  OrderedItemList *head = list;
-  OrderedItemList *new_node = calloc(1, sizeof(struct ORDERED_ITEM_LIST));
-
-  if (new_node) {
-    new_node->item = item;
-    new_node->next = NULL;
-
-    if (head == NULL) {
-      head = new_node;
-    } else if (head->item->time < new_node->item->time) {
-      new_node->next = head;
-      head = new_node;
-    } else {
-      OrderedItemList *current = head;
-
-      while (current->next != NULL) {
-        if (current->next->item->time < item->time) {
-          new_node->next = current->next;
-          current->next = new_node;
-          break;
-        } else {
-          current = current->next;
-        }
-      }
-
-      if (current->next == NULL) {
-        current->next = new_node;
-      }
+static void token_slab_release(TokenSlab * slab) {
+  if (slab && --slab->references == 0) {
+    if (slab->mapping) {
+      munmap(slab->mapping, slab->mapping_size);
     }
+    free(slab);
   }
-
-  return head;
 }
 
-static OrderedItemList * ordered_item_list_split(OrderedItemList * list, time_t split_time) {
-  OrderedItemList *leftovers = NULL;
-  OrderedItemList *current = list;
-  OrderedItemList *previous = NULL;
+/* Carves room for num_tokens tokens out of the slab, replacing the slab
+ * with a fresh one when it is full.
+ *
+ * Returns NULL if the array is too big to share a slab, in which case the
+ * caller should allocate it on its own.
+ */
+static Token * token_slab_alloc(TokenSlab ** slab, int num_tokens) {
+  Token *tokens = NULL;
 
-  /* Find the point in the list where items are older than purge_time and remove them. */
-  for ( ; current != NULL; previous = current, current = current->next) {
-    if (current->item->time < split_time) {
-      if (previous) {
-        previous->next = NULL;
+  if (num_tokens <= TOKEN_SLAB_SIZE / 4) {
+    if (NULL == *slab || (*slab)->capacity - (*slab)->used < num_tokens) {
+      TokenSlab *new_slab = malloc(sizeof(TokenSlab) + TOKEN_SLAB_SIZE * sizeof(Token));
+
+      if (NULL == new_slab) {
+        error("Could not allocate token slab");
+        return NULL;
       }
 
-      leftovers = current;
-      break;
+      new_slab->references = 1;
+      new_slab->used = 0;
+      new_slab->capacity = TOKEN_SLAB_SIZE;
+      new_slab->mapping = NULL;
+      new_slab->mapping_size = 0;
+
+      token_slab_release(*slab);
+      *slab = new_slab;
     }
+
+    tokens = &(*slab)->tokens[(*slab)->used];
+    (*slab)->used += num_tokens;
+    (*slab)->references++;
   }
 
-  return leftovers;
+  return tokens;
 }
 
-/* Loads all the items into the cache.
+/* Makes sure the item has room for at least capacity tokens.
  *
- * Caller must hold the db_access mutex and a write lock on the cache.
+ * If slab is not NULL the array is carved from the slab, otherwise
+ * it is malloced. Existing tokens are copied to the new array.
  */
-static int load_all_items(ItemCache * item_cache) {
+static int item_reserve_tokens(Item * item, int capacity, TokenSlab ** slab) {
   int rc = CLASSIFIER_OK;
-  OrderedItemList * last = item_cache->items_in_order;
 
-  sqlite3_bind_int(item_cache->fetch_all_items_stmt, 1, item_cache->load_items_since);
+  if (item->token_capacity < capacity) {
+    TokenSlab *token_slab = NULL;
+    Token *tokens = NULL;
 
-  /* Load the item ids and timestamp indexing and order them by each. */
-  while (SQLITE_ROW == sqlite3_step(item_cache->fetch_all_items_stmt)) {
-    const unsigned char * id = sqlite3_column_text(item_cache->fetch_all_items_stmt, 0);
-    int key = sqlite3_column_int(item_cache->fetch_all_items_stmt, 1);
-    time_t item_time = sqlite3_column_int64(item_cache->fetch_all_items_stmt, 2);
-
-    Item *item = create_item(id, key, item_time);
-    if (NULL == item) {
+    if (slab && NULL != (tokens = token_slab_alloc(slab, capacity))) {
+      token_slab = *slab;
+    } else if (NULL == (tokens = malloc(capacity * sizeof(Token)))) {
+      error("Could not malloc memory for token array");
       rc = CLASSIFIER_FAIL;
-      break;
-    }
-
-    if (item_cache->min_tokens > fetch_tokens_for(item_cache, item)) {
-      free_item(item);
-      continue;
     }
 
-    if (items_by_id_insert(item_cache, item)) {
-      rc = CLASSIFIER_FAIL;
-      free_item(item);
-      break;
-    }
+    if (tokens) {
+      if (item->num_tokens > 0) {
+        memcpy(tokens, item->tokens, item->num_tokens * sizeof(Token));
+      }
 
-    if (NULL == (last = ordered_item_list_insert_after(last, item))) {
-      free_item(item);
-      break;
-    }
+      if (item->slab) {
+        token_slab_release(item->slab);
+      } else {
+        free(item->tokens);
+      }
 
-    if (!item_cache->items_in_order) {
-      item_cache->items_in_order = last;
+      item->tokens = tokens;
+      item->token_capacity = capacity;
+      item->slab = token_slab;
     }
   }
 
-  sqlite3_clear_bindings(item_cache->fetch_all_items_stmt);
-  sqlite3_reset(item_cache->fetch_all_items_stmt);
-
   return rc;
 }
 
-static int load_random_background(ItemCache * item_cache) {
-  int rndbg_item_count = 0;
-  item_cache->random_background = new_pool();
+/* Token blobs are written as:
+ *
+ *   'W' <version> <varint count> (<varint id delta> <varint frequency>)* <4 byte FNV-1a checksum>
+ *
+ * with the ids in ascending order so each is stored as the difference from the
+ * one before it. The checksum is over everything before it and is stored in
+ * network byte order.
+ *
+ * Blobs written before the format was versioned are a bare sequence of
+ * TOKEN_BYTES records, a 4 byte id and a 2 byte frequency in network byte
+ * order. The high byte of an id is always 0 so they never start with the magic byte.
+ */
+static uint32_t token_blob_checksum(const unsigned char *data, int size) {
+  uint32_t hash = 2166136261U;
+  int i;
 
-  while (SQLITE_ROW == sqlite3_step(item_cache->random_background_stmt)) {
-    const unsigned char * id = sqlite3_column_text(item_cache->random_background_stmt, 0);
-    int key = sqlite3_column_int(item_cache->random_background_stmt, 1);
-    Item *item = create_item(id, key, -1);
+  for (i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 16777619U;
+  }
 
-    if (item) {
-      if (fetch_tokens_for(item_cache, item)) {
-        pool_add_item(item_cache->random_background, item);
-      }
+  return hash;
+}
 
-      free_item(item);
-      rndbg_item_count++;
-    } else {
-      error("Could not create item: %s (%i)", id, key);
+static unsigned char * put_varint(unsigned char *position, uint32_t value) {
+  while (value >= 0x80) {
+    *position++ = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  *position++ = (unsigned char) value;
+  return position;
+}
+
+/* Reads a varint from position, never going past end.
+ *
+ * @returns the position after the varint, or NULL if it runs off the end.
+ */
+static const unsigned char * get_varint(const unsigned char *position, const unsigned char *end, uint32_t *value) {
+  int shift;
+  *value = 0;
+
+  for (shift = 0; position < end && shift < 35; shift += 7) {
+    unsigned char byte = *position++;
+    *value |= (uint32_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return position;
     }
   }
-  sqlite3_reset(item_cache->random_background_stmt);
-  info("Randombackground contains %i items", rndbg_item_count);
 
-  return CLASSIFIER_OK;
+  return NULL;
 }
 
-/*****************************************************************************
- * External API functions for the item cache.
- *****************************************************************************/
+static int is_legacy_token_blob(const char *token_data, int size) {
+  return size < TOKEN_BLOB_HEADER_BYTES + TOKEN_BLOB_CHECKSUM_BYTES ||
+         TOKEN_BLOB_MAGIC != (unsigned char) token_data[0] ||
+         TOKEN_BLOB_VERSION != (unsigned char) token_data[1];
+}
 
-/** Initialize an SQLite database with the ItemCache schema.
+/* Checks a token blob is intact and gets the number of tokens in it.
  *
- * @param db_file File to initialize.
- * @param error Any error message is stored here.
+ * @returns the number of tokens, or -1 if the blob is corrupt.
  */
-int item_cache_initialize(const char *db_file, char * error) {
+static int token_blob_count(const char *token_data, int size) {
+  const unsigned char *data = (const unsigned char*) token_data;
+  const unsigned char *end = data + size - TOKEN_BLOB_CHECKSUM_BYTES;
+  uint32_t stored_checksum;
+  uint32_t count;
+
+  if (is_legacy_token_blob(token_data, size)) {
+    return 0 == (size % TOKEN_BYTES) ? size / TOKEN_BYTES : -1;
+  }
+
+  memcpy(&stored_checksum, end, TOKEN_BLOB_CHECKSUM_BYTES);
+  if (ntohl(stored_checksum) != token_blob_checksum(data, size - TOKEN_BLOB_CHECKSUM_BYTES) ||
+      NULL == get_varint(data + TOKEN_BLOB_HEADER_BYTES, end, &count) ||
+      /* Every token takes at least two bytes */
+      count > (uint32_t) size / 2) {
+    return -1;
+  }
+
+  return (int) count;
+}
+
+static int serialize_tokens(Item * item, int *size, char ** token_data) {
   int rc = CLASSIFIER_OK;
-  sqlite3 *db;
-  FILE *file;
+  int num_tokens = item_get_num_tokens(item);
 
-  if (NULL != (file = fopen(db_file, "r"))) {
-    snprintf(error, 512, "Database file %s already exists, no action taken.", db_file);
-    fclose(file);
-    rc = CLASSIFIER_FAIL;
-  } else if (SQLITE_OK != sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) {
-    snprintf(error, 512, "Error creating database file %s: %s.", db_file, sqlite3_errmsg(db));
-    sqlite3_close(db);
+  /* Each varint id delta takes at most 5 bytes and each frequency at most 3. */
+  if (NULL == (*token_data = malloc(TOKEN_BLOB_HEADER_BYTES + 5 + num_tokens * 8 + TOKEN_BLOB_CHECKSUM_BYTES))) {
+    fatal("Could not allocate data for token array");
     rc = CLASSIFIER_FAIL;
   } else {
-    FILE *schema_file;
-    char *schema;
-    char schema_file_name[512];
-    snprintf(schema_file_name, 512, "%s/%s/%s", DATADIR, PACKAGE,"initial_schema.sql");
-
-    if (NULL != (schema_file = fopen(schema_file_name, "r"))) {
-      fseek(schema_file, 0, SEEK_END);
-      int size = ftell(schema_file);
-      schema = malloc(size + 1);
-      fseek(schema_file, 0, SEEK_SET);
+    int i;
+    const Token *tokens = item_get_tokens(item);
+    unsigned char *start = (unsigned char*) *token_data;
+    unsigned char *position = start;
+    uint32_t previous_id = 0;
+    uint32_t checksum;
 
-      if (size != fread(schema, sizeof(char), size, schema_file)) {
-        rc = CLASSIFIER_FAIL;
-        snprintf(error, 512, "Error reading schema file %s: %s", schema_file_name, strerror(errno));
-      } else {
-        schema[size] = 0;
-        if (SQLITE_OK != sqlite3_exec(db, schema, NULL, NULL, NULL)) {
-          snprintf(error, 512, "Error loading schema into database file: %s", sqlite3_errmsg(db));
-          rc = CLASSIFIER_FAIL;
-        }
-      }
+    *position++ = TOKEN_BLOB_MAGIC;
+    *position++ = TOKEN_BLOB_VERSION;
+    position = put_varint(position, num_tokens);
 
-      free(schema);
-      fclose(schema_file);
-    } else {
-      snprintf(error, 512, "Could not find the database schema file at %s. Perhaps it is missing from the install.", schema_file_name);
-      rc = CLASSIFIER_FAIL;
+    for (i = 0; i < num_tokens; i++) {
+      position = put_varint(position, (uint32_t) tokens[i].id - previous_id);
+      position = put_varint(position, (unsigned short) tokens[i].frequency);
+      previous_id = tokens[i].id;
     }
 
-    sqlite3_close(db);
+    checksum = htonl(token_blob_checksum(start, position - start));
+    memcpy(position, &checksum, TOKEN_BLOB_CHECKSUM_BYTES);
+    *size = (position - start) + TOKEN_BLOB_CHECKSUM_BYTES;
   }
 
   return rc;
 }
 
-/** Create an SQLite ItemCache.
- *
- * @param item_cache A pointer to an pointer to an SQLiteItemSource. This
- *           will be initialized as an SQLiteItemSource.
- * @param cache_directory The directory containing the item cache.
- * @returns CLASSIFIER_OK if all went well, CLASSIFIER_FAIL if something went wrong.
- *          Providing that the function could allocate memory, item_cache will be an
- *          allocated item source in either case.  If the return value was
- *          CLASSIFIER_FAIL you can pass item_cache back to sqlite_item_source_errmsg
- *          to get a detailed error message.
- */
-int item_cache_create(ItemCache **item_cache, const char * cache_directory, const ItemCacheOptions * options) {
+static int save_tokens(ItemCache *item_cache, int entry_id, const char * token_data, int size) {
   int rc = CLASSIFIER_OK;
 
-  *item_cache = calloc(1, sizeof(struct ITEM_CACHE));
-
-  (*item_cache)->cache_directory = strdup(cache_directory);
-  (*item_cache)->cache_update_wait_time = options->cache_update_wait_time;
-  (*item_cache)->load_items_since = options->load_items_since;
-  (*item_cache)->min_tokens = options->min_tokens;
-  (*item_cache)->version_mismatch = 0;
-  (*item_cache)->items_by_id = NULL;
-  (*item_cache)->items_in_order = NULL;
-  (*item_cache)->random_background = NULL;
-  (*item_cache)->loaded = false;
-  (*item_cache)->update_queue = new_queue();
-  (*item_cache)->shutting_down = 0;
-
-  if (pthread_mutex_init(&(*item_cache)->db_access_mutex, NULL)) {
-    fatal("pthread_mutex_init error for db_access_mutex");
-    free(*item_cache);
-    *item_cache = NULL;
-    rc = CLASSIFIER_FAIL;
+  if (item_cache->segment_store) {
+    return segment_store_put(item_cache->segment_store, entry_id, token_data, size);
   }
 
-  if (pthread_rwlock_init(&(*item_cache)->cache_lock, NULL)) {
-    fatal("Could not allocate item cache");
+  if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_tokens_stmt, 1, entry_id)) {
+    error("Error binding entry id to %s", INSERT_ENTRY_TOKENS);
     rc = CLASSIFIER_FAIL;
-    free(*item_cache);
-    *item_cache = NULL;
-  }
-
-  if (*item_cache == NULL) {
-    fatal("Unable to allocate memory for Item Cache");
+  } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_tokens_stmt, 2, token_data, size, SQLITE_TRANSIENT)) {
+    error("Error binding blob to %s", INSERT_ENTRY_TOKENS);
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_tokens_stmt)) {
+    error("Error inserting token data for item %i: %s", entry_id, item_cache_errmsg(item_cache));
     rc = CLASSIFIER_FAIL;
-  } else {
-    rc = item_cache_open_database(*item_cache);
   }
 
+  sqlite3_clear_bindings(item_cache->insert_tokens_stmt);
+  sqlite3_reset(item_cache->insert_tokens_stmt);
+
   return rc;
 }
 
-/** Free the memory and database connection associated with the item cache.
+/* Decodes num_tokens tokens from a blob already checked by token_blob_count
+ * straight into the tokens array.
+ *
+ * @returns the total frequency of the tokens, -1 if they are not in
+ *          ascending order of id and need to be added one at a time, or
+ *          -2 if the blob is corrupt.
  */
-void free_item_cache(ItemCache *item_cache) {
+static int decode_tokens(const char * token_data, int size, Token * tokens, int num_tokens) {
+  int total_tokens = 0;
+  int sorted = 1;
+  int i;
 
-  if (item_cache) {
-    item_cache->shutting_down = 1;
+  if (is_legacy_token_blob(token_data, size)) {
+    for (i = 0; i < num_tokens; i++) {
+      int token;
+      short frequency;
+      memcpy(&token,     token_data, 4); token_data += 4;
+      memcpy(&frequency, token_data, 2); token_data += 2;
+      /* Tokens are stored in network byte order so switch them to host byte order */
+      tokens[i].id = ntohl(token);
+      tokens[i].frequency = ntohs(frequency);
 
-    if (item_cache->cache_updating_thread) {
-      info("Stopping cache updater");
-      pthread_detach(*item_cache->cache_updating_thread);
-      pthread_cancel(*item_cache->cache_updating_thread);
-      free(item_cache->cache_updating_thread);
-    }
+      if (i > 0 && tokens[i].id <= tokens[i - 1].id) {
+        sorted = 0;
+      }
 
-    if (item_cache->purge_thread) {
-      info("Stopping cache purger");
-      pthread_detach(*item_cache->purge_thread);
-      pthread_cancel(*item_cache->purge_thread);
-      free(item_cache->purge_thread);
+      total_tokens += tokens[i].frequency;
+    }
+  } else {
+    const unsigned char *end = (const unsigned char*) token_data + size - TOKEN_BLOB_CHECKSUM_BYTES;
+    const unsigned char *position = (const unsigned char*) token_data + TOKEN_BLOB_HEADER_BYTES;
+    uint32_t value, id = 0;
+
+    position = get_varint(position, end, &value);
+
+    for (i = 0; position && i < num_tokens; i++) {
+      if (NULL != (position = get_varint(position, end, &value))) {
+        id += value;
+        tokens[i].id = (int) id;
+        if (i > 0 && tokens[i].id <= tokens[i - 1].id) {
+          sorted = 0;
+        }
+        position = get_varint(position, end, &value);
+        tokens[i].frequency = (short) value;
+        total_tokens += tokens[i].frequency;
+      }
     }
 
-    if (item_cache->db) {
-      sqlite3_finalize(item_cache->fetch_item_stmt);
-      sqlite3_finalize(item_cache->fetch_all_items_stmt);
-      sqlite3_finalize(item_cache->random_background_stmt);
-      sqlite3_finalize(item_cache->insert_entry_stmt);
-      sqlite3_finalize(item_cache->update_entry_stmt);
-      sqlite3_finalize(item_cache->delete_entry_stmt);
-      sqlite3_finalize(item_cache->find_token_stmt);
-      sqlite3_finalize(item_cache->find_atom_stmt);
-      sqlite3_finalize(item_cache->insert_atom_stmt);
-      sqlite3_finalize(item_cache->insert_atom_xml_stmt);
-      sqlite3_finalize(item_cache->delete_atom_xml_stmt);
-      sqlite3_finalize(item_cache->delete_tokens_stmt);
-      sqlite3_finalize(item_cache->insert_tokens_stmt);
-      sqlite3_finalize(item_cache->touch_item_stmt);
-      sqlite3_finalize(item_cache->fetch_tokens_stmt);
-      sqlite3_close(item_cache->db);
+    if (NULL == position) {
+      return -2;
     }
+  }
 
-    if (item_cache->items_in_order) {
-      int freed_bytes;
-      uint8_t index[256];
-      index[0] = '\0';
-      PWord_t item_pointer;
+  return sorted ? total_tokens : -1;
+}
 
-      JSLF(item_pointer, item_cache->items_by_id, index);
-      while (NULL != item_pointer) {
-        free_item((Item*) (*item_pointer));
-        JSLN(item_pointer, item_cache->items_by_id, index);
-      }
-      JSLFA(freed_bytes, item_cache->items_by_id);
+/* Reads the tokens for the given item from token_data.
+ *
+ * If slab is not NULL the item's token array is carved from it.
+ *
+ * @returns the number of tokens fetched for the the item.
+ */
+static int read_tokens(const char * token_data, int size, Item * item, TokenSlab ** slab) {
+  int tokens_read = 0;
+  int num_tokens = token_data ? token_blob_count(token_data, size) : -1;
+  int total_tokens = -1;
+
+  if (!token_data) {
+    error("No token data for item");
+    tokens_read = -1;
+  } else if (num_tokens < 0) {
+    error("Token data is corrupt for item %i (size = %i)", item->key, size);
+    tokens_read = -1;
+  } else if (item_reserve_tokens(item, num_tokens, slab)) {
+    tokens_read = -1;
+  } else if (0 == item->num_tokens && 0 <= (total_tokens = decode_tokens(token_data, size, item->tokens, num_tokens))) {
+    /* Tokens are saved in order so they can usually be decoded in bulk */
+    item->num_tokens = tokens_read = num_tokens;
+    item->total_tokens = total_tokens;
+  } else if (-2 == total_tokens) {
+    error("Token data is corrupt for item %i (size = %i)", item->key, size);
+    tokens_read = -1;
+  } else {
+    Token *tokens = malloc(num_tokens * sizeof(Token));
+    int i;
+
+    if (NULL == tokens) {
+      fatal("Could not allocate data for token array");
+      tokens_read = -1;
+    } else if (-2 == decode_tokens(token_data, size, tokens, num_tokens)) {
+      error("Token data is corrupt for item %i (size = %i)", item->key, size);
+      tokens_read = -1;
+    } else {
+      for (i = 0; i < num_tokens; i++) {
+        item_add_token(item, tokens[i].id, tokens[i].frequency);
+        tokens_read++;
+      }
+    }
+
+    free(tokens);
+  }
+
+  return tokens_read;
+}
+
+/* Decodes a token blob into a scratch item. */
+static Item * decode_token_blob(const char *token_data, int size) {
+  Item *item = create_item((const unsigned char*) "", 0, 0);
+
+  if (item && read_tokens(token_data, size, item, NULL) < 0) {
+    free_item(item);
+    item = NULL;
+  }
+
+  return item;
+}
+
+/* Where read_stored_tokens puts the tokens it reads. */
+typedef struct TOKEN_READ {
+  Item *item;
+  TokenSlab **slab;
+} TokenRead;
+
+static int read_stored_tokens(int entry_id, const char *token_data, int size, void *memo) {
+  TokenRead *token_read = (TokenRead*) memo;
+  return read_tokens(token_data, size, token_read->item, token_read->slab);
+}
+
+/* Reads an item's tokens straight out of the segment store's mapping. */
+static int fetch_stored_tokens(SegmentStore * segment_store, Item * item, TokenSlab ** slab) {
+  TokenRead token_read = {item, slab};
+  return segment_store_read(segment_store, item->key, read_stored_tokens, &token_read);
+}
+
+static int fetch_tokens_for(ItemCache * item_cache, Reader * reader, Item * item, TokenSlab ** slab) {
+  int tokens_loaded = 0;
+
+  if (item && item_cache->segment_store) {
+    tokens_loaded = fetch_stored_tokens(item_cache->segment_store, item, slab);
+  } else if (reader && item) {
+    if (SQLITE_OK != sqlite3_bind_int(reader->fetch_tokens_stmt, 1, item->key)) {
+      error("Could not bind item->key to stmt: %s", sqlite3_errmsg(reader->db));
+      tokens_loaded = -1;
+    } else if (SQLITE_ROW != sqlite3_step(reader->fetch_tokens_stmt)) {
+      tokens_loaded = -1;
+    } else {
+      int blob_size = sqlite3_column_bytes(reader->fetch_tokens_stmt, 0);
+      const char *token_data = (char*) sqlite3_column_blob(reader->fetch_tokens_stmt, 0);
+      tokens_loaded = read_tokens(token_data, blob_size, item, slab);
+    }
+
+    sqlite3_clear_bindings(reader->fetch_tokens_stmt);
+    sqlite3_reset(reader->fetch_tokens_stmt);
+  }
+
+  return tokens_loaded;
+}
+
+/* Fetches the item metadata from the catalog database. */
+static Item * fetch_item_from_catalog(Reader * reader, const char * id) {
+	Item *item = NULL;
+
+	int sqlite3_rc = sqlite3_bind_text(reader->fetch_item_stmt, 1, id, -1, NULL);
+	if (SQLITE_OK != sqlite3_rc) {
+		fatal("fetch_item_stmt bind error = %s", sqlite3_errmsg(reader->db));
+		item = NULL;
+	} else {
+		sqlite3_rc = sqlite3_step(reader->fetch_item_stmt);
+
+		if (SQLITE_ROW == sqlite3_rc) {
+			item = create_item(sqlite3_column_text(reader->fetch_item_stmt, 0),
+                         sqlite3_column_int(reader->fetch_item_stmt, 1),
+                         sqlite3_column_int64(reader->fetch_item_stmt, 2));
+		} else if (SQLITE_DONE != sqlite3_rc) {
+			error("Error fetching item %s: %s", id, sqlite3_errmsg(reader->db));
+		}
+	}
+
+	sqlite3_clear_bindings(reader->fetch_item_stmt);
+	sqlite3_reset(reader->fetch_item_stmt);
+
+	return item;
+}
+
+/* Checks whether an entry still needs to be tokenized.
+ *
+ * This also sets the entry's id if it is already in the database.
+ */
+static int entry_needs_tokens(ItemCache * item_cache, Reader * reader, ItemCacheEntry * entry) {
+  int needs_tokens = true;
+  int found = false;
+
+  sqlite3_bind_text(reader->fetch_item_stmt, 1, entry->full_id, -1, NULL);
+  if (SQLITE_ROW == sqlite3_step(reader->fetch_item_stmt)) {
+    entry->id = sqlite3_column_int(reader->fetch_item_stmt, 1);
+    found = true;
+  }
+
+  sqlite3_clear_bindings(reader->fetch_item_stmt);
+  sqlite3_reset(reader->fetch_item_stmt);
+
+  if (found && item_cache->segment_store) {
+    needs_tokens = !segment_store_contains(item_cache->segment_store, entry->id);
+  } else if (found) {
+    sqlite3_bind_int(reader->fetch_tokens_stmt, 1, entry->id);
+    needs_tokens = SQLITE_ROW != sqlite3_step(reader->fetch_tokens_stmt);
+    sqlite3_clear_bindings(reader->fetch_tokens_stmt);
+    sqlite3_reset(reader->fetch_tokens_stmt);
+  }
+
+  return needs_tokens;
+}
+
+static int get_entry_key(ItemCache * item_cache, const char * entry_id) {
+  int entry_key = -1;
+
+  if (item_cache && entry_id) {
+    if (SQLITE_OK != sqlite3_bind_text(item_cache->fetch_item_stmt, 1, entry_id, -1, NULL)) {
+      error("Unable to bind %s to fetch_item_stmt: %s", entry_id, item_cache_errmsg(item_cache));
+    } else if (SQLITE_ROW != sqlite3_step(item_cache->fetch_item_stmt)) {
+      error("Entry does not exist: %s", entry_id);
+    } else {
+      entry_key = sqlite3_column_int(item_cache->fetch_item_stmt, 1);
+    }
+
+    sqlite3_clear_bindings(item_cache->fetch_item_stmt);
+    sqlite3_reset(item_cache->fetch_item_stmt);
+  }
+
+  return entry_key;
+}
+
+/* This will also update the entry's id. But side-effecty I guess */
+static int _is_new_entry(ItemCache * item_cache, ItemCacheEntry * entry) {
+  int is_new_entry = true;
+
+  sqlite3_bind_text(item_cache->fetch_item_stmt, 1, entry->full_id, -1, NULL);
+  if (SQLITE_ROW == sqlite3_step(item_cache->fetch_item_stmt)) {
+    is_new_entry = false;
+    entry->id = sqlite3_column_int(item_cache->fetch_item_stmt, 1);
+  }
+
+  sqlite3_clear_bindings(item_cache->fetch_item_stmt);
+  sqlite3_reset(item_cache->fetch_item_stmt);
+  return is_new_entry;
+}
+
+static int save_entry_xml(ItemCache *item_cache, ItemCacheEntry *entry) {
+  int rc = CLASSIFIER_OK;
+
+  if (!(entry->atom && entry->id > 0)) {
+    error("No xml or id for entry %s (%i)", entry->full_id, entry->id);
+    rc = CLASSIFIER_FAIL;
+  } else {
+    /* The binding is cleared before the entry can go away so the xml needn't be copied. */
+    int size = strlen(entry->atom);
+    if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_xml_stmt, 1, entry->id)) {
+      error("Unable to bind atom id: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_atom_xml_stmt, 2, entry->atom, size, SQLITE_STATIC)) {
+      error("Unable to bind atom xml: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_xml_stmt)) {
+      error("Unable to insert atom xml: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    }
+
+    sqlite3_clear_bindings(item_cache->insert_atom_xml_stmt);
+    sqlite3_reset(item_cache->insert_atom_xml_stmt);
+  }
+
+  return rc;
+}
+
+static int insert_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+  int rc = CLASSIFIER_OK;
+
+  if (SQLITE_OK != sqlite3_bind_text(item_cache->insert_entry_stmt, 1, entry->full_id, -1, NULL)) {
+    error("Error binding %s to parameter %i", entry->full_id, 1);
+    rc = CLASSIFIER_FAIL;
+  } else {
+    sqlite3_bind_double(item_cache->insert_entry_stmt, 2, entry->updated);
+    sqlite3_bind_double(item_cache->insert_entry_stmt, 3, entry->created_at);
+
+    if (SQLITE_DONE != sqlite3_step(item_cache->insert_entry_stmt)) {
+      error("Error inserting item %s: %s", entry->full_id, item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else {
+      entry->id = sqlite3_last_insert_rowid(item_cache->db);
+    }
+  }
+
+  sqlite3_clear_bindings(item_cache->insert_entry_stmt);
+  sqlite3_reset(item_cache->insert_entry_stmt);
+  return rc;
+}
+
+static int update_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+  int rc = CLASSIFIER_OK;
+  sqlite3_bind_double(item_cache->update_entry_stmt, 1, entry->updated);
+  sqlite3_bind_text(item_cache->update_entry_stmt, 2, entry->full_id, -1, NULL);
+
+  if (SQLITE_DONE != sqlite3_step(item_cache->update_entry_stmt)) {
+    error("Error update item %s: %s", entry->full_id, item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  sqlite3_clear_bindings(item_cache->update_entry_stmt);
+  sqlite3_reset(item_cache->update_entry_stmt);
+  return rc;
+}
+
+static int entry_has_tokens(ItemCache *item_cache, ItemCacheEntry *entry) {
+  int has_tokens = false;
+
+  if (item_cache->segment_store) {
+    has_tokens = segment_store_contains(item_cache->segment_store, entry->id);
+  } else if (SQLITE_OK != sqlite3_bind_int(item_cache->fetch_tokens_stmt, 1, entry->id)) {
+    fatal("Error bind int: %s", item_cache_errmsg(item_cache));
+  } else {
+    has_tokens = SQLITE_ROW == sqlite3_step(item_cache->fetch_tokens_stmt);
+    sqlite3_clear_bindings(item_cache->fetch_tokens_stmt);
+    sqlite3_reset(item_cache->fetch_tokens_stmt);
+  }
+
+  return has_tokens;
+}
+
+/* Writes an entry, its atom xml and its tokens inside the current group transaction.
+ *
+ * Each entry gets its own savepoint so one bad entry doesn't fail the
+ * rest of the group.
+ *
+ * Caller must hold the db_access_mutex.
+ */
+static int write_entry(ItemCache *item_cache, EntryWrite *write) {
+  int rc = CLASSIFIER_OK;
+  ItemCacheEntry *entry = write->entry;
+
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, "SAVEPOINT entry_write", NULL, NULL, NULL)) {
+    error("Could not start savepoint for %s: %s", entry->full_id, item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
+
+  if (write->tokens_only) {
+    /* The entry could have been removed since it was stored. */
+    if (_is_new_entry(item_cache, entry)) {
+      debug("Entry %s was removed before its tokens were saved", entry->full_id);
+      free_item(write->item);
+      write->item = NULL;
+    }
+  } else if (_is_new_entry(item_cache, entry)) {
+    rc = insert_entry(item_cache, entry);
+  } else {
+    rc = update_entry(item_cache, entry);
+  }
+
+  if (CLASSIFIER_OK == rc && !write->tokens_only) {
+    rc = save_entry_xml(item_cache, entry);
+  }
+
+  if (CLASSIFIER_OK == rc && write->item && entry_has_tokens(item_cache, entry)) {
+    /* Another write in this or an earlier group already tokenized the entry. */
+    free_item(write->item);
+    write->item = NULL;
+  }
+
+  if (CLASSIFIER_OK == rc && write->item) {
+    write->item->key = entry->id;
+    rc = save_tokens(item_cache, entry->id, write->token_data, write->token_data_size);
+  }
+
+  if (CLASSIFIER_OK != rc) {
+    sqlite3_exec(item_cache->db, "ROLLBACK TO entry_write", NULL, NULL, NULL);
+  }
+
+  sqlite3_exec(item_cache->db, "RELEASE entry_write", NULL, NULL, NULL);
+
+  return rc;
+}
+
+/* Writes a group of entries, along with any pending atoms, in one transaction.
+ *
+ * The atoms of every entry in the group are already pending by the time the
+ * group is taken off the queue, so they are always committed with or before
+ * the tokens that use them. If the transaction fails every write in the
+ * group fails.
+ *
+ * Hashed token ids don't depend on the tokens table so their strings are
+ * left for the cache updater to write.
+ */
+static void commit_entry_writes(ItemCache *item_cache, EntryWrite *group) {
+  int rc = CLASSIFIER_OK;
+  int num_writes = 0;
+  Array *atoms = NULL;
+  EntryWrite *write;
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, "BEGIN", NULL, NULL, NULL)) {
+    error("Could not begin group commit: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else if (!item_cache->hash_tokens && NULL != (atoms = take_pending_atoms(item_cache))) {
+    rc = write_atoms(item_cache, atoms);
+  }
+
+  for (write = group; write; write = write->next) {
+    write->rc = CLASSIFIER_OK == rc ? write_entry(item_cache, write) : CLASSIFIER_FAIL;
+    num_writes++;
+  }
+
+  /* Tokens in the segment store have to be on disk before the entries that need them. */
+  if (CLASSIFIER_OK == rc && item_cache->segment_store && DURABILITY_FULL == item_cache->durability) {
+    rc = segment_store_sync(item_cache->segment_store);
+  }
+
+  if (CLASSIFIER_OK == rc && SQLITE_OK != sqlite3_exec(item_cache->db, "COMMIT", NULL, NULL, NULL)) {
+    error("Could not commit group of %i entries: %s", num_writes, item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (CLASSIFIER_OK == rc) {
+    debug("Committed %i entries and %i atoms", num_writes, atoms ? atoms->size : 0);
+  } else {
+    sqlite3_exec(item_cache->db, "ROLLBACK", NULL, NULL, NULL);
+
+    for (write = group; write; write = write->next) {
+      /* The entry's id could be reused, so its stored tokens can't outlive it. */
+      if (item_cache->segment_store && write->item && write->item->key) {
+        segment_store_delete(item_cache->segment_store, write->item->key);
+      }
+      write->rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  if (atoms) {
+    finish_flushing_atoms(item_cache, atoms, CLASSIFIER_OK == rc);
+  }
+
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+}
+
+/* Queues the write for the next group commit and waits until it is committed.
+ *
+ * The first thread to find no commit in progress commits everything queued
+ * so far. Writes queued while it is busy are picked up by the next group,
+ * so the busier the cache is the more entries share a transaction.
+ */
+static int group_commit(ItemCache *item_cache, EntryWrite *write) {
+  pthread_mutex_lock(&item_cache->write_queue_mutex);
+
+  write->next = NULL;
+  if (item_cache->last_pending_write) {
+    item_cache->last_pending_write->next = write;
+  } else {
+    item_cache->pending_writes = write;
+  }
+  item_cache->last_pending_write = write;
+
+  while (!write->done) {
+    if (item_cache->committing) {
+      pthread_cond_wait(&item_cache->write_committed, &item_cache->write_queue_mutex);
+    } else {
+      EntryWrite *group = item_cache->pending_writes;
+      item_cache->pending_writes = NULL;
+      item_cache->last_pending_write = NULL;
+      item_cache->committing = true;
+      pthread_mutex_unlock(&item_cache->write_queue_mutex);
+
+      commit_entry_writes(item_cache, group);
+
+      pthread_mutex_lock(&item_cache->write_queue_mutex);
+      for (; group; group = group->next) {
+        group->done = true;
+      }
+      item_cache->committing = false;
+      pthread_cond_broadcast(&item_cache->write_committed);
+    }
+  }
+
+  pthread_mutex_unlock(&item_cache->write_queue_mutex);
+
+  return write->rc;
+}
+
+static time_t get_purge_time(int days_to_keep) {
+  time_t now = time(NULL);
+  struct tm purge_time_tm;
+  gmtime_r(&now, &purge_time_tm);
+  purge_time_tm.tm_mon -= (days_to_keep / 30);
+  purge_time_tm.tm_mday -= (days_to_keep % 30);
+  return timegm(&purge_time_tm);
+}
+
+static void * item_cache_purge_thread_func(void *memo) {
+  ItemCache *item_cache = (ItemCache *) memo;
+
+  while (!item_cache->shutting_down) {
+    sleep(item_cache->purge_interval);
+    item_cache_purge_old_items(item_cache);
+
+    if (item_cache->keep_entries_for > 0) {
+      item_cache_purge_old_entries(item_cache);
+    }
+
+    if (item_cache->segment_store) {
+      segment_store_compact(item_cache->segment_store);
+    }
+
+    if (item_cache->snapshot_file) {
+      item_cache_save_snapshot(item_cache);
+    }
+  }
+
+  return NULL;
+}
+
+/** The cache updating thread.
+ *
+ * This is one of the hairier functions in the Item cache.  It is responsible
+ * for saving new tokenized items in the database and adding new tokenized items
+ * into the in-memory cache that is used for classification.
+ *
+ * UpdateJob are first placed into the update_queue by the feature extraction thread.
+ * The updating thread then gets the jobs of the queue. The jobs contain an item that
+ * is to be saved into the database and, if that is successful, it is saved into the
+ * in-memory cache.  We use a write lock on the in-memory cache to ensure that
+ * nothing is reading or writing to the in-memory cache at this time.  The lock is around
+ * the smallest possible section, the item_cache_add_item function, to ensure we hold
+ * the lock for as short a time as possible.
+ *
+ * One particularly trick aspect to this is that new classification jobs are triggered
+ * by the addition of new items to the cache. This is handled by the calling of the
+ * update_callback when new items are added.  However item can come in spurts and we
+ * don't want to be creating a new classification job for every item if we are getting
+ * say 100-200 items at a rate of one every second or so, this will flood the classifier
+ * with thousands of small jobs that each classify a single item and then end.
+ *
+ * So what we want to try and do here is to add as many items as we can before calling
+ * the callback, but we also want to make sure the callback is called fairly regularly
+ * and you do don't have a small number of items waiting a long time to be classified.
+ * To do this we keep track of the number of items processed in a "run", when that reaches
+ * PROCESSING_LIMIT (default: 200) the callback is called and we continue processing new
+ * items.  Before that limit is reached we will try an get another item off the queue,
+ * if there are no items we wait 1 second, if there are still no items we then call the callback.
+ *
+ * So we have a couple of parameters that might need tuning:
+ *
+ *   PROCESSING_LIMIT: The number of items that will be processed before the update_callback is triggered.
+ *   QUEUE_WAIT: The time we wait for a new item in the queue before the update_callback is triggered.
+ */
+static void * cache_updating_func(void *memo) {
+  ItemCache *item_cache = (ItemCache*) memo;
+
+  while (!item_cache->shutting_down) {
+    UpdateJob *job = q_dequeue_or_wait(item_cache->update_queue, item_cache->cache_update_wait_time);
+    int items_added = 0;
+
+    if (job) {
+      do {
+
+        switch (job->type) {
+          case ADD:
+            job->item->time = time(NULL);
+            if (CLASSIFIER_OK == item_cache_add_item(item_cache, job->item)) {
+	      items_added++;
+	    } else {
+	      debug("No enough tokens to add to the classification item cache: %s\n", job->item->id);
+	      free_item(job->item);
+	    }
+	   break;
+	 default:
+	   fatal("Got unknown cache updating job type");
+	   break;
+        }
+
+        free(job);
+
+        /* When we have added 200 items to the queue
+         * skip to calling the callback. Otherwise
+         * try an get another job, possibly waiting
+         * one second for it to arrive.
+         */
+        if (items_added >= PROCESSING_LIMIT) {
+          debug("Hit PROCESSING_LIMIT(%i)", PROCESSING_LIMIT);
+          break;
+        } else {
+          job = q_dequeue_or_wait(item_cache->update_queue, item_cache->cache_update_wait_time);
+        }
+
+        /* We keep doing this until we don't get any more jobs after a 1 second wait. */
+        /* Is one second long enough? This might need to be a parameter. */
+      } while (job != NULL);
+
+      if (item_cache->update_callback && items_added > 0) {
+        debug("Trigger update callback for %i items", items_added);
+        item_cache->update_callback(item_cache, item_cache->update_callback_memo);
+      }
+    }
+
+    /* Nothing waits on the strings of hashed tokens or the touches of fetched
+     * items so they are written here. The updater is cancelled on shutdown,
+     * which mustn't happen while it holds the db_access_mutex.
+     */
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    if (item_cache->keep_token_strings) {
+      flush_atoms(item_cache);
+    }
+    flush_touched_items(item_cache);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+    pthread_setcancelstate(cancel_state, NULL);
+  }
+
+  return NULL;
+}
+
+/* Insert an item in the items by id cache.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int items_by_id_insert(ItemCache * item_cache, Item * item) {
+  int rc = CLASSIFIER_OK;
+
+  PWord_t item_pointer;
+  JSLI(item_pointer, item_cache->items_by_id, item->id);
+  if (NULL != item_pointer) {
+    *item_pointer = (Word_t) item;
+    item_cache->cached_size++;
+  } else {
+    fatal("Error malloc'ing item by id");
+    rc = CLASSIFIER_FAIL;
+  }
+
+  return rc;
+}
+
+static Item * items_by_id_get(ItemCache * item_cache, const unsigned char * id) {
+	Item *item = NULL;
+
+	PWord_t item_pointer;
+	JSLG(item_pointer, item_cache->items_by_id, id);
+	if (NULL != item_pointer) {
+		item = (Item*)(*item_pointer);
+	}
+
+	return item;
+}
+
+static int items_by_id_remove(ItemCache * item_cache, Item * item) {
+  int judyrc;
+
+  JSLD(judyrc, item_cache->items_by_id, item->id);
+  if (judyrc) {
+    item_cache->cached_size--;
+  }
+
+  return judyrc == 1 ? CLASSIFIER_OK : CLASSIFIER_FAIL;
+}
+
+
+/* Removes an item from the items_by_token index.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static void items_by_token_remove(ItemCache * item_cache, const Item * item) {
+  const Token *tokens = item_get_tokens(item);
+  int num_tokens = item_get_num_tokens(item);
+  int t;
+
+  for (t = 0; t < num_tokens; t++) {
+    PWord_t token_items;
+
+    JLG(token_items, item_cache->items_by_token, tokens[t].id);
+    if (NULL != token_items) {
+      int judyrc;
+      JLD(judyrc, *((Pvoid_t*) token_items), (Word_t) item);
+
+      /* Drop the token altogether once no cached items contain it. */
+      if (NULL == *((Pvoid_t*) token_items)) {
+        JLD(judyrc, item_cache->items_by_token, tokens[t].id);
+      }
+    }
+  }
+}
+
+/* Adds an item to the items_by_token index under each of its tokens.
+ *
+ * If this fails the item is left out of the index altogether.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int items_by_token_insert(ItemCache * item_cache, const Item * item) {
+  int rc = CLASSIFIER_OK;
+  const Token *tokens = item_get_tokens(item);
+  int num_tokens = item_get_num_tokens(item);
+  int t;
+
+  for (t = 0; t < num_tokens; t++) {
+    PWord_t token_items;
+    PWord_t item_pointer = NULL;
+
+    JLI(token_items, item_cache->items_by_token, tokens[t].id);
+    if (NULL != token_items) {
+      JLI(item_pointer, *((Pvoid_t*) token_items), (Word_t) item);
+    }
+
+    if (NULL == item_pointer) {
+      fatal("Error malloc'ing item by token");
+      rc = CLASSIFIER_FAIL;
+      break;
+    }
+  }
+
+  if (CLASSIFIER_OK != rc) {
+    items_by_token_remove(item_cache, item);
+  }
+
+  return rc;
+}
+
+/* Adds an item to both items_by_id and items_by_token.
+ *
+ * If either insert fails the item is in neither of them.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int items_index(ItemCache * item_cache, Item * item) {
+  int rc = items_by_id_insert(item_cache, item);
+
+  if (CLASSIFIER_OK == rc && CLASSIFIER_OK != (rc = items_by_token_insert(item_cache, item))) {
+    items_by_id_remove(item_cache, item);
+  }
+
+  return rc;
+}
+
+/* Removes an item added by items_index.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static void items_unindex(ItemCache * item_cache, Item * item) {
+  items_by_token_remove(item_cache, item);
+  items_by_id_remove(item_cache, item);
+}
+
+static void free_items_by_token(ItemCache * item_cache) {
+  int freed_bytes;
+  Word_t token_id = 0;
+  PWord_t token_items;
+
+  JLF(token_items, item_cache->items_by_token, token_id);
+  while (NULL != token_items) {
+    JLFA(freed_bytes, *((Pvoid_t*) token_items));
+    JLN(token_items, item_cache->items_by_token, token_id);
+  }
+
+  JLFA(freed_bytes, item_cache->items_by_token);
+}
+
+static OrderedItemList * ordered_item_list_insert_after(OrderedItemList * insert_after, Item * item) {
+  OrderedItemList * new = malloc(sizeof(OrderedItemList));
+  if (!new) {
+    fatal("Could not malloc OrderedItemList");
+  } else {
+    new->item = item;
+    new->next = NULL;
+
+    if (insert_after) {
+      new->next = insert_after->next;
+      insert_after->next = new;
+    }
+  }
+
+  return new;
+}
+
+/* Inserts item in list and returns the head of the list.
+ *
+ * Order is descending item time.
+ */
+static OrderedItemList * ordered_item_list_insert_in_order(OrderedItemList * list, Item * item) {
+  OrderedItemList *head = list;
+  OrderedItemList *new_node = calloc(1, sizeof(struct ORDERED_ITEM_LIST));
+
+  if (new_node) {
+    new_node->item = item;
+    new_node->next = NULL;
+
+    if (head == NULL) {
+      head = new_node;
+    } else if (head->item->time < new_node->item->time) {
+      new_node->next = head;
+      head = new_node;
+    } else {
+      OrderedItemList *current = head;
+
+      while (current->next != NULL) {
+        if (current->next->item->time < item->time) {
+          new_node->next = current->next;
+          current->next = new_node;
+          break;
+        } else {
+          current = current->next;
+        }
+      }
+
+      if (current->next == NULL) {
+        current->next = new_node;
+      }
+    }
+  }
+
+  return head;
+}
+
+static OrderedItemList * ordered_item_list_split(OrderedItemList * list, time_t split_time) {
+  OrderedItemList *leftovers = NULL;
+  OrderedItemList *current = list;
+  OrderedItemList *previous = NULL;
+
+  /* Find the point in the list where items are older than purge_time and remove them. */
+  for ( ; current != NULL; previous = current, current = current->next) {
+    if (current->item->time < split_time) {
+      if (previous) {
+        previous->next = NULL;
+      }
+
+      leftovers = current;
+      break;
+    }
+  }
+
+  return leftovers;
+}
+
+/* Used by qsort to sort loaded items in descending time order, newest key first. */
+static int compare_loaded_items(const void *item1_p, const void *item2_p) {
+  const Item *item1 = *((const Item**) item1_p);
+  const Item *item2 = *((const Item**) item2_p);
+
+  if (item1->time != item2->time) {
+    return item1->time < item2->time ? 1 : -1;
+  } else if (item1->key != item2->key) {
+    return item1->key < item2->key ? 1 : -1;
+  } else {
+    return 0;
+  }
+}
+
+/* Creates an item from a row of full_id, id, updated and tokens. With a
+ * segment store the row has no tokens and they are read from the store.
+ *
+ * @returns the number of tokens read for the item, or -1 if it could not be created.
+ */
+static int read_item_row(const ItemCache * item_cache, sqlite3_stmt * stmt, Item ** item, TokenSlab ** slab) {
+  const unsigned char * id = sqlite3_column_text(stmt, 0);
+  int key = sqlite3_column_int(stmt, 1);
+  time_t item_time = sqlite3_column_int64(stmt, 2);
+  int tokens_read = -1;
+
+  if (NULL == (*item = create_item(id, key, item_time))) {
+    tokens_read = -1;
+  } else if (item_cache->segment_store) {
+    tokens_read = fetch_stored_tokens(item_cache->segment_store, *item, slab);
+  } else {
+    tokens_read = read_tokens(sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3), *item, slab);
+  }
+
+  return tokens_read;
+}
+
+/* The range of entry keys loaded by one loader thread. */
+typedef struct LOADER_SHARD {
+  const ItemCache *item_cache;
+  int first_key;
+  int last_key;
+  Array *items;
+  int rc;
+  pthread_t thread;
+  int threaded;
+} LoaderShard;
+
+/* Loads the items in the shard's key range into the shard's own array.
+ *
+ * Each shard has its own connection and token slabs so shards don't share
+ * anything while loading.
+ */
+static void * loader_thread_func(void *memo) {
+  LoaderShard *shard = (LoaderShard*) memo;
+  const ItemCache *item_cache = shard->item_cache;
+  TokenSlab *slab = NULL;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+
+  shard->rc = CLASSIFIER_FAIL;
+
+  if (NULL == shard->items || CLASSIFIER_OK != open_read_only_database(item_cache, &db)) {
+    return NULL;
+  } else if (SQLITE_OK != sqlite3_prepare_v2(db, item_cache->segment_store ? FETCH_ALL_ITEM_KEYS_SQL : FETCH_ALL_ITEMS_SQL, -1, &stmt, NULL)) {
+    error("Unable to prepare statement: \"%s\"", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  shard->rc = CLASSIFIER_OK;
+  sqlite3_bind_int(stmt, 1, shard->first_key);
+  sqlite3_bind_int(stmt, 2, shard->last_key);
+  sqlite3_bind_int(stmt, 3, item_cache->load_items_since);
+
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    Item *item = NULL;
+
+    if (item_cache->min_tokens > read_item_row(item_cache, stmt, &item, &slab)) {
+      free_item(item);
+    } else if (arr_add(shard->items, item)) {
+      free_item(item);
+      shard->rc = CLASSIFIER_FAIL;
+      break;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  token_slab_release(slab);
+
+  return NULL;
+}
+
+/* Loads all the items into the cache.
+ *
+ * The range of keys of the entries to load is split into a shard for each
+ * loader thread.
+ * Each thread reads its items and their tokens in a single scan of the
+ * catalog in key order, which joins each entry to its tokens by primary
+ * key so both tables are read more or less sequentially. The shards are
+ * then merged, sorted into descending time order and indexed. Nothing is
+ * indexed if any shard fails to load.
+ *
+ * Caller must hold the db_access mutex and a write lock on the cache.
+ */
+static int load_all_items(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+  OrderedItemList * last = item_cache->items_in_order;
+  int num_shards = item_cache->load_threads;
+  LoaderShard *shards = calloc(num_shards, sizeof(LoaderShard));
+  Array *items = create_array(1024);
+  sqlite3_stmt *stmt = NULL;
+  int64_t first_key = 0, last_key = -1;
+  int i, j;
+
+  if (NULL == shards || NULL == items) {
+    fatal("Could not allocate loader shards");
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_KEY_RANGE_SQL, -1, &stmt, NULL)) {
+    fatal("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_OK == sqlite3_bind_int(stmt, 1, item_cache->load_items_since) &&
+             SQLITE_ROW == sqlite3_step(stmt) && SQLITE_NULL != sqlite3_column_type(stmt, 0)) {
+    first_key = sqlite3_column_int64(stmt, 0);
+    last_key = sqlite3_column_int64(stmt, 1);
+  }
+
+  sqlite3_finalize(stmt);
+
+  if (CLASSIFIER_OK == rc && last_key >= first_key) {
+    int64_t span = last_key - first_key + 1;
+
+    if (num_shards > span) {
+      num_shards = span;
+    }
+
+    for (i = 0; i < num_shards; i++) {
+      shards[i].item_cache = item_cache;
+      shards[i].first_key = first_key + span * i / num_shards;
+      shards[i].last_key = first_key + span * (i + 1) / num_shards - 1;
+      shards[i].items = create_array(1024);
+      shards[i].rc = CLASSIFIER_FAIL;
+    }
+
+    /* The first shard, and any shard a thread can't be started for, is loaded on this thread */
+    for (i = 1; i < num_shards; i++) {
+      shards[i].threaded = !pthread_create(&shards[i].thread, NULL, loader_thread_func, &shards[i]);
+    }
+
+    for (i = 0; i < num_shards; i++) {
+      if (!shards[i].threaded) {
+        loader_thread_func(&shards[i]);
+      }
+    }
+
+    for (i = 1; i < num_shards; i++) {
+      if (shards[i].threaded) {
+        pthread_join(shards[i].thread, NULL);
+      }
+    }
+
+    for (i = 0; i < num_shards; i++) {
+      if (CLASSIFIER_OK != shards[i].rc || NULL == shards[i].items) {
+        error("Could not load items %i to %i", shards[i].first_key, shards[i].last_key);
+        rc = CLASSIFIER_FAIL;
+      }
+
+      for (j = 0; shards[i].items && j < shards[i].items->size; j++) {
+        if (arr_add(items, shards[i].items->elements[j])) {
+          free_item(shards[i].items->elements[j]);
+          rc = CLASSIFIER_FAIL;
+        }
+      }
+
+      if (shards[i].items) {
+        free(shards[i].items->elements);
+        free(shards[i].items);
+      }
+    }
+  }
+
+  if (items && CLASSIFIER_OK != rc) {
+    for (i = 0; i < items->size; i++) {
+      free_item(items->elements[i]);
+    }
+
+    free(items->elements);
+    free(items);
+  } else if (items) {
+    qsort(items->elements, items->size, sizeof(Item*), compare_loaded_items);
+
+    /* Load the item ids and timestamp indexing and order them by each.
+     * An item that can't be added to all of them is left out of every one.
+     */
+    for (i = 0; i < items->size; i++) {
+      Item *item = items->elements[i];
+      OrderedItemList *node;
+
+      if (items_index(item_cache, item)) {
+        rc = CLASSIFIER_FAIL;
+        free_item(item);
+      } else if (NULL == (node = ordered_item_list_insert_after(last, item))) {
+        rc = CLASSIFIER_FAIL;
+        items_unindex(item_cache, item);
+        free_item(item);
+      } else {
+        last = node;
+        if (!item_cache->items_in_order) {
+          item_cache->items_in_order = last;
+        }
+      }
+    }
+
+    /* The items are now owned by the cache */
+    free(items->elements);
+    free(items);
+  }
+
+  free(shards);
+
+  return rc;
+}
+
+/* Moves any token blobs in tokens.db into the segment store, rewriting any
+ * still in the old format.
+ *
+ * This happens when a cache is first opened with a segment store. After
+ * that tokens.db only has blobs left in it if a crash stopped them being
+ * deleted once they were imported, and importing them again is harmless.
+ *
+ * Caller must hold the db_access_mutex.
+ */
+static int import_token_blobs(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+  int imported = 0;
+  sqlite3_stmt *stmt;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_ALL_ENTRY_TOKENS, -1, &stmt, NULL)) {
+    error("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
+
+  while (CLASSIFIER_OK == rc && SQLITE_ROW == sqlite3_step(stmt)) {
+    int entry_id = sqlite3_column_int(stmt, 0);
+    const char *token_data = sqlite3_column_blob(stmt, 1);
+    int size = sqlite3_column_bytes(stmt, 1);
+
+    if (NULL == token_data) {
+      continue;
+    } else if (is_legacy_token_blob(token_data, size)) {
+      Item *item = decode_token_blob(token_data, size);
+      char *new_token_data;
+      int new_size;
+
+      if (NULL == item) {
+        error("Could not decode tokens for entry %i, not importing them", entry_id);
+      } else if (CLASSIFIER_OK == (rc = serialize_tokens(item, &new_size, &new_token_data))) {
+        rc = segment_store_put(item_cache->segment_store, entry_id, new_token_data, new_size);
+        free(new_token_data);
+      }
+
+      free_item(item);
+    } else {
+      rc = segment_store_put(item_cache->segment_store, entry_id, token_data, size);
+    }
+
+    imported++;
+  }
+
+  sqlite3_finalize(stmt);
+
+  /* The blobs are only dropped from tokens.db once they are safely on disk
+   * and the cache is marked so it is never opened without the store again. */
+  if (CLASSIFIER_OK == rc && imported > 0) {
+    rc = segment_store_sync(item_cache->segment_store);
+  }
+
+  if (CLASSIFIER_OK == rc && !item_cache->tokens_in_segments) {
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, CREATE_TOKEN_STORAGE_SQL, NULL, NULL, NULL) ||
+        SQLITE_OK != sqlite3_exec(item_cache->db, INSERT_TOKEN_STORAGE_SQL, NULL, NULL, NULL)) {
+      fatal("Could not mark the item cache as using a segment store: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else {
+      item_cache->tokens_in_segments = true;
+    }
+  }
+
+  if (CLASSIFIER_OK == rc && imported > 0 &&
+      SQLITE_OK != sqlite3_exec(item_cache->db, DELETE_ALL_ENTRY_TOKENS, NULL, NULL, NULL)) {
+    error("Could not delete imported token blobs: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (CLASSIFIER_OK == rc && imported > 0) {
+    info("Imported %i token blobs into the segment store", imported);
+  }
+
+  return rc;
+}
+
+/* Builds the path of the segment store in the cache directory, with suffix appended. */
+static int segments_path(const ItemCache * item_cache, const char *suffix, char *path) {
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/segments%s", item_cache->cache_directory, suffix)) {
+    fatal("Path to segments too long: %s", item_cache->cache_directory);
+    return CLASSIFIER_FAIL;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+/* Finishes replacing the segment store with one written by renumber_stored_tokens.
+ *
+ * The new store is written to segments.new and the old one is moved to
+ * segments.old while they are swapped, so this can carry on from wherever
+ * a crash stopped it. A new store that was never marked to be swapped in
+ * is from a renumbering that didn't commit and is deleted.
+ *
+ * Caller must hold the db_access_mutex and not have the segment store open.
+ */
+static int finish_segment_swap(ItemCache * item_cache) {
+  char path[MAXPATHLEN], new_path[MAXPATHLEN], old_path[MAXPATHLEN];
+  struct stat path_stat;
+  sqlite3_stmt *stmt;
+  int pending = false;
+
+  if (CLASSIFIER_OK != segments_path(item_cache, "", path) ||
+      CLASSIFIER_OK != segments_path(item_cache, ".new", new_path) ||
+      CLASSIFIER_OK != segments_path(item_cache, ".old", old_path)) {
+    return CLASSIFIER_FAIL;
+  }
+
+  /* The table doesn't exist in caches that have never been renumbered. */
+  if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, FETCH_SEGMENT_SWAP_SQL, -1, &stmt, NULL)) {
+    if (SQLITE_ROW == sqlite3_step(stmt)) {
+      pending = sqlite3_column_int(stmt, 0) > 0;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  if (!pending) {
+    return segment_store_destroy(new_path);
+  }
+
+  if (0 == stat(new_path, &path_stat)) {
+    if (CLASSIFIER_OK != segment_store_destroy(old_path) ||
+        (0 == stat(path, &path_stat) && rename(path, old_path)) ||
+        rename(new_path, path)) {
+      error("Could not swap in the renumbered segment store %s: %s", new_path, strerror(errno));
+      return CLASSIFIER_FAIL;
+    }
+  }
+
+  if (CLASSIFIER_OK != segment_store_destroy(old_path)) {
+    return CLASSIFIER_FAIL;
+  } else if (SQLITE_OK != sqlite3_exec(item_cache->db, DELETE_SEGMENT_SWAP_SQL, NULL, NULL, NULL)) {
+    error("Could not clear the segment swap: %s", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
+
+  info("Swapped in the renumbered segment store");
+  return CLASSIFIER_OK;
+}
+
+static int reopen_segment_store(ItemCache * item_cache) {
+  char path[MAXPATHLEN];
+
+  if (CLASSIFIER_OK != segments_path(item_cache, "", path) ||
+      NULL == (item_cache->segment_store = segment_store_open(path))) {
+    return CLASSIFIER_FAIL;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+/* Opens the segment store in the cache directory, importing tokens.db into it. */
+static int open_segment_store(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  if (CLASSIFIER_OK != finish_segment_swap(item_cache) || CLASSIFIER_OK != reopen_segment_store(item_cache)) {
+    rc = CLASSIFIER_FAIL;
+  } else {
+    rc = import_token_blobs(item_cache);
+  }
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  return rc;
+}
+
+/* Adds the tokens in a token blob to a pool.
+ *
+ * @returns CLASSIFIER_OK, or CLASSIFIER_FAIL if the blob is corrupt.
+ */
+static int add_token_blob_to_pool(int entry_id, const char *token_data, int size, void *memo) {
+  Pool *pool = (Pool*) memo;
+  int num_tokens = token_data ? token_blob_count(token_data, size) : -1;
+  Token *tokens = num_tokens > 0 ? malloc(num_tokens * sizeof(Token)) : NULL;
+  int i;
+
+  if (num_tokens < 0 || (num_tokens > 0 && (NULL == tokens || -2 == decode_tokens(token_data, size, tokens, num_tokens)))) {
+    error("Token data is corrupt for a random background item (size = %i)", size);
+    free(tokens);
+    return CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; i < num_tokens; i++) {
+    pool_add_token(pool, tokens[i].id, tokens[i].frequency);
+  }
+
+  free(tokens);
+  return CLASSIFIER_OK;
+}
+
+/* Adds the tokens of every item in the random background straight to the pool.
+ *
+ * Items in the random background that have no tokens yet are logged and skipped.
+ */
+static int load_random_background(ItemCache * item_cache) {
+  int rndbg_item_count = 0;
+  item_cache->random_background = new_pool();
+
+  while (SQLITE_ROW == sqlite3_step(item_cache->random_background_stmt)) {
+    sqlite3_stmt *stmt = item_cache->random_background_stmt;
+    int entry_id = sqlite3_column_int(stmt, 0);
+    int rc;
+
+    if (item_cache->segment_store ? !segment_store_contains(item_cache->segment_store, entry_id) :
+                                    SQLITE_NULL == sqlite3_column_type(stmt, 1)) {
+      info("Random background item %i has no tokens, skipping it", entry_id);
+      continue;
+    } else if (item_cache->segment_store) {
+      rc = segment_store_read(item_cache->segment_store, entry_id,
+                              add_token_blob_to_pool, item_cache->random_background);
+    } else {
+      rc = add_token_blob_to_pool(entry_id, sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1),
+                                  item_cache->random_background);
+    }
+
+    if (CLASSIFIER_OK == rc) {
+      rndbg_item_count++;
+    }
+  }
+  sqlite3_reset(item_cache->random_background_stmt);
+  info("Randombackground contains %i items", rndbg_item_count);
+
+  return CLASSIFIER_OK;
+}
+
+/* Loads the entries in the load window that aren't in the cache.
+ *
+ * After a snapshot is loaded these are the entries that were still being
+ * added when it was written, since they were stored but not yet cached.
+ * Only the entry keys are read for the rest so this is much cheaper than
+ * a full load. Entries without tokens yet are left to the tokenizers.
+ *
+ * Caller must hold the db_access_mutex and a write lock on the cache.
+ */
+static int load_uncached_items(ItemCache * item_cache) {
+  sqlite3_stmt *stmt = item_cache->fetch_recent_item_keys_stmt;
+  int rc = CLASSIFIER_OK;
+  int items_loaded = 0;
+  TokenSlab *slab = NULL;
+
+  sqlite3_bind_int(stmt, 1, item_cache->load_items_since);
+
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    Item *item = NULL;
+    int tokens_read = 0;
+
+    if (items_by_id_get(item_cache, sqlite3_column_text(stmt, 0))) {
+      continue;
+    } else if (NULL == (item = create_item(sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int64(stmt, 2)))) {
+      rc = CLASSIFIER_FAIL;
+      break;
+    } else if (item_cache->segment_store) {
+      tokens_read = fetch_stored_tokens(item_cache->segment_store, item, &slab);
+    } else if (SQLITE_OK == sqlite3_bind_int(item_cache->fetch_tokens_stmt, 1, item->key) &&
+               SQLITE_ROW == sqlite3_step(item_cache->fetch_tokens_stmt)) {
+      tokens_read = read_tokens(sqlite3_column_blob(item_cache->fetch_tokens_stmt, 0),
+                                sqlite3_column_bytes(item_cache->fetch_tokens_stmt, 0), item, &slab);
+    }
+
+    sqlite3_clear_bindings(item_cache->fetch_tokens_stmt);
+    sqlite3_reset(item_cache->fetch_tokens_stmt);
+
+    if (tokens_read <= 0 || tokens_read < item_cache->min_tokens) {
+      free_item(item);
+    } else if (items_index(item_cache, item)) {
+      rc = CLASSIFIER_FAIL;
+      free_item(item);
+      break;
+    } else {
+      item_cache->items_in_order = ordered_item_list_insert_in_order(item_cache->items_in_order, item);
+      items_loaded++;
+    }
+  }
+
+  sqlite3_clear_bindings(stmt);
+  sqlite3_reset(stmt);
+  token_slab_release(slab);
+  info("Loaded %i items missing from the snapshot", items_loaded);
+
+  return rc;
+}
+
+/******************************************************************************
+ * Snapshot functions
+ *
+ * A snapshot is a copy of the in-memory cache that is mapped back in at
+ * startup instead of loading every item's tokens from the database. The
+ * catalog is still the source of truth, so a snapshot records the catalog's
+ * change count and largest entry id and is only loaded if neither has moved
+ * on since. Entries that were still being added when it was written are then
+ * loaded from the database.
+ *
+ * Snapshots are a local cache so they are written in the native byte order
+ * and the tokens are stored as Token arrays that items can use in place.
+ * Everything before a token array is a multiple of 4 bytes so the arrays
+ * are aligned in the mapping. The format is:
+ *
+ *   "WICS", version, sizeof(Token), catalog changes, largest entry id
+ *   random background as a count and (token id, frequency) pairs
+ *   number of items, then for each item in descending time order:
+ *     key, time (8 bytes), total tokens, number of tokens,
+ *     id length, id with its '\0' padded to 4 bytes, tokens
+ *   "WICE"
+ ******************************************************************************/
+
+#define SNAPSHOT_MAGIC "WICS"
+#define SNAPSHOT_END "WICE"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ITEM_HEADER_SIZE 24
+
+static void write_int(Buffer * b, int32_t value) {
+  buffer_in(b, (const char *) &value, sizeof(value));
+}
+
+/* Copies the in-memory cache into a snapshot in memory.
+ *
+ * This only copies so the cache is locked for as short a time as possible,
+ * the snapshot is written to disk once the lock has been released.
+ *
+ * Caller must hold a read lock on the cache.
+ */
+static Buffer * copy_snapshot(ItemCache * item_cache, int changes, int max_key) {
+  static const char padding[4] = {0, 0, 0, 0};
+  const Pool *random_background = item_cache->random_background;
+  int num_tokens = random_background ? pool_num_tokens(random_background) : 0;
+  int *token_ids = malloc((num_tokens + 1) * sizeof(int));
+  int *frequencies = malloc((num_tokens + 1) * sizeof(int));
+  size_t size = 64 + (size_t) num_tokens * 8;
+  OrderedItemList *current;
+  int32_t num_items = 0;
+  Buffer *b = NULL;
+  int i;
+
+  if (NULL == token_ids || NULL == frequencies) {
+    error("Could not allocate random background arrays for snapshot");
+    free(token_ids);
+    free(frequencies);
+    return NULL;
+  }
+
+  for (current = item_cache->items_in_order; current; current = current->next) {
+    size += SNAPSHOT_ITEM_HEADER_SIZE + strlen((char*) current->item->id) + 4 + current->item->num_tokens * sizeof(Token);
+    num_items++;
+  }
+
+  if (NULL == (b = new_buffer(size))) {
+    error("Could not allocate %lu bytes for snapshot", (unsigned long) size);
+    free(token_ids);
+    free(frequencies);
+    return NULL;
+  }
+
+  buffer_in(b, SNAPSHOT_MAGIC, 4);
+  write_int(b, SNAPSHOT_VERSION);
+  write_int(b, sizeof(Token));
+  write_int(b, changes);
+  write_int(b, max_key);
+
+  num_tokens = random_background ? pool_token_arrays(random_background, token_ids, frequencies) : 0;
+  write_int(b, num_tokens);
+  for (i = 0; i < num_tokens; i++) {
+    write_int(b, token_ids[i]);
+    write_int(b, frequencies[i]);
+  }
+
+  write_int(b, num_items);
+  for (current = item_cache->items_in_order; current; current = current->next) {
+    const Item *item = current->item;
+    int64_t item_time = item->time;
+    int32_t id_size = strlen((char*) item->id) + 1;
+
+    write_int(b, item->key);
+    buffer_in(b, (const char *) &item_time, sizeof(item_time));
+    write_int(b, item->total_tokens);
+    write_int(b, item->num_tokens);
+    write_int(b, id_size);
+    buffer_in(b, (const char *) item->id, id_size);
+    buffer_in(b, padding, -id_size & 3);
+    buffer_in(b, (const char *) item->tokens, item->num_tokens * sizeof(Token));
+  }
+
+  buffer_in(b, SNAPSHOT_END, 4);
+
+  free(token_ids);
+  free(frequencies);
+  return b;
+}
+
+/* Reads values from a mapped snapshot, failing once it reads past the end. */
+struct SnapshotReader {
+  char *data;
+  size_t size;
+  size_t position;
+  int failed;
+};
+
+static char * read_bytes(struct SnapshotReader * r, size_t n) {
+  char * bytes = NULL;
+
+  if (!r->failed && n <= r->size - r->position) {
+    bytes = r->data + r->position;
+    r->position += n;
+  } else {
+    r->failed = true;
+  }
+
+  return bytes;
+}
+
+static int32_t read_int(struct SnapshotReader * r) {
+  int32_t value = 0;
+  const char * bytes = read_bytes(r, sizeof(value));
+  if (bytes) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static int64_t read_int64(struct SnapshotReader * r) {
+  int64_t value = 0;
+  const char * bytes = read_bytes(r, sizeof(value));
+  if (bytes) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+/* Reads a count, failing the reader if there can't be that many elements of element_size left. */
+static int read_count(struct SnapshotReader * r, size_t element_size) {
+  int32_t count = read_int(r);
+
+  if (count < 0 || (size_t) count > (r->size - r->position) / element_size) {
+    r->failed = true;
+    count = 0;
+  }
+
+  return count;
+}
+
+static void free_ordered_item_list(OrderedItemList * list) {
+  while (list) {
+    OrderedItemList *next = list->next;
+    free_item(list->item);
+    free(list);
+    list = next;
+  }
+}
+
+/* Reads the items in the snapshot into a list in descending time order.
+ *
+ * The items' tokens are used in place and share the mapping through slab.
+ * Items older than purge_time or with less than min_tokens are skipped.
+ */
+static OrderedItemList * read_snapshot_items(ItemCache * item_cache, struct SnapshotReader * r, TokenSlab * slab, time_t purge_time) {
+  OrderedItemList *items = NULL;
+  OrderedItemList *last = NULL;
+  int num_items = read_count(r, SNAPSHOT_ITEM_HEADER_SIZE);
+  int i;
+
+  for (i = 0; i < num_items; i++) {
+    int key = read_int(r);
+    time_t item_time = read_int64(r);
+    int total_tokens = read_int(r);
+    int num_tokens = read_int(r);
+    int id_size = read_int(r);
+    const char *id = id_size > 0 ? read_bytes(r, id_size) : NULL;
+    read_bytes(r, -id_size & 3);
+    Token *tokens = num_tokens >= 0 ? (Token*) read_bytes(r, (size_t) num_tokens * sizeof(Token)) : NULL;
+
+    if (r->failed || !id || !tokens || id[id_size - 1] != '\0') {
+      r->failed = true;
+      break;
+    } else if (item_time < purge_time || num_tokens < item_cache->min_tokens) {
+      continue;
+    }
+
+    Item *item = create_item((const unsigned char *) id, key, item_time);
+    if (NULL == item) {
+      r->failed = true;
+      break;
+    }
+
+    item->tokens = tokens;
+    item->num_tokens = num_tokens;
+    item->token_capacity = num_tokens;
+    item->total_tokens = total_tokens;
+    item->slab = slab;
+    slab->references++;
+
+    if (NULL == (last = ordered_item_list_insert_after(last, item))) {
+      free_item(item);
+      r->failed = true;
+      break;
+    } else if (!items) {
+      items = last;
+    }
+  }
+
+  return items;
+}
+
+/* Loads the in-memory cache from its snapshot.
+ *
+ * Nothing is loaded unless the whole snapshot is valid and was written
+ * when the catalog was in the state given by changes and max_key. Anything
+ * else could have been removed or updated in the catalog since, in which
+ * case the cache needs a full load.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int load_snapshot(ItemCache * item_cache, int changes, int max_key, int * loaded) {
+  struct stat file_stat;
+  int rc = CLASSIFIER_FAIL;
+  int fd;
+
+  if (-1 == (fd = open(item_cache->snapshot_file, O_RDONLY))) {
+    info("No item cache snapshot at %s", item_cache->snapshot_file);
+    return rc;
+  }
+
+  if (0 == fstat(fd, &file_stat) && file_stat.st_size > 0) {
+    /* Mapped privately and writable so any changes to the items' tokens stay in memory. */
+    void * data = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    TokenSlab *slab = calloc(1, sizeof(TokenSlab));
+
+    if (MAP_FAILED == data) {
+      error("Could not map item cache snapshot %s: %s", item_cache->snapshot_file, strerror(errno));
+      free(slab);
+    } else if (NULL == slab) {
+      error("Could not allocate snapshot slab");
+      munmap(data, file_stat.st_size);
+    } else {
+      struct SnapshotReader reader = {data, file_stat.st_size, 0, false};
+      struct SnapshotReader *r = &reader;
+      OrderedItemList *items = NULL;
+      Pool *random_background = NULL;
+      int i;
+
+      /* The slab holds the mapping for as long as any item uses it, plus one while loading. */
+      slab->references = 1;
+      slab->mapping = data;
+      slab->mapping_size = file_stat.st_size;
+
+      const char *magic = read_bytes(r, 4);
+      if (!magic || memcmp(magic, SNAPSHOT_MAGIC, 4) || SNAPSHOT_VERSION != read_int(r) || sizeof(Token) != read_int(r)) {
+        info("Item cache snapshot %s is from a different version", item_cache->snapshot_file);
+        r->failed = true;
+      } else if (changes != read_int(r) || max_key != read_int(r)) {
+        info("Item cache snapshot %s is out of date with the catalog", item_cache->snapshot_file);
+        r->failed = true;
+      } else {
+        int num_tokens = read_count(r, 2 * sizeof(int32_t));
+        random_background = new_pool();
+        for (i = 0; random_background && i < num_tokens; i++) {
+          int token_id = read_int(r);
+          int frequency = read_int(r);
+          pool_add_token(random_background, token_id, frequency);
+        }
+
+        items = read_snapshot_items(item_cache, r, slab, get_purge_time(item_cache->load_items_since));
+
+        const char *end = read_bytes(r, 4);
+        if (!random_background || !end || memcmp(end, SNAPSHOT_END, 4) || r->position != r->size) {
+          r->failed = true;
+        }
+      }
+
+      if (r->failed) {
+        info("Ignoring item cache snapshot %s", item_cache->snapshot_file);
+        free_ordered_item_list(items);
+        if (random_background) {
+          free_pool(random_background);
+        }
+      } else {
+        OrderedItemList *current = items;
+        OrderedItemList *previous = NULL;
+        *loaded = true;
+        rc = CLASSIFIER_OK;
+
+        /* Drop any item that can't be indexed from the list too. */
+        while (current) {
+          OrderedItemList *next = current->next;
+
+          if (items_index(item_cache, current->item)) {
+            rc = CLASSIFIER_FAIL;
+            if (previous) {
+              previous->next = next;
+            } else {
+              items = next;
+            }
+            free_item(current->item);
+            free(current);
+          } else {
+            previous = current;
+          }
+
+          current = next;
+        }
+
+        item_cache->items_in_order = items;
+        if (item_cache->random_background) {
+          free_pool(item_cache->random_background);
+        }
+        item_cache->random_background = random_background;
+        info("Loaded %i items from snapshot %s", item_cache->cached_size, item_cache->snapshot_file);
+      }
+
+      token_slab_release(slab);
+    }
+  }
+
+  close(fd);
+  return rc;
+}
+
+/*****************************************************************************
+ * External API functions for the item cache.
+ *****************************************************************************/
+
+/** Initialize an SQLite database with the ItemCache schema.
+ *
+ * @param db_file File to initialize.
+ * @param error Any error message is stored here.
+ */
+int item_cache_initialize(const char *db_file, char * error) {
+  int rc = CLASSIFIER_OK;
+  sqlite3 *db;
+  FILE *file;
+
+  if (NULL != (file = fopen(db_file, "r"))) {
+    snprintf(error, 512, "Database file %s already exists, no action taken.", db_file);
+    fclose(file);
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_OK != sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) {
+    snprintf(error, 512, "Error creating database file %s: %s.", db_file, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    rc = CLASSIFIER_FAIL;
+  } else {
+    FILE *schema_file;
+    char *schema;
+    char schema_file_name[512];
+    snprintf(schema_file_name, 512, "%s/%s/%s", DATADIR, PACKAGE,"initial_schema.sql");
+
+    if (NULL != (schema_file = fopen(schema_file_name, "r"))) {
+      fseek(schema_file, 0, SEEK_END);
+      int size = ftell(schema_file);
+      schema = malloc(size + 1);
+      fseek(schema_file, 0, SEEK_SET);
+
+      if (size != fread(schema, sizeof(char), size, schema_file)) {
+        rc = CLASSIFIER_FAIL;
+        snprintf(error, 512, "Error reading schema file %s: %s", schema_file_name, strerror(errno));
+      } else {
+        schema[size] = 0;
+        if (SQLITE_OK != sqlite3_exec(db, schema, NULL, NULL, NULL)) {
+          snprintf(error, 512, "Error loading schema into database file: %s", sqlite3_errmsg(db));
+          rc = CLASSIFIER_FAIL;
+        }
+      }
+
+      free(schema);
+      fclose(schema_file);
+    } else {
+      snprintf(error, 512, "Could not find the database schema file at %s. Perhaps it is missing from the install.", schema_file_name);
+      rc = CLASSIFIER_FAIL;
+    }
+
+    sqlite3_close(db);
+  }
+
+  return rc;
+}
+
+/** Create an SQLite ItemCache.
+ *
+ * @param item_cache A pointer to an pointer to an SQLiteItemSource. This
+ *           will be initialized as an SQLiteItemSource.
+ * @param cache_directory The directory containing the item cache.
+ * @returns CLASSIFIER_OK if all went well, CLASSIFIER_FAIL if something went wrong.
+ *          Providing that the function could allocate memory, item_cache will be an
+ *          allocated item source in either case.  If the return value was
+ *          CLASSIFIER_FAIL you can pass item_cache back to sqlite_item_source_errmsg
+ *          to get a detailed error message.
+ */
+int item_cache_create(ItemCache **item_cache, const char * cache_directory, const ItemCacheOptions * options) {
+  int rc = CLASSIFIER_OK;
+
+  *item_cache = calloc(1, sizeof(struct ITEM_CACHE));
+
+  (*item_cache)->cache_directory = strdup(cache_directory);
+  (*item_cache)->cache_update_wait_time = options->cache_update_wait_time;
+  (*item_cache)->load_items_since = options->load_items_since;
+  (*item_cache)->min_tokens = options->min_tokens;
+  (*item_cache)->load_threads = options->load_threads > 1 ? options->load_threads : 1;
+  (*item_cache)->snapshot_file = options->snapshot_file ? strdup(options->snapshot_file) : NULL;
+  (*item_cache)->durability = options->durability;
+  (*item_cache)->use_segment_store = options->segment_store;
+  (*item_cache)->tokenizer_threads = options->tokenizer_threads;
+  (*item_cache)->max_readers = options->max_readers > 0 ? options->max_readers : DEFAULT_MAX_READERS;
+  (*item_cache)->hash_tokens = options->hash_tokens;
+  (*item_cache)->keep_token_strings = options->hash_tokens && options->keep_token_strings;
+  /* Never purge anything from the database that could still be in memory. */
+  (*item_cache)->keep_entries_for = options->keep_entries_for > 0 && options->keep_entries_for < options->load_items_since ?
+                                      options->load_items_since : options->keep_entries_for;
+  (*item_cache)->catalog_changes = -1;
+  (*item_cache)->version_mismatch = 0;
+  (*item_cache)->items_by_id = NULL;
+  (*item_cache)->items_in_order = NULL;
+  (*item_cache)->random_background = NULL;
+  (*item_cache)->loaded = false;
+  (*item_cache)->update_queue = new_queue();
+  (*item_cache)->tokenize_queue = new_queue();
+  (*item_cache)->shutting_down = 0;
+
+  if (pthread_mutex_init(&(*item_cache)->db_access_mutex, NULL)) {
+    fatal("pthread_mutex_init error for db_access_mutex");
+    free(*item_cache);
+    *item_cache = NULL;
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (*item_cache && (NULL == ((*item_cache)->pending_atoms = create_array(64)) ||
+                      pthread_rwlock_init(&(*item_cache)->atoms_lock, NULL))) {
+    fatal("Could not allocate atom dictionary");
+    free(*item_cache);
+    *item_cache = NULL;
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (*item_cache && (pthread_mutex_init(&(*item_cache)->reader_pool_mutex, NULL) ||
+                      pthread_cond_init(&(*item_cache)->reader_released, NULL) ||
+                      pthread_mutex_init(&(*item_cache)->touched_items_mutex, NULL))) {
+    fatal("pthread_mutex_init error for reader_pool_mutex");
+    free(*item_cache);
+    *item_cache = NULL;
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (*item_cache && (pthread_mutex_init(&(*item_cache)->write_queue_mutex, NULL) ||
+                      pthread_cond_init(&(*item_cache)->write_committed, NULL))) {
+    fatal("Could not allocate write queue");
+    free(*item_cache);
+    *item_cache = NULL;
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (*item_cache && pthread_rwlock_init(&(*item_cache)->cache_lock, NULL)) {
+    fatal("Could not allocate item cache");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache == NULL) {
+    fatal("Unable to allocate memory for Item Cache");
+    rc = CLASSIFIER_FAIL;
+  } else {
+    rc = item_cache_open_database(*item_cache);
+  }
+
+  if (CLASSIFIER_OK == rc && (*item_cache)->use_segment_store) {
+    rc = open_segment_store(*item_cache);
+  }
+
+  return rc;
+}
+
+/** Free the memory and database connection associated with the item cache.
+ */
+void free_item_cache(ItemCache *item_cache) {
+
+  if (item_cache) {
+    if (item_cache->snapshot_file && item_cache->loaded) {
+      item_cache_save_snapshot(item_cache);
+    }
+
+    item_cache->shutting_down = 1;
+
+    if (item_cache->tokenizers) {
+      int i;
+      info("Stopping tokenizers");
+      for (i = 0; i < item_cache->num_tokenizers; i++) {
+        pthread_join(item_cache->tokenizers[i], NULL);
+      }
+      free(item_cache->tokenizers);
+    }
+
+    if (item_cache->cache_updating_thread) {
+      info("Stopping cache updater");
+      pthread_detach(*item_cache->cache_updating_thread);
+      pthread_cancel(*item_cache->cache_updating_thread);
+      free(item_cache->cache_updating_thread);
+    }
+
+    if (item_cache->purge_thread) {
+      info("Stopping cache purger");
+      pthread_detach(*item_cache->purge_thread);
+      pthread_cancel(*item_cache->purge_thread);
+      free(item_cache->purge_thread);
+    }
+
+    if (item_cache->db) {
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      flush_atoms(item_cache);
+      flush_touched_items(item_cache);
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+      free_readers(item_cache);
+
+      sqlite3_finalize(item_cache->fetch_item_stmt);
+      sqlite3_finalize(item_cache->fetch_recent_item_keys_stmt);
+      sqlite3_finalize(item_cache->random_background_stmt);
+      sqlite3_finalize(item_cache->insert_entry_stmt);
+      sqlite3_finalize(item_cache->update_entry_stmt);
+      sqlite3_finalize(item_cache->delete_entry_stmt);
+      sqlite3_finalize(item_cache->fetch_expired_entries_stmt);
+      sqlite3_finalize(item_cache->insert_atom_stmt);
+      sqlite3_finalize(item_cache->insert_atom_xml_stmt);
+      sqlite3_finalize(item_cache->delete_atom_xml_stmt);
+      sqlite3_finalize(item_cache->delete_tokens_stmt);
+      sqlite3_finalize(item_cache->insert_tokens_stmt);
+      sqlite3_finalize(item_cache->touch_item_stmt);
+      sqlite3_finalize(item_cache->fetch_tokens_stmt);
+      sqlite3_close(item_cache->db);
+    }
+
+    segment_store_close(item_cache->segment_store);
+
+    if (item_cache->items_in_order) {
+      int freed_bytes;
+      uint8_t index[256];
+      index[0] = '\0';
+      PWord_t item_pointer;
+
+      JSLF(item_pointer, item_cache->items_by_id, index);
+      while (NULL != item_pointer) {
+        free_item((Item*) (*item_pointer));
+        JSLN(item_pointer, item_cache->items_by_id, index);
+      }
+      JSLFA(freed_bytes, item_cache->items_by_id);
+
+      OrderedItemList *current = item_cache->items_in_order;
+      while (current) {
+        OrderedItemList *to_free = current;
+        current = current->next;
+        free(to_free);
+      }
+
+      if (item_cache->random_background) {
+        free_pool(item_cache->random_background);
+      }
+    }
+
+    free_items_by_token(item_cache);
+
+    pthread_mutex_destroy(&item_cache->db_access_mutex);
+    pthread_rwlock_destroy(&item_cache->cache_lock);
+    pthread_mutex_destroy(&item_cache->reader_pool_mutex);
+    pthread_cond_destroy(&item_cache->reader_released);
+    pthread_mutex_destroy(&item_cache->touched_items_mutex);
+    pthread_mutex_destroy(&item_cache->write_queue_mutex);
+    pthread_cond_destroy(&item_cache->write_committed);
+
+    Word_t freed_atom_bytes;
+    JSLFA(freed_atom_bytes, item_cache->atoms);
+    JLFA(freed_atom_bytes, item_cache->known_hashes);
+    JSLFA(freed_atom_bytes, item_cache->touched_items);
+    free_array(item_cache->pending_atoms);
+    pthread_rwlock_destroy(&item_cache->atoms_lock);
+    free_queue(item_cache->update_queue);
+
+    /* Entries still waiting are already stored and get tokenized the next time the tokenizers start. */
+    ItemCacheEntry *entry;
+    while (NULL != (entry = q_dequeue(item_cache->tokenize_queue))) {
+      free_entry(entry);
+    }
+    free_queue(item_cache->tokenize_queue);
+
+    free(item_cache->cache_directory);
+    free(item_cache->snapshot_file);
+    memset(item_cache, 0, sizeof(struct ITEM_CACHE));
+    free(item_cache);
+  }
+}
+
+/** Gets the latest error message.
+ */
+const char * item_cache_errmsg(const ItemCache *item_cache) {
+  const char *msg = "No Error";
+
+  if (item_cache && item_cache->db) {
+    if (item_cache->version_mismatch) {
+      msg = "Database file's user version does not match classifier version."
+          " Trying running classifier-db-migrate from the classifier-tools package.";
+    } else if (item_cache->token_id_mismatch && item_cache->hash_tokens) {
+      msg = "Item cache numbers its tokens, convert it with --hash-atoms before using hashed tokens.";
+    } else if (item_cache->token_id_mismatch) {
+      msg = "Item cache uses hashed tokens, it must be opened with --hash-tokens.";
+    } else if (item_cache->token_storage_mismatch) {
+      msg = "Item cache keeps its tokens in a segment store, it must be opened with --segment-store.";
+    } else {
+      msg = sqlite3_errmsg(item_cache->db);
+    }
+  }
+
+  return msg;
+}
+
+/** Load the items from the database into an in-memory cache.
+ *
+ * The in memory cache has two structures, the first indexes each
+ * item by their id's which provides fast retrieval via id, and the
+ * second orders ids by time from newest to oldest.
+ *
+ * If the cache has a snapshot that is up to date with the catalog the
+ * items are mapped in from that and only the entries it is missing are
+ * read from the database.
+ */
+int item_cache_load(ItemCache *item_cache) {
+  if (!item_cache) {
+    fatal("item_cache_load got NULL for item_cache");
+    return CLASSIFIER_FAIL;
+  }
+
+  info("item_cache_load from %i days ago", item_cache->load_items_since);
+  time_t start_time = time(NULL);
+
+  pthread_rwlock_wrlock(&item_cache->cache_lock);
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+
+  int rc = CLASSIFIER_OK;
+  int from_snapshot = false;
+  int changes = -1;
+  int max_key = 0;
+
+  if (CLASSIFIER_OK != fetch_catalog_state(item_cache->db, &changes, &max_key)) {
+    rc = CLASSIFIER_FAIL;
+  } else if (item_cache->snapshot_file) {
+    rc = load_snapshot(item_cache, changes, max_key, &from_snapshot);
+  }
+
+  if (from_snapshot) {
+    if (CLASSIFIER_OK == rc) {
+      rc = load_uncached_items(item_cache);
+    }
+  } else if (changes >= 0 && CLASSIFIER_OK == (rc = load_all_items(item_cache))) {
+    rc = load_random_background(item_cache);
+  }
+
+  item_cache->catalog_changes = CLASSIFIER_OK == rc ? changes : -1;
+
+  item_cache->loaded = true;
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+  pthread_rwlock_unlock(&item_cache->cache_lock);
+
+  /* Any old token blobs are rewritten now, whether or not a purger is ever
+   * started, so they don't stay on the slow decode path.
+   */
+  if (CLASSIFIER_OK == rc) {
+    rc = item_cache_migrate_token_blobs(item_cache);
+  }
+  time_t end_time = time(NULL);
+
+  info("loaded %i items in %i seconds", item_cache_cached_size(item_cache), end_time - start_time);
+  return rc;
+}
+
+/** Returns the number of items in the in-memory cache.
+ */
+int item_cache_cached_size(ItemCache *item_cache) {
+  return item_cache->cached_size;
+}
+
+/** Returns true if the item cache has been loaded into memory.
+ */
+int item_cache_loaded(const ItemCache *item_cache) {
+  if (!item_cache) {
+    fatal("Got NULL item_cache in item_cache_loaded");
+    return false;
+  }
+
+  return item_cache->loaded;
+}
+
+/* Records that the item was used, flush_touched_items writes it to the database later. */
+void touch_item(ItemCache *item_cache, const unsigned char * id) {
+	if (item_cache && id) {
+		PWord_t value;
+		pthread_mutex_lock(&item_cache->touched_items_mutex);
+		JSLI(value, item_cache->touched_items, id);
+		pthread_mutex_unlock(&item_cache->touched_items_mutex);
+	}
+}
+
+/** Fetch an item from the cache.
+ *
+ * @param item_cache The ItemCache to get the item from.
+ * @param id The id of the item to get.
+ * @returns The Item with the id matching id. It is the responsibility of the
+ *          caller to free the item.
+ * TODO Handle SQLITE_BUSY in case another process locks the database.
+ */
+Item * item_cache_fetch_item(ItemCache *item_cache, const unsigned char * id, int * free_when_done) {
+  debug("fetching item %s", id);
+  Item *item = NULL;
+  *free_when_done = false;
+
+  if (!item_cache) {
+    fatal("Got NULL item_cache in item_cache_fetch_item");
+    return item;
+  }
+
+  pthread_rwlock_rdlock(&item_cache->cache_lock);
+  item = items_by_id_get(item_cache, id);
+  pthread_rwlock_unlock(&item_cache->cache_lock);
+
+  if (NULL == item) {
+    Reader *reader = acquire_reader(item_cache);
+    *free_when_done = true;
+
+    if (reader) {
+      item = fetch_item_from_catalog(reader, (char *) id);
+
+      if (item && fetch_tokens_for(item_cache, reader, item, NULL) <= 0) {
+        // TODO No tokens for the item, should probably add it to the tokenizer queue
+        free_item(item);
+        item = NULL;
+      }
+
+      release_reader(item_cache, reader);
+    }
+  }
+
+  touch_item(item_cache, id);
+
+  return item;
+}
+
+/** Iterates over each item.
+ *
+ */
+int item_cache_each_item(ItemCache *item_cache, ItemIterator iterator, void *memo) {
+  if (item_cache->loaded) {
+    pthread_rwlock_rdlock(&item_cache->cache_lock);
+    OrderedItemList *current = item_cache->items_in_order;
+
+    while (current) {
+      Item *item = current->item;
+      if (CLASSIFIER_OK != iterator(item, memo)) {
+        break;
+      }
+      current = current->next;
+    }
+
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+  }
+  return 0;
+}
+
+/* Used by qsort to sort candidate items in descending time order.
+ *
+ * Ties are broken on the item's address so duplicate candidates end up next to each other.
+ */
+static int compare_candidate_items(const void *item1_p, const void *item2_p) {
+  const Item *item1 = *((const Item**) item1_p);
+  const Item *item2 = *((const Item**) item2_p);
+
+  if (item1->time != item2->time) {
+    return item1->time < item2->time ? 1 : -1;
+  } else if (item1 != item2) {
+    return item1 < item2 ? -1 : 1;
+  } else {
+    return 0;
+  }
+}
+
+/* Counts the postings in items_by_token for the tokens.
+ *
+ * This is an upper bound on the number of items containing any of the tokens.
+ * Caller must hold a read lock on the cache.
+ */
+static int count_token_postings(ItemCache * item_cache, const int *token_ids, int num_token_ids) {
+  int num_postings = 0;
+  int i;
+
+  for (i = 0; i < num_token_ids; i++) {
+    PWord_t token_items;
+    JLG(token_items, item_cache->items_by_token, token_ids[i]);
+    if (NULL != token_items) {
+      Word_t count;
+      JLC(count, *((Pvoid_t*) token_items), 0, -1);
+      num_postings += count;
+    }
+  }
+
+  return num_postings;
+}
+
+/* Collects the items containing any of the tokens into items in descending time order.
+ *
+ * items must have room for count_token_postings items. Returns the number
+ * of items collected, each of which only appears once.
+ *
+ * Caller must hold a read lock on the cache.
+ */
+static int collect_items_with_tokens(ItemCache * item_cache, const int *token_ids, int num_token_ids, Item **items) {
+  int n = 0;
+  int unique = 0;
+  int i;
+
+  for (i = 0; i < num_token_ids; i++) {
+    PWord_t token_items;
+    JLG(token_items, item_cache->items_by_token, token_ids[i]);
+    if (NULL != token_items) {
+      Word_t item_address = 0;
+      PWord_t item_pointer;
+
+      JLF(item_pointer, *((Pvoid_t*) token_items), item_address);
+      while (NULL != item_pointer) {
+        items[n++] = (Item*) item_address;
+        JLN(item_pointer, *((Pvoid_t*) token_items), item_address);
+      }
+    }
+  }
+
+  qsort(items, n, sizeof(Item*), compare_candidate_items);
+
+  for (i = 0; i < n; i++) {
+    if (i == 0 || items[i] != items[i - 1]) {
+      items[unique++] = items[i];
+    }
+  }
+
+  return unique;
+}
+
+/** Counts the items that contain at least one of the given tokens.
+ *
+ *  This is the number of items item_cache_each_item_with_tokens and
+ *  item_cache_each_item_in_parallel visit for the same tokens, so it
+ *  can be used to report progress through an iteration.
+ */
+int item_cache_count_items_with_tokens(ItemCache *item_cache, const int *token_ids, int num_token_ids) {
+  int num_items = 0;
+
+  if (item_cache->loaded) {
+    pthread_rwlock_rdlock(&item_cache->cache_lock);
+    num_items = count_token_postings(item_cache, token_ids, num_token_ids);
+
+    if (num_items >= item_cache->cached_size) {
+      num_items = item_cache->cached_size;
+    } else if (num_items > 0) {
+      Pvoid_t items = NULL;
+      Word_t count;
+      Word_t freed_bytes;
+      int i;
+
+      for (i = 0; i < num_token_ids; i++) {
+        PWord_t token_items;
+        JLG(token_items, item_cache->items_by_token, token_ids[i]);
+        if (NULL != token_items) {
+          Word_t item_address = 0;
+          PWord_t item_pointer;
+
+          JLF(item_pointer, *((Pvoid_t*) token_items), item_address);
+          while (NULL != item_pointer) {
+            PWord_t seen;
+            JLI(seen, items, item_address);
+            JLN(item_pointer, *((Pvoid_t*) token_items), item_address);
+          }
+        }
+      }
+
+      JLC(count, items, 0, -1);
+      JLFA(freed_bytes, items);
+      num_items = count;
+    }
+
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+  }
+
+  return num_items;
+}
+
+/** Iterates over each item that contains at least one of the given tokens.
+ *
+ *  Items are visited in the same descending time order as item_cache_each_item
+ *  and each item is only visited once, no matter how many of the tokens it contains.
+ *  If token_ids is NULL every item is visited.
+ *
+ *  The candidates come from the items_by_token index. If the tokens are common
+ *  enough that they cover more postings than there are items in the cache, this
+ *  just iterates over every item since that is cheaper than building the
+ *  candidate list and the iterator must cope with non-matching items anyway.
+ *
+ *  If counted is not NULL it is called with the number of items that will be
+ *  visited before the first one is, under the same lock as the iteration, so
+ *  items added in the meantime can't make the count wrong.
+ *
+ *  Returns CLASSIFIER_FAIL if the candidates couldn't be collected.
+ */
+int item_cache_each_item_with_tokens(ItemCache *item_cache, const int *token_ids, int num_token_ids,
+                                     ItemCountCallback counted, ItemIterator iterator, void *memo) {
+  int rc = CLASSIFIER_OK;
+
+  if (!item_cache->loaded) {
+    if (counted) {
+      counted(0, memo);
+    }
+  } else {
+    int num_candidates;
+    int i;
+
+    pthread_rwlock_rdlock(&item_cache->cache_lock);
+    num_candidates = token_ids ? count_token_postings(item_cache, token_ids, num_token_ids) : item_cache->cached_size;
+
+    if (num_candidates >= item_cache->cached_size) {
+      OrderedItemList *current;
+
+      if (counted) {
+        counted(item_cache->cached_size, memo);
+      }
+
+      for (current = item_cache->items_in_order; current; current = current->next) {
+        if (CLASSIFIER_OK != iterator(current->item, memo)) {
+          break;
+        }
+      }
+    } else if (num_candidates > 0) {
+      Item **candidates = malloc(num_candidates * sizeof(Item*));
+
+      if (NULL == candidates) {
+        fatal("Malloc error allocating candidate items");
+        rc = CLASSIFIER_FAIL;
+      } else {
+        num_candidates = collect_items_with_tokens(item_cache, token_ids, num_token_ids, candidates);
+
+        if (counted) {
+          counted(num_candidates, memo);
+        }
+
+        for (i = 0; i < num_candidates; i++) {
+          if (CLASSIFIER_OK != iterator(candidates[i], memo)) {
+            break;
+          }
+        }
+
+        free(candidates);
+      }
+    } else if (counted) {
+      counted(0, memo);
+    }
+
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+  }
+
+  return rc;
+}
+
+/* State shared by the threads of a parallel iteration. */
+typedef struct PARALLEL_ITERATION {
+  Item **items;
+  int num_items;
+  ItemChunkIterator iterator;
+  void *memo;
+
+  /* Guards next_chunk and failed */
+  pthread_mutex_t mutex;
+  /* Index of the first item in the next chunk to be handed out */
+  int next_chunk;
+  int failed;
+} ParallelIteration;
+
+typedef struct PARALLEL_WORKER {
+  ParallelIteration *iteration;
+  int worker;
+} ParallelWorker;
+
+/* Runs chunks of a parallel iteration until there are none left.
+ *
+ * There is no fixed split of the items between workers, each worker takes
+ * the next chunk as soon as it finishes its last one. A worker that gets
+ * cheap chunks just ends up doing more of them, so the workers all finish
+ * at about the same time.
+ */
+static void * parallel_iteration_worker_func(void *memo) {
+  ParallelWorker *worker = (ParallelWorker*) memo;
+  ParallelIteration *iteration = worker->iteration;
+
+  while (true) {
+    int chunk_start;
+    int chunk_size;
+    int failed;
+
+    pthread_mutex_lock(&iteration->mutex);
+    chunk_start = iteration->next_chunk;
+    failed = iteration->failed;
+    if (!failed) {
+      iteration->next_chunk += PARALLEL_CHUNK_SIZE;
+    }
+    pthread_mutex_unlock(&iteration->mutex);
+
+    if (failed || chunk_start >= iteration->num_items) {
+      break;
+    }
+
+    chunk_size = iteration->num_items - chunk_start;
+    if (chunk_size > PARALLEL_CHUNK_SIZE) {
+      chunk_size = PARALLEL_CHUNK_SIZE;
+    }
+
+    if (CLASSIFIER_OK != iteration->iterator((const Item**) iteration->items + chunk_start, chunk_size,
+                                             worker->worker, iteration->memo)) {
+      pthread_mutex_lock(&iteration->mutex);
+      iteration->failed = true;
+      pthread_mutex_unlock(&iteration->mutex);
+    }
+  }
+
+  return NULL;
+}
+
+/** Iterates over chunks of the items using a number of threads.
+ *
+ *  If token_ids is not NULL only the items containing at least one of the tokens
+ *  are visited, as in item_cache_each_item_with_tokens. Items are split into chunks
+ *  of PARALLEL_CHUNK_SIZE in descending time order and each chunk is passed to the
+ *  iterator along with the number, from 0 to num_workers - 1, of the worker running it.
+ *  A worker only runs one chunk at a time so the iterator can keep per-worker state
+ *  without locking.
+ *
+ *  The calling thread is worker 0, so with one worker this doesn't create any threads.
+ *  If the iterator doesn't return CLASSIFIER_OK no more chunks are started.
+ *
+ *  If counted is not NULL it is called with the number of items before any
+ *  chunks are started, as in item_cache_each_item_with_tokens.
+ *
+ *  Returns CLASSIFIER_OK if every chunk was iterated.
+ */
+int item_cache_each_item_in_parallel(ItemCache *item_cache, const int *token_ids, int num_token_ids, int num_workers,
+                                     ItemCountCallback counted, ItemChunkIterator iterator, void *memo) {
+  int rc = CLASSIFIER_OK;
+
+  if (!item_cache->loaded) {
+    if (counted) {
+      counted(0, memo);
+    }
+  } else {
+    ParallelIteration iteration;
+    int num_items;
+    int i;
+
+    pthread_rwlock_rdlock(&item_cache->cache_lock);
+
+    if (token_ids && (num_items = count_token_postings(item_cache, token_ids, num_token_ids)) < item_cache->cached_size) {
+      if (NULL != (iteration.items = malloc((num_items + 1) * sizeof(Item*)))) {
+        num_items = collect_items_with_tokens(item_cache, token_ids, num_token_ids, iteration.items);
+      }
+    } else {
+      num_items = item_cache->cached_size;
+
+      if (NULL != (iteration.items = malloc((num_items + 1) * sizeof(Item*)))) {
+        OrderedItemList *current;
+        num_items = 0;
+
+        for (current = item_cache->items_in_order; current; current = current->next) {
+          iteration.items[num_items++] = current->item;
+        }
+      }
+    }
+
+    if (NULL == iteration.items) {
+      fatal("Malloc error allocating items for parallel iteration");
+      rc = CLASSIFIER_FAIL;
+    } else {
+      if (counted) {
+        counted(num_items, memo);
+      }
+
+      /* No point in having workers that will never get a chunk */
+      int chunks = (num_items + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+      if (num_workers > chunks) {
+        num_workers = chunks;
+      }
+      if (num_workers < 1) {
+        num_workers = 1;
+      }
+
+      ParallelWorker workers[num_workers];
+      pthread_t threads[num_workers];
+      int threads_started = 0;
+
+      iteration.num_items = num_items;
+      iteration.iterator = iterator;
+      iteration.memo = memo;
+      iteration.next_chunk = 0;
+      iteration.failed = false;
+      pthread_mutex_init(&iteration.mutex, NULL);
+
+      for (i = 0; i < num_workers; i++) {
+        workers[i].iteration = &iteration;
+        workers[i].worker = i;
+      }
+
+      /* The items are protected by our read lock for as long as the other workers are running */
+      for (i = 1; i < num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, parallel_iteration_worker_func, &workers[i])) {
+          error("Could not start parallel iteration worker %i, continuing with %i", i, i);
+          break;
+        }
+
+        threads_started++;
+      }
+
+      parallel_iteration_worker_func(&workers[0]);
+
+      for (i = 1; i <= threads_started; i++) {
+        pthread_join(threads[i], NULL);
+      }
+
+      if (iteration.failed) {
+        rc = CLASSIFIER_FAIL;
+      }
+
+      pthread_mutex_destroy(&iteration.mutex);
+      free(iteration.items);
+    }
+
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+  }
+
+  return rc;
+}
+
+/** Gets the RandomBackground pool.
+ *
+ *  This only returns the pool if the item cache has been loaded.
+ *  Otherwise it returns NULL.
+ *
+ *  The items to use in the random background are defined in the random_backgrounds
+ *  table in the database. The pool returned has each of these items added to it.
+ *
+ * @param item_cache The ItemCache to get the random background pool for.
+ * @return The random background pool.
+ */
+const Pool * item_cache_random_background(ItemCache * item_cache)  {
+  const Pool * random_background = NULL;
+  if (item_cache) {
+    if (!item_cache->random_background) {
+      item_cache->random_background = new_pool();
+    }
+
+    random_background = item_cache->random_background;
+  }
+
+  return random_background;
+}
+
+#include <sys/time.h>
+#include <time.h>
+
+static float tdiff(struct timeval from, struct timeval to) {
+  double from_d = from.tv_sec + (from.tv_usec / 1000000.0);
+  double to_d = to.tv_sec + (to.tv_usec / 1000000.0);
+  return to_d - from_d;
+}
+
+/* Tokenizes and atomizes the entry of a write, unless its tokens are already stored.
+ *
+ * If the entry has tokens to save they are left in write->item and
+ * serialized in write->token_data. An atom that can't be tokenized, or
+ * has no features, still gets an empty set of tokens so it counts as
+ * tokenized and isn't tried again every time the tokenizers start.
+ */
+static void tokenize_entry(ItemCache *item_cache, EntryWrite *write) {
+  ItemCacheEntry *entry = write->entry;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  // We don't want to extract features for items we already have.
+  // TODO Handle updates to features for items somehow?
+  int needs_tokens = true;
+  Reader *reader = acquire_reader(item_cache);
+  if (reader) {
+    needs_tokens = entry_needs_tokens(item_cache, reader, entry);
+    release_reader(item_cache, reader);
+  }
+
+  if (needs_tokens && (entry->features || entry->atom)) {
+    Pvoid_t features = entry->features;
+    entry->features = NULL;
+
+    if (NULL == features) {
+      debug("tokenizing entry %s", entry->full_id);
+      if (NULL == (features = atom_tokenize(entry->atom))) {
+        info("Entry %s has no features, saving it without tokens", entry->full_id);
+      }
+    }
+
+    if (NULL != (write->item = create_item(entry->full_id, entry->id, entry->updated))) {
+      struct timeval tokenized;
+      gettimeofday(&tokenized, NULL);
+      debug("tokenized %.7fs", tdiff(start, tokenized));
+
+      PWord_t PValue;
+      uint8_t token[512];
+      token[0] = '\0';
+
+      JSLF(PValue, features, token);
+      while (PValue != NULL) {
+        int atomizedId = item_cache_atomize(item_cache, token);
+        item_add_token(write->item, atomizedId, *PValue);
+        JSLN(PValue, features, token);
+      }
+
+      struct timeval atomized;
+      gettimeofday(&atomized, NULL);
+      debug("atomized %.7fs", tdiff(tokenized, atomized));
+
+      Word_t rc;
+      JSLFA(rc, features);
+
+      if (CLASSIFIER_OK != serialize_tokens(write->item, &write->token_data_size, &write->token_data)) {
+        free_item(write->item);
+        write->item = NULL;
+      }
+    }
+  }
+}
+
+/* Passes the item from a committed write on to the cache updater. */
+static void finish_entry_write(ItemCache *item_cache, EntryWrite *write) {
+  if (write->item && CLASSIFIER_OK == write->rc) {
+    UpdateJob *job = create_add_job(write->item);
+    q_enqueue(item_cache->update_queue, job);
+    debug("Added to update queue");
+  } else if (write->item) {
+    free_item(write->item);
+  }
+
+  free(write->token_data);
+}
+
+/* Tokenizes an entry that has already been stored and saves its tokens. */
+static int tokenize_stored_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+  EntryWrite write = {entry, NULL, NULL, 0, CLASSIFIER_OK, false, NULL, true};
+
+  tokenize_entry(item_cache, &write);
+  if (write.item) {
+    group_commit(item_cache, &write);
+  }
+
+  finish_entry_write(item_cache, &write);
+
+  return write.rc;
+}
+
+/** Adds an entry to the item cache.
+ *
+ * The entry is written to the database along with any other entries being
+ * added at the same time, in a single transaction. This only returns once
+ * that transaction is committed.
+ *
+ * If the tokenizer threads are running the entry is tokenized by one of
+ * them after it is committed. Otherwise, or if they already have
+ * TOKENIZE_QUEUE_LIMIT entries waiting, it is tokenized first and its
+ * tokens are committed with it.
+ *
+ * TODO Add SQLITE_BUSY handling for add_entry
+ */
+// :id, :full_id, :title, :author, :alternate, :self, :spider, :content, :updated, :feed_id, :created_at
+int item_cache_add_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+  int rc = CLASSIFIER_OK;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  if (item_cache && entry) {
+	EntryWrite write = {entry, NULL, NULL, 0, CLASSIFIER_OK, false, NULL, false};
+	int tokenize_later = item_cache->num_tokenizers > 0 && !entry->features &&
+	                     q_size(item_cache->tokenize_queue) < TOKENIZE_QUEUE_LIMIT;
+
+	if (!tokenize_later) {
+		tokenize_entry(item_cache, &write);
+	}
+
+	rc = group_commit(item_cache, &write);
+
+	struct timeval committed;
+	gettimeofday(&committed, NULL);
+	debug("committed %.7fs", tdiff(start, committed));
+
+	if (tokenize_later && CLASSIFIER_OK == rc) {
+		q_enqueue(item_cache->tokenize_queue, copy_entry(entry));
+	}
+
+	finish_entry_write(item_cache, &write);
+  }
+
+  return rc;
+}
+
+/** Removes an entry from the item cache.
+ *
+ * TODO Add SQLITE_BUSY handling to remove_entry.
+ * TODO Queue up job to remove entry from in-memory queues.
+ */
+int item_cache_remove_entry(ItemCache *item_cache, int entry_id) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    int sqlite3_rc;
+    sqlite3_bind_int(item_cache->delete_entry_stmt, 1, entry_id);
+    sqlite3_rc = sqlite3_step(item_cache->delete_entry_stmt);
+    sqlite3_clear_bindings(item_cache->delete_entry_stmt);
+    sqlite3_reset(item_cache->delete_entry_stmt);
+
+    if (SQLITE_DONE != sqlite3_rc) {
+      if (SQLITE_CONSTRAINT == sqlite3_rc) {
+        info("Constraint violated");
+        rc = ITEM_CACHE_ENTRY_PROTECTED;
+      } else {
+        error("Error deleting ItemCache entry %i: %s", entry_id, item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      }
+    } else {
+      sqlite3_bind_int(item_cache->delete_atom_xml_stmt, 1, entry_id);
+      sqlite3_step(item_cache->delete_atom_xml_stmt);
+      sqlite3_reset(item_cache->delete_atom_xml_stmt);
+      sqlite3_bind_int(item_cache->delete_tokens_stmt, 1, entry_id);
+      sqlite3_step(item_cache->delete_tokens_stmt);
+      sqlite3_reset(item_cache->delete_tokens_stmt);
+      if (item_cache->segment_store) {
+        segment_store_delete(item_cache->segment_store, entry_id);
+      }
+      info("Deleted ItemCache entry %i", entry_id);
+    }
+
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+  }
+
+  return rc;
+}
+
+/** Adds an item to the in memory item cache.
+ *
+ * This doesn't touch the database at all.
+ *
+ * NO ONE SHOULD CALL THIS: it is available only for testing!!
+ *
+ */
+int item_cache_add_item(ItemCache *item_cache, Item *item) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache && item) {
+    if (item_get_num_tokens(item) < item_cache->min_tokens) {
+      rc = CLASSIFIER_FAIL;
+    } else {
+      pthread_rwlock_wrlock(&item_cache->cache_lock);
+
+      if (CLASSIFIER_OK == items_index(item_cache, item)) {
+        item_cache->items_in_order = ordered_item_list_insert_in_order(item_cache->items_in_order, item);
+      } else {
+        fatal("Malloc error indexing item");
+        rc = CLASSIFIER_FAIL;
+      }
+
+      pthread_rwlock_unlock(&item_cache->cache_lock);
+    }
+  }
+
+  return rc;
+}
+
+/** Saves the item in the database.
+ *
+ * This save the tokenized representation of an entry in the database.
+ * The item must have an entry in the DB or it will not be saved.
+ *
+ * @param item_cache The item cache to save the item in.
+ * @param item The tokenized item to save in the cache's database.
+ */
+int item_cache_save_item(ItemCache * item_cache, Item *item) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache && item) {
+    debug("Saving item %s", item->id);
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    int entry_key = get_entry_key(item_cache, (char*) item->id);
+
+    if (entry_key <= 0) {
+      rc = CLASSIFIER_FAIL;
+    } else if (!item_cache->hash_tokens && CLASSIFIER_OK != (rc = flush_atoms(item_cache))) {
+      error("Not saving tokens for %s until its atoms are saved", item->id);
+    } else {
+      int size;
+      char *token_data;
+      if (CLASSIFIER_OK == (rc = serialize_tokens(item, &size, &token_data))) {
+        rc = save_tokens(item_cache, entry_key, token_data, size);
+        free(token_data);
+      }
+    }
+
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+  }
+
+  return rc;
+}
+
+int item_cache_purge_old_items(ItemCache *item_cache) {
+  info("Starting purge_old_items");
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    int number_purged = 0;
+    pthread_rwlock_wrlock(&item_cache->cache_lock);
+
+    OrderedItemList *purge_list = ordered_item_list_split(item_cache->items_in_order, get_purge_time(item_cache->load_items_since));
+
+    if (purge_list == item_cache->items_in_order) {
+      item_cache->items_in_order = NULL;
+    }
+
+    while (purge_list) {
+      OrderedItemList *next = purge_list->next;
+      items_by_id_remove(item_cache, purge_list->item);
+      items_by_token_remove(item_cache, purge_list->item);
+      free_item(purge_list->item);
+      free(purge_list);
+      purge_list = next;
+      number_purged++;
+    }
+
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+    info("Purged %i items", number_purged);
+  }
+
+  return rc;
+}
+
+/* Deletes up to PURGE_BATCH_SIZE expired entries from all three databases
+ * in one transaction and gives some of the freed pages back to the file
+ * system.
+ *
+ * Caller must hold the db_access_mutex.
+ *
+ * @returns the number of entries deleted, or -1 if the batch failed.
+ */
+static int purge_entry_batch(ItemCache *item_cache) {
+  static const char *databases[] = {"main", "atom", "token"};
+  int entry_ids[PURGE_BATCH_SIZE];
+  int num_entries = 0;
+  int changes_before, changes_after, max_key;
+  int i;
+
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, "BEGIN", NULL, NULL, NULL)) {
+    error("Could not begin purge transaction: %s", item_cache_errmsg(item_cache));
+    return -1;
+  }
+
+  fetch_catalog_state(item_cache->db, &changes_before, &max_key);
+
+  sqlite3_bind_int(item_cache->fetch_expired_entries_stmt, 1, item_cache->keep_entries_for);
+  sqlite3_bind_int(item_cache->fetch_expired_entries_stmt, 2, item_cache->keep_entries_for);
+  sqlite3_bind_int(item_cache->fetch_expired_entries_stmt, 3, PURGE_BATCH_SIZE);
+  while (num_entries < PURGE_BATCH_SIZE && SQLITE_ROW == sqlite3_step(item_cache->fetch_expired_entries_stmt)) {
+    entry_ids[num_entries++] = sqlite3_column_int(item_cache->fetch_expired_entries_stmt, 0);
+  }
+  sqlite3_clear_bindings(item_cache->fetch_expired_entries_stmt);
+  sqlite3_reset(item_cache->fetch_expired_entries_stmt);
+
+  for (i = 0; i < num_entries; i++) {
+    sqlite3_stmt *statements[] = {item_cache->delete_entry_stmt, item_cache->delete_atom_xml_stmt, item_cache->delete_tokens_stmt};
+    int j;
+
+    for (j = 0; j < 3 && num_entries >= 0; j++) {
+      sqlite3_bind_int(statements[j], 1, entry_ids[i]);
+      if (SQLITE_DONE != sqlite3_step(statements[j])) {
+        /* This includes the random background trigger, which rolls back the whole transaction. */
+        error("Error purging entry %i: %s", entry_ids[i], item_cache_errmsg(item_cache));
+        num_entries = -1;
+      }
+      sqlite3_reset(statements[j]);
+    }
+  }
+
+  if (num_entries >= 0) {
+    fetch_catalog_state(item_cache->db, &changes_after, &max_key);
+  }
+
+  if (num_entries >= 0 && SQLITE_OK != sqlite3_exec(item_cache->db, "COMMIT", NULL, NULL, NULL)) {
+    error("Could not commit purge transaction: %s", item_cache_errmsg(item_cache));
+    num_entries = -1;
+  }
+
+  if (num_entries < 0) {
+    sqlite3_exec(item_cache->db, "ROLLBACK", NULL, NULL, NULL);
+  } else if (num_entries > 0) {
+    /* Purged entries are older than anything in memory, so if the cache matched
+     * the catalog before it still does and its snapshot can stay valid. */
+    if (changes_before >= 0 && changes_before == item_cache->catalog_changes) {
+      item_cache->catalog_changes = changes_after;
+    }
+
+    /* Only drop the stored tokens once the entries are gone for good. */
+    for (i = 0; item_cache->segment_store && i < num_entries; i++) {
+      segment_store_delete(item_cache->segment_store, entry_ids[i]);
+    }
+
+    for (i = 0; i < 3; i++) {
+      char sql[128];
+      snprintf(sql, sizeof(sql), "PRAGMA %s.incremental_vacuum(%i)", databases[i], PURGE_VACUUM_PAGES);
+      sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL);
+    }
+  }
+
+  return num_entries;
+}
+
+/** Purges entries that haven't been updated or used for keep_entries_for
+ *  days from the database, along with their atom xml and tokens.
+ *
+ * Entries in the random background are never purged. The entries are
+ * deleted in small batches and the db_access_mutex is released for a
+ * moment between each one so ingestion can carry on while this runs.
+ */
+int item_cache_purge_old_entries(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache && item_cache->keep_entries_for > 0) {
+    int number_purged = 0;
+    int batch_size;
+
+    info("Purging entries older than %i days from the database", item_cache->keep_entries_for);
+
+    /* Don't purge anything that was used since the last flush. */
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    flush_touched_items(item_cache);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    do {
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      batch_size = purge_entry_batch(item_cache);
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+      if (batch_size < 0) {
+        rc = CLASSIFIER_FAIL;
+      } else {
+        number_purged += batch_size;
+      }
+
+      if (batch_size == PURGE_BATCH_SIZE) {
+        usleep(PURGE_BATCH_PAUSE);
+      }
+    } while (batch_size == PURGE_BATCH_SIZE && !item_cache->shutting_down);
+
+    info("Purged %i entries from the database", number_purged);
+  }
+
+  return rc;
+}
+
+/** Saves the in-memory cache to its snapshot file.
+ *
+ * The snapshot is written to a temporary file and renamed over the
+ * old one, so a crash while saving leaves the previous snapshot in
+ * place. New items only wait while the cache is copied, not while
+ * the copy is written to disk.
+ *
+ * @returns CLASSIFIER_OK if the snapshot was written, otherwise CLASSIFIER_FAIL.
+ */
+int item_cache_save_snapshot(ItemCache * item_cache) {
+  char tmp_path[MAXPATHLEN];
+  int rc = CLASSIFIER_FAIL;
+
+  if (!item_cache || !item_cache->snapshot_file || !item_cache->loaded) {
+    return rc;
+  } else if (sizeof(tmp_path) <= snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", item_cache->snapshot_file)) {
+    error("Snapshot path %s is too long", item_cache->snapshot_file);
+    return rc;
+  }
+
+  time_t start_time = time(NULL);
+  Buffer *snapshot = NULL;
+  FILE *file = NULL;
+  int changes, max_key;
+
+  /* Read before copying so anything changed in between only makes the snapshot look older than it is. */
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  int state = fetch_catalog_state(item_cache->db, &changes, &max_key);
+  changes = item_cache->catalog_changes;
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  if (CLASSIFIER_OK != state) {
+    return rc;
+  }
+
+  pthread_rwlock_rdlock(&item_cache->cache_lock);
+  snapshot = copy_snapshot(item_cache, changes, max_key);
+  pthread_rwlock_unlock(&item_cache->cache_lock);
+
+  if (NULL == snapshot) {
+    error("Could not copy the item cache for its snapshot");
+  } else if (NULL == (file = fopen(tmp_path, "w"))) {
+    error("Could not create item cache snapshot %s: %s", tmp_path, strerror(errno));
+  } else {
+    int written = snapshot->length == fwrite(snapshot->buf, 1, snapshot->length, file);
+
+    if (fclose(file) || !written || rename(tmp_path, item_cache->snapshot_file)) {
+      error("Could not write item cache snapshot %s: %s", item_cache->snapshot_file, strerror(errno));
+      unlink(tmp_path);
+    } else {
+      info("Saved item cache snapshot to %s in %i seconds", item_cache->snapshot_file, time(NULL) - start_time);
+      rc = CLASSIFIER_OK;
+    }
+  }
+
+  free_buffer(snapshot);
+  return rc;
+}
+
+int item_cache_start_purger(ItemCache * item_cache, int purge_interval) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    item_cache->purge_interval = purge_interval;
+    item_cache->purge_thread = malloc(sizeof(pthread_t));
+    if (item_cache->purge_thread == NULL) {
+      fatal("Could not malloc purge_thread");
+      rc = CLASSIFIER_FAIL;
+    } else {
+      if (pthread_create(item_cache->purge_thread,NULL, item_cache_purge_thread_func, item_cache)) {
+        fatal("Could not start purge thread");
+        rc = CLASSIFIER_FAIL;
+      }
+    }
+  }
+
+  return rc;
+}
+
+/** Gets the number of updates to in-memory cache waiting in the update queue. */
+int item_cache_update_queue_size(const ItemCache * item_cache) {
+  int size = -1;
+  if (item_cache) {
+    size = q_size(item_cache->update_queue);
+  }
+  return size;
+}
+
+int item_cache_start_cache_updater(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    if (item_cache->cache_updating_thread) {
+      fatal("Tried to start the updating thread twice");
+      rc = CLASSIFIER_FAIL;
+    } else {
+      item_cache->cache_updating_thread = malloc(sizeof(pthread_t));
+      if (pthread_create(item_cache->cache_updating_thread, NULL, cache_updating_func, item_cache)) {
+        fatal("Error creating item cache updating thread");
+        rc = CLASSIFIER_FAIL;
+      }
+    }
+  }
+
+  return rc;
+}
+
+/* Tokenizes any stored entries that are missing their tokens.
+ *
+ * Entries still waiting for the tokenizers when the cache was closed were
+ * stored without them. This scans for them on its own connection so the
+ * writer isn't held up while it does.
+ */
+static void tokenize_untokenized_entries(ItemCache *item_cache) {
+  char atom_path[MAXPATHLEN];
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_stmt *entry_stmt = NULL;
+  int found = 0;
+
+  if (MAXPATHLEN <= snprintf(atom_path, MAXPATHLEN, "%s/atom.db", item_cache->cache_directory)) {
+    error("Path to atom database too long: %s", item_cache->cache_directory);
+  } else if (CLASSIFIER_OK != open_read_only_database(item_cache, &db)) {
+    error("Could not open a connection to look for untokenized entries");
+  } else if (CLASSIFIER_OK != attach_database(db, atom_path, "atom")) {
+    error("Could not attach %s: %s", atom_path, sqlite3_errmsg(db));
+  } else if (SQLITE_OK != sqlite3_prepare_v2(db, item_cache->segment_store ? FETCH_ENTRY_IDS_SQL : FETCH_UNTOKENIZED_ENTRIES_SQL, -1, &stmt, NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(db, FETCH_STORED_ENTRY_SQL, -1, &entry_stmt, NULL)) {
+    error("Could not prepare untokenized entries query: %s", sqlite3_errmsg(db));
+  } else {
+    /* Only the ids are read for every entry, the atom is only read for the ones without tokens. */
+    while (!item_cache->shutting_down && SQLITE_ROW == sqlite3_step(stmt)) {
+      int id = sqlite3_column_int(stmt, 0);
+
+      if (item_cache->segment_store && segment_store_contains(item_cache->segment_store, id)) {
+        continue;
+      }
+
+      sqlite3_bind_int(entry_stmt, 1, id);
+      if (SQLITE_ROW == sqlite3_step(entry_stmt)) {
+        ItemCacheEntry *entry = create_item_cache_entry((const char*) sqlite3_column_text(entry_stmt, 0),
+                                                        sqlite3_column_int64(entry_stmt, 1), 0,
+                                                        (const char*) sqlite3_column_text(entry_stmt, 2));
+        entry->id = id;
+        tokenize_stored_entry(item_cache, entry);
+        free_entry(entry);
+        found++;
+      }
+      sqlite3_reset(entry_stmt);
+    }
+  }
+
+  if (found) {
+    info("Tokenized %i entries that were stored without tokens", found);
+  }
+
+  sqlite3_finalize(entry_stmt);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+}
+
+static void * tokenizer_thread_func(void *memo) {
+  ItemCache *item_cache = (ItemCache*) memo;
+
+  while (!item_cache->shutting_down) {
+    ItemCacheEntry *entry = q_dequeue_or_wait(item_cache->tokenize_queue, 1);
+
+    if (entry) {
+      tokenize_stored_entry(item_cache, entry);
+      free_entry(entry);
+    }
+  }
+
+  return NULL;
+}
+
+/* The first tokenizer catches up on entries left untokenized before it starts on the queue. */
+static void * first_tokenizer_thread_func(void *memo) {
+  tokenize_untokenized_entries((ItemCache*) memo);
+  return tokenizer_thread_func(memo);
+}
+
+/** Starts the threads that tokenize added entries.
+ *
+ * While these are running item_cache_add_entry returns as soon as an entry
+ * is stored and leaves tokenizing it to them, so how fast entries can be
+ * added isn't limited by how fast each one can be tokenized. Entries left
+ * without tokens when the cache was last closed are tokenized again.
+ *
+ * Does nothing if the cache was created with no tokenizer_threads.
+ */
+int item_cache_start_tokenizers(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    if (item_cache->tokenizers) {
+      fatal("Tried to start the tokenizers twice");
+      rc = CLASSIFIER_FAIL;
+    } else if (item_cache->tokenizer_threads > 0) {
+      item_cache->tokenizers = calloc(item_cache->tokenizer_threads, sizeof(pthread_t));
 
-      OrderedItemList *current = item_cache->items_in_order;
-      while (current) {
-        OrderedItemList *to_free = current;
-        current = current->next;
-        free(to_free);
-      }
+      if (NULL == item_cache->tokenizers) {
+        fatal("Could not malloc tokenizers");
+        rc = CLASSIFIER_FAIL;
+      } else {
+        int i;
+        for (i = 0; i < item_cache->tokenizer_threads; i++) {
+          if (pthread_create(&item_cache->tokenizers[i], NULL, i ? tokenizer_thread_func : first_tokenizer_thread_func, item_cache)) {
+            fatal("Error creating tokenizer thread");
+            rc = CLASSIFIER_FAIL;
+            break;
+          }
+
+          item_cache->num_tokenizers++;
+        }
 
-      if (item_cache->random_background) {
-        free_pool(item_cache->random_background);
+        info("Started %i tokenizer threads", item_cache->num_tokenizers);
       }
     }
+  }
 
-    pthread_mutex_destroy(&item_cache->db_access_mutex);
-    pthread_rwlock_destroy(&item_cache->cache_lock);
-    free_queue(item_cache->update_queue);
+  return rc;
+}
 
-    free(item_cache->cache_directory);
-    memset(item_cache, 0, sizeof(struct ITEM_CACHE));
-    free(item_cache);
+int item_cache_set_update_callback(ItemCache *item_cache, UpdateCallback callback, void *memo) {
+  if (item_cache) {
+    item_cache->update_callback = callback;
+    item_cache->update_callback_memo = memo;
   }
+  return CLASSIFIER_OK;
 }
 
-/** Gets the latest error message.
- */
-const char * item_cache_errmsg(const ItemCache *item_cache) {
-  const char *msg = "No Error";
+/******************************************************************************
+ * Atomization functions.
+ ******************************************************************************/
 
-  if (item_cache && item_cache->db) {
-    if (item_cache->version_mismatch) {
-      msg = "Database file's user version does not match classifier version."
-          " Trying running classifier-db-migrate from the classifier-tools package.";
-    } else {
-      msg = sqlite3_errmsg(item_cache->db);
+/* Queues the string of a hashed token to be written to the tokens table,
+ * unless it is already there or queued.
+ */
+static void keep_token_string(ItemCache * item_cache, int atom, const char * s) {
+  PWord_t known;
+
+  pthread_rwlock_rdlock(&item_cache->atoms_lock);
+  JLG(known, item_cache->known_hashes, atom);
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+  if (NULL == known) {
+    pthread_rwlock_wrlock(&item_cache->atoms_lock);
+    JLI(known, item_cache->known_hashes, atom);
+
+    if (NULL == known) {
+      error("Error malloc'ing known token hash for %s", s);
+    } else if (!*known) {
+      PendingAtom *pending = malloc(sizeof(PendingAtom) + strlen(s) + 1);
+
+      if (NULL == pending || arr_add(item_cache->pending_atoms, pending)) {
+        int judyrc;
+        error("Error malloc'ing pending atom for %s", s);
+        JLD(judyrc, item_cache->known_hashes, atom);
+        free(pending);
+      } else {
+        pending->atom = atom;
+        strcpy(pending->token, s);
+        *known = true;
+      }
     }
-  }
 
-  return msg;
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
+  }
 }
 
-/** Load the items from the database into an in-memory cache.
+/** Converts a string token into it's atomized form.
  *
- * The in memory cache has two structures, the first indexes each
- * item by their id's which provides fast retrieval via id, and the
- * second orders ids by time from newest to oldest.
+ *  If no atom for the string exists this will create one. Atoms are looked up
+ *  in memory and new atoms are written to the database in a batch when the
+ *  next item is saved.
  *
+ *  With hashed token ids the atom is just the token's hash and the tokens
+ *  table is only written to, in the background, if token strings are kept.
+ *
+ *  @return The integer atom for the token or -1 if it failed.
  */
-int item_cache_load(ItemCache *item_cache) {
-  if (!item_cache) {
-    fatal("item_cache_load got NULL for item_cache");
-    return CLASSIFIER_FAIL;
-  }
+int item_cache_atomize(ItemCache * item_cache, const char * s) {
+  int atom = -1;
 
-  info("item_cache_load from %i days ago", item_cache->load_items_since);
-  time_t start_time = time(NULL);
+  if (item_cache && s && item_cache->hash_tokens) {
+    atom = token_hash(s);
 
-  pthread_rwlock_wrlock(&item_cache->cache_lock);
-  pthread_mutex_lock(&item_cache->db_access_mutex);
+    if (item_cache->keep_token_strings) {
+      keep_token_string(item_cache, atom, s);
+    }
+  } else if (item_cache && s) {
+    PWord_t atom_pointer;
 
-  int rc = load_all_items(item_cache);
+    pthread_rwlock_rdlock(&item_cache->atoms_lock);
+    JSLG(atom_pointer, item_cache->atoms, (const uint8_t*) s);
+    if (NULL != atom_pointer) {
+      atom = (int) *atom_pointer;
+    }
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
 
-  if (CLASSIFIER_OK == rc) {
-    rc = load_random_background(item_cache);
-  }
+    if (-1 == atom) {
+      pthread_rwlock_wrlock(&item_cache->atoms_lock);
+      JSLI(atom_pointer, item_cache->atoms, (const uint8_t*) s);
 
-  item_cache->loaded = true;
-  pthread_mutex_unlock(&item_cache->db_access_mutex);
-  pthread_rwlock_unlock(&item_cache->cache_lock);
-  time_t end_time = time(NULL);
+      if (NULL == atom_pointer) {
+        error("Error malloc'ing atom for %s", s);
+      } else if (*atom_pointer) {
+        /* Another thread added it while we waited for the lock */
+        atom = (int) *atom_pointer;
+      } else {
+        PendingAtom *pending = malloc(sizeof(PendingAtom) + strlen(s) + 1);
 
-  info("loaded %i items in %i seconds", item_cache_cached_size(item_cache), end_time - start_time);
-  return rc;
-}
+        if (NULL == pending || arr_add(item_cache->pending_atoms, pending)) {
+          int judyrc;
+          error("Error malloc'ing pending atom for %s", s);
+          JSLD(judyrc, item_cache->atoms, (const uint8_t*) s);
+          free(pending);
+        } else {
+          pending->atom = atom = item_cache->next_atom++;
+          strcpy(pending->token, s);
+          *atom_pointer = atom;
+        }
+      }
 
-/** Returns the number of items in the in-memory cache.
- */
-int item_cache_cached_size(ItemCache *item_cache) {
-  return item_cache->cached_size;
+      pthread_rwlock_unlock(&item_cache->atoms_lock);
+    }
+  }
+
+  return atom;
 }
 
-/** Returns true if the item cache has been loaded into memory.
+/* Looks for the atom in the atoms that haven't been committed yet.
+ *
+ * Returns a copy of its token, or NULL if it isn't there.
  */
-int item_cache_loaded(const ItemCache *item_cache) {
-  if (!item_cache) {
-    fatal("Got NULL item_cache in item_cache_loaded");
-    return false;
+static char * find_uncommitted_atom(ItemCache * item_cache, int atom) {
+  Array *batches[2];
+  char *s = NULL;
+  int i, j;
+
+  pthread_rwlock_rdlock(&item_cache->atoms_lock);
+  batches[0] = item_cache->pending_atoms;
+  batches[1] = item_cache->flushing_atoms;
+
+  for (i = 0; NULL == s && i < 2; i++) {
+    for (j = 0; batches[i] && NULL == s && j < batches[i]->size; j++) {
+      const PendingAtom *pending = batches[i]->elements[j];
+      if (pending->atom == atom) {
+        s = strdup(pending->token);
+      }
+    }
   }
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
 
-  return item_cache->loaded;
-}
-
-void touch_item(ItemCache *item_cache, const unsigned char * id) {
-	if (item_cache && id) {
-		pthread_mutex_lock(&item_cache->db_access_mutex);
-		sqlite3_bind_text(item_cache->touch_item_stmt, 1, id, -1, NULL);
-		sqlite3_step(item_cache->touch_item_stmt);
-		sqlite3_reset(item_cache->touch_item_stmt);
-		pthread_mutex_unlock(&item_cache->db_access_mutex);
-	}
+  return s;
 }
 
-/** Fetch an item from the cache.
- *
- * @param item_cache The ItemCache to get the item from.
- * @param id The id of the item to get.
- * @returns The Item with the id matching id. It is the responsibility of the
- *          caller to free the item.
- * TODO Handle SQLITE_BUSY in case another process locks the database.
- */
-Item * item_cache_fetch_item(ItemCache *item_cache, const unsigned char * id, int * free_when_done) {
-  debug("fetching item %s", id);
-  Item *item = NULL;
-  *free_when_done = false;
+char * item_cache_globalize(ItemCache * item_cache, int atom) {
+  char * s = NULL;
 
-  if (!item_cache) {
-    fatal("Got NULL item_cache in item_cache_fetch_item");
-    return item;
-  }
+  if (item_cache && NULL == (s = find_uncommitted_atom(item_cache, atom))) {
+    Reader *reader = acquire_reader(item_cache);
 
-  pthread_rwlock_rdlock(&item_cache->cache_lock);
-  item = items_by_id_get(item_cache, id);
-  pthread_rwlock_unlock(&item_cache->cache_lock);
+    if (reader) {
+      sqlite3_bind_int(reader->find_token_stmt, 1, atom);
 
-  if (NULL == item) {
-    *free_when_done = true;
-    pthread_mutex_lock(&item_cache->db_access_mutex);
-    item = fetch_item_from_catalog(item_cache, (char *) id);
+      if (SQLITE_ROW == sqlite3_step(reader->find_token_stmt)) {
+        const char *token = (char*) sqlite3_column_text(reader->find_token_stmt, 0);
+        if (token) {
+          s = strdup(token);
+        }
+      }
 
-    if (item && fetch_tokens_for(item_cache, item) <= 0) {
-      // TODO No tokens for the item, should probably add it to the tokenizer queue
-    	free_item(item);
-    	item = NULL;
+      sqlite3_clear_bindings(reader->find_token_stmt);
+      sqlite3_reset(reader->find_token_stmt);
+      release_reader(item_cache, reader);
     }
+  }
 
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
+  return s;
+}
+
+/******************************************************************************
+ * Atom garbage collection functions
+ ******************************************************************************/
+
+/* An atom in the tokens table and how often it is used. */
+typedef struct ATOM_USAGE {
+  int atom;
+  int new_atom;
+  Word_t frequency;
+  char token[];
+} AtomUsage;
+
+/* Used by qsort to put the most used atoms first, then by atom so the order is stable. */
+static int compare_atom_usage(const void *usage1_p, const void *usage2_p) {
+  const AtomUsage *usage1 = *((const AtomUsage**) usage1_p);
+  const AtomUsage *usage2 = *((const AtomUsage**) usage2_p);
+
+  if (usage1->frequency != usage2->frequency) {
+    return usage1->frequency > usage2->frequency ? -1 : 1;
   }
 
-  touch_item(item_cache, id);
+  return usage1->atom - usage2->atom;
+}
 
-  return item;
+static int compare_tokens_by_id(const void *token1_p, const void *token2_p) {
+  return ((const Token*) token1_p)->id - ((const Token*) token2_p)->id;
 }
 
-/** Iterates over each item.
- *
- */
-int item_cache_each_item(ItemCache *item_cache, ItemIterator iterator, void *memo) {
-  if (item_cache->loaded) {
-    pthread_rwlock_rdlock(&item_cache->cache_lock);
-    OrderedItemList *current = item_cache->items_in_order;
+/* Adds the frequency of every atom in a token blob to the JudyL array in memo. */
+static int add_atom_usage(int entry_id, const char *token_data, int size, void *memo) {
+  Pvoid_t *usage = (Pvoid_t*) memo;
+  Item *item = decode_token_blob(token_data, size);
+  int rc = CLASSIFIER_OK;
+  int i;
 
-    while (current) {
-      Item *item = current->item;
-      if (CLASSIFIER_OK != iterator(item, memo)) {
-        break;
-      }
-      current = current->next;
+  for (i = 0; item && i < item->num_tokens; i++) {
+    PWord_t frequency;
+    JLI(frequency, *usage, item->tokens[i].id);
+    if (NULL == frequency) {
+      fatal("Error malloc'ing atom usage");
+      rc = CLASSIFIER_FAIL;
+      break;
     }
-
-    pthread_rwlock_unlock(&item_cache->cache_lock);
+    *frequency += item->tokens[i].frequency;
   }
-  return 0;
+
+  free_item(item);
+  return rc;
 }
 
-/** Gets the RandomBackground pool.
- *
- *  This only returns the pool if the item cache has been loaded.
- *  Otherwise it returns NULL.
+/* Adds up the frequency of every atom over all the token blobs.
  *
- *  The items to use in the random background are defined in the random_backgrounds
- *  table in the database. The pool returned has each of these items added to it.
+ * Caller must hold the db_access_mutex.
  *
- * @param item_cache The ItemCache to get the random background pool for.
- * @return The random background pool.
+ * @param usage A JudyL array keyed by atom to add the frequencies to.
  */
-const Pool * item_cache_random_background(ItemCache * item_cache)  {
-  const Pool * random_background = NULL;
-  if (item_cache) {
-    if (!item_cache->random_background) {
-      item_cache->random_background = new_pool();
-    }
+static int count_atom_usage(ItemCache *item_cache, Pvoid_t *usage) {
+  int rc = CLASSIFIER_OK;
+  sqlite3_stmt *stmt;
 
-    random_background = item_cache->random_background;
+  if (item_cache->segment_store) {
+    return segment_store_each(item_cache->segment_store, add_atom_usage, usage);
+  } else if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_ALL_TOKENS_SQL, -1, &stmt, NULL)) {
+    error("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
   }
 
-  return random_background;
+  while (CLASSIFIER_OK == rc && SQLITE_ROW == sqlite3_step(stmt)) {
+    rc = add_atom_usage(0, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0), usage);
+  }
+
+  sqlite3_finalize(stmt);
+  return rc;
 }
 
-#include <sys/time.h>
-#include <time.h>
+/* Reads every atom in the tokens table along with its frequency from usage. */
+static Array * load_atom_usage(ItemCache *item_cache, Pvoid_t usage) {
+  Array *atoms = create_array(1024);
+  sqlite3_stmt *stmt;
 
-static float tdiff(struct timeval from, struct timeval to) {
-  double from_d = from.tv_sec + (from.tv_usec / 1000000.0);
-  double to_d = to.tv_sec + (to.tv_usec / 1000000.0);
-  return to_d - from_d;
+  if (NULL == atoms) {
+    return NULL;
+  } else if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, LOAD_ATOMS_SQL, -1, &stmt, NULL)) {
+    error("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    free_array(atoms);
+    return NULL;
+  }
+
+  while (atoms && SQLITE_ROW == sqlite3_step(stmt)) {
+    const char *token = (const char*) sqlite3_column_text(stmt, 1);
+    AtomUsage *atom_usage = token ? malloc(sizeof(AtomUsage) + strlen(token) + 1) : NULL;
+    PWord_t frequency;
+
+    if (NULL == token) {
+      continue;
+    } else if (NULL == atom_usage || arr_add(atoms, atom_usage)) {
+      fatal("Error malloc'ing atom usage");
+      free(atom_usage);
+      free_array(atoms);
+      atoms = NULL;
+    } else {
+      atom_usage->atom = sqlite3_column_int(stmt, 0);
+      atom_usage->new_atom = atom_usage->atom;
+      strcpy(atom_usage->token, token);
+      JLG(frequency, usage, atom_usage->atom);
+      atom_usage->frequency = frequency ? *frequency : 0;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  return atoms;
 }
 
-/** Adds an entry to the item cache.
+/* Deletes the atoms that aren't used by any token blob.
  *
- * This immediately stores the item in the database.
- *
- * TODO Add SQLITE_BUSY handling for add_entry
+ * Caller must hold the db_access_mutex and be in a transaction.
  */
-// :id, :full_id, :title, :author, :alternate, :self, :spider, :content, :updated, :feed_id, :created_at
-int item_cache_add_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
+static int delete_unused_atoms(ItemCache *item_cache, const Array *atoms) {
   int rc = CLASSIFIER_OK;
-  struct timeval start;
-  gettimeofday(&start, NULL);
-  if (item_cache && entry) {
-	pthread_mutex_lock(&item_cache->db_access_mutex);
-	int is_new_entry = _is_new_entry(item_cache, entry);
-
-	if (is_new_entry) {
-	  insert_entry(item_cache, entry);
-	} else {
-	  update_entry(item_cache, entry);
-	}
+  sqlite3_stmt *stmt;
+  int i;
 
-	if (save_entry_xml(item_cache, entry)) {
-	  rc = CLASSIFIER_FAIL;
-	}
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, DELETE_ATOM_SQL, -1, &stmt, NULL)) {
+    error("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
 
-	pthread_mutex_unlock(&item_cache->db_access_mutex);
-
-	struct timeval inserted;
-	gettimeofday(&inserted, NULL);
-	debug("insertion: %.7fs", tdiff(start, inserted));
-
-	// We don't want to extract features for items we already have.
-	// TODO Handle updates to features for items somehow?
-
-	if (rc == CLASSIFIER_OK && (is_new_entry || !entry_has_tokens(item_cache, entry))) {
-		debug("tokenizing entry %s", entry->full_id);
-		if (entry->atom) {
-			Pvoid_t features = atom_tokenize(entry->atom);
-			if (features) {
-				Item *item = create_item(entry->full_id, entry->id, entry->updated);
-				item->tokens = NULL;
-
-				struct timeval tokenized;
-				gettimeofday(&tokenized, NULL);
-				debug("tokenized %.7fs", tdiff(inserted, tokenized));
-
-				PWord_t PValue;
-				uint8_t token[512];
-				token[0] = '\0';
-
-				JSLF(PValue, features, token);
-				while (PValue != NULL) {
-					int atomizedId = item_cache_atomize(item_cache, token);
-					item_add_token(item, atomizedId, *PValue);
-					JSLN(PValue, features, token);
-				}
-
-				struct timeval atomized;
-				gettimeofday(&atomized, NULL);
-				debug("atomized %.7fs", tdiff(tokenized, atomized));
-				     
-				Word_t rc;
-				JSLFA(rc, features);
-
-				if (CLASSIFIER_OK == item_cache_save_item(item_cache, item)) {
-					UpdateJob *job = create_add_job(item);
-					q_enqueue(item_cache->update_queue, job);
-					debug("Added to update queue");
-				}
-
-				struct timeval complete;
-				gettimeofday(&complete, NULL);
-				debug("complete %.7fs", tdiff(atomized, complete));
-			}
-		}
-	}
+  for (i = 0; CLASSIFIER_OK == rc && i < atoms->size; i++) {
+    const AtomUsage *atom_usage = atoms->elements[i];
 
+    if (0 == atom_usage->frequency) {
+      sqlite3_bind_int(stmt, 1, atom_usage->atom);
+      if (SQLITE_DONE != sqlite3_step(stmt)) {
+        error("Error deleting atom %i: %s", atom_usage->atom, item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      }
+      sqlite3_reset(stmt);
+    }
   }
 
+  sqlite3_finalize(stmt);
   return rc;
 }
 
-/** Removes an entry from the item cache.
+/* Encodes a token blob in the current format, with its atoms renumbered if
+ * renumbering is not NULL. Atoms renumbered to the same id, which happens
+ * when token hashes collide, are merged.
  *
- * TODO Add SQLITE_BUSY handling to remove_entry.
- * TODO Queue up job to remove entry from in-memory queues.
+ * @returns CLASSIFIER_OK with the new blob in new_token_data, which the caller
+ *          must free, or NULL in new_token_data if the blob couldn't be decoded.
  */
-int item_cache_remove_entry(ItemCache *item_cache, int entry_id) {
+static int encode_token_blob(int entry_id, const char *token_data, int size, Pvoid_t renumbering,
+                             char **new_token_data, int *new_size) {
   int rc = CLASSIFIER_OK;
+  Item *item = decode_token_blob(token_data, size);
+  int i, num_tokens = 0;
 
-  if (item_cache) {
-    pthread_mutex_lock(&item_cache->db_access_mutex);
-    int sqlite3_rc;
-    sqlite3_bind_int(item_cache->delete_entry_stmt, 1, entry_id);
-    sqlite3_rc = sqlite3_step(item_cache->delete_entry_stmt);
-    sqlite3_clear_bindings(item_cache->delete_entry_stmt);
-    sqlite3_reset(item_cache->delete_entry_stmt);
+  *new_token_data = NULL;
 
-    if (SQLITE_DONE != sqlite3_rc) {
-      if (SQLITE_CONSTRAINT == sqlite3_rc) {
-        info("Constraint violated");
-        rc = ITEM_CACHE_ENTRY_PROTECTED;
+  if (NULL == item) {
+    error("Could not decode tokens for entry %i, leaving them alone", entry_id);
+    return rc;
+  }
+
+  if (renumbering) {
+    for (i = 0; i < item->num_tokens; i++) {
+      PWord_t new_atom;
+      JLG(new_atom, renumbering, item->tokens[i].id);
+      if (new_atom) {
+        item->tokens[num_tokens].id = (int) *new_atom;
+        item->tokens[num_tokens].frequency = item->tokens[i].frequency;
+        num_tokens++;
+      }
+    }
+
+    qsort(item->tokens, num_tokens, sizeof(Token), compare_tokens_by_id);
+
+    for (i = 1, item->num_tokens = num_tokens ? 1 : 0; i < num_tokens; i++) {
+      Token *last = &item->tokens[item->num_tokens - 1];
+
+      if (last->id == item->tokens[i].id) {
+        last->frequency = last->frequency + item->tokens[i].frequency > SHRT_MAX ?
+                            SHRT_MAX : last->frequency + item->tokens[i].frequency;
       } else {
-        error("Error deleting ItemCache entry %i: %s", entry_id, item_cache_errmsg(item_cache));
-        rc = CLASSIFIER_FAIL;
+        item->tokens[item->num_tokens++] = item->tokens[i];
       }
-    } else {
-      sqlite3_bind_int(item_cache->delete_atom_xml_stmt, 1, entry_id);
-      sqlite3_step(item_cache->delete_atom_xml_stmt);
-      sqlite3_reset(item_cache->delete_atom_xml_stmt);
-      sqlite3_bind_int(item_cache->delete_tokens_stmt, 1, entry_id);
-      sqlite3_step(item_cache->delete_tokens_stmt);
-      sqlite3_reset(item_cache->delete_tokens_stmt);
-      info("Deleted ItemCache entry %i", entry_id);
     }
+  }
+
+  rc = serialize_tokens(item, new_size, new_token_data);
+  free_item(item);
+  return rc;
+}
 
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
+/* Rewrites a token blob in tokens.db in the current format, with its atoms
+ * renumbered if renumbering is not NULL.
+ */
+static int rewrite_token_blob(ItemCache *item_cache, sqlite3_stmt *update_stmt, int entry_id,
+                              const char *token_data, int size, Pvoid_t renumbering) {
+  char *new_token_data;
+  int new_size;
+  int rc = encode_token_blob(entry_id, token_data, size, renumbering, &new_token_data, &new_size);
+
+  if (CLASSIFIER_OK == rc && new_token_data) {
+    sqlite3_bind_blob(update_stmt, 1, new_token_data, new_size, SQLITE_TRANSIENT);
+    sqlite3_bind_int(update_stmt, 2, entry_id);
+    if (SQLITE_DONE != sqlite3_step(update_stmt)) {
+      error("Error rewriting tokens for entry %i: %s", entry_id, item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    }
+    sqlite3_clear_bindings(update_stmt);
+    sqlite3_reset(update_stmt);
   }
 
+  free(new_token_data);
   return rc;
 }
 
-/** Adds an item to the in memory item cache.
+/* Rewrites the token blobs of the next TOKEN_REWRITE_CHUNK_SIZE entries after
+ * *last_entry_id, or just the ones in the legacy format if legacy_only is set.
  *
- * This doesn't touch the database at all.
+ * The blobs are read before any are updated so none change while the
+ * select is still stepping.
  *
- * NO ONE SHOULD CALL THIS: it is available only for testing!!
+ * Caller must hold the db_access_mutex and be in a transaction.
  *
+ * @returns the number of entries read, or -1 on error.
  */
-int item_cache_add_item(ItemCache *item_cache, Item *item) {
+static int rewrite_token_blob_chunk(ItemCache *item_cache, sqlite3_stmt *fetch_stmt, sqlite3_stmt *update_stmt,
+                                    int *last_entry_id, Pvoid_t renumbering, int legacy_only) {
   int rc = CLASSIFIER_OK;
+  int entry_ids[TOKEN_REWRITE_CHUNK_SIZE];
+  Array *blobs = create_array(TOKEN_REWRITE_CHUNK_SIZE);
+  int num_rows = 0;
+  int i;
 
-  if (item_cache && item) {
-    if (item_get_num_tokens(item) < item_cache->min_tokens) {
-      rc = CLASSIFIER_FAIL;
-    } else {
-      pthread_rwlock_wrlock(&item_cache->cache_lock);
+  if (NULL == blobs) {
+    return -1;
+  }
 
-      if (CLASSIFIER_OK == items_by_id_insert(item_cache, item)) {
-        item_cache->items_in_order = ordered_item_list_insert_in_order(item_cache->items_in_order, item);
-      } else {
-        fatal("Malloc error inserting into items_by_id");
-        rc = CLASSIFIER_FAIL;
-      }
+  sqlite3_bind_int(fetch_stmt, 1, *last_entry_id);
+  sqlite3_bind_int(fetch_stmt, 2, TOKEN_REWRITE_CHUNK_SIZE);
+  while (CLASSIFIER_OK == rc && SQLITE_ROW == sqlite3_step(fetch_stmt)) {
+    const char *token_data = sqlite3_column_blob(fetch_stmt, 1);
+    int size = sqlite3_column_bytes(fetch_stmt, 1);
+    int *blob;
 
-      pthread_rwlock_unlock(&item_cache->cache_lock);
+    *last_entry_id = sqlite3_column_int(fetch_stmt, 0);
+    num_rows++;
+
+    if (legacy_only && (NULL == token_data || !is_legacy_token_blob(token_data, size))) {
+      continue;
+    } else if (NULL == (blob = malloc(sizeof(int) + size)) || arr_add(blobs, blob)) {
+      fatal("Error malloc'ing token blob");
+      free(blob);
+      rc = CLASSIFIER_FAIL;
+    } else {
+      blob[0] = size;
+      memcpy(blob + 1, token_data, size);
+      entry_ids[blobs->size - 1] = *last_entry_id;
     }
   }
+  sqlite3_clear_bindings(fetch_stmt);
+  sqlite3_reset(fetch_stmt);
 
-  return rc;
+  for (i = 0; CLASSIFIER_OK == rc && i < blobs->size; i++) {
+    const int *blob = blobs->elements[i];
+    rc = rewrite_token_blob(item_cache, update_stmt, entry_ids[i], (const char*) (blob + 1), blob[0], renumbering);
+  }
+
+  free_array(blobs);
+  return CLASSIFIER_OK == rc ? num_rows : -1;
 }
 
-/** Saves the item in the database.
+/* Gives the used atoms dense ids in order of frequency, or their token's
+ * hash if hash is set, and rewrites the tokens table and every token blob
+ * in tokens.db to use them.
  *
- * This save the tokenized representation of an entry in the database.
- * The item must have an entry in the DB or it will not be saved.
+ * When hashes collide the most used token keeps its string in the tokens
+ * table and the blobs merge the colliding tokens.
  *
- * @param item_cache The item cache to save the item in.
- * @param item The tokenized item to save in the cache's database.
+ * Caller must hold the db_access_mutex and be in a transaction.
+ *
+ * @param renumbering A JudyL array to fill with each atom's new id.
  */
-int item_cache_save_item(ItemCache * item_cache, Item *item) {
+static int renumber_atoms(ItemCache *item_cache, Array *atoms, Pvoid_t *renumbering, int hash) {
   int rc = CLASSIFIER_OK;
+  sqlite3_stmt *insert_stmt = item_cache->insert_atom_stmt;
+  sqlite3_stmt *fetch_stmt = NULL;
+  sqlite3_stmt *update_stmt = NULL;
+  int last_entry_id = 0;
+  int num_rows;
+  int i;
 
-  if (item_cache && item) {
-    debug("Saving item %s", item->id);
-    pthread_mutex_lock(&item_cache->db_access_mutex);
-    int entry_key = get_entry_key(item_cache, (char*) item->id);
+  qsort(atoms->elements, atoms->size, sizeof(AtomUsage*), compare_atom_usage);
 
-    if (entry_key <= 0) {
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, DELETE_ALL_ATOMS_SQL, NULL, NULL, NULL)) {
+    error("Could not clear the tokens table: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else if (hash &&
+             (SQLITE_OK != sqlite3_exec(item_cache->db, CREATE_TOKEN_HASHING_SQL, NULL, NULL, NULL) ||
+              SQLITE_OK != sqlite3_exec(item_cache->db, INSERT_TOKEN_HASHING_SQL, NULL, NULL, NULL) ||
+              SQLITE_OK != sqlite3_prepare_v2(item_cache->db, INSERT_HASHED_ATOM_SQL, -1, &insert_stmt, NULL))) {
+    error("Could not mark the item cache as using hashed token ids: %s", item_cache_errmsg(item_cache));
+    insert_stmt = NULL;
+    rc = CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; CLASSIFIER_OK == rc && i < atoms->size; i++) {
+    AtomUsage *atom_usage = atoms->elements[i];
+    PWord_t new_atom;
+
+    if (0 == atom_usage->frequency) {
+      break;
+    }
+
+    atom_usage->new_atom = hash ? token_hash(atom_usage->token) : i + 1;
+    JLI(new_atom, *renumbering, atom_usage->atom);
+    if (NULL == new_atom) {
+      fatal("Error malloc'ing atom renumbering");
       rc = CLASSIFIER_FAIL;
     } else {
-      int size;
-      char *token_data;
-      if (CLASSIFIER_OK == (rc = serialize_tokens(item, &size, &token_data))) {
-        rc = save_tokens(item_cache, entry_key, token_data, size);
-        free(token_data);
+      *new_atom = atom_usage->new_atom;
+      sqlite3_bind_int(insert_stmt, 1, atom_usage->new_atom);
+      sqlite3_bind_text(insert_stmt, 2, atom_usage->token, -1, NULL);
+      if (SQLITE_DONE != sqlite3_step(insert_stmt)) {
+        error("Error inserting renumbered atom %i: %s", atom_usage->new_atom, item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
       }
+      sqlite3_clear_bindings(insert_stmt);
+      sqlite3_reset(insert_stmt);
     }
+  }
 
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
+  if (insert_stmt != item_cache->insert_atom_stmt) {
+    sqlite3_finalize(insert_stmt);
   }
 
-  return rc;
-}
+  if (CLASSIFIER_OK == rc &&
+      (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_TOKENS_AFTER_SQL, -1, &fetch_stmt, NULL) ||
+       SQLITE_OK != sqlite3_prepare_v2(item_cache->db, UPDATE_ENTRY_TOKENS, -1, &update_stmt, NULL))) {
+    error("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
 
-int item_cache_purge_old_items(ItemCache *item_cache) {
-  info("Starting purge_old_items");
-  int rc = CLASSIFIER_OK;
+  while (CLASSIFIER_OK == rc) {
+    num_rows = rewrite_token_blob_chunk(item_cache, fetch_stmt, update_stmt, &last_entry_id, *renumbering, 0);
+    if (num_rows < 0) {
+      rc = CLASSIFIER_FAIL;
+    } else if (num_rows < TOKEN_REWRITE_CHUNK_SIZE) {
+      break;
+    }
+  }
 
-  if (item_cache) {
-    int number_purged = 0;
-    pthread_rwlock_wrlock(&item_cache->cache_lock);
+  sqlite3_finalize(fetch_stmt);
+  sqlite3_finalize(update_stmt);
 
-    OrderedItemList *purge_list = ordered_item_list_split(item_cache->items_in_order, get_purge_time(item_cache->load_items_since));
+  return rc;
+}
 
-    if (purge_list == item_cache->items_in_order) {
-      item_cache->items_in_order = NULL;
-    }
+/* The store renumbered token vectors are written to. */
+struct RenumberedStore {
+  SegmentStore *store;
+  Pvoid_t renumbering;
+};
 
-    while (purge_list) {
-      OrderedItemList *next = purge_list->next;
-      items_by_id_remove(item_cache, purge_list->item);
-      free_item(purge_list->item);
-      free(purge_list);
-      purge_list = next;
-      number_purged++;
-    }
+static int write_renumbered_tokens(int entry_id, const char *token_data, int size, void *memo) {
+  struct RenumberedStore *renumbered = (struct RenumberedStore*) memo;
+  char *new_token_data;
+  int new_size;
+  int rc = encode_token_blob(entry_id, token_data, size, renumbered->renumbering, &new_token_data, &new_size);
 
-    pthread_rwlock_unlock(&item_cache->cache_lock);
-    info("Purged %i items", number_purged);
+  if (CLASSIFIER_OK == rc) {
+    rc = new_token_data ? segment_store_put(renumbered->store, entry_id, new_token_data, new_size) :
+                          segment_store_put(renumbered->store, entry_id, token_data, size);
   }
 
+  free(new_token_data);
   return rc;
 }
 
-int item_cache_start_purger(ItemCache * item_cache, int purge_interval) {
+/* Writes every token vector in the segment store with its atoms renumbered
+ * to a new store alongside it, and marks the new store to replace it.
+ *
+ * The old store can't be rewritten in place since the renumbered tokens
+ * table and store have to change together. The mark is part of the
+ * transaction that renumbers the tokens table, so finish_segment_swap only
+ * swaps the new store in if that commits, otherwise it deletes it.
+ *
+ * Caller must hold the db_access_mutex and be in a transaction.
+ */
+static int renumber_stored_tokens(ItemCache *item_cache, Pvoid_t renumbering) {
   int rc = CLASSIFIER_OK;
+  struct RenumberedStore renumbered = {NULL, renumbering};
+  char new_path[MAXPATHLEN];
 
-  if (item_cache) {
-    item_cache->purge_interval = purge_interval;
-    item_cache->purge_thread = malloc(sizeof(pthread_t));
-    if (item_cache->purge_thread == NULL) {
-      fatal("Could not malloc purge_thread");
+  if (CLASSIFIER_OK != segments_path(item_cache, ".new", new_path) || CLASSIFIER_OK != segment_store_destroy(new_path)) {
+    rc = CLASSIFIER_FAIL;
+  } else if (NULL == (renumbered.store = segment_store_open(new_path))) {
+    rc = CLASSIFIER_FAIL;
+  } else {
+    if (CLASSIFIER_OK != (rc = segment_store_each(item_cache->segment_store, write_renumbered_tokens, &renumbered))) {
+      error("Could not write renumbered tokens to %s", new_path);
+    } else if (CLASSIFIER_OK == (rc = segment_store_sync(renumbered.store)) &&
+               (SQLITE_OK != sqlite3_exec(item_cache->db, CREATE_SEGMENT_SWAP_SQL, NULL, NULL, NULL) ||
+                SQLITE_OK != sqlite3_exec(item_cache->db, INSERT_SEGMENT_SWAP_SQL, NULL, NULL, NULL))) {
+      error("Could not mark the renumbered segment store: %s", item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
-    } else {
-      if (pthread_create(item_cache->purge_thread,NULL, item_cache_purge_thread_func, item_cache)) {
-        fatal("Could not start purge thread");
-        rc = CLASSIFIER_FAIL;
-      }
     }
+
+    segment_store_close(renumbered.store);
   }
 
   return rc;
 }
 
-/** Gets the number of updates to in-memory cache waiting in the update queue. */
-int item_cache_update_queue_size(const ItemCache * item_cache) {
-  int size = -1;
-  if (item_cache) {
-    size = q_size(item_cache->update_queue);
+/* Brings the in-memory dictionary into line with the collected atoms.
+ *
+ * Once the atoms have been hashed the cache uses hashed token ids from then on.
+ */
+static void update_atom_dictionary(ItemCache *item_cache, const Array *atoms, int renumbered, int hashed) {
+  Word_t freed_bytes;
+  int i;
+
+  pthread_rwlock_wrlock(&item_cache->atoms_lock);
+
+  if (renumbered) {
+    JSLFA(freed_bytes, item_cache->atoms);
+    item_cache->next_atom = 1;
   }
-  return size;
-}
 
-int item_cache_start_cache_updater(ItemCache * item_cache) {
-  int rc = CLASSIFIER_OK;
+  if (hashed) {
+    item_cache->hash_tokens = true;
+    item_cache->keep_token_strings = true;
+  }
 
-  if (item_cache) {
-    if (item_cache->cache_updating_thread) {
-      fatal("Tried to start the updating thread twice");
-      rc = CLASSIFIER_FAIL;
-    } else {
-      item_cache->cache_updating_thread = malloc(sizeof(pthread_t));
-      if (pthread_create(item_cache->cache_updating_thread, NULL, cache_updating_func, item_cache)) {
-        fatal("Error creating item cache updating thread");
-        rc = CLASSIFIER_FAIL;
+  for (i = 0; i < atoms->size; i++) {
+    const AtomUsage *atom_usage = atoms->elements[i];
+    PWord_t atom_pointer;
+    int judyrc;
+
+    if (item_cache->hash_tokens) {
+      if (0 == atom_usage->frequency && !hashed) {
+        JLD(judyrc, item_cache->known_hashes, atom_usage->atom);
+      } else if (atom_usage->frequency && hashed) {
+        JLI(atom_pointer, item_cache->known_hashes, atom_usage->new_atom);
+        if (atom_pointer) {
+          *atom_pointer = true;
+        }
+      }
+    } else if (0 == atom_usage->frequency) {
+      if (!renumbered) {
+        JSLD(judyrc, item_cache->atoms, (const uint8_t*) atom_usage->token);
+      }
+    } else if (renumbered) {
+      JSLI(atom_pointer, item_cache->atoms, (const uint8_t*) atom_usage->token);
+      if (atom_pointer) {
+        *atom_pointer = atom_usage->new_atom;
+      }
+
+      if (atom_usage->new_atom >= item_cache->next_atom) {
+        item_cache->next_atom = atom_usage->new_atom + 1;
       }
     }
   }
 
-  return rc;
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
 }
 
-int item_cache_set_update_callback(ItemCache *item_cache, UpdateCallback callback, void *memo) {
-  if (item_cache) {
-    item_cache->update_callback = callback;
-    item_cache->update_callback_memo = memo;
+/* Deletes unused atoms and renumbers the rest if renumber is set, giving
+ * them their token's hash as their id if hash is also set.
+ */
+static int collect_atoms(ItemCache *item_cache, int renumber, int hash) {
+  int rc = CLASSIFIER_OK;
+  Pvoid_t usage = NULL;
+  Pvoid_t renumbering = NULL;
+  Array *atoms = NULL;
+  Word_t freed_bytes;
+  Word_t atoms_in_use = 0;
+  int unused_atoms = 0;
+  int i;
+
+  if (!item_cache || item_cache->loaded) {
+    error("Atoms can only be collected from an item cache that hasn't been loaded");
+    return CLASSIFIER_FAIL;
+  } else if (renumber && item_cache->hash_tokens) {
+    error("Hashed token ids can't be renumbered");
+    return CLASSIFIER_FAIL;
   }
-  return CLASSIFIER_OK;
-}
 
-/******************************************************************************
- * Atomization functions.
- ******************************************************************************/
+  pthread_mutex_lock(&item_cache->db_access_mutex);
 
-/** Converts a string token into it's atomized form.
- *
- *  If no atom for the string exists this will create one.
- *
- *  @return The integer atom for the token or -1 if it failed.
- */
-int item_cache_atomize(ItemCache * item_cache, const char * s) {
-  int atom = -1;
+  if (CLASSIFIER_OK == (rc = flush_atoms(item_cache)) &&
+      CLASSIFIER_OK == (rc = count_atom_usage(item_cache, &usage)) &&
+      NULL == (atoms = load_atom_usage(item_cache, usage))) {
+    rc = CLASSIFIER_FAIL;
+  }
 
-  if (item_cache && s) {
-    pthread_mutex_lock(&item_cache->db_access_mutex);
+  for (i = 0; CLASSIFIER_OK == rc && i < atoms->size; i++) {
+    if (0 == ((AtomUsage*) atoms->elements[i])->frequency) {
+      unused_atoms++;
+    }
+  }
+
+  if (CLASSIFIER_OK == rc && renumber) {
+    JLC(atoms_in_use, usage, 0, -1);
+    if (atoms_in_use != atoms->size - unused_atoms) {
+      /* Renumbering would have to drop these from the tokens so leave everything alone. */
+      error("Entries use %i atoms that aren't in the tokens table, not renumbering", (int) (atoms_in_use - (atoms->size - unused_atoms)));
+      rc = CLASSIFIER_FAIL;
+    }
+  }
 
-    if (SQLITE_OK != sqlite3_bind_text(item_cache->find_atom_stmt, 1, s, -1, NULL)) {
-      error("Error binding %s to parameter 1", s);
+  if (CLASSIFIER_OK == rc && SQLITE_OK != sqlite3_exec(item_cache->db, "BEGIN", NULL, NULL, NULL)) {
+    error("Could not begin atom collection: %s", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else if (CLASSIFIER_OK == rc) {
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, DROP_STALE_ATOM_TRIGGER_SQL, NULL, NULL, NULL)) {
+      error("Could not drop stale tokens trigger: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else if (renumber) {
+      if (CLASSIFIER_OK == (rc = renumber_atoms(item_cache, atoms, &renumbering, hash)) && item_cache->segment_store) {
+        rc = renumber_stored_tokens(item_cache, renumbering);
+      }
     } else {
+      rc = delete_unused_atoms(item_cache, atoms);
+    }
 
-      if (SQLITE_ROW == sqlite3_step(item_cache->find_atom_stmt)) {
-        atom = sqlite3_column_int(item_cache->find_atom_stmt, 0);
-      } else {
-        if (SQLITE_OK != sqlite3_bind_text(item_cache->insert_atom_stmt, 1, s, -1, NULL)) {
-          error("Error bind %s to parameter 1", s);
-        } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_stmt)) {
-          error("Error executing atom insertion: %s", item_cache_errmsg(item_cache));
-        } else {
-          atom = sqlite3_last_insert_rowid(item_cache->db);
-        }
+    if (CLASSIFIER_OK == rc && SQLITE_OK != sqlite3_exec(item_cache->db, "COMMIT", NULL, NULL, NULL)) {
+      error("Could not commit atom collection: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    }
 
-        sqlite3_clear_bindings(item_cache->insert_atom_stmt);
-        sqlite3_reset(item_cache->insert_atom_stmt);
-      }
+    if (CLASSIFIER_OK != rc) {
+      sqlite3_exec(item_cache->db, "ROLLBACK", NULL, NULL, NULL);
+    }
+  }
+
+  /* Swaps in the renumbered store if the renumbering committed, otherwise throws it away. */
+  if (renumber && item_cache->segment_store) {
+    segment_store_close(item_cache->segment_store);
+    item_cache->segment_store = NULL;
 
-      sqlite3_clear_bindings(item_cache->find_atom_stmt);
-      sqlite3_reset(item_cache->find_atom_stmt);
+    if (CLASSIFIER_OK != finish_segment_swap(item_cache) || CLASSIFIER_OK != reopen_segment_store(item_cache)) {
+      rc = CLASSIFIER_FAIL;
     }
+  }
 
+  if (CLASSIFIER_OK == rc) {
+    update_atom_dictionary(item_cache, atoms, renumber, hash);
+    info("Deleted %i of %i atoms%s", unused_atoms, atoms->size,
+         hash ? " and hashed the rest" : renumber ? " and renumbered the rest" : "");
 
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
+    if (renumber && item_cache->snapshot_file && unlink(item_cache->snapshot_file) && ENOENT != errno) {
+      error("Could not delete item cache snapshot %s: %s", item_cache->snapshot_file, strerror(errno));
+    }
   }
 
-  return atom;
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  free_array(atoms);
+  JLFA(freed_bytes, usage);
+  JLFA(freed_bytes, renumbering);
+
+  return rc;
 }
 
-char * item_cache_globalize(ItemCache * item_cache, int atom) {
-  char * s = NULL;
+/** Deletes atoms that aren't used by any entry's tokens.
+ *
+ * If renumber is true the remaining atoms are also given dense ids, with
+ * the most frequently used atoms getting the smallest ids, and every
+ * entry's tokens are rewritten to use them. Renumbering makes the item
+ * cache snapshot useless so it is deleted, and any other saved data that
+ * refers to atoms, such as tagger snapshots, must be thrown away too.
+ * Hashed token ids can't be renumbered.
+ *
+ * This must only be run on an item cache that hasn't been loaded, and
+ * nothing else may use the database while it runs.
+ */
+int item_cache_collect_atoms(ItemCache *item_cache, int renumber) {
+  return collect_atoms(item_cache, renumber, false);
+}
 
-  if (item_cache) {
-    pthread_mutex_lock(&item_cache->db_access_mutex);
+/** Converts an item cache that numbers its tokens to hashed token ids.
+ *
+ * This is renumbering with each atom's new id being the hash of its token,
+ * so the same caveats apply, and the cache must be opened with hash_tokens
+ * from then on. Tokens whose hashes collide are merged.
+ */
+int item_cache_hash_atoms(ItemCache *item_cache) {
+  if (item_cache && item_cache->hash_tokens) {
+    error("Item cache already uses hashed token ids");
+    return CLASSIFIER_FAIL;
+  }
+
+  return collect_atoms(item_cache, true, true);
+}
+
+/** Rewrites any token blobs still in the format used before user version 6.
+ *
+ * Old blobs can still be read so this is done in small transactions while
+ * the item cache is in use, pausing between each to let other writers in.
+ * Once every blob has been rewritten tokens.db is marked so later runs
+ * don't need to look at them again. item_cache_load calls this itself.
+ */
+int item_cache_migrate_token_blobs(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+  sqlite3_stmt *fetch_stmt = NULL;
+  sqlite3_stmt *update_stmt = NULL;
+  int last_entry_id = 0;
+  int num_rows = 0;
+
+  if (!item_cache || item_cache->token_blob_version >= TOKEN_BLOB_VERSION) {
+    return rc;
+  }
 
-    sqlite3_bind_int(item_cache->find_token_stmt, 1, atom);
+  info("Migrating token blobs to version %i", TOKEN_BLOB_VERSION);
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_TOKENS_AFTER_SQL, -1, &fetch_stmt, NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2(item_cache->db, UPDATE_ENTRY_TOKENS, -1, &update_stmt, NULL)) {
+    error("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
 
-    if (SQLITE_ROW == sqlite3_step(item_cache->find_token_stmt)) {
-      const char *token = (char*) sqlite3_column_text(item_cache->find_token_stmt, 0);
-      if (token) {
-        s = strdup(token);
+  while (CLASSIFIER_OK == rc && !item_cache->shutting_down) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, "BEGIN", NULL, NULL, NULL)) {
+      error("Could not begin token blob migration: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else if ((num_rows = rewrite_token_blob_chunk(item_cache, fetch_stmt, update_stmt, &last_entry_id, NULL, 1)) < 0 ||
+               SQLITE_OK != sqlite3_exec(item_cache->db, "COMMIT", NULL, NULL, NULL)) {
+      error("Could not migrate token blobs after entry %i: %s", last_entry_id, item_cache_errmsg(item_cache));
+      sqlite3_exec(item_cache->db, "ROLLBACK", NULL, NULL, NULL);
+      rc = CLASSIFIER_FAIL;
+    } else if (num_rows < TOKEN_REWRITE_CHUNK_SIZE) {
+      if (SQLITE_OK != sqlite3_exec(item_cache->db, SET_TOKEN_BLOB_VERSION_SQL, NULL, NULL, NULL)) {
+        error("Could not set the token blob version: %s", item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      } else {
+        item_cache->token_blob_version = TOKEN_BLOB_VERSION;
+        info("Migrated token blobs to version %i", TOKEN_BLOB_VERSION);
       }
     }
-
-    sqlite3_clear_bindings(item_cache->find_token_stmt);
-    sqlite3_reset(item_cache->find_token_stmt);
     pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    if (CLASSIFIER_OK != rc || item_cache->token_blob_version >= TOKEN_BLOB_VERSION) {
+      break;
+    }
+
+    usleep(PURGE_BATCH_PAUSE);
   }
-  return s;
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  sqlite3_finalize(fetch_stmt);
+  sqlite3_finalize(update_stmt);
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  return rc;
 }
 
 /******************************************************************************
@@ -1745,6 +5517,9 @@ Item * create_item(const unsigned char *id, int key, time_t item_time) {
     item->time = item_time;
     item->key = key;
     item->tokens = NULL;
+    item->num_tokens = 0;
+    item->token_capacity = 0;
+    item->slab = NULL;
   } else {
     fatal("Malloc Error allocating item %d", id);
   }
@@ -1804,48 +5579,61 @@ time_t item_get_time(const Item * item) {
 }
 
 int item_get_num_tokens(const Item * item) {
-  Word_t count;
-  JLC(count, item->tokens, 0, -1);
-  return (int) count;
+  return item->num_tokens;
 }
 
 int item_get_total_tokens(const Item * item) {
   return item->total_tokens;
 }
 
+/** Returns the item's tokens as an array sorted by token id.
+ *
+ *  The array has item_get_num_tokens(item) elements and is owned by the item.
+ */
+const Token * item_get_tokens(const Item * item) {
+  return item->tokens;
+}
+
+/* Returns the position of the first token in the item with an id >= token_id. */
+static int item_token_position(const Item * item, int token_id) {
+  int low = 0;
+  int high = item->num_tokens;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (item->tokens[middle].id < token_id) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
 short item_get_token_frequency(const Item * item, int token_id) {
-  short return_frequency;
-  Word_t * frequency;
-  JLG(frequency, item->tokens, token_id);
+  short return_frequency = 0;
+  int position = item_token_position(item, token_id);
 
-  if (NULL == frequency) {
-    return_frequency = 0;
-  } else {
-    return_frequency = *frequency;
+  if (position < item->num_tokens && item->tokens[position].id == token_id) {
+    return_frequency = item->tokens[position].frequency;
   }
 
   return return_frequency;
 }
 
 int item_next_token(const Item * item, int * token_id, short * token_frequency) {
-  int success = true;
-  PWord_t frequency = NULL;
-  Word_t index = (Word_t) *token_id;
+  int success = false;
+  *token_frequency = 0;
 
   if (NULL != item) {
-    if (0 == token_id) {
-      JLF(frequency, item->tokens, index);
-    } else {
-      JLN(frequency, item->tokens, index);
-    }
-  }
+    int position = item_token_position(item, *token_id + 1);
 
-  if (NULL == frequency) {
-    success = false;
-    *token_frequency = 0;
-  } else {
-    *token_id = index;
-    *token_frequency = *frequency;
+    if (position < item->num_tokens) {
+      success = true;
+      *token_id = item->tokens[position].id;
+      *token_frequency = item->tokens[position].frequency;
+    }
   }
 
   return success;
@@ -1854,10 +5642,10 @@ int item_next_token(const Item * item, int * token_id, short * token_frequency)
 void free_item(Item *item) {
   if (NULL != item) {
     free(item->id);
-    int freed_bytes;
-    if (item->tokens) {
-      JLFA(freed_bytes, item->tokens);
-      item->tokens = NULL;
+    if (item->slab) {
+      token_slab_release(item->slab);
+    } else {
+      free(item->tokens);
     }
     free(item);
   }
@@ -1865,18 +5653,35 @@ void free_item(Item *item) {
 
 int item_add_token(Item *item, int id, short token_frequency) {
   int return_code = 0;
-  Word_t token_id;
-  Word_t * token_frequency_p;
+  int position = item->num_tokens;
 
-  item->total_tokens += token_frequency;
-  token_id = (Word_t) id;
+  /* Tokens usually arrive in order so only search when they don't. */
+  if (position > 0 && item->tokens[position - 1].id >= id) {
+    position = item_token_position(item, id);
+  }
 
-  JLI(token_frequency_p, item->tokens, token_id);
-  if (PJERR == token_frequency_p) {
-    error("Could not malloc memory for token array");
+  if (position < item->num_tokens && item->tokens[position].id == id) {
+    /* Two tokens hashed to the same id, count them together like
+     * rewrite_token_blob does when it merges them.
+     */
+    int frequency = item->tokens[position].frequency + token_frequency;
+    if (frequency > SHRT_MAX) {
+      frequency = SHRT_MAX;
+    }
+    token_frequency = frequency - item->tokens[position].frequency;
+    item->tokens[position].frequency = frequency;
+  } else if (item->num_tokens == item->token_capacity &&
+             item_reserve_tokens(item, item->token_capacity ? item->token_capacity * 2 : 16, NULL)) {
     return_code = ERR;
   } else {
-    *token_frequency_p = (int) token_frequency;
+    memmove(&item->tokens[position + 1], &item->tokens[position], (item->num_tokens - position) * sizeof(Token));
+    item->tokens[position].id = id;
+    item->tokens[position].frequency = token_frequency;
+    item->num_tokens++;
+  }
+
+  if (!return_code) {
+    item->total_tokens += token_frequency;
   }
 
   return return_code;
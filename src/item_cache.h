@@ -36,10 +36,46 @@ typedef struct TOKEN {
   short frequency;
 } Token, *Token_p;
 
+/* How hard the item cache works to make sure an added entry survives a crash. */
+typedef enum ITEM_CACHE_DURABILITY {
+  /* Sync the database on every commit, so entries survive power loss. */
+  DURABILITY_FULL,
+  /* Sync only when the write-ahead log is checkpointed, so entries survive a
+   * crash of the classifier but the last few commits can be lost on power loss. */
+  DURABILITY_NORMAL,
+  /* Never sync and leave it to the operating system. */
+  DURABILITY_OFF
+} ItemCacheDurability;
+
 typedef struct ITEM_CACHE_OPTIONS {
   int cache_update_wait_time;
   int load_items_since;
   int min_tokens;
+  /* File to save the in-memory cache to for faster startup, or NULL for none. */
+  const char *snapshot_file;
+  /* Number of threads used to load the items from the database. */
+  int load_threads;
+  /* How durable commits to the database are. */
+  ItemCacheDurability durability;
+  /* Number of days to keep unused entries in the database, or 0 to keep them forever. */
+  int keep_entries_for;
+  /* Keep token vectors in append-only segment files under the cache directory,
+   * read through mmap, instead of in tokens.db. A cache has to be opened this
+   * way once it has been. */
+  int segment_store;
+  /* Number of threads that tokenize entries after they are added, once
+   * item_cache_start_tokenizers is called. 0 tokenizes them as they are added. */
+  int tokenizer_threads;
+  /* Use token_hash of each token as its id instead of numbering tokens in
+   * the tokens table, so adding an entry needs no dictionary lookups. A
+   * cache has to be created this way or converted with item_cache_hash_atoms. */
+  int hash_tokens;
+  /* With hash_tokens, still write each new token to the tokens table in the
+   * background so item_cache_globalize can turn its id back into a string. */
+  int keep_token_strings;
+  /* Maximum number of read-only connections to the database, one for each
+   * thread that reads from it. 0 uses a default of 8. */
+  int max_readers;
 } ItemCacheOptions;
 
 typedef struct ITEM Item;
@@ -48,7 +84,9 @@ typedef struct ITEM_CACHE ItemCache;
 typedef struct ITEM_CACHE_ENTRY ItemCacheEntry;
 
 typedef int (*ItemIterator) (const Item *item, void *memo);
+typedef int (*ItemChunkIterator) (const Item **items, int num_items, int worker, void *memo);
 typedef void (*UpdateCallback) (ItemCache * item_cache, void *memo);
+typedef void (*ItemCountCallback) (int num_items, void *memo);
 
 extern int          item_cache_initialize         (const char *dbfile, char *error);
 extern int          item_cache_create             (ItemCache **is, const char *db_file, const ItemCacheOptions * options);
@@ -58,6 +96,9 @@ extern int          item_cache_cached_size        (ItemCache *item_cache);
 extern Item *       item_cache_fetch_item         (ItemCache *item_cache,  const unsigned char * item_id, int * free_when_done);  
 extern const char * item_cache_errmsg             (const ItemCache *is);
 extern int          item_cache_each_item          (ItemCache *item_cache, ItemIterator iterator, void *memo);
+extern int          item_cache_each_item_with_tokens(ItemCache *item_cache, const int *token_ids, int num_token_ids, ItemCountCallback counted, ItemIterator iterator, void *memo);
+extern int          item_cache_each_item_in_parallel(ItemCache *item_cache, const int *token_ids, int num_token_ids, int num_workers, ItemCountCallback counted, ItemChunkIterator iterator, void *memo);
+extern int          item_cache_count_items_with_tokens(ItemCache *item_cache, const int *token_ids, int num_token_ids);
 extern const Pool * item_cache_random_background  (ItemCache *item_cache);
 extern int          item_cache_add_entry          (ItemCache *item_cache, ItemCacheEntry *entry);
 extern int          item_cache_remove_entry       (ItemCache *item_cache, int entry_id);
@@ -65,11 +106,17 @@ extern int          item_cache_add_item           (ItemCache *item_cache, Item *
 extern int          item_cache_save_item          (ItemCache *item_cache, Item *item);
 extern int          item_cache_start_purger       (ItemCache *item_cache, int purge_interval);
 extern int          item_cache_purge_old_items    (ItemCache *item_cache);
+extern int          item_cache_purge_old_entries  (ItemCache *item_cache);
+extern int          item_cache_save_snapshot      (ItemCache *item_cache);
 extern int          item_cache_start_cache_updater     (ItemCache *item_cache);
+extern int          item_cache_start_tokenizers   (ItemCache *item_cache);
 extern int          item_cache_update_queue_size  (const ItemCache * item_cache);
 extern int          item_cache_set_update_callback(ItemCache *item_cache, UpdateCallback callback, void *memo);
 extern int          item_cache_atomize            (ItemCache *item_cache, const char *s);
 extern char *       item_cache_globalize          (ItemCache *item_cache, int atom);
+extern int          item_cache_collect_atoms      (ItemCache *item_cache, int renumber);
+extern int          item_cache_hash_atoms         (ItemCache *item_cache);
+extern int          item_cache_migrate_token_blobs(ItemCache *item_cache);
 extern void         free_item_cache               (ItemCache *is);
 
 extern ItemCacheEntry * create_item_cache_entry( const char * full_id,
@@ -78,6 +125,7 @@ extern ItemCacheEntry * create_item_cache_entry( const char * full_id,
                                                  const char * atom);
 extern ItemCacheEntry * create_entry_from_atom_xml_document(xmlDocPtr doc, const char * xml_source);
 extern ItemCacheEntry * create_entry_from_atom_xml(const char * xml);
+extern ItemCacheEntry * item_cache_parse_entry(const ItemCache * item_cache, const char * xml, int * well_formed);
 extern int item_cache_entry_id(const ItemCacheEntry *entry);
 extern const char * item_cache_entry_full_id(const ItemCacheEntry *entry);
 extern const char * item_cache_entry_title(const ItemCacheEntry *entry);
@@ -90,6 +138,7 @@ extern Item * create_item_with_tokens_and_time (const unsigned char * id, int to
 extern const unsigned char * item_get_id             (const Item *item);
 extern int    item_get_total_tokens   (const Item *item);
 extern int    item_get_num_tokens     (const Item *item);
+extern const Token * item_get_tokens  (const Item *item);
 extern time_t item_get_time           (const Item *item);
 extern short  item_get_token_frequency(const Item *item, int token_id);
 extern int    item_next_token         (const Item *item, int * token_id, short * token_frequency);
@@ -100,11 +149,15 @@ extern int    item_add_token          (Item *item, int id, short frequency);
 /* Prototypes for pools */
 extern Pool * new_pool               (void);
 extern int    pool_add_item          (Pool *pool, const Item *item);
+extern int    pool_remove_item       (Pool *pool, const Item *item);
+extern int    pool_add_token         (Pool *pool, int token_id, int frequency);
 extern int    pool_add_items         (Pool *pool, const int items[], int size, const ItemCache *is);
 extern int    pool_num_tokens        (const Pool *pool);
 extern int    pool_total_tokens      (const Pool *pool);
 extern int    pool_token_frequency   (const Pool *pool, int token_id);
 extern void   free_pool              (Pool *pool);
 extern int    pool_next_token        (const Pool *pool, Token_p token);
+extern int    pool_token_arrays      (const Pool *pool, int *token_ids, int *frequencies);
+extern unsigned int pool_fingerprint (const Pool *pool);
 
 #endif /*SQLITE_ITEM_SOURCE_H_*/
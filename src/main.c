@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <json/json.h>
 #include "logging.h"
 #include "classification_engine.h"
@@ -49,6 +50,8 @@
 #define DEFAULT_CACHE_UPDATE_WAIT_TIME 60
 #define DEFAULT_LOAD_ITEMS_SINCE 30
 #define DEFAULT_MIN_TOKENS 50
+#define DEFAULT_TAGS_PER_BATCH 50
+#define DEFAULT_TOKENIZER_THREADS 2
 
 #define PID_VAL 512
 #define DB_VAL  513
@@ -58,6 +61,18 @@
 #define MIN_TOKENS_VAL 517
 #define PERFORMANCE_LOG_FILE_VAL 519
 #define TAG_INDEX_VAL 520
+#define TAGS_PER_BATCH_VAL 521
+#define THREADS_PER_JOB_VAL 522
+#define LOAD_THREADS_VAL 523
+#define DURABILITY_VAL 524
+#define KEEP_ENTRIES_FOR_VAL 525
+#define COLLECT_ATOMS_VAL 526
+#define RENUMBER_ATOMS_VAL 527
+#define SEGMENT_STORE_VAL 528
+#define TOKENIZER_THREADS_VAL 529
+#define HASH_TOKENS_VAL 530
+#define NO_TOKEN_STRINGS_VAL 531
+#define HASH_ATOMS_VAL 532
 
 #define SHORT_OPTS "hvdo:t:n:p:a:c:"
 #define USAGE "Usage: classifier [-dvh] [-o LOGFILE] [--db DATABASE_FILE] [--pid PIDFILE]  [--create-db]\n"
@@ -69,7 +84,7 @@ static Credentials item_cache_credentials = {NULL, NULL};
 static Credentials classification_credentials = {NULL, NULL};
 static TaggerCacheOptions tagger_cache_options = {NULL, &classifier_credentials};
 static TaggerCache *tagger_cache;
-static ClassificationEngineOptions ce_options = {1, 0.0, NULL, &classifier_credentials};
+static ClassificationEngineOptions ce_options = {1, 0.0, NULL, &classifier_credentials, DEFAULT_TAGS_PER_BATCH};
 static ClassificationEngine *engine;
 static Httpd *httpd;
 static HttpConfig http_config = {8080, NULL, &item_cache_credentials, &classification_credentials};
@@ -133,6 +148,15 @@ static void printHelp(void) {
   printf("                     Default: 0\n");
   printf("        --performance-log FILE\n");
   printf("                     location of the file in which to write job timings\n\n");
+  printf("        --tags-per-batch N\n");
+  printf("                     number of tags to classify new items for in a single\n");
+  printf("                     pass over the item cache\n");
+  printf("                     Default: %i\n\n", DEFAULT_TAGS_PER_BATCH);
+  printf("        --threads-per-job N\n");
+  printf("                     number of threads used to classify all the items\n");
+  printf("                     for a single tag\n");
+  printf("                     Default: online processors left over after the\n");
+  printf("                     tokenizer threads, split between the workers\n\n");
   printf("        --tag-index URL\n");
   printf("                     URL which provides an index of the tags to classify\n\n");
 
@@ -140,6 +164,16 @@ static void printHelp(void) {
   printf("        --db FILE    location of the item cache database file\n");
   printf("        --create     if provide the classifier with create the database at\n");
   printf("                     --db and exit\n");
+  printf("        --collect-atoms\n");
+  printf("                     delete atoms no entry uses from the database at --db\n");
+  printf("                     and exit. The classifier must not be running\n");
+  printf("        --renumber-atoms\n");
+  printf("                     like --collect-atoms but also renumber the remaining\n");
+  printf("                     atoms by frequency and throw away saved taggers\n");
+  printf("        --hash-atoms\n");
+  printf("                     like --renumber-atoms but give each atom the hash\n");
+  printf("                     of its token, after which the database at --db\n");
+  printf("                     must be used with --hash-tokens\n");
   printf("        --cache-update-wait-time N\n");
   printf("                     number of seconds to wait after a cache update\n");
   printf("                     before spawning classification jobs\n");
@@ -149,7 +183,36 @@ static void printHelp(void) {
   printf("                     Default: %i days\n", DEFAULT_LOAD_ITEMS_SINCE);
   printf("        --min-tokens N\n");
   printf("                     the minimum number of tokens an item requires to be\n");
-  printf("                     classified\n\n");
+  printf("                     classified\n");
+  printf("        --load-threads N\n");
+  printf("                     number of threads used to load the item cache\n");
+  printf("                     Default: number of online processors\n");
+  printf("        --durability full|normal|off\n");
+  printf("                     how hard to work to keep added entries if the\n");
+  printf("                     machine crashes. normal can lose the last few\n");
+  printf("                     entries on power loss, off leaves it to the OS\n");
+  printf("                     Default: full\n");
+  printf("        --keep-entries-for N\n");
+  printf("                     how many days to keep entries that haven't been\n");
+  printf("                     updated or used in the database. Never less than\n");
+  printf("                     --load-items-since. 0 keeps them forever\n");
+  printf("                     Default: 0\n");
+  printf("        --segment-store\n");
+  printf("                     keep token vectors in memory mapped segment files\n");
+  printf("                     instead of tokens.db, which is imported the first\n");
+  printf("                     time it is used. The cache must always be opened\n");
+  printf("                     with it from then on\n");
+  printf("        --tokenizer-threads N\n");
+  printf("                     number of threads that tokenize entries after they\n");
+  printf("                     are stored. 0 tokenizes them before responding\n");
+  printf("                     Default: %i\n", DEFAULT_TOKENIZER_THREADS);
+  printf("        --hash-tokens\n");
+  printf("                     use a hash of each token as its id instead of\n");
+  printf("                     looking it up in the tokens table. The database\n");
+  printf("                     must be empty or converted with --hash-atoms\n");
+  printf("        --no-token-strings\n");
+  printf("                     with --hash-tokens, don't write new tokens to the\n");
+  printf("                     tokens table, so clues can't show them\n\n");
 
   printf(" HTTP Options:\n");
   printf("    -p, --port N     the port to run the HTTP server on\n");
@@ -158,6 +221,57 @@ static void printHelp(void) {
   printf("                     Default: any\n\n");
 }
 
+/* Deletes every saved tagger in directory, since their clues refer to atoms by id. */
+static void remove_tagger_snapshots(const char * directory) {
+  DIR *dir = opendir(directory);
+
+  if (dir) {
+    struct dirent *file;
+    char path[MAXPATHLEN];
+
+    while (NULL != (file = readdir(dir))) {
+      if (file->d_name[0] != '.' && MAXPATHLEN > snprintf(path, MAXPATHLEN, "%s/%s", directory, file->d_name)) {
+        unlink(path);
+      }
+    }
+
+    closedir(dir);
+  }
+}
+
+static int run_atom_collection(const char * db_file, int renumber, int hash) {
+  int rc = EXIT_SUCCESS;
+  static char item_snapshot_file[MAXPATHLEN];
+  char snapshot_directory[MAXPATHLEN];
+
+  if (MAXPATHLEN > snprintf(item_snapshot_file, MAXPATHLEN, "%s/items.snapshot", db_file)) {
+    item_cache_options.snapshot_file = item_snapshot_file;
+  }
+
+  /* The atoms are still numbered until they are hashed. */
+  if (hash) {
+    item_cache_options.hash_tokens = false;
+  }
+
+  if (CLASSIFIER_OK != item_cache_create(&item_cache, db_file, &item_cache_options)) {
+    fprintf(stderr, "Error opening classifier database file at %s: %s\n", db_file, item_cache_errmsg(item_cache));
+    rc = EXIT_FAILURE;
+  } else if (CLASSIFIER_OK != (hash ? item_cache_hash_atoms(item_cache) : item_cache_collect_atoms(item_cache, renumber))) {
+    fprintf(stderr, "Error collecting atoms in %s\n", db_file);
+    rc = EXIT_FAILURE;
+  } else {
+    if (renumber && MAXPATHLEN > snprintf(snapshot_directory, MAXPATHLEN, "%s/taggers", db_file)) {
+      remove_tagger_snapshots(snapshot_directory);
+    }
+
+    fprintf(stderr, "Atoms successfully collected in '%s'\n", db_file);
+  }
+
+  free_item_cache(item_cache);
+  item_cache = NULL;
+  return rc;
+}
+
 volatile sig_atomic_t termination_in_progress = 0;
 
 void termination_handler(int sig) {
@@ -230,6 +344,12 @@ static void _daemonize(const char * pid_file) {
 static int start_classifier(const char * db_file) {
   SET_XML_ERROR_HANDLERS;
 
+  /* The in-memory cache is saved next to the database so it can be mapped back in on restart */
+  static char item_snapshot_file[MAXPATHLEN];
+  if (MAXPATHLEN > snprintf(item_snapshot_file, MAXPATHLEN, "%s/items.snapshot", db_file)) {
+    item_cache_options.snapshot_file = item_snapshot_file;
+  }
+
   if (CLASSIFIER_OK != item_cache_create(&item_cache, db_file, &item_cache_options)) {
     fprintf(stderr, "Error opening classifier database file at %s: %s\n", db_file, item_cache_errmsg(item_cache));
     free_item_cache(item_cache);
@@ -237,8 +357,18 @@ static int start_classifier(const char * db_file) {
   } else {
     item_cache_load(item_cache);
     item_cache_start_cache_updater(item_cache);
+    item_cache_start_tokenizers(item_cache);
     item_cache_start_purger(item_cache, 60 * 60 * 24);
 
+    /* Precomputed taggers are saved next to the item cache so they survive a restart */
+    static char snapshot_directory[MAXPATHLEN];
+    if (MAXPATHLEN > snprintf(snapshot_directory, MAXPATHLEN, "%s/taggers", db_file) &&
+        (0 == mkdir(snapshot_directory, 0755) || EEXIST == errno)) {
+      tagger_cache_options.snapshot_directory = snapshot_directory;
+    } else {
+      error("Could not create tagger snapshot directory %s, taggers will not be saved", snapshot_directory);
+    }
+
     tagger_cache = create_tagger_cache(item_cache, &tagger_cache_options);
     tagger_cache->tag_retriever = &fetch_url;
     tagger_cache->tag_index_retriever = &fetch_url;
@@ -261,8 +391,45 @@ static int start_classifier(const char * db_file) {
   }
 }
 
+/* Fills in the thread counts that weren't given on the command line from
+ * the online processors. Loading the item cache finishes before anything
+ * else starts so it gets all of them. The tokenizers keep running beside
+ * the classification jobs, so they get a few and the worker jobs split the
+ * rest between them instead of each taking every processor.
+ */
+static void default_thread_counts(void) {
+  int processors = sysconf(_SC_NPROCESSORS_ONLN);
+  if (processors < 1) {
+    processors = 1;
+  }
+
+  if (item_cache_options.load_threads < 0) {
+    item_cache_options.load_threads = processors;
+  }
+
+  if (item_cache_options.tokenizer_threads < 0) {
+    item_cache_options.tokenizer_threads = processors < DEFAULT_TOKENIZER_THREADS ? processors : DEFAULT_TOKENIZER_THREADS;
+  }
+
+  if (ce_options.threads_per_job < 0) {
+    int workers = ce_options.worker_threads > 0 ? ce_options.worker_threads : 1;
+    int available = processors - item_cache_options.tokenizer_threads;
+    ce_options.threads_per_job = available / workers > 0 ? available / workers : 1;
+  }
+
+  /* Every job thread and tokenizer can be reading items at once, plus one
+   * shared by the server's connections for globalizing clues. */
+  if (item_cache_options.max_readers <= 0) {
+    int workers = ce_options.worker_threads > 0 ? ce_options.worker_threads : 1;
+    item_cache_options.max_readers = workers * ce_options.threads_per_job + item_cache_options.tokenizer_threads + 1;
+  }
+}
+
 int main(int argc, char **argv) {
   int create_database = false;
+  int collect_atoms = false;
+  int renumber_atoms = false;
+  int hash_atoms = false;
   int daemonize = false;
   char *log_file = DEFAULT_LOG_FILE;
   char *pid_file = DEFAULT_PID_FILE;
@@ -285,14 +452,26 @@ int main(int argc, char **argv) {
       {"pid", required_argument, 0, PID_VAL},
       {"db", required_argument, 0, DB_VAL},
       {"create-db", no_argument, 0, CREATE_DB_VAL},
+      {"collect-atoms", no_argument, 0, COLLECT_ATOMS_VAL},
+      {"renumber-atoms", no_argument, 0, RENUMBER_ATOMS_VAL},
+      {"hash-atoms", no_argument, 0, HASH_ATOMS_VAL},
 
       {"cache-update-wait-time", required_argument, 0, CACHE_UPDATE_WAIT_TIME_VAL},
       {"load-items-since", required_argument, 0, LOAD_ITEMS_SINCE_VAL},
       {"min-tokens", required_argument, 0, MIN_TOKENS_VAL},
+      {"load-threads", required_argument, 0, LOAD_THREADS_VAL},
+      {"durability", required_argument, 0, DURABILITY_VAL},
+      {"keep-entries-for", required_argument, 0, KEEP_ENTRIES_FOR_VAL},
+      {"segment-store", no_argument, 0, SEGMENT_STORE_VAL},
+      {"tokenizer-threads", required_argument, 0, TOKENIZER_THREADS_VAL},
+      {"hash-tokens", no_argument, 0, HASH_TOKENS_VAL},
+      {"no-token-strings", no_argument, 0, NO_TOKEN_STRINGS_VAL},
 
       {"worker-threads", required_argument, 0, 'n'},
       {"positive-threshold", required_argument, 0, 't'},
       {"performance-log", required_argument, 0, PERFORMANCE_LOG_FILE_VAL},
+      {"tags-per-batch", required_argument, 0, TAGS_PER_BATCH_VAL},
+      {"threads-per-job", required_argument, 0, THREADS_PER_JOB_VAL},
 
       {"port", required_argument, 0, 'p'},
       {"allowed_ip", required_argument, 0, 'a'},
@@ -304,6 +483,12 @@ int main(int argc, char **argv) {
       {0, 0, 0, 0}
   };
 
+  /* -1 means not given, see default_thread_counts. */
+  ce_options.threads_per_job = -1;
+  item_cache_options.load_threads = -1;
+  item_cache_options.tokenizer_threads = -1;
+  item_cache_options.keep_token_strings = true;
+
   while (-1 != (opt = getopt_long(argc, argv, SHORT_OPTS, long_options, &longindex))) {
     switch (opt) {
       case 'o':
@@ -318,6 +503,15 @@ int main(int argc, char **argv) {
       case CREATE_DB_VAL:
         create_database = true;
         break;
+      case COLLECT_ATOMS_VAL:
+        collect_atoms = true;
+        break;
+      case RENUMBER_ATOMS_VAL:
+        collect_atoms = renumber_atoms = true;
+        break;
+      case HASH_ATOMS_VAL:
+        collect_atoms = renumber_atoms = hash_atoms = true;
+        break;
       case 'd':
         daemonize = true;
         break;
@@ -332,6 +526,36 @@ int main(int argc, char **argv) {
       case MIN_TOKENS_VAL:
         item_cache_options.min_tokens = strtol(optarg, NULL, 10);
         break;
+      case LOAD_THREADS_VAL:
+        item_cache_options.load_threads = strtol(optarg, NULL, 10);
+        break;
+      case DURABILITY_VAL:
+        if (!strcmp(optarg, "full")) {
+          item_cache_options.durability = DURABILITY_FULL;
+        } else if (!strcmp(optarg, "normal")) {
+          item_cache_options.durability = DURABILITY_NORMAL;
+        } else if (!strcmp(optarg, "off")) {
+          item_cache_options.durability = DURABILITY_OFF;
+        } else {
+          fprintf(stderr, "Unknown durability '%s', expected full, normal or off\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case KEEP_ENTRIES_FOR_VAL:
+        item_cache_options.keep_entries_for = strtol(optarg, NULL, 10);
+        break;
+      case SEGMENT_STORE_VAL:
+        item_cache_options.segment_store = true;
+        break;
+      case TOKENIZER_THREADS_VAL:
+        item_cache_options.tokenizer_threads = strtol(optarg, NULL, 10);
+        break;
+      case HASH_TOKENS_VAL:
+        item_cache_options.hash_tokens = true;
+        break;
+      case NO_TOKEN_STRINGS_VAL:
+        item_cache_options.keep_token_strings = false;
+        break;
 
       /* Classification Engine Options */
       case 'n': /* Number of worker threads */
@@ -343,6 +567,12 @@ int main(int argc, char **argv) {
       case PERFORMANCE_LOG_FILE_VAL:
         ce_options.performance_log = optarg;
         break;
+      case TAGS_PER_BATCH_VAL:
+        ce_options.tags_per_batch = strtol(optarg, NULL, 10);
+        break;
+      case THREADS_PER_JOB_VAL:
+        ce_options.threads_per_job = strtol(optarg, NULL, 10);
+        break;
 
       /* HTTP options */
       case 'p':
@@ -377,6 +607,8 @@ int main(int argc, char **argv) {
     }
   }
 
+  default_thread_counts();
+
   int rc = EXIT_SUCCESS;
 
   if (create_database) {
@@ -387,6 +619,8 @@ int main(int argc, char **argv) {
     } else {
       fprintf(stderr, "Database successfully initialized at '%s'\n", db_file);
     }
+  } else if (collect_atoms) {
+    rc = run_atom_collection(db_file, renumber_atoms, hash_atoms);
   } else {
     if (create_file(log_file)) {
       fprintf(stderr, "Could not create %s: %s\n", log_file, strerror(errno));
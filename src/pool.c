@@ -58,10 +58,13 @@ void free_pool(Pool *pool) {
 /** Not Re-entrant */
 int pool_add_item(Pool *pool, const Item *item) {
   int success = true;
-  int token_id = 0;
-  short frequency = 0;
+  int i;
+  int num_tokens = item_get_num_tokens(item);
+  const Token *tokens = item_get_tokens(item);
   
-  while (item_next_token(item, &token_id, &frequency)) {
+  for (i = 0; i < num_tokens; i++) {
+    int token_id = tokens[i].id;
+    short frequency = tokens[i].frequency;
     PWord_t pool_frequency;
     JLG(pool_frequency, pool->tokens, token_id);
     
@@ -82,6 +85,61 @@ int pool_add_item(Pool *pool, const Item *item) {
     return false;    
 }
 
+/** Adds frequency occurrences of a token to the pool.
+ *
+ *  Not Re-entrant
+ */
+int pool_add_token(Pool *pool, int token_id, int frequency) {
+  PWord_t pool_frequency;
+  JLI(pool_frequency, pool->tokens, token_id);
+  
+  if (PJERR == pool_frequency) {
+    error("Error allocating memory for Judy Array");
+    return false;
+  }
+  
+  *pool_frequency += frequency;
+  pool->total_tokens += frequency;
+  return true;
+}
+
+/** Removes an item that was previously added to the pool.
+ *
+ *  Tokens whose frequency drops to zero are removed from the pool.
+ *
+ *  Not Re-entrant
+ */
+int pool_remove_item(Pool *pool, const Item *item) {
+  int i;
+  int num_tokens = item_get_num_tokens(item);
+  const Token *tokens = item_get_tokens(item);
+  
+  for (i = 0; i < num_tokens; i++) {
+    Word_t token_id = tokens[i].id;
+    PWord_t pool_frequency;
+    JLG(pool_frequency, pool->tokens, token_id);
+    
+    if (NULL != pool_frequency) {
+      int frequency = (int) tokens[i].frequency;
+      
+      if (frequency >= (int) *pool_frequency) {
+        int judyrc;
+        pool->total_tokens -= (int) *pool_frequency;
+        JLD(judyrc, pool->tokens, token_id);
+        if (JERR == judyrc) goto judy_error;
+      } else {
+        *pool_frequency -= frequency;
+        pool->total_tokens -= frequency;
+      }
+    }
+  }
+  
+  return true;
+  judy_error:
+    error("Error removing token from Judy Array");
+    return false;
+}
+
 // /** Not Re-entrant */
 // int pool_add_items(Pool *pool, const int items[], int size, const ItemCache *item_cache) {
 //   int success = true;
@@ -132,6 +190,60 @@ int pool_token_frequency(const Pool *pool, int token_id) {
   return frequency;
 }
 
+/** Copies the pool's tokens into flat arrays in ascending token id order.
+ *
+ *  token_ids and frequencies must both have room for pool_num_tokens(pool) elements.
+ *  Returns the number of tokens copied.
+ */
+int pool_token_arrays(const Pool *pool, int *token_ids, int *frequencies) {
+  int n = 0;
+  
+  if (NULL != pool) {
+    Word_t token_id = 0;
+    PWord_t frequency;
+    
+    JLF(frequency, pool->tokens, token_id);
+    while (NULL != frequency) {
+      token_ids[n] = (int) token_id;
+      frequencies[n] = (int) *frequency;
+      n++;
+      JLN(frequency, pool->tokens, token_id);
+    }
+  }
+  
+  return n;
+}
+
+/** Hashes every token id and frequency in the pool.
+ *
+ *  Two pools with the same fingerprint almost certainly hold the same tokens,
+ *  which lets something computed from a pool be checked against it later
+ *  without keeping a copy of the pool.
+ */
+unsigned int pool_fingerprint(const Pool *pool) {
+  unsigned int hash = 2166136261U;
+  
+  if (NULL != pool) {
+    Word_t token_id = 0;
+    PWord_t frequency;
+    
+    JLF(frequency, pool->tokens, token_id);
+    while (NULL != frequency) {
+      unsigned int values[2] = {(unsigned int) token_id, (unsigned int) *frequency};
+      const unsigned char *bytes = (const unsigned char *) values;
+      int i;
+      
+      for (i = 0; i < sizeof(values); i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+      }
+      
+      JLN(frequency, pool->tokens, token_id);
+    }
+  }
+  
+  return hash;
+}
+
 int pool_next_token(const Pool *pool, Token_p token) {
   int success = true;
   PWord_t frequency = NULL;
@@ -0,0 +1,735 @@
+// General info: http://doc.winnowtag.org/open-source
+// Source code repository: http://github.com/winnowtag
+// Questions and feedback: contact@winnowtag.org
+//
+// Copyright (c) 2007-2011 The Kaphan Foundation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// contact@winnowtag.org
+
+/* Append-only storage for token vectors.
+ *
+ * Records are appended to numbered segment files in a directory, each one
+ * an entry id and a size in network byte order followed by the data. A
+ * record with a size of 0 deletes the entry. Segments are mapped into
+ * memory when they are opened so reads go straight to the page cache
+ * without any copying.
+ *
+ * The index from entry id to the location of its latest record is kept in
+ * memory and rebuilt by replaying the segments in order when the store is
+ * opened. A torn record at the end of a segment, left by a crash part way
+ * through an append, is truncated away.
+ *
+ * Updated and deleted entries leave dead records behind, so each segment
+ * keeps count of how many of its bytes are still live and
+ * segment_store_compact copies the live records out of mostly dead
+ * segments and deletes them.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <Judy.h>
+#include "segment_store.h"
+#include "logging.h"
+#include "misc.h"
+
+#define SEGMENT_FILE_PREFIX "segment-"
+#define SEGMENT_RECORD_HEADER_BYTES 8
+/* Segments are never bigger than this, so offsets fit in SEGMENT_OFFSET_BITS. */
+#define SEGMENT_OFFSET_BITS 26
+#define SEGMENT_MAX_BYTES (1 << SEGMENT_OFFSET_BITS)
+/* Segments with less than this percentage of live bytes are compacted. */
+#define SEGMENT_MIN_LIVE_PERCENT 50
+
+/* A location packs the segment number above the offset of the record in it. */
+#define LOCATION(segment, offset) (((Word_t) (segment) << SEGMENT_OFFSET_BITS) | (Word_t) (offset))
+#define LOCATION_SEGMENT(location) ((int) ((location) >> SEGMENT_OFFSET_BITS))
+#define LOCATION_OFFSET(location) ((size_t) ((location) & (SEGMENT_MAX_BYTES - 1)))
+
+typedef struct SEGMENT {
+  int number;
+  int fd;
+  /* The whole of SEGMENT_MAX_BYTES is mapped so appends never need a remap. */
+  const char *map;
+  /* Bytes of records written to the segment. */
+  size_t size;
+  /* Bytes of the records that are still the latest for their entry. */
+  size_t live_bytes;
+} Segment;
+
+struct SEGMENT_STORE {
+  char *directory;
+
+  /* JudyL array of segment number to Segment. */
+  Pvoid_t segments;
+
+  /* The segment records are appended to, always the highest numbered. */
+  Segment *active;
+
+  /* JudyL array of entry id to the location of its latest record. */
+  Pvoid_t index;
+  int num_entries;
+
+  /* Protects segments and index. Readers hold it while they use a
+   * record's data so a compacted segment isn't unmapped under them.
+   */
+  pthread_rwlock_t lock;
+
+  /* Serializes appends and compaction. The index and segments are only
+   * ever changed while this is held.
+   */
+  pthread_mutex_t append_mutex;
+};
+
+/******************************************************************************
+ * Segment functions
+ ******************************************************************************/
+
+static int segment_path(const SegmentStore *store, int number, char *path) {
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/" SEGMENT_FILE_PREFIX "%06d", store->directory, number)) {
+    error("Segment path too long in %s", store->directory);
+    return CLASSIFIER_FAIL;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+static void close_segment(Segment *segment) {
+  if (segment) {
+    if (segment->map != MAP_FAILED) {
+      munmap((void*) segment->map, SEGMENT_MAX_BYTES);
+    }
+    close(segment->fd);
+    free(segment);
+  }
+}
+
+static Segment * open_segment(const SegmentStore *store, int number, int create) {
+  char path[MAXPATHLEN];
+  Segment *segment;
+  struct stat st;
+
+  if (CLASSIFIER_OK != segment_path(store, number, path)) {
+    return NULL;
+  } else if (NULL == (segment = calloc(1, sizeof(Segment)))) {
+    fatal("Could not allocate segment");
+    return NULL;
+  }
+
+  segment->number = number;
+  segment->map = MAP_FAILED;
+
+  if (-1 == (segment->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644))) {
+    error("Could not open segment %s: %s", path, strerror(errno));
+    free(segment);
+    return NULL;
+  } else if (fstat(segment->fd, &st) || st.st_size > SEGMENT_MAX_BYTES) {
+    error("Segment %s is unreadable or too big", path);
+    close_segment(segment);
+    return NULL;
+  } else if (MAP_FAILED == (segment->map = mmap(NULL, SEGMENT_MAX_BYTES, PROT_READ, MAP_SHARED, segment->fd, 0))) {
+    error("Could not map segment %s: %s", path, strerror(errno));
+    close_segment(segment);
+    return NULL;
+  }
+
+  segment->size = st.st_size;
+  return segment;
+}
+
+static Segment * find_segment(const SegmentStore *store, int number) {
+  PWord_t segment;
+  JLG(segment, store->segments, number);
+  return segment ? (Segment*) *segment : NULL;
+}
+
+static void read_record_header(const Segment *segment, size_t offset, int *entry_id, int *size) {
+  uint32_t header[2];
+  memcpy(header, segment->map + offset, SEGMENT_RECORD_HEADER_BYTES);
+  *entry_id = (int) ntohl(header[0]);
+  *size = (int) ntohl(header[1]);
+}
+
+static size_t record_bytes(const SegmentStore *store, Word_t location) {
+  const Segment *segment = find_segment(store, LOCATION_SEGMENT(location));
+  int entry_id, size;
+
+  read_record_header(segment, LOCATION_OFFSET(location), &entry_id, &size);
+  return SEGMENT_RECORD_HEADER_BYTES + size;
+}
+
+/******************************************************************************
+ * Index functions
+ ******************************************************************************/
+
+/* Points the index at the record at location, or removes the entry if the
+ * record deletes it, and moves the live byte counts to match.
+ *
+ * Caller must hold the write lock, or be opening the store.
+ */
+static int index_record(SegmentStore *store, int entry_id, Word_t location, int size) {
+  PWord_t current;
+  int deleted;
+
+  JLG(current, store->index, entry_id);
+  if (current) {
+    find_segment(store, LOCATION_SEGMENT(*current))->live_bytes -= record_bytes(store, *current);
+  }
+
+  if (0 == size) {
+    JLD(deleted, store->index, entry_id);
+    if (deleted) {
+      store->num_entries--;
+    }
+  } else {
+    if (NULL == current) {
+      JLI(current, store->index, entry_id);
+      if (NULL == current) {
+        fatal("Error malloc'ing segment index");
+        return CLASSIFIER_FAIL;
+      }
+      store->num_entries++;
+    }
+
+    *current = location;
+    find_segment(store, LOCATION_SEGMENT(location))->live_bytes += SEGMENT_RECORD_HEADER_BYTES + size;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+/* Indexes every record in a segment and truncates any torn record at the end. */
+static int replay_segment(SegmentStore *store, Segment *segment) {
+  size_t offset = 0;
+
+  while (offset + SEGMENT_RECORD_HEADER_BYTES <= segment->size) {
+    int entry_id, size;
+    read_record_header(segment, offset, &entry_id, &size);
+
+    if (size < 0 || offset + SEGMENT_RECORD_HEADER_BYTES + size > segment->size) {
+      break;
+    } else if (CLASSIFIER_OK != index_record(store, entry_id, LOCATION(segment->number, offset), size)) {
+      return CLASSIFIER_FAIL;
+    }
+
+    offset += SEGMENT_RECORD_HEADER_BYTES + size;
+  }
+
+  if (offset != segment->size) {
+    info("Truncating torn record at %zu in segment %i", offset, segment->number);
+    if (ftruncate(segment->fd, offset)) {
+      error("Could not truncate segment %i: %s", segment->number, strerror(errno));
+      return CLASSIFIER_FAIL;
+    }
+    segment->size = offset;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+/******************************************************************************
+ * Appending
+ ******************************************************************************/
+
+/* Starts a new active segment once the current one is full.
+ *
+ * The old one is synced first so it never needs looking at again.
+ * Caller must hold the append_mutex.
+ */
+static int roll_segment(SegmentStore *store) {
+  Segment *segment;
+  PWord_t slot;
+
+  if (fdatasync(store->active->fd)) {
+    error("Could not sync segment %i: %s", store->active->number, strerror(errno));
+    return CLASSIFIER_FAIL;
+  } else if (NULL == (segment = open_segment(store, store->active->number + 1, true))) {
+    return CLASSIFIER_FAIL;
+  }
+
+  pthread_rwlock_wrlock(&store->lock);
+  JLI(slot, store->segments, segment->number);
+  if (slot) {
+    *slot = (Word_t) segment;
+    store->active = segment;
+  }
+  pthread_rwlock_unlock(&store->lock);
+
+  if (NULL == slot) {
+    fatal("Error malloc'ing segment list");
+    close_segment(segment);
+    return CLASSIFIER_FAIL;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+/* Appends a record and indexes it.
+ *
+ * Caller must hold the append_mutex.
+ */
+static int append_record(SegmentStore *store, int entry_id, const char *data, int size) {
+  uint32_t header[2] = {htonl(entry_id), htonl(size)};
+  size_t offset;
+  int rc;
+
+  if (size < 0 || SEGMENT_RECORD_HEADER_BYTES + size > SEGMENT_MAX_BYTES) {
+    error("Record for entry %i is too big for a segment (%i bytes)", entry_id, size);
+    return CLASSIFIER_FAIL;
+  } else if (store->active->size + SEGMENT_RECORD_HEADER_BYTES + size > SEGMENT_MAX_BYTES &&
+             CLASSIFIER_OK != roll_segment(store)) {
+    return CLASSIFIER_FAIL;
+  }
+
+  offset = store->active->size;
+  if (SEGMENT_RECORD_HEADER_BYTES != pwrite(store->active->fd, header, SEGMENT_RECORD_HEADER_BYTES, offset) ||
+      size != pwrite(store->active->fd, data, size, offset + SEGMENT_RECORD_HEADER_BYTES)) {
+    error("Could not append to segment %i: %s", store->active->number, strerror(errno));
+    /* Don't leave a partial record for the next append to follow. */
+    if (ftruncate(store->active->fd, offset)) {
+      error("Could not truncate segment %i: %s", store->active->number, strerror(errno));
+    }
+    return CLASSIFIER_FAIL;
+  }
+
+  pthread_rwlock_wrlock(&store->lock);
+  store->active->size += SEGMENT_RECORD_HEADER_BYTES + size;
+  rc = index_record(store, entry_id, LOCATION(store->active->number, offset), size);
+  pthread_rwlock_unlock(&store->lock);
+
+  return rc;
+}
+
+/******************************************************************************
+ * Public API
+ ******************************************************************************/
+
+/** Opens the segment store in directory, creating the directory if needed. */
+SegmentStore * segment_store_open(const char *directory) {
+  SegmentStore *store = calloc(1, sizeof(SegmentStore));
+  DIR *dir = NULL;
+  struct dirent *dirent;
+  PWord_t slot;
+  Word_t number = 0;
+  int rc = CLASSIFIER_OK;
+
+  if (NULL == store || NULL == (store->directory = strdup(directory))) {
+    fatal("Could not allocate segment store");
+    free(store);
+    return NULL;
+  }
+
+  pthread_rwlock_init(&store->lock, NULL);
+  pthread_mutex_init(&store->append_mutex, NULL);
+
+  if (mkdir(directory, 0755) && EEXIST != errno) {
+    error("Could not create segment directory %s: %s", directory, strerror(errno));
+    rc = CLASSIFIER_FAIL;
+  } else if (NULL == (dir = opendir(directory))) {
+    error("Could not open segment directory %s: %s", directory, strerror(errno));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  while (CLASSIFIER_OK == rc && NULL != (dirent = readdir(dir))) {
+    if (!strncmp(dirent->d_name, SEGMENT_FILE_PREFIX, strlen(SEGMENT_FILE_PREFIX))) {
+      Segment *segment = open_segment(store, strtol(dirent->d_name + strlen(SEGMENT_FILE_PREFIX), NULL, 10), false);
+
+      if (NULL == segment) {
+        rc = CLASSIFIER_FAIL;
+      } else {
+        JLI(slot, store->segments, segment->number);
+        if (NULL == slot) {
+          fatal("Error malloc'ing segment list");
+          close_segment(segment);
+          rc = CLASSIFIER_FAIL;
+        } else {
+          *slot = (Word_t) segment;
+        }
+      }
+    }
+  }
+
+  if (dir) {
+    closedir(dir);
+  }
+
+  /* Segments are replayed oldest first so later records win. */
+  JLF(slot, store->segments, number);
+  while (CLASSIFIER_OK == rc && slot) {
+    store->active = (Segment*) *slot;
+    rc = replay_segment(store, store->active);
+    JLN(slot, store->segments, number);
+  }
+
+  if (CLASSIFIER_OK == rc && NULL == store->active) {
+    Segment *segment = open_segment(store, 1, true);
+
+    JLI(slot, store->segments, 1);
+    if (NULL == segment || NULL == slot) {
+      close_segment(segment);
+      rc = CLASSIFIER_FAIL;
+    } else {
+      *slot = (Word_t) segment;
+      store->active = segment;
+    }
+  }
+
+  if (CLASSIFIER_OK != rc) {
+    segment_store_close(store);
+    return NULL;
+  }
+
+  info("Opened segment store %s with %i entries", directory, store->num_entries);
+  return store;
+}
+
+void segment_store_close(SegmentStore *store) {
+  if (store) {
+    PWord_t slot;
+    Word_t number = 0;
+    Word_t freed_bytes;
+
+    JLF(slot, store->segments, number);
+    while (slot) {
+      close_segment((Segment*) *slot);
+      JLN(slot, store->segments, number);
+    }
+
+    JLFA(freed_bytes, store->segments);
+    JLFA(freed_bytes, store->index);
+    pthread_rwlock_destroy(&store->lock);
+    pthread_mutex_destroy(&store->append_mutex);
+    free(store->directory);
+    free(store);
+  }
+}
+
+/** Deletes the segments in directory and the directory itself.
+ *
+ * The store in directory must not be open. A directory that doesn't exist
+ * is already destroyed.
+ */
+int segment_store_destroy(const char *directory) {
+  char path[MAXPATHLEN];
+  struct dirent *dirent;
+  DIR *dir;
+  int rc = CLASSIFIER_OK;
+
+  if (NULL == (dir = opendir(directory))) {
+    if (ENOENT == errno) {
+      return CLASSIFIER_OK;
+    }
+
+    error("Could not open segment directory %s: %s", directory, strerror(errno));
+    return CLASSIFIER_FAIL;
+  }
+
+  while (CLASSIFIER_OK == rc && NULL != (dirent = readdir(dir))) {
+    if (!strncmp(dirent->d_name, SEGMENT_FILE_PREFIX, strlen(SEGMENT_FILE_PREFIX))) {
+      if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/%s", directory, dirent->d_name) || unlink(path)) {
+        error("Could not delete segment %s in %s: %s", dirent->d_name, directory, strerror(errno));
+        rc = CLASSIFIER_FAIL;
+      }
+    }
+  }
+
+  closedir(dir);
+
+  if (CLASSIFIER_OK == rc && rmdir(directory)) {
+    error("Could not delete segment directory %s: %s", directory, strerror(errno));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  return rc;
+}
+
+/** Stores data as the latest record for entry_id. */
+int segment_store_put(SegmentStore *store, int entry_id, const char *data, int size) {
+  int rc;
+
+  if (size <= 0) {
+    error("Refusing to store an empty record for entry %i", entry_id);
+    return CLASSIFIER_FAIL;
+  }
+
+  pthread_mutex_lock(&store->append_mutex);
+  rc = append_record(store, entry_id, data, size);
+  pthread_mutex_unlock(&store->append_mutex);
+
+  return rc;
+}
+
+int segment_store_delete(SegmentStore *store, int entry_id) {
+  int rc = CLASSIFIER_OK;
+
+  pthread_mutex_lock(&store->append_mutex);
+  if (segment_store_contains(store, entry_id)) {
+    rc = append_record(store, entry_id, NULL, 0);
+  }
+  pthread_mutex_unlock(&store->append_mutex);
+
+  return rc;
+}
+
+int segment_store_contains(SegmentStore *store, int entry_id) {
+  PWord_t location;
+
+  pthread_rwlock_rdlock(&store->lock);
+  JLG(location, store->index, entry_id);
+  pthread_rwlock_unlock(&store->lock);
+
+  return NULL != location;
+}
+
+/** Passes the data for entry_id to reader without copying it.
+ *
+ * @returns the return value of reader, or -1 if the store has no data for entry_id.
+ */
+int segment_store_read(SegmentStore *store, int entry_id, SegmentRecordIterator reader, void *memo) {
+  int rc = -1;
+  PWord_t location;
+
+  pthread_rwlock_rdlock(&store->lock);
+  JLG(location, store->index, entry_id);
+  if (location) {
+    const Segment *segment = find_segment(store, LOCATION_SEGMENT(*location));
+    size_t offset = LOCATION_OFFSET(*location);
+    int record_entry_id, size;
+
+    read_record_header(segment, offset, &record_entry_id, &size);
+    rc = reader(entry_id, segment->map + offset + SEGMENT_RECORD_HEADER_BYTES, size, memo);
+  }
+  pthread_rwlock_unlock(&store->lock);
+
+  return rc;
+}
+
+/** Passes every entry's data to iterator in order of entry id.
+ *
+ * Appends wait until the iteration is finished, so iterator must not
+ * change the store. Stops as soon as the iterator fails.
+ */
+int segment_store_each(SegmentStore *store, SegmentRecordIterator iterator, void *memo) {
+  int rc = CLASSIFIER_OK;
+  PWord_t location;
+  Word_t entry_id = 0;
+
+  pthread_rwlock_rdlock(&store->lock);
+  JLF(location, store->index, entry_id);
+  while (CLASSIFIER_OK == rc && location) {
+    const Segment *segment = find_segment(store, LOCATION_SEGMENT(*location));
+    size_t offset = LOCATION_OFFSET(*location);
+    int record_entry_id, size;
+
+    read_record_header(segment, offset, &record_entry_id, &size);
+    rc = iterator(entry_id, segment->map + offset + SEGMENT_RECORD_HEADER_BYTES, size, memo);
+    JLN(location, store->index, entry_id);
+  }
+  pthread_rwlock_unlock(&store->lock);
+
+  return rc;
+}
+
+int segment_store_size(SegmentStore *store) {
+  int size;
+
+  pthread_rwlock_rdlock(&store->lock);
+  size = store->num_entries;
+  pthread_rwlock_unlock(&store->lock);
+
+  return size;
+}
+
+/** Syncs the active segment to disk. Full segments are synced when they fill up. */
+int segment_store_sync(SegmentStore *store) {
+  int rc = CLASSIFIER_OK;
+
+  pthread_mutex_lock(&store->append_mutex);
+  if (fdatasync(store->active->fd)) {
+    error("Could not sync segment %i: %s", store->active->number, strerror(errno));
+    rc = CLASSIFIER_FAIL;
+  }
+  pthread_mutex_unlock(&store->append_mutex);
+
+  return rc;
+}
+
+/* The entry ids with records in the segments a compaction keeps, used to
+ * tell whether a tombstone still hides an older record.
+ *
+ * It is only built when a compacted segment has tombstones, and then only
+ * for the segments older than it.
+ */
+typedef struct OLDER_RECORDS {
+  /* JudyL array used as a set of entry ids. */
+  Pvoid_t ids;
+  /* Segments numbered below this have been added. */
+  Word_t scanned_to;
+} OlderRecords;
+
+static int add_older_records(const SegmentStore *store, OlderRecords *older, int number) {
+  Word_t segment_number = older->scanned_to;
+  PWord_t slot;
+
+  JLF(slot, store->segments, segment_number);
+  while (slot && segment_number < (Word_t) number) {
+    const Segment *segment = (const Segment*) *slot;
+    size_t offset = 0;
+
+    while (offset < segment->size) {
+      PWord_t id_slot;
+      int entry_id, size;
+
+      read_record_header(segment, offset, &entry_id, &size);
+      if (size > 0) {
+        JLI(id_slot, older->ids, entry_id);
+        if (NULL == id_slot) {
+          fatal("Error malloc'ing older record set");
+          return CLASSIFIER_FAIL;
+        }
+      }
+
+      offset += SEGMENT_RECORD_HEADER_BYTES + size;
+    }
+
+    JLN(slot, store->segments, segment_number);
+  }
+
+  if (older->scanned_to < (Word_t) number) {
+    older->scanned_to = number;
+  }
+
+  return CLASSIFIER_OK;
+}
+
+/* Copies the live records in a segment to the active segment and deletes it.
+ *
+ * Tombstones for entries that are still deleted are copied too while an
+ * older segment has a record for the entry, otherwise replaying the
+ * segments would bring the entry back.
+ *
+ * Caller must hold the append_mutex.
+ */
+static int compact_segment(SegmentStore *store, Segment *segment, OlderRecords *older) {
+  char path[MAXPATHLEN];
+  size_t offset = 0;
+  int rc = CLASSIFIER_OK;
+  int deleted;
+
+  while (CLASSIFIER_OK == rc && offset < segment->size) {
+    PWord_t location;
+    PWord_t older_record;
+    int entry_id, size;
+
+    read_record_header(segment, offset, &entry_id, &size);
+    /* Only appends change the index, so it can be read without the lock here. */
+    JLG(location, store->index, entry_id);
+    if (location && *location == LOCATION(segment->number, offset)) {
+      rc = append_record(store, entry_id, segment->map + offset + SEGMENT_RECORD_HEADER_BYTES, size);
+    } else if (NULL == location && 0 == size &&
+               CLASSIFIER_OK == (rc = add_older_records(store, older, segment->number))) {
+      JLG(older_record, older->ids, entry_id);
+      if (older_record) {
+        rc = append_record(store, entry_id, NULL, 0);
+      }
+    }
+
+    offset += SEGMENT_RECORD_HEADER_BYTES + size;
+  }
+
+  /* The copies must be on disk before the originals go. */
+  if (CLASSIFIER_OK != rc || fdatasync(store->active->fd) || CLASSIFIER_OK != segment_path(store, segment->number, path)) {
+    return CLASSIFIER_FAIL;
+  }
+
+  pthread_rwlock_wrlock(&store->lock);
+  JLD(deleted, store->segments, segment->number);
+  pthread_rwlock_unlock(&store->lock);
+
+  close_segment(segment);
+  if (unlink(path)) {
+    error("Could not delete compacted segment %s: %s", path, strerror(errno));
+  }
+
+  return CLASSIFIER_OK;
+}
+
+static int mostly_dead(const Segment *segment) {
+  return segment->size > 0 && segment->live_bytes * 100 < segment->size * SEGMENT_MIN_LIVE_PERCENT;
+}
+
+/** Reclaims the space used by dead records.
+ *
+ * Every segment that is less than SEGMENT_MIN_LIVE_PERCENT live has its
+ * live records copied to the end of the store and is then deleted. If the
+ * active segment is one of them a new one is started first. Segments
+ * started while compacting are left for the next time. Writers wait
+ * for each segment to be compacted but readers carry on until the segment
+ * is unmapped.
+ */
+int segment_store_compact(SegmentStore *store) {
+  int rc = CLASSIFIER_OK;
+  int compacted = 0;
+  OlderRecords older = {NULL, 0};
+  Word_t number = 0;
+  Word_t freed_bytes;
+  PWord_t slot;
+  int first_new;
+
+  pthread_mutex_lock(&store->append_mutex);
+  if (mostly_dead(store->active)) {
+    rc = roll_segment(store);
+  }
+
+  first_new = store->active->number;
+  JLF(slot, store->segments, number);
+  while (CLASSIFIER_OK == rc && slot && number < (Word_t) first_new) {
+    Segment *segment = (Segment*) *slot;
+
+    if (mostly_dead(segment)) {
+      if (CLASSIFIER_OK == (rc = compact_segment(store, segment, &older))) {
+        compacted++;
+      }
+    }
+
+    JLN(slot, store->segments, number);
+  }
+  pthread_mutex_unlock(&store->append_mutex);
+
+  JLFA(freed_bytes, older.ids);
+
+  if (compacted) {
+    info("Compacted %i segments in %s", compacted, store->directory);
+  }
+
+  return rc;
+}
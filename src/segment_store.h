@@ -0,0 +1,49 @@
+// General info: http://doc.winnowtag.org/open-source
+// Source code repository: http://github.com/winnowtag
+// Questions and feedback: contact@winnowtag.org
+//
+// Copyright (c) 2007-2011 The Kaphan Foundation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// contact@winnowtag.org
+
+#ifndef SEGMENT_STORE_H_
+#define SEGMENT_STORE_H_
+
+typedef struct SEGMENT_STORE SegmentStore;
+
+/* Called with a record's data, which points straight into the segment's
+ * mapping and is only valid until the function returns.
+ */
+typedef int (*SegmentRecordIterator) (int entry_id, const char *data, int size, void *memo);
+
+extern SegmentStore * segment_store_open     (const char *directory);
+extern void           segment_store_close    (SegmentStore *store);
+extern int            segment_store_put      (SegmentStore *store, int entry_id, const char *data, int size);
+extern int            segment_store_delete   (SegmentStore *store, int entry_id);
+extern int            segment_store_contains (SegmentStore *store, int entry_id);
+extern int            segment_store_read     (SegmentStore *store, int entry_id, SegmentRecordIterator reader, void *memo);
+extern int            segment_store_each     (SegmentStore *store, SegmentRecordIterator iterator, void *memo);
+extern int            segment_store_size     (SegmentStore *store);
+extern int            segment_store_sync     (SegmentStore *store);
+extern int            segment_store_compact  (SegmentStore *store);
+extern int            segment_store_destroy  (const char *directory);
+
+#endif /* SEGMENT_STORE_H_ */
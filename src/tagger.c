@@ -31,6 +31,12 @@
 
 #include <config.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
@@ -39,6 +45,9 @@
 #include "xml.h"
 #include "logging.h"
 #include "hmac_sign.h"
+#include "classifier.h"
+#include "buffer.h"
+#include "misc.h"
 
 
 /************************************************************************************************
@@ -211,19 +220,53 @@ Tagger * build_tagger(const char * atom, ItemCache * item_cache) {
   return tagger;
 }
 
-static void train_pool(Pool * pool, ItemCache * item_cache, char ** examples, int size) {
-  int i;
+/* Adds an example to the pool and records it in trained, unless it is already trained.
+ *
+ * Returns the item if it was added so the caller can use its tokens, the caller
+ * must free it if *free_when_done is set. Returns NULL if it is missing from the item cache.
+ */
+static Item * train_example(Pool * pool, Pvoid_t * trained, ItemCache * item_cache, const char * example, int * free_when_done) {
+  PWord_t trained_pointer;
+  Item * item = NULL;
   
-  for (i = 0; i < size; i++) {
-    int free_when_done = 0;
-    Item * item = item_cache_fetch_item(item_cache, (unsigned char*) examples[i], &free_when_done);
-    if (item) {
+  *free_when_done = 0;
+  JSLG(trained_pointer, *trained, (const uint8_t*) example);
+  
+  if (NULL == trained_pointer) {
+    if (NULL != (item = item_cache_fetch_item(item_cache, (unsigned char*) example, free_when_done))) {
       pool_add_item(pool, item);
-      if (free_when_done) free_item(item);
+      JSLI(trained_pointer, *trained, (const uint8_t*) example);
+      if (PJERR == trained_pointer) {
+        fatal("Malloc error recording trained example");
+      }
     } else {
-    	printf("Missing: %s\n", examples[i]);
+      debug("Missing: %s", example);
     }
   }
+  
+  return item;
+}
+
+static void train_pool(Pool * pool, Pvoid_t * trained, ItemCache * item_cache, char ** examples, int size) {
+  int i;
+  
+  for (i = 0; i < size; i++) {
+    int free_when_done = 0;
+    Item * item = train_example(pool, trained, item_cache, examples[i], &free_when_done);
+    if (item && free_when_done) free_item(item);
+  }
+}
+
+/* Frees the pools and the record of which examples are in them. */
+static void free_training(Tagger * tagger) {
+  Word_t bytes;
+  
+  if (tagger->positive_pool) free_pool(tagger->positive_pool);
+  if (tagger->negative_pool) free_pool(tagger->negative_pool);
+  JSLFA(bytes, tagger->positive_trained);
+  JSLFA(bytes, tagger->negative_trained);
+  tagger->positive_pool = NULL;
+  tagger->negative_pool = NULL;
 }
 
 static int train(Tagger * tagger, ItemCache * item_cache) {
@@ -231,10 +274,10 @@ static int train(Tagger * tagger, ItemCache * item_cache) {
   tagger->positive_pool = new_pool();
   tagger->negative_pool = new_pool();
 
-  train_pool(tagger->positive_pool, item_cache, 
+  train_pool(tagger->positive_pool, &tagger->positive_trained, item_cache, 
              tagger->positive_examples, 
              tagger->positive_example_count);
-  train_pool(tagger->negative_pool, item_cache, 
+  train_pool(tagger->negative_pool, &tagger->negative_trained, item_cache, 
              tagger->negative_examples, 
              tagger->negative_example_count);
            
@@ -286,17 +329,40 @@ TaggerState train_tagger(Tagger * tagger, ItemCache * item_cache) {
   return state;
 }
 
+/* Computes the clue for a token from the tagger's pools. */
+static double token_probability(const Tagger * tagger, const Pool * random_background, int token_id) {
+  return tagger->probability_function(tagger->positive_pool, tagger->negative_pool, 
+                                      random_background, token_id, tagger->bias);
+}
+
+/* Builds the strong clue filter and candidate tokens once the clues are complete. */
+static void index_clues(Tagger * tagger) {
+  /* The list is complete so build the filter select_clues uses to skip weak clues */
+  index_strong_clues(tagger->clues, MIN_PROB_STRENGTH);
+  
+  if (tagger->candidate_tokens) {
+    free(tagger->candidate_tokens);
+    tagger->candidate_tokens = NULL;
+    tagger->num_candidate_tokens = 0;
+  }
+  
+  if (tagger->candidate_tokens_function) {
+    tagger->candidate_tokens = tagger->candidate_tokens_function(tagger->clues, &tagger->num_candidate_tokens);
+  }
+}
+
 /** Precomputes the tagger's clues.
  *
  *  This function expects a tagger in the TRAINED state.
  *
  *  This will create and fill the clues list with probabilities for all
- *  tokens in all the pools in the tagger.  It uses the tagger's probability
- *  function to generate the probability for each token.
+ *  tokens in all the pools in the tagger.  It uses the tagger's precompute
+ *  function if it has one, otherwise the probability function is called
+ *  to generate the probability for each token.
  *
- *  Once complete the tagger will be in the PRECOMPUTED state, the positive
- *  and negative pools will have been free'd and set to NULL and the tagger
- *  can be used to classify items.
+ *  Once complete the tagger will be in the PRECOMPUTED state and can be used
+ *  to classify items. The positive and negative pools are kept so that
+ *  update_tagger can retrain the next version of the tag from them.
  */
 TaggerState precompute_tagger(Tagger * tagger, const Pool * random_background) {
   TaggerState state = TAGGER_SEQUENCE_ERROR;
@@ -305,36 +371,205 @@ TaggerState precompute_tagger(Tagger * tagger, const Pool * random_background) {
     Token working_token;
     state = tagger->state = TAGGER_PRECOMPUTED;
     tagger->clues = new_clue_list();
+    tagger->random_background = random_background;
         
-    for (working_token.id = 0; pool_next_token(random_background, &working_token); ) {
-      double probability = tagger->probability_function(tagger->positive_pool, tagger->negative_pool, 
-                                                        random_background, working_token.id, tagger->bias);
-      add_clue(tagger->clues, working_token.id, probability);
+    if (tagger->precompute_function) {
+      tagger->precompute_function(tagger->clues, tagger->positive_pool, tagger->negative_pool, random_background, tagger->bias);
+    } else {
+      for (working_token.id = 0; pool_next_token(random_background, &working_token); ) {
+        add_clue(tagger->clues, working_token.id, token_probability(tagger, random_background, working_token.id));
+      }
+      
+      for (working_token.id = 0; pool_next_token(tagger->positive_pool, &working_token); ) {
+        if (NULL == get_clue(tagger->clues, working_token.id)) {
+          add_clue(tagger->clues, working_token.id, token_probability(tagger, random_background, working_token.id));
+        }
+      }
+      
+      for (working_token.id = 0; pool_next_token(tagger->negative_pool, &working_token); ) {
+        if (NULL == get_clue(tagger->clues, working_token.id)) {
+          add_clue(tagger->clues, working_token.id, token_probability(tagger, random_background, working_token.id));
+        }
+      }
     }
     
-    for (working_token.id = 0; pool_next_token(tagger->positive_pool, &working_token); ) {
-      if (NULL == get_clue(tagger->clues, working_token.id)) {
-        double probability = tagger->probability_function(tagger->positive_pool, tagger->negative_pool, 
-                                                          random_background, working_token.id, tagger->bias);
-        add_clue(tagger->clues, working_token.id, probability);        
-      }
+    index_clues(tagger);
+  }
+  
+  return state;
+}
+
+/* Records the tokens of an item in the changed_tokens set. */
+static void add_changed_tokens(Pvoid_t *changed_tokens, const Item *item) {
+  int num_tokens = item_get_num_tokens(item);
+  const Token *tokens = item_get_tokens(item);
+  int i;
+  
+  for (i = 0; i < num_tokens; i++) {
+    PWord_t changed;
+    JLI(changed, *changed_tokens, tokens[i].id);
+    if (PJERR == changed) {
+      fatal("Malloc error allocating changed token");
+      break;
     }
+    *changed = 1;
+  }
+}
+
+/* Brings a pool trained with old_examples up to date with new_examples.
+ *
+ * trained holds the ids of the old examples whose tokens are actually in the pool.
+ * Trained examples that aren't in new_examples are subtracted and new examples
+ * that aren't trained yet are added, which retries any that were missing from
+ * the item cache last time. The tokens of every changed item are recorded in
+ * changed_tokens.
+ *
+ * Returns FAIL if a removed example can no longer be fetched, since its tokens
+ * can't be subtracted the pool has to be trained from scratch.
+ */
+static int train_pool_changes(Pool * pool, Pvoid_t * trained, ItemCache * item_cache, char ** old_examples, int old_size,
+                              char ** new_examples, int new_size, Pvoid_t *changed_tokens) {
+  Pvoid_t new_ids = NULL;
+  PWord_t id_pointer;
+  Word_t bytes;
+  int rc = OK;
+  int i;
+  
+  for (i = 0; i < new_size; i++) {
+    JSLI(id_pointer, new_ids, (uint8_t*) new_examples[i]);
+  }
+  
+  /* Removals first so a failure doesn't waste any fetches of added examples */
+  for (i = 0; OK == rc && i < old_size; i++) {
+    PWord_t trained_pointer;
+    JSLG(id_pointer, new_ids, (uint8_t*) old_examples[i]);
+    JSLG(trained_pointer, *trained, (uint8_t*) old_examples[i]);
     
-    for (working_token.id = 0; pool_next_token(tagger->negative_pool, &working_token); ) {
-      if (NULL == get_clue(tagger->clues, working_token.id)) {
-        double probability = tagger->probability_function(tagger->positive_pool, tagger->negative_pool, 
-                                                          random_background, working_token.id, tagger->bias);
-        add_clue(tagger->clues, working_token.id, probability);
+    if (NULL == id_pointer && NULL != trained_pointer) {
+      int free_when_done = 0;
+      Item * item = item_cache_fetch_item(item_cache, (unsigned char*) old_examples[i], &free_when_done);
+      
+      if (item) {
+        int removed;
+        pool_remove_item(pool, item);
+        add_changed_tokens(changed_tokens, item);
+        if (free_when_done) free_item(item);
+        JSLD(removed, *trained, (uint8_t*) old_examples[i]);
+      } else {
+        info("Removed example %s is no longer available", old_examples[i]);
+        rc = FAIL;
       }
     }
+  }
+  
+  for (i = 0; OK == rc && i < new_size; i++) {
+    int free_when_done = 0;
+    Item * item = train_example(pool, trained, item_cache, new_examples[i], &free_when_done);
     
-    free_pool(tagger->positive_pool);
-    free_pool(tagger->negative_pool);
-    tagger->positive_pool = NULL;
-    tagger->negative_pool = NULL;
+    if (item) {
+      add_changed_tokens(changed_tokens, item);
+      if (free_when_done) free_item(item);
+    }
   }
   
-  return state;
+  JSLFA(bytes, new_ids);
+  return rc;
+}
+
+/** Trains and precomputes a tagger by updating a previous version of the same tag.
+ *
+ *  This expects tagger to be a newly LOADED version of previous, which must
+ *  be PRECOMPUTED. The tagger takes over the pools and clues of previous and
+ *  only the examples that were added or removed since previous was trained
+ *  are added to or removed from the pools.
+ *
+ *  Every clue depends on the total size of the pools, so if those or the bias
+ *  have changed every clue has to be recomputed, although this is done in place.
+ *  Otherwise only the clues for the tokens of the changed examples are recomputed.
+ *  Tokens that no longer appear in any pool lose their clue, so the result is
+ *  the same as training and precomputing the tagger from scratch.
+ *
+ *  If previous can't be updated, because it was computed against a different
+ *  random background, tagger is left untouched and needs to be prepared as usual.
+ *
+ *  @return The new state of the tagger.
+ */
+TaggerState update_tagger(Tagger * tagger, Tagger * previous, ItemCache * item_cache) {
+  const Pool *random_background = item_cache_random_background(item_cache);
+  
+  if (!tagger || !previous || tagger->state != TAGGER_LOADED) {
+    return TAGGER_SEQUENCE_ERROR;
+  } else if (previous->state != TAGGER_PRECOMPUTED || !previous->positive_pool || !previous->negative_pool ||
+             previous->random_background != random_background || tagger->probability_function == NULL) {
+    return tagger->state;
+  }
+  
+  Pvoid_t changed_tokens = NULL;
+  PWord_t changed;
+  Word_t token_id = 0;
+  Word_t bytes;
+  int previous_positive_total = pool_total_tokens(previous->positive_pool);
+  int previous_negative_total = pool_total_tokens(previous->negative_pool);
+  
+  tagger->positive_pool = previous->positive_pool;
+  tagger->negative_pool = previous->negative_pool;
+  tagger->positive_trained = previous->positive_trained;
+  tagger->negative_trained = previous->negative_trained;
+  tagger->clues = previous->clues;
+  tagger->random_background = random_background;
+  previous->positive_pool = NULL;
+  previous->negative_pool = NULL;
+  previous->positive_trained = NULL;
+  previous->negative_trained = NULL;
+  previous->clues = NULL;
+  
+  if (OK != train_pool_changes(tagger->positive_pool, &tagger->positive_trained, item_cache,
+                               previous->positive_examples, previous->positive_example_count,
+                               tagger->positive_examples, tagger->positive_example_count, &changed_tokens) ||
+      OK != train_pool_changes(tagger->negative_pool, &tagger->negative_trained, item_cache,
+                               previous->negative_examples, previous->negative_example_count,
+                               tagger->negative_examples, tagger->negative_example_count, &changed_tokens)) {
+    info("Training %s from scratch since it can't be updated", tagger->training_url);
+    JLFA(bytes, changed_tokens);
+    free_training(tagger);
+    free_clue_list(tagger->clues);
+    tagger->clues = NULL;
+    tagger->random_background = NULL;
+    return tagger->state;
+  }
+  
+  if (tagger->bias != previous->bias || 
+      pool_total_tokens(tagger->positive_pool) != previous_positive_total ||
+      pool_total_tokens(tagger->negative_pool) != previous_negative_total) {
+    const Clue *clue;
+    int position = 0;
+    
+    while (NULL != (clue = next_clue(tagger->clues, &position))) {
+      set_clue(tagger->clues, clue->token_id, token_probability(tagger, random_background, clue->token_id));
+    }
+  }
+  
+  /* Changed tokens can also be new to the tagger or no longer in any pool */
+  JLF(changed, changed_tokens, token_id);
+  while (NULL != changed) {
+    if (pool_token_frequency(tagger->positive_pool, token_id) || pool_token_frequency(tagger->negative_pool, token_id) ||
+        (random_background && pool_token_frequency(random_background, token_id))) {
+      set_clue(tagger->clues, token_id, token_probability(tagger, random_background, token_id));
+    } else {
+      remove_clue(tagger->clues, token_id);
+    }
+    
+    JLN(changed, changed_tokens, token_id);
+  }
+  
+  JLC(bytes, changed_tokens, 0, -1);
+  debug("Updated %s with %lu changed tokens", tagger->training_url, bytes);
+  JLFA(bytes, changed_tokens);
+  
+  tagger->state = TAGGER_PRECOMPUTED;
+  index_clues(tagger);
+  
+  return tagger->state;
 }
 
 int classify_item(const Tagger *tagger, const Item *item, double * probability) {
@@ -348,6 +583,23 @@ int classify_item(const Tagger *tagger, const Item *item, double * probability)
   return rc;
 }
 
+/** Gets the tokens an item must contain at least one of to be classified at or above threshold.
+ *
+ *  Returns NULL when every item needs to be classified, either because the
+ *  threshold is low enough for an item without any clues to reach it or
+ *  because the tagger doesn't have any candidate tokens.
+ */
+const int * get_candidate_tokens(const Tagger *tagger, double threshold, int *num) {
+  const int *tokens = NULL;
+  
+  if (tagger && tagger->state == TAGGER_PRECOMPUTED && threshold > UNKNOWN_WORD_PROB) {
+    tokens = tagger->candidate_tokens;
+    *num = tagger->num_candidate_tokens;
+  }
+  
+  return tokens;
+}
+
 Clue ** get_clues(const Tagger *tagger, const Item *item, int *num) {
   Clue **clues = NULL;
   
@@ -358,6 +610,417 @@ Clue ** get_clues(const Tagger *tagger, const Item *item, int *num) {
   return clues;
 }
 
+/************************************************************************************************
+ *  Functions for saving precomputed taggers to disk and loading them back in.
+ *
+ *  A snapshot holds everything needed to classify with the tagger and to update it
+ *  with update_tagger, so after a restart a tagger only needs to be rebuilt if the
+ *  tag has been modified. Snapshots are a local cache so they are written in the
+ *  native byte order. The format is:
+ *
+ *    "WTGS", version
+ *    training_url, tag_id, classifier_taggings_url, term, scheme
+ *    updated, last_classified, bias
+ *    random background total tokens, random background fingerprint, or -1, 0 without one
+ *    positive examples, negative examples
+ *    clues as (token id, probability) pairs
+ *    has pools, then the positive and negative pools as (token id, frequency) pairs,
+ *      each followed by a flag per example saying whether the example is in the pool
+ *    "WTGE"
+ *
+ *  Strings are a length followed by the characters, -1 for NULL. Lists are a count
+ *  followed by the elements.
+*************************************************************************************************/
+
+#define SNAPSHOT_MAGIC "WTGS"
+#define SNAPSHOT_END "WTGE"
+#define SNAPSHOT_VERSION 4
+#define NO_RANDOM_BACKGROUND_TOKENS -1
+
+/* Builds the path of the snapshot for the training url from a hash of the url. */
+static int snapshot_path(const char * directory, const char * training_url, char * path, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *c;
+  
+  for (c = (const unsigned char *) training_url; *c; c++) {
+    hash = (hash ^ *c) * 1099511628211ULL;
+  }
+  
+  return size > snprintf(path, size, "%s/%016llx.tagger", directory, (unsigned long long) hash) ? OK : FAIL;
+}
+
+static void write_int(Buffer * b, int32_t value) {
+  buffer_in(b, (const char *) &value, sizeof(value));
+}
+
+static void write_double(Buffer * b, double value) {
+  buffer_in(b, (const char *) &value, sizeof(value));
+}
+
+static void write_string(Buffer * b, const char * string) {
+  if (string) {
+    write_int(b, strlen(string));
+    buffer_in(b, string, strlen(string));
+  } else {
+    write_int(b, -1);
+  }
+}
+
+static void write_examples(Buffer * b, char ** examples, int count) {
+  int i;
+  
+  write_int(b, count);
+  for (i = 0; i < count; i++) {
+    write_string(b, examples[i]);
+  }
+}
+
+static int write_pool(Buffer * b, const Pool * pool) {
+  int num_tokens = pool_num_tokens(pool);
+  int *token_ids = malloc((num_tokens + 1) * sizeof(int));
+  int *frequencies = malloc((num_tokens + 1) * sizeof(int));
+  int i;
+  
+  if (NULL == token_ids || NULL == frequencies) {
+    free(token_ids);
+    free(frequencies);
+    return FAIL;
+  }
+  
+  num_tokens = pool_token_arrays(pool, token_ids, frequencies);
+  write_int(b, num_tokens);
+  for (i = 0; i < num_tokens; i++) {
+    write_int(b, token_ids[i]);
+    write_int(b, frequencies[i]);
+  }
+  
+  free(token_ids);
+  free(frequencies);
+  return OK;
+}
+
+/* Writes a flag for each example saying whether it is in the trained set. */
+static void write_trained(Buffer * b, Pvoid_t trained, char ** examples, int count) {
+  int i;
+  
+  write_int(b, count);
+  for (i = 0; i < count; i++) {
+    PWord_t trained_pointer;
+    JSLG(trained_pointer, trained, (uint8_t*) examples[i]);
+    write_int(b, NULL != trained_pointer);
+  }
+}
+
+/** Saves a precomputed tagger to a snapshot file in directory.
+ *
+ *  The snapshot is written to a temporary file and renamed over any existing
+ *  snapshot for the tag, so a reader never sees a partly written snapshot.
+ *
+ *  @return TAGGER_OK if the snapshot was written, TAGGER_SEQUENCE_ERROR if the
+ *          tagger isn't precomputed and TAG_NOT_FOUND if the file couldn't be written.
+ */
+int save_tagger_snapshot(const Tagger * tagger, const char * directory) {
+  char path[MAXPATHLEN];
+  char tmp_path[MAXPATHLEN];
+  int rc = TAGGER_OK;
+  
+  if (!tagger || tagger->state != TAGGER_PRECOMPUTED || !tagger->training_url) {
+    return TAGGER_SEQUENCE_ERROR;
+  } else if (OK != snapshot_path(directory, tagger->training_url, path, sizeof(path)) ||
+             sizeof(tmp_path) <= snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)) {
+    error("Snapshot path for %s in %s is too long", tagger->training_url, directory);
+    return TAG_NOT_FOUND;
+  }
+  
+  int has_pools = tagger->positive_pool && tagger->negative_pool;
+  int estimated_size = 1024 + tagger->clues->size * 12;
+  if (has_pools) {
+    estimated_size += (pool_num_tokens(tagger->positive_pool) + pool_num_tokens(tagger->negative_pool)) * 8;
+  }
+  
+  Buffer *b = new_buffer(estimated_size);
+  const Clue *clue;
+  int position = 0;
+  
+  buffer_in(b, SNAPSHOT_MAGIC, 4);
+  write_int(b, SNAPSHOT_VERSION);
+  write_string(b, tagger->training_url);
+  write_string(b, tagger->tag_id);
+  write_string(b, tagger->classifier_taggings_url);
+  write_string(b, tagger->term);
+  write_string(b, tagger->scheme);
+  write_double(b, tagger->updated);
+  write_double(b, tagger->last_classified);
+  write_double(b, tagger->bias);
+  if (tagger->random_background) {
+    write_int(b, pool_total_tokens(tagger->random_background));
+    write_int(b, pool_fingerprint(tagger->random_background));
+  } else {
+    write_int(b, NO_RANDOM_BACKGROUND_TOKENS);
+    write_int(b, 0);
+  }
+  write_examples(b, tagger->positive_examples, tagger->positive_example_count);
+  write_examples(b, tagger->negative_examples, tagger->negative_example_count);
+  
+  write_int(b, tagger->clues->size);
+  while (NULL != (clue = next_clue(tagger->clues, &position))) {
+    write_int(b, clue->token_id);
+    write_double(b, clue->probability);
+  }
+  
+  write_int(b, has_pools);
+  if (has_pools) {
+    if (OK != write_pool(b, tagger->positive_pool) || OK != write_pool(b, tagger->negative_pool)) {
+      error("Malloc error writing pools for %s", tagger->training_url);
+      rc = TAG_NOT_FOUND;
+    }
+    
+    write_trained(b, tagger->positive_trained, tagger->positive_examples, tagger->positive_example_count);
+    write_trained(b, tagger->negative_trained, tagger->negative_examples, tagger->negative_example_count);
+  }
+  
+  buffer_in(b, SNAPSHOT_END, 4);
+  
+  if (TAGGER_OK == rc) {
+    FILE *file = fopen(tmp_path, "w");
+    
+    if (NULL == file) {
+      error("Could not create tagger snapshot %s: %s", tmp_path, strerror(errno));
+      rc = TAG_NOT_FOUND;
+    } else {
+      int written = fwrite(b->buf, 1, b->length, file) == b->length;
+      
+      if (fclose(file) || !written || rename(tmp_path, path)) {
+        error("Could not write tagger snapshot %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        rc = TAG_NOT_FOUND;
+      } else {
+        debug("Saved %s to %s", tagger->training_url, path);
+      }
+    }
+  }
+  
+  free_buffer(b);
+  return rc;
+}
+
+/* Reads values from a mapped snapshot, failing once it reads past the end. */
+struct SnapshotReader {
+  const char *data;
+  size_t size;
+  size_t position;
+  int failed;
+};
+
+static const char * read_bytes(struct SnapshotReader * r, size_t n) {
+  const char * bytes = NULL;
+  
+  if (!r->failed && n <= r->size - r->position) {
+    bytes = r->data + r->position;
+    r->position += n;
+  } else {
+    r->failed = true;
+  }
+  
+  return bytes;
+}
+
+static int32_t read_int(struct SnapshotReader * r) {
+  int32_t value = 0;
+  const char * bytes = read_bytes(r, sizeof(value));
+  if (bytes) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static double read_double(struct SnapshotReader * r) {
+  double value = 0;
+  const char * bytes = read_bytes(r, sizeof(value));
+  if (bytes) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+/* Returns the next string in the snapshot as a new string, or NULL. */
+static char * read_string(struct SnapshotReader * r) {
+  char * string = NULL;
+  int32_t length = read_int(r);
+  
+  if (length >= 0) {
+    const char * bytes = read_bytes(r, length);
+    
+    if (bytes && NULL != (string = malloc(length + 1))) {
+      memcpy(string, bytes, length);
+      string[length] = '\0';
+    }
+  }
+  
+  return string;
+}
+
+/* Reads a count, failing the reader if there can't be that many elements of element_size left. */
+static int read_count(struct SnapshotReader * r, size_t element_size) {
+  int32_t count = read_int(r);
+  
+  if (count < 0 || (size_t) count > (r->size - r->position) / element_size) {
+    r->failed = true;
+    count = 0;
+  }
+  
+  return count;
+}
+
+static char ** read_examples(struct SnapshotReader * r, int * count) {
+  char ** examples = NULL;
+  int i;
+  
+  *count = read_count(r, sizeof(int32_t));
+  if (*count > 0 && NULL != (examples = calloc(*count, sizeof(char*)))) {
+    for (i = 0; i < *count; i++) {
+      if (NULL == (examples[i] = read_string(r))) {
+        r->failed = true;
+      }
+    }
+  }
+  
+  return examples;
+}
+
+static Pool * read_pool(struct SnapshotReader * r) {
+  Pool * pool = new_pool();
+  int num_tokens = read_count(r, 2 * sizeof(int32_t));
+  int i;
+  
+  for (i = 0; pool && i < num_tokens; i++) {
+    int token_id = read_int(r);
+    int frequency = read_int(r);
+    pool_add_token(pool, token_id, frequency);
+  }
+  
+  return pool;
+}
+
+/* Reads the flags written by write_trained into the trained set. */
+static void read_trained(struct SnapshotReader * r, Pvoid_t * trained, char ** examples, int count) {
+  int i;
+  
+  if (count != read_count(r, sizeof(int32_t))) {
+    r->failed = true;
+  }
+  
+  for (i = 0; !r->failed && i < count; i++) {
+    if (read_int(r)) {
+      PWord_t trained_pointer;
+      JSLI(trained_pointer, *trained, (uint8_t*) examples[i]);
+    }
+  }
+}
+
+static void read_snapshot(Tagger * tagger, struct SnapshotReader * r, const char * training_url, const Pool * random_background) {
+  int i;
+  
+  if (NULL == read_bytes(r, 4) || memcmp(r->data, SNAPSHOT_MAGIC, 4) || SNAPSHOT_VERSION != read_int(r)) {
+    info("Tagger snapshot for %s is from a different version", training_url);
+    r->failed = true;
+    return;
+  }
+  
+  tagger->training_url = read_string(r);
+  if (!tagger->training_url || strcmp(tagger->training_url, training_url)) {
+    r->failed = true;
+    return;
+  }
+  
+  tagger->tag_id = read_string(r);
+  tagger->classifier_taggings_url = read_string(r);
+  tagger->term = read_string(r);
+  tagger->scheme = read_string(r);
+  tagger->updated = read_double(r);
+  tagger->last_classified = read_double(r);
+  tagger->bias = read_double(r);
+  
+  /* The clues are only valid for the random background they were computed against,
+   * or without one if they were computed without one. */
+  int expected_tokens = random_background ? pool_total_tokens(random_background) : NO_RANDOM_BACKGROUND_TOKENS;
+  int32_t expected_fingerprint = random_background ? (int32_t) pool_fingerprint(random_background) : 0;
+  if (expected_tokens != read_int(r) || expected_fingerprint != read_int(r)) {
+    info("Tagger snapshot for %s was computed against a different random background", training_url);
+    r->failed = true;
+    return;
+  }
+  
+  tagger->positive_examples = read_examples(r, &tagger->positive_example_count);
+  tagger->negative_examples = read_examples(r, &tagger->negative_example_count);
+  
+  int num_clues = read_count(r, sizeof(int32_t) + sizeof(double));
+  tagger->clues = new_clue_list();
+  reserve_clues(tagger->clues, num_clues);
+  for (i = 0; i < num_clues; i++) {
+    int token_id = read_int(r);
+    double probability = read_double(r);
+    add_clue(tagger->clues, token_id, probability);
+  }
+  
+  if (read_int(r)) {
+    tagger->positive_pool = read_pool(r);
+    tagger->negative_pool = read_pool(r);
+    read_trained(r, &tagger->positive_trained, tagger->positive_examples, tagger->positive_example_count);
+    read_trained(r, &tagger->negative_trained, tagger->negative_examples, tagger->negative_example_count);
+  }
+  
+  const char * end = read_bytes(r, 4);
+  if (!end || memcmp(end, SNAPSHOT_END, 4) || r->position != r->size) {
+    r->failed = true;
+  }
+}
+
+/** Loads a tagger from its snapshot in directory.
+ *
+ *  The tagger should be empty apart from its classification functions. On success
+ *  it is PRECOMPUTED and can be used straight away, although it should still be
+ *  revalidated against the tag document using its updated time.
+ *
+ *  Snapshots computed against a different random background are ignored.
+ *
+ *  @return TAGGER_OK if the tagger was loaded, otherwise TAG_NOT_FOUND. If the snapshot
+ *          couldn't be loaded the caller should free the tagger.
+ */
+int load_tagger_snapshot(Tagger * tagger, const char * directory, const char * training_url, const Pool * random_background) {
+  char path[MAXPATHLEN];
+  struct stat file_stat;
+  int rc = TAG_NOT_FOUND;
+  int fd;
+  
+  if (!tagger || !directory || !training_url || OK != snapshot_path(directory, training_url, path, sizeof(path))) {
+    return rc;
+  } else if (-1 == (fd = open(path, O_RDONLY))) {
+    return rc;
+  }
+  
+  if (0 == fstat(fd, &file_stat) && file_stat.st_size > 0) {
+    void * data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (MAP_FAILED == data) {
+      error("Could not map tagger snapshot %s: %s", path, strerror(errno));
+    } else {
+      struct SnapshotReader reader = {data, file_stat.st_size, 0, false};
+      read_snapshot(tagger, &reader, training_url, random_background);
+      munmap(data, file_stat.st_size);
+      
+      if (reader.failed) {
+        info("Ignoring invalid tagger snapshot %s for %s", path, training_url);
+      } else {
+        tagger->random_background = random_background;
+        tagger->state = TAGGER_PRECOMPUTED;
+        index_clues(tagger);
+        rc = TAGGER_OK;
+        debug("Loaded %s from %s", training_url, path);
+      }
+    }
+  }
+  
+  close(fd);
+  return rc;
+}
+
 struct output {
   int pos;
   int size;
@@ -544,10 +1207,10 @@ void free_tagger(Tagger * tagger) {
       free(tagger->negative_examples);
     }
     
-    if (tagger->positive_pool) free_pool(tagger->positive_pool);
-    if (tagger->negative_pool) free_pool(tagger->negative_pool);
+    free_training(tagger);
     
     if (tagger->clues) free_clue_list(tagger->clues);
+    if (tagger->candidate_tokens) free(tagger->candidate_tokens);
     if (tagger->atom) free(tagger->atom);
     
     free(tagger);
@@ -94,10 +94,19 @@ typedef struct TAGGER {
   /* The function that is used for calculating the probability for a token. */
   double (*probability_function)(const Pool *positive, const Pool *negative, const Pool *random_bg, int token_id, double bias);
   
+  /* The function that computes the clues for every token in the pools at once.
+   * It must give the same clues as probability_function. If NULL, precompute_tagger
+   * calls probability_function for each token.
+   */
+  void (*precompute_function)(ClueList *clues, const Pool *positive, const Pool *negative, const Pool *random_bg, double bias);
+  
   /* The function that is used to classify a item */
   double (*classification_function)(const ClueList *clues, const Item *item);
   
   Clue ** (*get_clues_function)(const ClueList *clues, const Item *item, int *num);
+
+  /* The function that selects the tokens an item must contain to be classified above 0.5 */
+  int * (*candidate_tokens_function)(const ClueList *clues, int *num);
   
   /**** Tag examples *****/
   
@@ -118,8 +127,24 @@ typedef struct TAGGER {
   Pool *positive_pool;
   Pool *negative_pool;
   
+  /* Sets of the ids of the examples whose tokens are in each pool. Examples that
+   * were missing from the item cache when the pool was trained aren't in these,
+   * so update_tagger only subtracts what was added and retries the rest.
+   */
+  Pvoid_t positive_trained;
+  Pvoid_t negative_trained;
+  
   /**** Precomputed classifier state ****/
   ClueList *clues;
+
+  /* The random background the clues were computed against */
+  const Pool *random_background;
+
+  /* The tokens an item must contain at least one of to be classified above 0.5.
+   * NULL if the tagger has no candidate_tokens_function.
+   */
+  int *candidate_tokens;
+  int num_candidate_tokens;
   
   /* Hold on to the latest atom document, in case we need it? */
   char *atom;
@@ -129,17 +154,25 @@ typedef struct TAGGER_CACHE_OPTIONS {
   /* URL for the index of tags which will be handled by the classifier. */
   const char * tag_index_url;
   const Credentials * credentials;
+  /* Directory to save snapshots of precomputed taggers in. NULL disables snapshots. */
+  const char * snapshot_directory;
 } TaggerCacheOptions;
 
 typedef int (*TagRetriever)(const char * tag_training_url, time_t last_updated, 
                             const Credentials * credentials, 
                             char ** tag_document, char ** errmsg);
 
+typedef int (*TaggingsSaver)(const Tagger * tagger, Array * taggings,
+                             const Credentials * credentials, char ** errmsg);
+
 typedef struct TAGGER_CACHE {
   /* URL for the index of tags which will be handled by the classifier. */
   const char * tag_index_url;
   const Credentials * credentials;
   
+  /* Directory precomputed taggers are saved in so they survive a restart. Can be NULL. */
+  const char * snapshot_directory;
+  
   /* Tagger cache mutex.  Only one thread can access the internal arrays of the tagger cache at one time. */
   pthread_mutex_t mutex;
   
@@ -149,6 +182,11 @@ typedef struct TAGGER_CACHE {
   /* Function used to fetch tag documents. This is really just a function pointer to help testing. */
   TagRetriever tag_retriever;
   
+  /* Functions used to send the taggings of a classification back to the tag, default to
+   * update_taggings and replace_taggings. These are also just function pointers to help testing. */
+  TaggingsSaver taggings_updater;
+  TaggingsSaver taggings_replacer;
+  
   /* Function used to fetch tag index documents. This is really just a function pointer to help testing. */
   int (*tag_index_retriever)(const char * tag_index_url, time_t last_updated, 
                             const Credentials * credentials, 
@@ -176,11 +214,15 @@ extern Tagger *      build_tagger        (const char * atom, ItemCache * item_ca
 extern TaggerState   train_tagger        (Tagger * tagger, ItemCache * item_cache);
 extern TaggerState   precompute_tagger   (Tagger * tagger, const Pool * random_background);
 extern TaggerState   prepare_tagger      (Tagger * tagger, ItemCache * item_cache);
+extern TaggerState   update_tagger       (Tagger * tagger, Tagger * previous, ItemCache * item_cache);
 extern int           classify_item       (const Tagger * tagger, const Item * item, double * probability);
 extern Clue **       get_clues           (const Tagger * tagger, const Item * item, int * num);
+extern const int *   get_candidate_tokens(const Tagger * tagger, double threshold, int * num);
 extern int           update_taggings     (const Tagger * tagger, Array *list, const Credentials * credentials, char ** errmsg);
 extern int           replace_taggings    (const Tagger * tagger, Array *list, const Credentials * credentials, char ** errmsg);
 extern int           get_missing_entries (Tagger * tagger, ItemCacheEntry ** entries);
+extern int           save_tagger_snapshot(const Tagger * tagger, const char * directory);
+extern int           load_tagger_snapshot(Tagger * tagger, const char * directory, const char * training_url, const Pool * random_background);
 extern void          free_tagger         (Tagger * tagger);
 
 extern TaggerCache * create_tagger_cache (ItemCache * item_cache, TaggerCacheOptions * options);
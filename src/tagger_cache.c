@@ -50,12 +50,15 @@ TaggerCache * create_tagger_cache(ItemCache * item_cache, TaggerCacheOptions *op
     if (opts) {
       tagger_cache->tag_index_url = opts->tag_index_url;
       tagger_cache->credentials = opts->credentials;
+      tagger_cache->snapshot_directory = opts->snapshot_directory;
     }
     
     tagger_cache->tag_urls = NULL;
     tagger_cache->failed_tags = NULL;
     tagger_cache->taggers = NULL;
     tagger_cache->tag_urls_last_updated = -1;
+    tagger_cache->taggings_updater = &update_taggings;
+    tagger_cache->taggings_replacer = &replace_taggings;
 
     if (pthread_mutex_init(&tagger_cache->mutex, NULL)) {
       fatal("pthread_mutex_init error for tagger_cache");
@@ -77,8 +80,10 @@ TaggerCache * create_tagger_cache(ItemCache * item_cache, TaggerCacheOptions *op
  */
 static void setup_classification_functions(Tagger *tagger) {
   tagger->probability_function    = &naive_bayes_probability;
+  tagger->precompute_function     = &naive_bayes_precompute;
   tagger->classification_function = &naive_bayes_classify;
   tagger->get_clues_function      = &select_clues;
+  tagger->candidate_tokens_function = &naive_bayes_candidate_tokens;
 }
 
 /* Fetch a Tag document and call build_tagger to return a Tagger representing that document.
@@ -126,6 +131,32 @@ static Tagger * fetch_tagger(TagRetriever tag_retriever, ItemCache *item_cache,
   return tagger;
 }
 
+/* Loads the tagger for tag_training_url from its snapshot, if snapshots are enabled and it has one.
+ *
+ * @return The precomputed tagger or NULL if there is no valid snapshot for it.
+ */
+static Tagger * load_snapshot(TaggerCache * tagger_cache, const char * tag_training_url) {
+  Tagger *tagger = NULL;
+  
+  if (tagger_cache->snapshot_directory && tagger_cache->item_cache) {
+    if (NULL == (tagger = calloc(1, sizeof(struct TAGGER)))) {
+      fatal("Malloc error allocating tagger");
+    } else {
+      setup_classification_functions(tagger);
+      
+      if (TAGGER_OK != load_tagger_snapshot(tagger, tagger_cache->snapshot_directory, tag_training_url,
+                                            item_cache_random_background(tagger_cache->item_cache))) {
+        free_tagger(tagger);
+        tagger = NULL;
+      } else {
+        info("Loaded %s from its snapshot", tag_training_url);
+      }
+    }
+  }
+  
+  return tagger;
+}
+
 /** Marks a tagger, identified by the tag_training_url, as checked out
  */
 static int mark_as_checked_out(TaggerCache *tagger_cache, const char * tag_training_url) {
@@ -272,6 +303,9 @@ int determine_return_state(Tagger *tagger, char ** errmsg) {
 }
 
 /* This will fetch ori update the tagger, depending on whether tagger is NULL or not.
+ *
+ * An updated tagger takes over the pools and clues of the cached tagger, which is
+ * replaced by it in the cache.
  */
 static int fetch_or_update_tagger(TaggerCache * tagger_cache, const char *tag_url, Tagger **tagger, char ** errmsg) {
   int updated = 0;
@@ -284,6 +318,8 @@ static int fetch_or_update_tagger(TaggerCache * tagger_cache, const char *tag_ur
     
     if ((updated_tagger = fetch_tagger(tagger_cache->tag_retriever, tagger_cache->item_cache, tag_url, (*tagger)->updated, tagger_cache->credentials, errmsg))) {
       updated = 1;
+      /* Retrain from the cached version so only the changed examples need to be trained */
+      update_tagger(updated_tagger, *tagger, tagger_cache->item_cache);
       *tagger = updated_tagger;          
     } else {
       debug("Tag %s not modified, using cached version", (*tagger)->training_url);
@@ -354,12 +390,33 @@ int get_tagger(TaggerCache * tagger_cache, const char * tag_training_url, Tagger
       if (errmsg) *errmsg = strdup(CHECKED_OUT_MSG);        
       rc = cache_rc;
     } else {
+      /* A tagger that isn't cached may have been saved before a restart. It is
+       * revalidated with the tag document just like a cached tagger. */
+      Tagger *snapshot = NULL;
+      if (!temp_tagger) {
+        temp_tagger = snapshot = load_snapshot(tagger_cache, tag_training_url);
+      }
+      
       int tagger_is_new = fetch_or_update_tagger(tagger_cache, tag_training_url, &temp_tagger, errmsg);
             
       if (temp_tagger) {
         prepare_tagger(temp_tagger, tagger_cache->item_cache);
       }
       
+      if (snapshot && snapshot == temp_tagger) {
+        /* The snapshot is still current so it just needs to be cached */
+        tagger_is_new = 1;
+      } else {
+        if (snapshot) {
+          /* The snapshot was out of date and has been replaced */
+          free_tagger(snapshot);
+        }
+        
+        if (tagger_is_new && tagger_cache->snapshot_directory && temp_tagger->state == TAGGER_PRECOMPUTED) {
+          save_tagger_snapshot(temp_tagger, tagger_cache->snapshot_directory);
+        }
+      }
+      
       if (tagger_is_new) {
         cache_tagger(tagger_cache, temp_tagger);
       }
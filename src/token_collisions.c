@@ -0,0 +1,140 @@
+// General info: http://doc.winnowtag.org/open-source
+// Source code repository: http://github.com/winnowtag
+// Questions and feedback: contact@winnowtag.org
+//
+// Copyright (c) 2007-2011 The Kaphan Foundation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// contact@winnowtag.org
+
+#include <config.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <Judy.h>
+#include "misc.h"
+#include "tokenizer.h"
+
+static void print_help() {
+  printf("Token Hash Collisions\n\n");
+  printf("Hashes every token in an item cache's tokens table with the hash used by\n");
+  printf("--hash-tokens and reports how many of them collide.\n\n");
+  printf("Usage: token_collisions [-l] <item_cache>\n");
+  printf("  -l  list each token that collides and the token it collides with\n");
+}
+
+#define SHORT_OPTS "hvl"
+#define FETCH_TOKENS_SQL "select token from tokens order by id"
+
+/* Counts the tokens in the tokens table whose hash was already taken by an earlier one. */
+static int count_collisions(const char *item_cache, int list) {
+  char path[MAXPATHLEN];
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  Pvoid_t hashes = NULL;
+  Word_t freed_bytes;
+  Word_t hash = 0;
+  PWord_t first_token;
+  double num_tokens = 0;
+  double collisions = 0;
+
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache)) {
+    fprintf(stderr, "Path to catalog.db too long: %s\n", item_cache);
+    return EXIT_FAILURE;
+  } else if (SQLITE_OK != sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(db, FETCH_TOKENS_SQL, -1, &stmt, NULL)) {
+    fprintf(stderr, "Could not read the tokens in %s: %s\n", path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return EXIT_FAILURE;
+  }
+
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    const char *token = (const char*) sqlite3_column_text(stmt, 0);
+
+    if (token) {
+      num_tokens++;
+      JLI(first_token, hashes, token_hash(token));
+
+      if (NULL == first_token) {
+        fprintf(stderr, "Error malloc'ing token hashes\n");
+        break;
+      } else if (*first_token) {
+        collisions++;
+        if (list) {
+          printf("%s collides with %s\n", token, (const char*) *first_token);
+        }
+      } else {
+        *first_token = (Word_t) strdup(token);
+      }
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  printf("Tokens:              %.0f\n", num_tokens);
+  printf("Colliding tokens:    %.0f (%.6f%%)\n", collisions, num_tokens ? 100 * collisions / num_tokens : 0);
+  /* n^2 / 2m for a uniform hash into m = 2^31 ids */
+  printf("Expected collisions: %.1f\n", num_tokens * (num_tokens - 1) / 4294967296.0);
+
+  JLF(first_token, hashes, hash);
+  while (first_token) {
+    free((char*) *first_token);
+    JLN(first_token, hashes, hash);
+  }
+  JLFA(freed_bytes, hashes);
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char ** argv) {
+  int list = false;
+  int longindex;
+  int opt;
+  static struct option long_options[] = {
+        {"version", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {"list", no_argument, 0, 'l'},
+        {0,0,0,0}
+      };
+
+  while (-1 != (opt = getopt_long(argc, argv, SHORT_OPTS, long_options, &longindex))) {
+    switch (opt) {
+    case 'h':
+      print_help();
+      return EXIT_SUCCESS;
+    case 'v':
+      printf("%s\n", PACKAGE_STRING);
+      return EXIT_SUCCESS;
+    case 'l':
+      list = true;
+      break;
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_help();
+    return EXIT_FAILURE;
+  }
+
+  return count_collisions(argv[optind], list);
+}
@@ -25,167 +25,177 @@
 // contact@winnowtag.org
 
 #include <libxml/HTMLparser.h>
-#include <libxml/xmlreader.h>
+#include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/uri.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
 #include "tokenizer.h"
 #include "logging.h"
 #include "buffer.h"
 #include <string.h>
-#include <ctype.h>
 #include <Judy.h>
-#include <regex.h>
-#include "xml.h"
-
-// From http://www.daniweb.com/code/snippet216955.html
-int rreplace (char *buf, int size, regex_t *re, char *rp) {
-    char *pos;
-    int sub, so, n;
-    regmatch_t pmatch [10]; /* regoff_t is int so size is int */
-
-    if (regexec (re, buf, 10, pmatch, 0)) return 0;
-    for (pos = rp; *pos; pos++)
-        if (*pos == '\\' && *(pos + 1) > '0' && *(pos + 1) <= '9') {
-            so = pmatch [*(pos + 1) - 48].rm_so;
-            n = pmatch [*(pos + 1) - 48].rm_eo - so;
-            if (so < 0 || strlen (rp) + n - 1 > size) return 1;
-            memmove (pos + n, pos + 2, strlen (pos) - 1);
-            memmove (pos, buf + so, n);
-            pos = pos + n - 2;
-        }
-    sub = pmatch [1].rm_so; /* no repeated replace when sub >= 0 */
-    for (pos = buf; !regexec (re, pos, 1, pmatch, 0); ) {
-        n = pmatch [0].rm_eo - pmatch [0].rm_so;
-        pos += pmatch [0].rm_so;
-        if (strlen (buf) - n + strlen (rp) > size) return 1;
-        memmove (pos + strlen (rp), pos + n, strlen (pos) - n + 1);
-        memmove (pos, rp, strlen (rp));
-        pos += strlen (rp);
-        if (sub >= 0) break;
-    }
-    return 0;
-}
 
-static int replace(char *buf, int size, const char * pattern, char *rp) {
-	regex_t regex;
-	int regex_error;
+/* Maximum length of a feature that is built on the stack. */
+#define FEATURE_BUFFER_SIZE 256
 
-	if ((regex_error = regcomp(&regex, pattern, REG_EXTENDED)) != 0) {
-		char buffer[1024];
-	    regerror(regex_error, &regex, buffer, sizeof(buffer));
-	    fatal("Error compiling REGEX: %s", buffer);
-	} else if (rreplace(buf, size, &regex, rp)) {
-		fatal("Error doing regex replace");
-	} else {
-	  regfree(&regex);
+/* 1 for the characters that make up words: ASCII letters, digits and '-'.
+ * Everything else separates words.
+ */
+static const unsigned char word_chars[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* Counts the feature made of prefix followed by the first length characters
+ * of value, lower cased if fold is true.
+ */
+static Pvoid_t add_feature(Pvoid_t features, const char *prefix, const char *value, int length, int fold) {
+	char buffer[FEATURE_BUFFER_SIZE];
+	int prefix_length = strlen(prefix);
+	char *feature = prefix_length + length < FEATURE_BUFFER_SIZE ? buffer : malloc(prefix_length + length + 1);
+	Word_t *PValue;
+	int i;
+
+	if (NULL == feature) {
+		fatal("Could not allocate feature");
+		return features;
 	}
 
-	return 0;
-}
+	memcpy(feature, prefix, prefix_length);
+	for (i = 0; i < length; i++) {
+		char c = value[i];
+		feature[prefix_length + i] = fold && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+	}
+	feature[prefix_length + length] = '\0';
 
-static void processNode(xmlTextReaderPtr reader, Buffer * buf) {
-	int type = xmlTextReaderNodeType(reader);
+	JSLI(PValue, features, (unsigned char*) feature);
+	(*PValue)++;
 
-	if (type == XML_TEXT_NODE) {
-		unsigned char *s = xmlTextReaderReadString(reader);
-		int slen = strlen(s);
-		char enc[512];
-		int enclen = 512;
-		if (!htmlEncodeEntities(enc, &enclen, s, &slen, 0)) {
-			buffer_in(buf, enc, enclen);
+	if (feature != buffer) {
+		free(feature);
+	}
 
-			if (enc[enclen-1] != ' ') {
-				buffer_in(buf, " ", 1);
-			}
-		}
+	return features;
+}
 
-		free(s);
-	}
+static Pvoid_t add_token(const char *token, Pvoid_t features) {
+	return add_feature(features, "t:", token, strlen(token), false);
 }
 
-static void foldcase(char * txt) {
-	int i;
+/* Adds the word running from start to end.
+ *
+ * Leading and trailing dashes are dropped when asked to and anything left
+ * that is shorter than 2 characters is ignored.
+ */
+static Pvoid_t add_word(Pvoid_t features, const char *start, const char *end, int strip_leading, int strip_trailing) {
+	if (strip_leading) {
+		while (start < end && *start == '-') start++;
+	}
 
-	for (i = 0; txt[i]; i++) {
-		txt[i] = tolower(txt[i]);
+	if (strip_trailing) {
+		while (end > start && end[-1] == '-') end--;
+	}
+
+	if (end - start >= 2) {
+		features = add_feature(features, "t:", start, end - start, true);
 	}
-}
 
-static Pvoid_t add_token(char *token, Pvoid_t features) {
-	Word_t *PValue;
-	int toklen = strlen(token);
-	char *feature = malloc(toklen * sizeof(char) + 3);
-	strncpy(feature, "t:", 3);
-	strncat(feature, token, toklen + 3);
-	JSLI(PValue, features, (unsigned char*) feature);
-	(*PValue)++;
-	free(feature);
 	return features;
 }
 
-static Pvoid_t tokenize_text(char * txt, int length, Pvoid_t features) {
-	char *token;
-
-	// Remove HTML entities
-	replace(txt, length, "&[^;]+;", " ");
-	// Remove all non-alphanums
-	replace(txt, length, "[^a-zA-Z0-9\\-]", " ");
-	// Remove leading and trailing dashes
-	replace(txt, length, "[[:space:]]+[\\-]+", " ");
-	replace(txt, length, "\\-+[[:space:]]+", " ");
-	// Normalize whitespace
-	replace(txt, length, "[[:space:]]+", " ");
-	foldcase(txt);
-
-	for (; (token = strsep(&txt, "\t\n ")) != NULL; ) {
-		if (token != '\0') {
-			int toklen = strlen(token) + 1; // +1 for \0
-			if (toklen > 2) {
-				features = add_token(token, features);
+/* Adds the words in txt to features in a single pass.
+ *
+ * Words are runs of letters, digits and dashes. Anything else separates
+ * them, including HTML entities, which run from an '&' to the next ';'.
+ * Words are case folded as they are added and lose any leading or trailing
+ * dashes unless they are at the very start or end of the text.
+ */
+static Pvoid_t tokenize_text(const char * txt, Pvoid_t features) {
+	/* The next ';' in txt, or NULL once there are none left. */
+	const char *semicolon = txt;
+	const char *word = NULL;
+	const char *p = txt;
+
+	for (;;) {
+		unsigned char c = *p;
+
+		if (word_chars[c]) {
+			if (!word) {
+				word = p;
 			}
+			p++;
+			continue;
 		}
+
+		if (word) {
+			/* Dashes are kept at the very start and end of the text */
+			features = add_word(features, word, p, word != txt, c != '\0');
+			word = NULL;
+		}
+
+		if (c == '\0') {
+			break;
+		} else if (c == '&' && semicolon) {
+			if (semicolon <= p) {
+				semicolon = strchr(p + 1, ';');
+			}
+
+			/* An entity needs at least one character before its ';' */
+			if (semicolon && semicolon > p + 1) {
+				p = semicolon + 1;
+				continue;
+			}
+		}
+
+		p++;
 	}
 
 	return features;
 }
 
-static Buffer *extractText(htmlDocPtr doc) {
-		char * term = "\0";
-    Buffer *buf = new_buffer(256);
-    xmlTextReaderPtr reader = xmlReaderWalker(doc);
-    while(xmlTextReaderRead(reader)){
-        processNode(reader, buf);
-    }
-    xmlFreeTextReader(reader);
-
-    buffer_in(buf, term, 1);
-    return buf;
-}
-
 static Pvoid_t add_url_component(char * uri, Pvoid_t features) {
 	if (uri) {
-		Word_t *PValue;
-		int size = strlen(uri) + 8;
-		char * token = malloc(sizeof(char) * size);
-		strncpy(token, "URLSeg:", size);
-		strncat(token, uri, size);
-		JSLI(PValue, features, (unsigned char*) token);
-		(*PValue)++;
-		free(token);
+		features = add_feature(features, "URLSeg:", uri, strlen(uri), false);
 	}
 
 	return features;
 }
 
+/* Removes every "www." from a host name in place. */
+static void strip_www(char * host) {
+	char *out = host;
+
+	while (*host) {
+		if (!strncmp(host, "www.", 4)) {
+			host += 4;
+		} else {
+			*out++ = *host++;
+		}
+	}
+
+	*out = '\0';
+}
+
 static Pvoid_t tokenize_uri(const char * uristr, Pvoid_t features) {
 	xmlURIPtr uri = xmlParseURI(uristr);
 	if (uri) {
 		features = add_url_component(uri->path, features);
 
 		if (uri->server) {
-			replace(uri->server, strlen(uri->server), "www\\.", "");
+			strip_www(uri->server);
 			features = add_url_component(uri->server, features);
 		}
 
@@ -195,44 +205,134 @@ static Pvoid_t tokenize_uri(const char * uristr, Pvoid_t features) {
 	return features;
 }
 
-static Pvoid_t tokenize_uris(htmlDocPtr doc, Pvoid_t features) {
-	xmlTextReaderPtr reader = xmlReaderWalker(doc);
+/* Tokenizes HTML as it is parsed.
+ *
+ * Text is split into words as it arrives from the SAX parser. A word can
+ * be split across calls to characters, so the start of an unfinished word
+ * is kept in partial until the rest of it arrives. Each run of text ends
+ * at the next tag, comment or script, so the words either side of one
+ * are never joined.
+ */
+typedef struct HTML_TOKENIZER {
+	Pvoid_t features;
+	Buffer *partial;
+	/* Whether the word in partial started at the very start of the text */
+	int partial_at_start;
+	int seen_text;
+} HtmlTokenizer;
+
+static void end_html_text(HtmlTokenizer *tokenizer) {
+	if (tokenizer->partial->length) {
+		Buffer *partial = tokenizer->partial;
+		tokenizer->features = add_word(tokenizer->features, partial->buf, partial->buf + partial->length,
+		                               !tokenizer->partial_at_start, true);
+		partial->length = 0;
+	}
+}
 
-	while (xmlTextReaderRead(reader)) {
-		int type = xmlTextReaderNodeType(reader);
-		if (type == XML_ELEMENT_NODE) {
-			char *uri = (char *) xmlTextReaderGetAttribute(reader, BAD_CAST "href");
-			if (uri) {
-				features = tokenize_uri(uri, features);
-				free(uri);
+static void html_characters(void *ctx, const xmlChar *ch, int len) {
+	HtmlTokenizer *tokenizer = (HtmlTokenizer*) ctx;
+	const char *text = (const char*) ch;
+	const char *end = text + len;
+	const char *word = text;
+	const char *p;
+
+	for (p = text; p < end; p++) {
+		if (!word_chars[(unsigned char) *p]) {
+			if (tokenizer->partial->length) {
+				buffer_in(tokenizer->partial, word, p - word);
+				end_html_text(tokenizer);
+			} else if (p > word) {
+				tokenizer->features = add_word(tokenizer->features, word, p, tokenizer->seen_text || word != text, true);
 			}
 
-			uri = (char*) xmlTextReaderGetAttribute(reader, BAD_CAST "src");
-			if (uri) {
-				features = tokenize_uri(uri, features);
-				free(uri);
+			word = p + 1;
+		}
+	}
+
+	if (word < end) {
+		if (!tokenizer->partial->length) {
+			tokenizer->partial_at_start = !tokenizer->seen_text && word == text;
+		}
+
+		buffer_in(tokenizer->partial, word, end - word);
+	}
+
+	if (len > 0) {
+		tokenizer->seen_text = true;
+	}
+}
+
+static void html_start_element(void *ctx, const xmlChar *name, const xmlChar **atts) {
+	HtmlTokenizer *tokenizer = (HtmlTokenizer*) ctx;
+	end_html_text(tokenizer);
+
+	if (atts) {
+		int i;
+		for (i = 0; atts[i]; i += 2) {
+			if (atts[i + 1] && (xmlStrEqual(atts[i], BAD_CAST "href") || xmlStrEqual(atts[i], BAD_CAST "src"))) {
+				tokenizer->features = tokenize_uri((const char*) atts[i + 1], tokenizer->features);
 			}
 		}
 	}
+}
+
+static void html_end_element(void *ctx, const xmlChar *name) {
+	end_html_text((HtmlTokenizer*) ctx);
+}
 
-	xmlFreeTextReader(reader);
+static void html_end_text(void *ctx, const xmlChar *value) {
+	end_html_text((HtmlTokenizer*) ctx);
+}
 
-	return features;
+/* Script and style contents are not tokenized */
+static void html_cdata(void *ctx, const xmlChar *value, int len) {
+	end_html_text((HtmlTokenizer*) ctx);
+}
+
+static void html_ignore_characters(void *ctx, const xmlChar *ch, int len) {
+	end_html_text((HtmlTokenizer*) ctx);
+}
+
+static htmlSAXHandler html_tokenizer_sax = {
+	.startElement = html_start_element,
+	.endElement = html_end_element,
+	.characters = html_characters,
+	.ignorableWhitespace = html_ignore_characters,
+	.cdataBlock = html_cdata,
+	.comment = html_end_text
+};
+
+static htmlParserCtxtPtr start_html_tokenizer(HtmlTokenizer *tokenizer, Pvoid_t features) {
+	tokenizer->features = features;
+	tokenizer->partial = new_buffer(64);
+	tokenizer->partial_at_start = false;
+	tokenizer->seen_text = false;
+
+	return htmlCreatePushParserCtxt(&html_tokenizer_sax, tokenizer, NULL, 0, NULL, XML_CHAR_ENCODING_UTF8);
+}
+
+static Pvoid_t finish_html_tokenizer(HtmlTokenizer *tokenizer, htmlParserCtxtPtr parser) {
+	if (parser) {
+		htmlParseChunk(parser, NULL, 0, true);
+		htmlFreeParserCtxt(parser);
+	}
+
+	end_html_text(tokenizer);
+	free_buffer(tokenizer->partial);
+
+	return tokenizer->features;
 }
 
 Pvoid_t html_tokenize_into_features(const char * html, Pvoid_t features) {
-	xmlSubstituteEntitiesDefault(0);
-	htmlDocPtr doc = htmlParseDoc(BAD_CAST html, "UTF-8");
-
-	if (doc) {
-		Buffer *buf = extractText(doc);
-		features = tokenize_text(buf->buf, buf->length, features);
-		features = tokenize_uris(doc, features);
-		free_buffer(buf);
-		xmlFreeDoc(doc);
+	HtmlTokenizer tokenizer;
+	htmlParserCtxtPtr parser = start_html_tokenizer(&tokenizer, features);
+
+	if (parser) {
+		htmlParseChunk(parser, html, strlen(html), false);
 	}
 
-	return features;
+	return finish_html_tokenizer(&tokenizer, parser);
 }
 
 /** Tokenize a string of HTML.
@@ -244,44 +344,284 @@ Pvoid_t html_tokenize(const char * html) {
 	return html_tokenize_into_features(html, NULL);
 }
 
-Pvoid_t atom_tokenize(const char * atom) {
-	Pvoid_t features = NULL;
-
-	if (atom) {
-		xmlDocPtr doc = xmlParseDoc(BAD_CAST atom);
-		if (doc) {
-			xmlXPathContextPtr context = xmlXPathNewContext(doc);
-			xmlXPathRegisterNs(context, BAD_CAST "atom", BAD_CAST "http://www.w3.org/2005/Atom");
-
-			char *html = get_element_value(context, "/atom:entry/atom:content/text()");
-			if (html) {
-				features = html_tokenize_into_features(html, features);
-				xmlFree(html);
-			}
+#define ATOM_NS "http://www.w3.org/2005/Atom"
 
-			char *title = get_element_value(context, "/atom:entry/atom:title/text()");
-			if (title) {
-				features = tokenize_text(title, strlen(title), features);
-				xmlFree(title);
-			}
+typedef enum ATOM_FIELD {
+	NO_FIELD = 0,
+	CONTENT_FIELD = 1,
+	TITLE_FIELD = 2,
+	AUTHOR_FIELD = 4,
+	LINK_FIELD = 8,
+	ID_FIELD = 16,
+	UPDATED_FIELD = 32
+} AtomField;
+
+/* Tokenizes an Atom entry as it is parsed.
+ *
+ * Only the first content, title, author name and alternate link in the
+ * entry are used. The text of the content is handed straight to an HTML
+ * push parser as it arrives, so neither document is ever built in memory.
+ * The id and updated of the entry are picked up along the way.
+ */
+typedef struct ATOM_TOKENIZER {
+	Pvoid_t features;
+	/* Whether to extract features or just the id and updated */
+	int tokenize;
+	char *id;
+	char *updated;
+	int depth;
+	int in_entry;
+	int in_author;
+	/* The field the text at field_depth belongs to */
+	AtomField field;
+	int field_depth;
+	/* Fields that have already been found */
+	int seen;
+	Buffer *text;
+	HtmlTokenizer html;
+	htmlParserCtxtPtr content;
+} AtomTokenizer;
+
+static const xmlChar * attribute_value(const xmlChar **attributes, int nb_attributes, const char *name, int *length) {
+	int i;
+
+	for (i = 0; i < nb_attributes; i++) {
+		const xmlChar **attribute = attributes + i * 5;
+		if (attribute[2] == NULL && xmlStrEqual(attribute[0], BAD_CAST name)) {
+			*length = attribute[4] - attribute[3];
+			return attribute[3];
+		}
+	}
 
-			char *author = get_element_value(context, "/atom:entry/atom:author/atom:name/text()");
-			if (author) {
-				features = add_token(author, features);
-				xmlFree(author);
+	return NULL;
+}
+
+/* Copies an attribute value reported by the SAX2 parser.
+ *
+ * Without entity substitution the parser leaves each '&' escaped as
+ * "&#38;" in attribute values, so they are decoded here.
+ */
+static char * copy_attribute_value(const xmlChar *value, int length) {
+	char *copy = malloc(length + 1);
+
+	if (copy) {
+		const char *in = (const char*) value;
+		const char *end = in + length;
+		char *out = copy;
+
+		while (in < end) {
+			if (end - in >= 5 && !strncmp(in, "&#38;", 5)) {
+				*out++ = '&';
+				in += 5;
+			} else {
+				*out++ = *in++;
 			}
+		}
+
+		*out = '\0';
+	}
+
+	return copy;
+}
 
-			char *link = get_attribute_value(context, "/atom:entry/atom:link[@rel='alternate']", "href");
+static void atom_link(AtomTokenizer *tokenizer, const xmlChar **attributes, int nb_attributes) {
+	int length;
+	const xmlChar *rel = attribute_value(attributes, nb_attributes, "rel", &length);
+
+	if (rel && length == 9 && !strncmp((const char*) rel, "alternate", 9)) {
+		const xmlChar *href = attribute_value(attributes, nb_attributes, "href", &length);
+		tokenizer->seen |= LINK_FIELD;
+
+		if (href) {
+			char *link = copy_attribute_value(href, length);
 			if (link) {
-				features = tokenize_uri(link, features);
-				xmlFree(link);
+				tokenizer->features = tokenize_uri(link, tokenizer->features);
+				free(link);
 			}
+		}
+	}
+}
 
-			xmlXPathFreeContext(context);
+static void atom_start_element(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI,
+                               int nb_namespaces, const xmlChar **namespaces,
+                               int nb_attributes, int nb_defaulted, const xmlChar **attributes) {
+	AtomTokenizer *tokenizer = (AtomTokenizer*) ctx;
+	int atom = URI && xmlStrEqual(URI, BAD_CAST ATOM_NS);
+	AtomField field = NO_FIELD;
+
+	tokenizer->depth++;
+
+	if (tokenizer->depth == 1) {
+		tokenizer->in_entry = atom && xmlStrEqual(localname, BAD_CAST "entry");
+	} else if (tokenizer->in_entry && atom && tokenizer->depth == 2) {
+		if (xmlStrEqual(localname, BAD_CAST "id")) {
+			field = ID_FIELD;
+		} else if (xmlStrEqual(localname, BAD_CAST "updated")) {
+			field = UPDATED_FIELD;
+		} else if (!tokenizer->tokenize) {
+			/* Only the id and updated are wanted */
+		} else if (xmlStrEqual(localname, BAD_CAST "content")) {
+			field = CONTENT_FIELD;
+		} else if (xmlStrEqual(localname, BAD_CAST "title")) {
+			field = TITLE_FIELD;
+		} else if (xmlStrEqual(localname, BAD_CAST "author")) {
+			tokenizer->in_author = true;
+		} else if (xmlStrEqual(localname, BAD_CAST "link") && !(tokenizer->seen & LINK_FIELD)) {
+			atom_link(tokenizer, attributes, nb_attributes);
 		}
+	} else if (tokenizer->tokenize && tokenizer->in_author && atom && tokenizer->depth == 3 && xmlStrEqual(localname, BAD_CAST "name")) {
+		field = AUTHOR_FIELD;
+	}
+
+	if (field != NO_FIELD && !(tokenizer->seen & field)) {
+		tokenizer->field = field;
+		tokenizer->field_depth = tokenizer->depth;
+		tokenizer->seen |= field;
 
-		xmlFreeDoc(doc);
+		if (field == CONTENT_FIELD) {
+			tokenizer->content = start_html_tokenizer(&tokenizer->html, tokenizer->features);
+		}
 	}
+}
 
-	return features;
+static void atom_end_element(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI) {
+	AtomTokenizer *tokenizer = (AtomTokenizer*) ctx;
+
+	if (tokenizer->field != NO_FIELD && tokenizer->depth == tokenizer->field_depth) {
+		if (tokenizer->field == CONTENT_FIELD) {
+			tokenizer->features = finish_html_tokenizer(&tokenizer->html, tokenizer->content);
+			tokenizer->content = NULL;
+		} else {
+			buffer_in(tokenizer->text, "\0", 1);
+
+			if (tokenizer->field == ID_FIELD) {
+				/* An empty id is as good as a missing one. */
+				if (tokenizer->text->length > 1) {
+					tokenizer->id = strdup(tokenizer->text->buf);
+				}
+			} else if (tokenizer->field == UPDATED_FIELD) {
+				tokenizer->updated = strdup(tokenizer->text->buf);
+			} else if (tokenizer->field == TITLE_FIELD) {
+				tokenizer->features = tokenize_text(tokenizer->text->buf, tokenizer->features);
+			} else if (tokenizer->text->length > 1) {
+				tokenizer->features = add_token(tokenizer->text->buf, tokenizer->features);
+			}
+
+			tokenizer->text->length = 0;
+		}
+
+		tokenizer->field = NO_FIELD;
+	}
+
+	if (tokenizer->depth == 2) {
+		tokenizer->in_author = false;
+	}
+
+	tokenizer->depth--;
+}
+
+static void atom_characters(void *ctx, const xmlChar *ch, int len) {
+	AtomTokenizer *tokenizer = (AtomTokenizer*) ctx;
+
+	if (tokenizer->field == NO_FIELD || tokenizer->depth != tokenizer->field_depth) {
+		return;
+	}
+
+	if (tokenizer->field == CONTENT_FIELD) {
+		if (tokenizer->content) {
+			htmlParseChunk(tokenizer->content, (const char*) ch, len, false);
+		}
+	} else {
+		buffer_in(tokenizer->text, (const char*) ch, len);
+	}
+}
+
+static xmlSAXHandler atom_tokenizer_sax = {
+	.initialized = XML_SAX2_MAGIC,
+	.startElementNs = atom_start_element,
+	.endElementNs = atom_end_element,
+	.characters = atom_characters,
+	.cdataBlock = atom_characters
+};
+
+/** Parse an Atom entry in a single pass.
+ *
+ * @param atom The entry as Atom XML.
+ * @param length The number of bytes in atom.
+ * @param tokenize Whether to extract the entry's features as well as its id and updated.
+ * @param entry Filled in with what was found, each part is NULL if it was missing.
+ * @return true if the entry is well formed, otherwise entry is left empty.
+ */
+int atom_parse_entry(const char * atom, int length, int tokenize, AtomEntry * entry) {
+	int well_formed = false;
+	AtomTokenizer tokenizer;
+	xmlParserCtxtPtr parser;
+
+	memset(entry, 0, sizeof(AtomEntry));
+	if (NULL == atom) {
+		return false;
+	}
+
+	memset(&tokenizer, 0, sizeof(tokenizer));
+	tokenizer.tokenize = tokenize;
+	tokenizer.text = new_buffer(256);
+
+	if (NULL != (parser = xmlCreatePushParserCtxt(&atom_tokenizer_sax, &tokenizer, NULL, 0, NULL))) {
+		xmlParseChunk(parser, atom, length, true);
+
+		/* A content element left open by a broken document */
+		if (tokenizer.content) {
+			tokenizer.features = finish_html_tokenizer(&tokenizer.html, tokenizer.content);
+		}
+
+		well_formed = parser->wellFormed;
+		xmlFreeParserCtxt(parser);
+	}
+
+	if (well_formed) {
+		entry->id = tokenizer.id;
+		entry->updated = tokenizer.updated;
+		entry->features = tokenizer.features;
+	} else {
+		Word_t bytes;
+		free(tokenizer.id);
+		free(tokenizer.updated);
+		JSLFA(bytes, tokenizer.features);
+	}
+
+	free_buffer(tokenizer.text);
+	return well_formed;
+}
+
+/** Tokenize an Atom entry.
+ *
+ * @param atom The entry as an Atom XML string.
+ * @return an Array of Features, or NULL if the entry is not well formed.
+ */
+Pvoid_t atom_tokenize(const char * atom) {
+	AtomEntry entry;
+
+	if (atom_parse_entry(atom, atom ? strlen(atom) : 0, true, &entry)) {
+		free(entry.id);
+		free(entry.updated);
+	}
+
+	return entry.features;
+}
+
+/* 32 bit FNV-1a of the feature, folded into the positive range of an int
+ * since token ids are stored as ints. 0 is never returned so a hashed id
+ * can't be mistaken for a missing one.
+ */
+int token_hash(const char * feature) {
+	const unsigned char *p;
+	unsigned int hash = 2166136261U;
+
+	for (p = (const unsigned char*) feature; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619U;
+	}
+
+	hash = (hash >> 31) ^ (hash & 0x7fffffff);
+	return hash ? (int) hash : 1;
 }
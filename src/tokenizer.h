@@ -29,7 +29,21 @@
 #define TOKENIZER_H_
 #include <Judy.h>
 
+/* What atom_parse_entry finds in an Atom entry. */
+typedef struct ATOM_ENTRY {
+  char *id;
+  char *updated;
+  /* The features atom_tokenize would return, if they were asked for. */
+  Pvoid_t features;
+} AtomEntry;
+
 Pvoid_t html_tokenize(const char * html);
 Pvoid_t atom_tokenize(const char * atom);
+int atom_parse_entry(const char * atom, int length, int tokenize, AtomEntry * entry);
+
+/* Name of the hash token_hash computes, recorded in item caches that use it. */
+#define TOKEN_HASH_FUNCTION "fnv1a-31"
+
+int token_hash(const char * feature);
 
 #endif /* TOKENIZER_H_ */
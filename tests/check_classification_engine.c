@@ -26,12 +26,15 @@
 
 #include <check.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "assertions.h"
 #include "../src/classification_engine.h"
 #include "../src/logging.h"
 #include "../src/item_cache.h"
 #include "../src/fetch_url.h"
 #include "fixtures.h"
+#include "read_document.h"
 
 #define TAG_ID "http://localhost:8000/test.atom"
 #define BOGUS_TAG_ID 11111
@@ -108,6 +111,20 @@ START_TEST(cancelling_a_job_sets_its_state_to_cancelled) {
   assert_equal(CJOB_STATE_CANCELLED, job->state);
 } END_TEST
 
+START_TEST(batched_new_items_jobs_queue_one_entry_per_batch) {
+  Array *tag_urls = create_array(3);
+  arr_add(tag_urls, strdup(TAG_ID));
+  arr_add(tag_urls, strdup(TAG_ID));
+  arr_add(tag_urls, strdup(TAG_ID));
+
+  opts.tags_per_batch = 2;
+  assert_equal(3, ce_add_classify_new_items_jobs(ce, tag_urls));
+  opts.tags_per_batch = 0;
+
+  assert_equal(2, ce_num_waiting_jobs(ce));
+  free_array(tag_urls);
+} END_TEST
+
 START_TEST(suspended_classification_engine_processes_no_jobs) {
   ce_add_classification_job(ce, TAG_ID);
   ce_add_classification_job(ce, TAG_ID);
@@ -150,6 +167,253 @@ START_TEST (remove_classification_job_wont_removes_the_job_from_the_engines_job_
   assert_not_null(j2);
 } END_TEST
 
+/************************************************************************
+ * Classification tests
+ ************************************************************************/
+#define OTHER_TAG_ID "http://localhost:8000/other.atom"
+
+static char *tag_document;
+static pthread_mutex_t saved_taggings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *saved_taggings[2];
+static int times_saved;
+
+/* Returns a copy of document with the first occurrence of from replaced by to. */
+static char * replace_in_document(const char *document, const char *from, const char *to) {
+  const char *at = strstr(document, from);
+  char *replaced = calloc(strlen(document) + strlen(to) + 1, sizeof(char));
+
+  strncpy(replaced, document, at - document);
+  strcat(replaced, to);
+  strcat(replaced, at + strlen(from));
+  return replaced;
+}
+
+/* Serves complete_tag.atom for TAG_ID and the same tag with a different bias for
+ * OTHER_TAG_ID, both last classified before any of the items in the fixture. */
+static int serve_tag_document(const char * tag_url, time_t last_updated, const Credentials * ignore, char ** document, char ** errmsg) {
+  char *classified = replace_in_document(tag_document, "2008-04-15T01:16:23Z", "2007-01-01T00:00:00Z");
+
+  if (!strcmp(tag_url, OTHER_TAG_ID)) {
+    *document = replace_in_document(classified, "<ns1:bias>1.2</ns1:bias>", "<ns1:bias>0.8</ns1:bias>");
+    free(classified);
+  } else {
+    *document = classified;
+  }
+
+  return TAG_OK;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*((char * const *) a), *((char * const *) b));
+}
+
+/* Saves the taggings for a tag as a sorted list of item ids and strengths. */
+static int record_taggings(const Tagger * tagger, Array * taggings, const Credentials * ignore, char ** errmsg) {
+  char **lines = calloc(taggings->size + 1, sizeof(char*));
+  char *recorded = calloc(taggings->size * 64 + 1, sizeof(char));
+  int i;
+
+  for (i = 0; i < taggings->size; i++) {
+    Tagging *tagging = (Tagging*) taggings->elements[i];
+    lines[i] = calloc(64, sizeof(char));
+    snprintf(lines[i], 64, "%s %.6f\n", tagging->item_id, tagging->strength);
+  }
+
+  qsort(lines, taggings->size, sizeof(char*), compare_strings);
+
+  for (i = 0; i < taggings->size; i++) {
+    strcat(recorded, lines[i]);
+    free(lines[i]);
+  }
+
+  free(lines);
+
+  pthread_mutex_lock(&saved_taggings_mutex);
+  i = strcmp(tagger->training_url, TAG_ID) ? 1 : 0;
+  free(saved_taggings[i]);
+  saved_taggings[i] = recorded;
+  times_saved++;
+  pthread_mutex_unlock(&saved_taggings_mutex);
+
+  return 0;
+}
+
+/* Waits up to 10 seconds for taggings to have been saved this many times. */
+static int wait_for_taggings(int times) {
+  int waited;
+
+  for (waited = 0; waited < 100; waited++) {
+    int saved;
+
+    pthread_mutex_lock(&saved_taggings_mutex);
+    saved = times_saved;
+    pthread_mutex_unlock(&saved_taggings_mutex);
+
+    if (saved >= times) {
+      return true;
+    }
+
+    usleep(100000);
+  }
+
+  return false;
+}
+
+/* Runs the jobs for both tags through an engine and takes their taggings. */
+static void classify_both_tags(int batched, int threads_per_job, char **taggings) {
+  ClassificationEngine *engine = create_classification_engine(item_cache, tagger_cache, &opts);
+
+  times_saved = 0;
+  opts.threads_per_job = threads_per_job;
+
+  if (batched) {
+    Array *tag_urls = create_array(2);
+    arr_add(tag_urls, strdup(TAG_ID));
+    arr_add(tag_urls, strdup(OTHER_TAG_ID));
+    opts.tags_per_batch = 2;
+    assert_equal(2, ce_add_classify_new_items_jobs(engine, tag_urls));
+    free_array(tag_urls);
+  } else {
+    opts.tags_per_batch = 0;
+    ce_add_classification_job(engine, TAG_ID);
+    ce_add_classification_job(engine, OTHER_TAG_ID);
+  }
+
+  ce_start(engine);
+  assert_true(wait_for_taggings(2));
+  ce_stop(engine);
+  free_classification_engine(engine);
+
+  taggings[0] = saved_taggings[0];
+  taggings[1] = saved_taggings[1];
+  saved_taggings[0] = saved_taggings[1] = NULL;
+  assert_not_null(taggings[0]);
+  assert_not_null(taggings[1]);
+}
+
+static int collect_items(const Item *item, void *memo) {
+  const Item **items = (const Item **) memo;
+  int n;
+
+  for (n = 0; items[n]; n++);
+  items[n] = item;
+  return CLASSIFIER_OK;
+}
+
+/* Adds variations of the fixture's items to the cache, each missing a
+ * different few of the tokens, so there are enough items for a parallel
+ * job to split them into several chunks. */
+static void add_item_variations(int num_variations) {
+  const Item *items[11] = {NULL};
+  int n;
+
+  item_cache_each_item(item_cache, collect_items, items);
+
+  for (n = 0; n < num_variations; n++) {
+    const Item *source = items[n % 10];
+    const Token *source_tokens = item_get_tokens(source);
+    int tokens[item_get_num_tokens(source)][2];
+    int num_tokens = 0;
+    int t;
+
+    for (t = 0; t < item_get_num_tokens(source); t++) {
+      if (t % 7 != n % 7) {
+        tokens[num_tokens][0] = source_tokens[t].id;
+        tokens[num_tokens][1] = source_tokens[t].frequency;
+        num_tokens++;
+      }
+    }
+
+    char id[64];
+    snprintf(id, sizeof(id), "urn:peerworks.org:variation#%i", n);
+    item_cache_add_item(item_cache, create_item_with_tokens_and_time((unsigned char*) id, tokens, num_tokens,
+                                                                     item_get_time(source) - n));
+  }
+}
+
+static void setup_classification() {
+  setup_fixture_path();
+  tag_document = read_document("fixtures/complete_tag.atom");
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  item_cache_load(item_cache);
+  tagger_cache = create_tagger_cache(item_cache, NULL);
+  tagger_cache->tag_retriever = &serve_tag_document;
+  tagger_cache->taggings_updater = &record_taggings;
+  tagger_cache->taggings_replacer = &record_taggings;
+  opts.positive_threshold = 0.9;
+}
+
+static void teardown_classification() {
+  opts.positive_threshold = 0.0;
+  opts.tags_per_batch = 0;
+  opts.threads_per_job = 0;
+  free_tagger_cache(tagger_cache);
+  free_item_cache(item_cache);
+  free(tag_document);
+  teardown_fixture_path();
+}
+
+START_TEST (batched_jobs_save_the_same_taggings_as_single_jobs) {
+  char *single[2];
+  char *batched[2];
+
+  classify_both_tags(false, 1, single);
+  /* The batch's taggers are prepared by two threads */
+  classify_both_tags(true, 2, batched);
+
+  assert_true(strlen(single[0]) > 0);
+  assert_equal_s(single[0], batched[0]);
+  assert_equal_s(single[1], batched[1]);
+  assert_true(strcmp(single[0], single[1]));
+
+  free(single[0]);
+  free(single[1]);
+  free(batched[0]);
+  free(batched[1]);
+} END_TEST
+
+START_TEST (parallel_jobs_save_the_same_taggings_as_single_threaded_jobs) {
+  char *single[2];
+  char *parallel[2];
+
+  add_item_variations(2000);
+  classify_both_tags(false, 1, single);
+  classify_both_tags(false, 4, parallel);
+
+  assert_true(strlen(single[0]) > 0);
+  assert_equal_s(single[0], parallel[0]);
+  assert_equal_s(single[1], parallel[1]);
+
+  free(single[0]);
+  free(single[1]);
+  free(parallel[0]);
+  free(parallel[1]);
+} END_TEST
+
+START_TEST (new_items_jobs_save_the_tagger_snapshot_with_when_it_was_classified) {
+  TaggerCacheOptions snapshot_options = {NULL, NULL, "/tmp/valid-copy/taggers"};
+  char *taggings[2];
+  time_t started = time(NULL);
+
+  system("mkdir /tmp/valid-copy/taggers");
+  free_tagger_cache(tagger_cache);
+  tagger_cache = create_tagger_cache(item_cache, &snapshot_options);
+  tagger_cache->tag_retriever = &serve_tag_document;
+  tagger_cache->taggings_updater = &record_taggings;
+  tagger_cache->taggings_replacer = &record_taggings;
+
+  classify_both_tags(true, 1, taggings);
+
+  Tagger *tagger = calloc(1, sizeof(struct TAGGER));
+  assert_equal(TAGGER_OK, load_tagger_snapshot(tagger, "/tmp/valid-copy/taggers", TAG_ID, item_cache_random_background(item_cache)));
+  assert_true(tagger->last_classified >= started);
+
+  free_tagger(tagger);
+  free(taggings[0]);
+  free(taggings[1]);
+} END_TEST
+
 /************************************************************************
  * Initialization tests.
  ************************************************************************/
@@ -200,14 +464,25 @@ Suite * classification_engine_suite(void) {
   tcase_add_test(tc_jt_case, retrieve_job_via_id);
   tcase_add_test(tc_jt_case, cancelling_a_job_sets_its_state_to_cancelled);
   tcase_add_test(tc_jt_case, cancelling_a_job_removes_it_from_the_system_once_a_worker_gets_to_it);
+  tcase_add_test(tc_jt_case, batched_new_items_jobs_queue_one_entry_per_batch);
   tcase_add_test(tc_jt_case, suspended_classification_engine_processes_no_jobs);
   //tcase_add_test(tc_jt_case, resuming_suspended_engine_processes_jobs);
   tcase_add_test(tc_jt_case, remove_classification_job_removes_the_job_from_the_engines_job_index_if_job_is_complete);
   tcase_add_test(tc_jt_case, remove_classification_job_wont_removes_the_job_from_the_engines_job_index_if_job_is_not_complete);
   // END_TESTS
 
+  TCase *tc_classification_case = tcase_create("classification");
+  tcase_add_checked_fixture(tc_classification_case, setup_classification, teardown_classification);
+  tcase_set_timeout(tc_classification_case, 30);
+  // START_TESTS
+  tcase_add_test(tc_classification_case, batched_jobs_save_the_same_taggings_as_single_jobs);
+  tcase_add_test(tc_classification_case, parallel_jobs_save_the_same_taggings_as_single_threaded_jobs);
+  tcase_add_test(tc_classification_case, new_items_jobs_save_the_tagger_snapshot_with_when_it_was_classified);
+  // END_TESTS
+
   suite_add_tcase(s, tc_initialization_case);
   suite_add_tcase(s, tc_jt_case);
+  suite_add_tcase(s, tc_classification_case);
   // TODO suite_add_tcase(s, tc_end_to_end);
   return s;
 }
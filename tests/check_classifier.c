@@ -70,6 +70,41 @@ START_TEST (test_probability_hook_with_bias) {
   free_item(i2);
 } END_TEST
 
+START_TEST (precompute_hook_matches_the_probability_hook_for_every_token) {
+  int tokens_1[][2] = {1, 5, 2, 15, 4, 1};
+  int tokens_2[][2] = {1, 5, 3, 5};
+  int tokens_3[][2] = {2, 3, 3, 7, 5, 2, 6, 9};
+  Item *i1 = create_item_with_tokens((unsigned char*) "1", tokens_1, 3);
+  Item *i2 = create_item_with_tokens((unsigned char*) "2", tokens_2, 2);
+  Item *i3 = create_item_with_tokens((unsigned char*) "3", tokens_3, 4);
+  
+  Pool *rb = new_pool();
+  Pool *positive_pool = new_pool();
+  Pool *negative_pool = new_pool();
+  pool_add_item(positive_pool, i1);
+  pool_add_item(negative_pool, i2);
+  pool_add_item(rb, i3);
+  
+  ClueList *clues = new_clue_list();
+  naive_bayes_precompute(clues, positive_pool, negative_pool, rb, 1.1);
+  assert_equal(6, clues->size);
+  
+  int token_id;
+  for (token_id = 1; token_id <= 6; token_id++) {
+    Clue *clue = get_clue(clues, token_id);
+    assert_not_null(clue);
+    assert_equal_f(naive_bayes_probability(positive_pool, negative_pool, rb, token_id, 1.1), clue->probability);
+  }
+  
+  free_clue_list(clues);
+  free_pool(rb);
+  free_pool(positive_pool);
+  free_pool(negative_pool);
+  free_item(i1);
+  free_item(i2);
+  free_item(i3);
+} END_TEST
+
 #define TOKEN_PROBS(pc, ps, nc, ns, bc, bs)         \
       ProbToken positive, negative, random; \
       positive.token_count = pc;                    \
@@ -175,6 +210,16 @@ START_TEST (clue_selection_sorted_by_strength) {
   free_item(item);
 } END_TEST
 
+START_TEST (candidate_tokens_are_the_strong_positive_clues) {
+  int num_tokens;
+  int *tokens = naive_bayes_candidate_tokens(&clues, &num_tokens);
+  assert_not_null(tokens);
+  assert_equal(2, num_tokens);
+  assert_equal(1, tokens[0]);
+  assert_equal(4, tokens[1]);
+  free(tokens);
+} END_TEST
+
 START_TEST (classify_1) {
   int tokens[][2] = {10, 10};
   Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 1);
@@ -256,6 +301,30 @@ START_TEST (classify_10) {
   free_item(item);
 } END_TEST
 
+START_TEST (classify_only_uses_the_strongest_clues_of_a_long_item) {
+  ClueList *long_clues = new_clue_list();
+  int with_weak_clues[400][2];
+  int without_weak_clues[400][2];
+  int t;
+  
+  for (t = 0; t < 200; t++) {
+    add_clue(long_clues, 1000 + t, 0.9);
+    add_clue(long_clues, 2000 + t, 0.35);
+    with_weak_clues[t][0] = without_weak_clues[t][0] = 1000 + t;
+    with_weak_clues[t + 200][0] = 2000 + t;
+    without_weak_clues[t + 200][0] = 3000 + t;
+    with_weak_clues[t][1] = with_weak_clues[t + 200][1] = 1;
+    without_weak_clues[t][1] = without_weak_clues[t + 200][1] = 1;
+  }
+  
+  Item *item = create_item_with_tokens((unsigned char*) "1", with_weak_clues, 400);
+  Item *expected_item = create_item_with_tokens((unsigned char*) "2", without_weak_clues, 400);
+  assert_equal_f(naive_bayes_classify(long_clues, expected_item), naive_bayes_classify(long_clues, item));
+  free_item(item);
+  free_item(expected_item);
+  free_clue_list(long_clues);
+} END_TEST
+
 /*************************************************************
  *   Unit tests for chi2q(double, int)
  *
@@ -284,6 +353,11 @@ START_TEST (chi2_test3) {
 START_TEST (chi2_test4) {
   assert_equal_f(0.52169717971, chi2Q(300, 300));
 } END_TEST
+
+START_TEST (chi2_with_large_x2_does_not_underflow) {
+  assert_equal_f(1.0, chi2Q(1600.0, 2000));
+  assert_equal_f(0.0, chi2Q(1600.0, 1200));
+} END_TEST
   
 Suite *
 classifier_suite(void) {
@@ -296,11 +370,13 @@ classifier_suite(void) {
   tcase_add_test(tc_chi2, chi2_test2);
   tcase_add_test(tc_chi2, chi2_test3);
   tcase_add_test(tc_chi2, chi2_test4);
+  tcase_add_test(tc_chi2, chi2_with_large_x2_does_not_underflow);
   suite_add_tcase(s, tc_chi2);
 
   TCase *tc_precomputer = tcase_create("Precomputer");
   tcase_add_checked_fixture(tc_precomputer, setup_mock_items, teardown_mock_items);
   tcase_add_test(tc_precomputer, test_probability_hook_with_bias);
+  tcase_add_test(tc_precomputer, precompute_hook_matches_the_probability_hook_for_every_token);
   tcase_add_test(tc_precomputer, probability_1);
   tcase_add_test(tc_precomputer, probability_2);
   tcase_add_test(tc_precomputer, probability_3);
@@ -314,6 +390,7 @@ classifier_suite(void) {
   tcase_add_checked_fixture(tc_classifier, setup_classifier_test, teardown_classifier_test);
   tcase_add_test(tc_classifier, clue_selection_filters_out_weak_clues);
   tcase_add_test(tc_classifier, clue_selection_sorted_by_strength);
+  tcase_add_test(tc_classifier, candidate_tokens_are_the_strong_positive_clues);
   tcase_add_test(tc_classifier, classify_1);
   tcase_add_test(tc_classifier, classify_2);
   tcase_add_test(tc_classifier, classify_3);
@@ -324,6 +401,7 @@ classifier_suite(void) {
   tcase_add_test(tc_classifier, classify_8);
   tcase_add_test(tc_classifier, classify_9);
   tcase_add_test(tc_classifier, classify_10);
+  tcase_add_test(tc_classifier, classify_only_uses_the_strongest_clues_of_a_long_item);
   suite_add_tcase(s, tc_classifier);
   
   return s;
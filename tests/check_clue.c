@@ -71,6 +71,93 @@ START_TEST (test_can_get_clue_by_token_id) {
   assert_equal_f(0.45, clue->strength);
 } END_TEST
 
+START_TEST (test_can_get_clues_after_the_list_grows) {
+  ClueList *clues = new_clue_list();
+  int i;
+  for (i = 1; i <= 5000; i++) {
+    add_clue(clues, i * 7, 0.5 + i / 20000.0);
+  }
+  
+  assert_equal(5000, clues->size);
+  for (i = 1; i <= 5000; i++) {
+    Clue *clue = get_clue(clues, i * 7);
+    assert_not_null(clue);
+    assert_equal(i * 7, clue->token_id);
+    assert_equal_f(0.5 + i / 20000.0, clue->probability);
+  }
+  
+  assert_null(get_clue(clues, 8));
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_removing_clues_leaves_the_others_reachable) {
+  ClueList *clues = new_clue_list();
+  int i;
+  for (i = 1; i <= 5000; i++) {
+    add_clue(clues, i * 7, 0.5 + i / 20000.0);
+  }
+  
+  for (i = 1; i <= 5000; i += 2) {
+    remove_clue(clues, i * 7);
+  }
+  
+  assert_equal(2500, clues->size);
+  for (i = 1; i <= 5000; i++) {
+    Clue *clue = get_clue(clues, i * 7);
+    if (i % 2) {
+      assert_null(clue);
+    } else {
+      assert_not_null(clue);
+      assert_equal_f(0.5 + i / 20000.0, clue->probability);
+    }
+  }
+  
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_set_clue_updates_an_existing_clue) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  set_clue(clues, 1234, 0.15);
+  
+  assert_equal(1, clues->size);
+  assert_equal_f(0.15, get_clue(clues, 1234)->probability);
+  assert_equal_f(0.35, get_clue(clues, 1234)->strength);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_next_clue_visits_every_clue_once) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  add_clue(clues, 4321, 0.15);
+  add_clue(clues, 99, 0.5);
+  
+  int position = 0;
+  int sum = 0, count = 0;
+  const Clue *clue;
+  while (NULL != (clue = next_clue(clues, &position))) {
+    sum += clue->token_id;
+    count++;
+  }
+  
+  assert_equal(3, count);
+  assert_equal(1234 + 4321 + 99, sum);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_get_strong_clue_only_returns_strong_clues) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  add_clue(clues, 4321, 0.55);
+  index_strong_clues(clues, 0.1);
+  
+  assert_not_null(get_strong_clue(clues, 1234, 0.1));
+  assert_null(get_strong_clue(clues, 4321, 0.1));
+  assert_null(get_strong_clue(clues, 5555, 0.1));
+  assert_not_null(get_strong_clue(clues, 4321, 0.05));
+  free_clue_list(clues);
+} END_TEST
+
 Suite *
 clue_suite(void) {
   Suite *s = suite_create("Clues");  
@@ -83,6 +170,11 @@ clue_suite(void) {
   tcase_add_test(tc_clue, test_adding_clue_to_list_increments_size);
   tcase_add_test(tc_clue, test_adding_same_clue_to_list_twice_increments_size_once);
   tcase_add_test(tc_clue, test_can_get_clue_by_token_id);  
+  tcase_add_test(tc_clue, test_can_get_clues_after_the_list_grows);
+  tcase_add_test(tc_clue, test_removing_clues_leaves_the_others_reachable);
+  tcase_add_test(tc_clue, test_set_clue_updates_an_existing_clue);
+  tcase_add_test(tc_clue, test_next_clue_visits_every_clue_once);
+  tcase_add_test(tc_clue, test_get_strong_clue_only_returns_strong_clues);
 // END_TESTS
 
   suite_add_tcase(s, tc_clue);
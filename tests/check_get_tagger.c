@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <sqlite3.h>
 #include "assertions.h"
 #include "fixtures.h"
@@ -186,6 +187,81 @@ START_TEST (test_get_cached_tagger_triggers_conditional_get_with_tags_updated_ti
 } END_TEST
 
 
+/******* Snapshot tests *********/
+
+static TaggerCacheOptions snapshot_options = {NULL, NULL, "/tmp/valid-copy/taggers"};
+
+static void setup_for_snapshots(void) {
+  setup_fixture_path();
+  document = read_document("fixtures/complete_tag.atom");
+  system("rm -Rf /tmp/valid-copy && cp -Rf fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy && mkdir /tmp/valid-copy/taggers");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  item_cache_load(item_cache);
+  load_tag_document_called = 0;
+  tagger_cache = create_tagger_cache(item_cache, &snapshot_options);
+  tagger_cache->tag_retriever = &load_tag_document;
+}
+
+START_TEST (test_restarted_tagger_cache_loads_the_tagger_from_its_snapshot) {
+  Tagger *tagger = NULL;
+  get_tagger(tagger_cache, "http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom", &tagger, NULL);
+  int num_clues = tagger->clues->size;
+  int num_positive_tokens = pool_total_tokens(tagger->positive_pool);
+  double probability = get_clue(tagger->clues, 1)->probability;
+  time_t updated = tagger->updated;
+  release_tagger(tagger_cache, tagger);
+  free_tagger_cache(tagger_cache);
+
+  tagger_cache = create_tagger_cache(item_cache, &snapshot_options);
+  tagger_cache->tag_retriever = &load_tag_document;
+  int rc = get_tagger(tagger_cache, "http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom", &tagger, NULL);
+
+  assert_equal(TAGGER_OK, rc);
+  assert_equal(2, load_tag_document_called);
+  assert_equal(updated, last_updated_called);
+  assert_equal(TAGGER_PRECOMPUTED, tagger->state);
+  assert_equal(num_clues, tagger->clues->size);
+  assert_equal(num_positive_tokens, pool_total_tokens(tagger->positive_pool));
+  assert_equal_f(probability, get_clue(tagger->clues, 1)->probability);
+  assert_equal_s("http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom", tagger->training_url);
+} END_TEST
+
+START_TEST (test_snapshot_is_ignored_without_a_snapshot_directory) {
+  Tagger *tagger = NULL;
+  get_tagger(tagger_cache, "http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom", &tagger, NULL);
+  release_tagger(tagger_cache, tagger);
+  free_tagger_cache(tagger_cache);
+
+  tagger_cache = create_tagger_cache(item_cache, NULL);
+  tagger_cache->tag_retriever = &load_tag_document;
+  int rc = get_tagger(tagger_cache, "http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom", &tagger, NULL);
+
+  /* Without the snapshot there is nothing to revalidate so the unmodified response is a miss */
+  assert_equal(TAG_NOT_FOUND, rc);
+  assert_equal(-1, last_updated_called);
+} END_TEST
+
+START_TEST (test_snapshot_without_a_random_background_needs_no_random_background) {
+  Tagger *tagger = NULL;
+  get_tagger(tagger_cache, "http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom", &tagger, NULL);
+  const Pool *random_background = tagger->random_background;
+  tagger->random_background = NULL;
+  assert_equal(TAGGER_OK, save_tagger_snapshot(tagger, "/tmp/valid-copy/taggers"));
+  tagger->random_background = random_background;
+  release_tagger(tagger_cache, tagger);
+
+  /* An empty random background mustn't match the lack of one */
+  Pool *empty = new_pool();
+  Tagger *loaded = calloc(1, sizeof(struct TAGGER));
+  assert_equal(TAG_NOT_FOUND, load_tagger_snapshot(loaded, "/tmp/valid-copy/taggers", tagger->training_url, empty));
+  free_tagger(loaded);
+
+  loaded = calloc(1, sizeof(struct TAGGER));
+  assert_equal(TAGGER_OK, load_tagger_snapshot(loaded, "/tmp/valid-copy/taggers", tagger->training_url, NULL));
+  free_tagger(loaded);
+  free_pool(empty);
+} END_TEST
+
 /******* Missing item tests *********/
 
 START_TEST (test_get_tagger_that_returns_a_incomplete_valid_document_returns_TAGGER_OK) {
@@ -297,9 +373,16 @@ check_get_tagger_suite(void) {
   tcase_add_test(tc_updating, test_updating_tagger_has_later_timestamp);
   tcase_add_test(tc_updating, test_updated_tagger_gets_cached);
 
+  TCase *tc_snapshots = tcase_create("Snapshot case");
+  tcase_add_checked_fixture(tc_snapshots, setup_for_snapshots, teardown);
+  tcase_add_test(tc_snapshots, test_restarted_tagger_cache_loads_the_tagger_from_its_snapshot);
+  tcase_add_test(tc_snapshots, test_snapshot_is_ignored_without_a_snapshot_directory);
+  tcase_add_test(tc_snapshots, test_snapshot_without_a_random_background_needs_no_random_background);
+
   suite_add_tcase(s, tc_incomplete_case);
   suite_add_tcase(s, tc_case);
   suite_add_tcase(s, tc_updating);
+  suite_add_tcase(s, tc_snapshots);
   return s;
 }
 
@@ -24,7 +24,9 @@
 
 // contact@winnowtag.org
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <check.h>
 #include "fixtures.h"
@@ -91,6 +93,24 @@ START_TEST(should_strip_out_html_entities) {
 	assertFeatures(html, tokens, freq, 3);
 } END_TEST
 
+START_TEST(should_strip_dashes_from_the_ends_of_words) {
+	char *html = "<p>text --lead trail-- in--word - x-</p>";
+	char *tokens[] = {"t:text", "t:lead", "t:trail", "t:in--word"};
+	int freq[] = {1, 1, 1, 1};
+	Pvoid_t features = html_tokenize(html);
+	char token[256] = "";
+	Word_t *PValue;
+	int count = 0;
+
+	JSLF(PValue, features, token);
+	while (PValue != NULL) {
+		count++;
+		JSLN(PValue, features, token);
+	}
+	assert_equal(4, count);
+	assertFeaturesEqual(features, tokens, freq, 4);
+} END_TEST
+
 START_TEST(should_remove_single_characters) {
 	char *html = "<p>text <span>html</span> content a</p>";
 	char *tokens[] = {"t:html", "t:text", "t:content"};
@@ -131,6 +151,60 @@ START_TEST(should_fold_case_with_atom_properties) {
 	assertEntryFeatures(atom, tokens, freq, 7);
 } END_TEST
 
+START_TEST(should_tokenize_long_text_in_entries) {
+	char atom[4096];
+	int i, length;
+
+	length = sprintf(atom, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+	                       "<entry xmlns=\"http://www.w3.org/2005/Atom\">"
+	                       "<link rel=\"self\" href=\"http://example.org/self\"/>"
+	                       "<link rel=\"alternate\" href=\"http://www.example.org/a?b=1&amp;c=2\"/>"
+	                       "<content type=\"html\">&lt;p&gt;");
+	for (i = 0; i < 200; i++) {
+		length += sprintf(atom + length, "word ");
+	}
+	sprintf(atom + length, "&lt;/p&gt;</content></entry>");
+
+	char *tokens[] = {"t:word", "URLSeg:example.org", "URLSeg:/a"};
+	int freq[] = {200, 1, 1};
+	assertEntryFeatures(atom, tokens, freq, 3);
+} END_TEST
+
+START_TEST(should_not_tokenize_broken_entries) {
+	assert_null(atom_tokenize("<entry xmlns=\"http://www.w3.org/2005/Atom\"><title>Title</entry>"));
+} END_TEST
+
+START_TEST(should_parse_the_id_and_updated_of_entries) {
+	const char *atom = "<entry xmlns=\"http://www.w3.org/2005/Atom\"><id>urn:entry:1</id>"
+	                   "<title>Title</title><updated>2008-01-01T00:00:00Z</updated>"
+	                   "<author><name>Author</name><id>not the entry</id></author></entry>";
+	AtomEntry entry;
+
+	assert_true(atom_parse_entry(atom, strlen(atom), false, &entry));
+	assert_equal_s("urn:entry:1", entry.id);
+	assert_equal_s("2008-01-01T00:00:00Z", entry.updated);
+	assert_null(entry.features);
+	free(entry.id);
+	free(entry.updated);
+
+	assert_true(atom_parse_entry(atom, strlen(atom), true, &entry));
+	assert_equal_s("urn:entry:1", entry.id);
+	assert_not_null(entry.features);
+	free(entry.id);
+	free(entry.updated);
+	Word_t bytes;
+	JSLFA(bytes, entry.features);
+} END_TEST
+
+START_TEST(should_not_parse_broken_entries) {
+	const char *atom = "<entry xmlns=\"http://www.w3.org/2005/Atom\"><id>urn:entry:1</id><title>Title</entry>";
+	AtomEntry entry;
+
+	assert_false(atom_parse_entry(atom, strlen(atom), true, &entry));
+	assert_null(entry.id);
+	assert_null(entry.features);
+} END_TEST
+
 Suite *
 pool_suite(void) {
   Suite *s = suite_create("HTML Tokenizer");
@@ -141,10 +215,15 @@ pool_suite(void) {
   tcase_add_test(tcase, should_fold_case);
   tcase_add_test(tcase, should_strip_out_punctuation);
   tcase_add_test(tcase, should_strip_out_html_entities);
+  tcase_add_test(tcase, should_strip_dashes_from_the_ends_of_words);
   tcase_add_test(tcase, should_remove_single_characters);
   tcase_add_test(tcase, should_aggregate_tokens);
   tcase_add_test(tcase, should_split_html_from_content);
   tcase_add_test(tcase, should_fold_case_with_atom_properties);
+  tcase_add_test(tcase, should_tokenize_long_text_in_entries);
+  tcase_add_test(tcase, should_not_tokenize_broken_entries);
+  tcase_add_test(tcase, should_parse_the_id_and_updated_of_entries);
+  tcase_add_test(tcase, should_not_parse_broken_entries);
   suite_add_tcase(s, tcase);
 
   return s;
@@ -28,13 +28,16 @@
 #include "fixtures.h"
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include "assertions.h"
 #include "read_document.h"
 #include "../src/item_cache.h"
 #include "../src/misc.h"
 #include "../src/item_cache.h"
 #include "../src/logging.h"
+#include "../src/tokenizer.h"
 #include <sqlite3.h>
+#include <pthread.h>
 
 static ItemCacheOptions item_cache_options = {1, 3650, 2};
 
@@ -65,6 +68,41 @@ START_TEST (create_with_valid_db) {
   teardown_fixture_path();
 } END_TEST
 
+START_TEST (create_item_with_unordered_tokens_sorts_them) {
+  int tokens[][2] = {{9, 2}, {3, 1}, {12, 4}, {1, 1}};
+  Item *item = create_item_with_tokens((unsigned char*) "id", tokens, 4);
+  assert_equal(4, item_get_num_tokens(item));
+  assert_equal(8, item_get_total_tokens(item));
+
+  const Token *item_tokens = item_get_tokens(item);
+  assert_equal(1, item_tokens[0].id);
+  assert_equal(3, item_tokens[1].id);
+  assert_equal(9, item_tokens[2].id);
+  assert_equal(2, item_tokens[2].frequency);
+  assert_equal(12, item_tokens[3].id);
+
+  int token_id = 3;
+  short frequency;
+  assert_true(item_next_token(item, &token_id, &frequency));
+  assert_equal(9, token_id);
+  assert_equal(2, frequency);
+  free_item(item);
+} END_TEST
+
+START_TEST (adding_a_token_twice_adds_the_frequencies) {
+  Item *item = create_item((unsigned char*) "id", 1, 0);
+  assert_equal(0, item_add_token(item, 5, 2));
+  assert_equal(0, item_add_token(item, 5, 3));
+  assert_equal(1, item_get_num_tokens(item));
+  assert_equal(5, item_get_token_frequency(item, 5));
+  assert_equal(5, item_get_total_tokens(item));
+
+  assert_equal(0, item_add_token(item, 5, SHRT_MAX));
+  assert_equal(SHRT_MAX, item_get_token_frequency(item, 5));
+  assert_equal(SHRT_MAX, item_get_total_tokens(item));
+  free_item(item);
+} END_TEST
+
 /* Tests for fetching an item */
 
 ItemCache *item_cache;
@@ -122,6 +160,57 @@ START_TEST (test_free_when_done_is_true_when_the_item_is_not_in_the_memory_cache
   assert_equal(true, free_when_done);
 } END_TEST
 
+static void * fetch_item_thread(void *unused) {
+  long num_tokens = 0;
+  int i;
+
+  for (i = 0; i < 10; i++) {
+    int free_item_when_done;
+    Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_item_when_done);
+    if (item) {
+      num_tokens += item_get_num_tokens(item);
+      free_item(item);
+    }
+  }
+
+  return (void *) num_tokens;
+}
+
+START_TEST (test_fetch_item_from_several_threads_at_once) {
+  pthread_t threads[4];
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, fetch_item_thread, NULL);
+  }
+
+  for (i = 0; i < 4; i++) {
+    void *num_tokens;
+    pthread_join(threads[i], &num_tokens);
+    assert_equal(760, (int) (long) num_tokens);
+  }
+} END_TEST
+
+START_TEST (test_fetch_item_from_more_threads_than_readers) {
+  ItemCacheOptions one_reader = item_cache_options;
+  one_reader.max_readers = 1;
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &one_reader);
+
+  pthread_t threads[4];
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, fetch_item_thread, NULL);
+  }
+
+  for (i = 0; i < 4; i++) {
+    void *num_tokens;
+    pthread_join(threads[i], &num_tokens);
+    assert_equal(760, (int) (long) num_tokens);
+  }
+} END_TEST
+
 START_TEST (test_fetch_item_after_load) {
   item_cache_load(item_cache);
   Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
@@ -141,21 +230,45 @@ START_TEST (test_fetch_item_after_load_contains_tokens) {
   assert_equal(76, item_get_num_tokens(item));
 } END_TEST
 
-START_TEST (test_fetch_item_should_update_the_last_used_tstamp) {
-	Item * item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+START_TEST (test_fetch_item_after_load_has_tokens_sorted_by_id) {
+  item_cache_load(item_cache);
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+
+  int i;
+  const Token *tokens = item_get_tokens(item);
+  for (i = 1; i < item_get_num_tokens(item); i++) {
+    assert_true(tokens[i - 1].id < tokens[i].id);
+  }
+
+  assert_equal(3, item_get_token_frequency(item, 9949));
+} END_TEST
 
+static double last_used_at(const char *id) {
+	double tstamp = -1;
 	sqlite3 *db;
 	sqlite3_stmt *stmt;
 	sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READONLY, NULL);
-	sqlite3_prepare_v2(db, "select last_used_at from entries where full_id = 'urn:peerworks.org:entry#890806'", -1, &stmt, NULL);
-	if (SQLITE_ROW != sqlite3_step(stmt)) {
-		fail("Could not get record");
-	} else {
-		double tstamp = sqlite3_column_double(stmt, 0);
-		assert_true(tstamp > 0);
+	sqlite3_prepare_v2(db, "select ifnull(last_used_at, 0) from entries where full_id = ?", -1, &stmt, NULL);
+	sqlite3_bind_text(stmt, 1, id, -1, NULL);
+	if (SQLITE_ROW == sqlite3_step(stmt)) {
+		tstamp = sqlite3_column_double(stmt, 0);
 	}
 
+	sqlite3_finalize(stmt);
 	sqlite3_close(db);
+	return tstamp;
+}
+
+START_TEST (test_fetch_item_should_update_the_last_used_tstamp) {
+	Item * item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+	if (free_when_done) free_item(item);
+
+	/* The touch is written when the cache is flushed, not by the fetch. */
+	assert_equal_f(0.0, last_used_at("urn:peerworks.org:entry#890806"));
+	free_item_cache(item_cache);
+	item_cache = NULL;
+	assert_true(last_used_at("urn:peerworks.org:entry#890806") > 0);
 } END_TEST
 
 /* Test loading the item cache */
@@ -253,6 +366,46 @@ START_TEST (test_iteration_happens_in_reverse_updated_order) {
   assert_equal_s("urn:peerworks.org:entry#886294", ids[9]);
 } END_TEST
 
+START_TEST (test_load_with_several_threads_loads_every_item_in_order) {
+  ItemCache *threaded_item_cache;
+  ItemCacheOptions threaded_options = {1, 3650, 2, NULL, 4};
+  unsigned char *ids[10];
+  item_cache_create(&threaded_item_cache, "/tmp/valid-copy", &threaded_options);
+  int rc = item_cache_load(threaded_item_cache);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(10, item_cache_cached_size(threaded_item_cache));
+  assert_equal(750, pool_num_tokens(item_cache_random_background(threaded_item_cache)));
+
+  i = 0;
+  item_cache_each_item(threaded_item_cache, stores_ids, ids);
+  assert_equal_s("urn:peerworks.org:entry#709254", ids[0]);
+  assert_equal_s("urn:peerworks.org:entry#802739", ids[5]);
+  assert_equal_s("urn:peerworks.org:entry#886294", ids[9]);
+  free_item_cache(threaded_item_cache);
+} END_TEST
+
+static int stores_chunk_ids(const Item **items, int num_items, int worker, void *memo) {
+  unsigned char **ids = (unsigned char **) memo;
+  int n;
+
+  for (n = 0; n < num_items; n++) {
+    ids[i++] = (unsigned char *) item_get_id(items[n]);
+  }
+
+  return CLASSIFIER_OK;
+}
+
+START_TEST (test_parallel_iteration_visits_each_item_once_in_reverse_updated_order) {
+  i = 0;
+  unsigned char *ids[10];
+  int rc = item_cache_each_item_in_parallel(item_cache, NULL, 0, 4, NULL, stores_chunk_ids, ids);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(10, i);
+  assert_equal_s("urn:peerworks.org:entry#709254", ids[0]);
+  assert_equal_s("urn:peerworks.org:entry#802739", ids[5]);
+  assert_equal_s("urn:peerworks.org:entry#886294", ids[9]);
+} END_TEST
+
 /* Test RandomBackground */
 START_TEST (test_random_background_is_empty_pool_before_load) {
   assert_not_null(item_cache_random_background(item_cache));
@@ -277,6 +430,18 @@ START_TEST (test_random_background_has_right_count_for_a_token) {
   assert_equal(2, pool_token_frequency(bg, 2515));
 } END_TEST
 
+START_TEST (test_random_background_skips_items_without_tokens) {
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "delete from entry_tokens where id = 890806", NULL, NULL, NULL));
+  sqlite3_close(db);
+
+  assert_equal(CLASSIFIER_OK, item_cache_load(item_cache));
+  const Pool *bg = item_cache_random_background(item_cache);
+  assert_true(pool_num_tokens(bg) > 0);
+  assert_true(pool_num_tokens(bg) < 750);
+} END_TEST
+
 /* Item Cache modification */
 
 static char *entry_document;
@@ -348,6 +513,44 @@ START_TEST (test_can_add_entry_without_a_feed_id) {
   sqlite3_close(db);
 } END_TEST
 
+START_TEST (parsing_an_entry_keeps_its_xml_without_copying_it) {
+  int well_formed;
+  ItemCacheEntry *entry = item_cache_parse_entry(item_cache, entry_document, &well_formed);
+  assert_true(well_formed);
+  assert_not_null(entry);
+  assert_equal_s("urn:peerworks.org:entry#1", item_cache_entry_full_id(entry));
+  assert_true(entry_document == item_cache_entry_atom(entry));
+  free_entry(entry);
+} END_TEST
+
+START_TEST (parsing_a_broken_entry_fails) {
+  int well_formed;
+  assert_null(item_cache_parse_entry(item_cache, "<entry><id>1</id>", &well_formed));
+  assert_false(well_formed);
+  assert_null(item_cache_parse_entry(item_cache, "<entry xmlns=\"http://www.w3.org/2005/Atom\"><title>No id</title></entry>", &well_formed));
+  assert_true(well_formed);
+} END_TEST
+
+START_TEST (parsing_an_entry_with_an_empty_id_fails) {
+  int well_formed;
+  assert_null(item_cache_parse_entry(item_cache, "<entry xmlns=\"http://www.w3.org/2005/Atom\"><id></id><title>Empty id</title></entry>", &well_formed));
+  assert_true(well_formed);
+  assert_null(item_cache_parse_entry(item_cache, "<entry xmlns=\"http://www.w3.org/2005/Atom\"><id/><title>Empty id</title></entry>", &well_formed));
+  assert_true(well_formed);
+  assert_null(create_entry_from_atom_xml("<entry xmlns=\"http://www.w3.org/2005/Atom\"><id></id><title>Empty id</title></entry>"));
+} END_TEST
+
+START_TEST (adding_a_parsed_entry_saves_its_tokens) {
+  ItemCacheEntry *entry = item_cache_parse_entry(item_cache, entry_document, NULL);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  free_entry(entry);
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_equal(2, item_get_token_frequency(item, 1252));
+  free_item(item);
+} END_TEST
+
 START_TEST (adding_an_entry_twice_does_not_fail) {
   ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
   int rc = item_cache_add_entry(item_cache, entry);
@@ -375,6 +578,17 @@ START_TEST (adding_an_entry_twice_does_not_add_a_duplicate) {
   sqlite3_close(db);
 } END_TEST
 
+START_TEST (test_opening_the_cache_puts_the_database_in_wal_mode) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "PRAGMA journal_mode", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal_s("wal", sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
 START_TEST (test_destroying_an_entry_removes_it_from_the_database_file) {
   int rc = item_cache_remove_entry(item_cache, 753459);
   assert_equal(CLASSIFIER_OK, rc);
@@ -546,6 +760,82 @@ START_TEST (test_add_item_puts_it_in_the_right_position_at_end) {
   assert_equal(11, position);
 } END_TEST
 
+int candidate_tokens[][2] = {9999991, 1, 9999992, 1, 9999993, 1, 9999994, 1};
+
+START_TEST (test_add_item_makes_it_a_candidate_for_its_tokens) {
+  item = create_item_with_tokens_and_time((unsigned char*) "urn:890807", candidate_tokens, 4, (time_t) 1178683198L);
+  item_cache_add_item(item_cache, item);
+  int token_ids[] = {9999993};
+  int found = false;
+  int iteration_count = 0;
+  item_cache_each_item_with_tokens(item_cache, token_ids, 1, NULL, adding_item_iterator, &found);
+  item_cache_each_item_with_tokens(item_cache, token_ids, 1, NULL, iterates_over_all_items, &iteration_count);
+  assert_equal(true, found);
+  assert_equal(1, iteration_count);
+} END_TEST
+
+START_TEST (test_candidate_items_are_iterated_once_in_reverse_updated_order) {
+  Item *older = create_item_with_tokens_and_time((unsigned char*) "urn:890807", candidate_tokens, 4, (time_t) 1177975519L);
+  Item *newer = create_item_with_tokens_and_time((unsigned char*) "urn:890808", candidate_tokens, 2, (time_t) 1179051840L);
+  item_cache_add_item(item_cache, older);
+  item_cache_add_item(item_cache, newer);
+  int token_ids[] = {9999991, 9999992, 9999993};
+  unsigned char *ids[10];
+  i = 0;
+  item_cache_each_item_with_tokens(item_cache, token_ids, 3, NULL, stores_ids, ids);
+  assert_equal(2, i);
+  assert_equal_s("urn:890808", ids[0]);
+  assert_equal_s("urn:890807", ids[1]);
+} END_TEST
+
+START_TEST (test_counting_candidate_items_counts_each_item_once) {
+  Item *older = create_item_with_tokens_and_time((unsigned char*) "urn:890807", candidate_tokens, 4, (time_t) 1177975519L);
+  Item *newer = create_item_with_tokens_and_time((unsigned char*) "urn:890808", candidate_tokens, 2, (time_t) 1179051840L);
+  item_cache_add_item(item_cache, older);
+  item_cache_add_item(item_cache, newer);
+  int token_ids[] = {9999991, 9999992, 9999993};
+  assert_equal(2, item_cache_count_items_with_tokens(item_cache, token_ids, 3));
+  assert_equal(1, item_cache_count_items_with_tokens(item_cache, token_ids + 2, 1));
+} END_TEST
+
+static void stores_count(int num_items, void *memo) {
+  int *iteration_count = (int*) memo;
+  assert_equal(0, *iteration_count);
+  *iteration_count = -num_items;
+}
+
+static int counts_up_to_zero(const Item *item, void *memo) {
+  int *iteration_count = (int*) memo;
+  (*iteration_count)++;
+  return CLASSIFIER_OK;
+}
+
+START_TEST (test_iterating_candidates_counts_them_first) {
+  Item *older = create_item_with_tokens_and_time((unsigned char*) "urn:890807", candidate_tokens, 4, (time_t) 1177975519L);
+  Item *newer = create_item_with_tokens_and_time((unsigned char*) "urn:890808", candidate_tokens, 2, (time_t) 1179051840L);
+  item_cache_add_item(item_cache, older);
+  item_cache_add_item(item_cache, newer);
+  int token_ids[] = {9999991, 9999992, 9999993};
+  int iteration_count = 0;
+
+  assert_equal(CLASSIFIER_OK, item_cache_each_item_with_tokens(item_cache, token_ids, 3, stores_count, counts_up_to_zero, &iteration_count));
+  assert_equal(0, iteration_count);
+  assert_equal(CLASSIFIER_OK, item_cache_each_item_with_tokens(item_cache, NULL, 0, stores_count, counts_up_to_zero, &iteration_count));
+  assert_equal(0, iteration_count);
+  assert_equal(CLASSIFIER_OK, item_cache_each_item_with_tokens(item_cache, token_ids, 0, stores_count, counts_up_to_zero, &iteration_count));
+  assert_equal(0, iteration_count);
+} END_TEST
+
+START_TEST (test_purging_an_item_removes_it_from_the_candidates) {
+  item = create_item_with_tokens_and_time((unsigned char*) "urn:890807", candidate_tokens, 4, (time_t) 1L);
+  item_cache_add_item(item_cache, item);
+  item_cache_purge_old_items(item_cache);
+  int token_ids[] = {9999991};
+  int iteration_count = 0;
+  item_cache_each_item_with_tokens(item_cache, token_ids, 1, NULL, iterates_over_all_items, &iteration_count);
+  assert_equal(0, iteration_count);
+} END_TEST
+
 static int get_entry_id(char *db_file, char *full_id) {
   int id = -1;
 
@@ -581,7 +871,9 @@ START_TEST (test_save_item_stores_it_in_the_database) {
   assert_equal(SQLITE_ROW, rc);
   char* tokens = (char*) sqlite3_column_blob(stmt, 0);
   assert_not_null(tokens);
-  assert_equal(8 * 6 /* num tokens * TOKEN_BYTES */, sqlite3_column_bytes(stmt, 0));
+  assert_equal('W', tokens[0]);
+  assert_equal(1, tokens[1]);
+  assert_equal(24 /* header, count, delta encoded tokens and checksum */, sqlite3_column_bytes(stmt, 0));
   sqlite3_finalize(stmt);
   sqlite3_close(db);
 } END_TEST
@@ -666,6 +958,32 @@ START_TEST (test_adding_multiple_entries_causes_item_added_to_cache) {
   assert_equal(12, item_cache_cached_size(item_cache));
 } END_TEST
 
+static void * add_entry_thread(void *document) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml((char *) document);
+  int rc = item_cache_add_entry(item_cache, entry);
+  free_entry(entry);
+  return (void *) (long) rc;
+}
+
+START_TEST (test_adding_entries_from_several_threads_adds_each_entry_once) {
+  char *documents[] = {entry_document, entry_document2, entry_document, entry_document2};
+  pthread_t threads[4];
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, add_entry_thread, documents[i]);
+  }
+
+  for (i = 0; i < 4; i++) {
+    void *rc;
+    pthread_join(threads[i], &rc);
+    assert_equal(CLASSIFIER_OK, (int) (long) rc);
+  }
+
+  sleep(1);
+  assert_equal(12, item_cache_cached_size(item_cache));
+} END_TEST
+
 static int *memo_ref = NULL;
 static void update_callback(ItemCache * item_cache, void *memo) {
   memo_ref = (int*) memo;
@@ -794,6 +1112,162 @@ START_TEST (test_purge_loaded_cache_doesnt_crash) {
   sleep(2);
 } END_TEST
 
+/* Database purging */
+
+static void setup_database_purging(void) {
+  setup_fixture_path();
+  item_cache_options.load_items_since = 30;
+  item_cache_options.keep_entries_for = 30;
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+}
+
+static void teardown_database_purging(void) {
+  teardown_fixture_path();
+  free_item_cache(item_cache);
+  item_cache_options.load_items_since = 3650;
+  item_cache_options.keep_entries_for = 0;
+}
+
+static int count_rows(const char *db_file, const char *sql) {
+  int count = -1;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (SQLITE_ROW == sqlite3_step(stmt)) {
+    count = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return count;
+}
+
+START_TEST (test_purging_old_entries_keeps_the_random_background) {
+  assert_equal(CLASSIFIER_OK, item_cache_purge_old_entries(item_cache));
+  assert_equal(3, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+  assert_equal(3, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from entries where id in (select entry_id from random_backgrounds)"));
+} END_TEST
+
+START_TEST (test_purging_old_entries_deletes_their_tokens) {
+  item_cache_purge_old_entries(item_cache);
+  assert_equal(0, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens where id not in (709254, 802739, 890806)"));
+} END_TEST
+
+START_TEST (test_purging_old_entries_keeps_recently_used_entries) {
+  int free_when_done;
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#886294", &free_when_done);
+  free_item(item);
+
+  item_cache_purge_old_entries(item_cache);
+  assert_equal(4, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+  assert_equal(1, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens where id = 886294"));
+} END_TEST
+
+/* Snapshot tests */
+static ItemCacheOptions snapshot_options = {1, 3650, 2, "/tmp/valid-copy/items.snapshot"};
+
+static void setup_snapshot(void) {
+  setup_fixture_path();
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  entry_document = read_document("fixtures/entry.atom");
+}
+
+static void teardown_snapshot(void) {
+  teardown_fixture_path();
+  free_item_cache(item_cache);
+}
+
+static ItemCache * restart_item_cache(void) {
+  ItemCache *restarted;
+  free_item_cache(item_cache);
+  item_cache_create(&restarted, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(restarted);
+  return restarted;
+}
+
+START_TEST (test_restarted_item_cache_loads_its_items_from_the_snapshot) {
+  assert_equal(CLASSIFIER_OK, item_cache_save_snapshot(item_cache));
+
+  /* Without the snapshot there would be no tokens to load the items with */
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "delete from entry_tokens", NULL, NULL, NULL));
+  sqlite3_close(db);
+  item_cache = restart_item_cache();
+
+  assert_equal(10, item_cache_cached_size(item_cache));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_false(free_when_done);
+  assert_equal(1178551672, item_get_time(item));
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, 9949));
+  assert_equal(750, pool_num_tokens(item_cache_random_background(item_cache)));
+  assert_equal(2, pool_token_frequency(item_cache_random_background(item_cache), 2515));
+} END_TEST
+
+START_TEST (test_entries_added_after_the_snapshot_are_loaded_from_the_database) {
+  assert_equal(CLASSIFIER_OK, item_cache_save_snapshot(item_cache));
+  item_cache_add_entry(item_cache, create_entry_from_atom_xml(entry_document));
+  item_cache = restart_item_cache();
+
+  assert_equal(11, item_cache_cached_size(item_cache));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_false(free_when_done);
+  assert_equal(2, item_get_token_frequency(item, 1252));
+} END_TEST
+
+START_TEST (test_entries_removed_after_the_snapshot_are_not_loaded_from_it) {
+  assert_equal(CLASSIFIER_OK, item_cache_save_snapshot(item_cache));
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "delete from entries where id = 753459", NULL, NULL, NULL));
+  sqlite3_close(db);
+  item_cache = restart_item_cache();
+
+  assert_equal(9, item_cache_cached_size(item_cache));
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#753459", &free_when_done));
+} END_TEST
+
+START_TEST (test_purging_entries_keeps_the_snapshot_valid) {
+  ItemCacheOptions purging_options = snapshot_options;
+  purging_options.keep_entries_for = 3650;
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "insert into entries (id, full_id, updated, created_at) values "
+                                           "(1000001, 'urn:peerworks.org:entry#old', julianday('now') - 7300, julianday('now') - 7300)",
+                                           NULL, NULL, NULL));
+  sqlite3_close(db);
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &purging_options);
+  item_cache_load(item_cache);
+
+  assert_equal(CLASSIFIER_OK, item_cache_purge_old_entries(item_cache));
+  assert_equal(CLASSIFIER_OK, item_cache_save_snapshot(item_cache));
+
+  /* Only a snapshot still up to date with the catalog can load the items without their tokens */
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "delete from entry_tokens", NULL, NULL, NULL));
+  sqlite3_close(db);
+  item_cache = restart_item_cache();
+
+  assert_equal(10, item_cache_cached_size(item_cache));
+} END_TEST
+
+START_TEST (test_invalid_snapshot_is_ignored) {
+  system("echo 'not a snapshot' > /tmp/valid-copy/items.snapshot");
+  ItemCache *restarted;
+  item_cache_create(&restarted, "/tmp/valid-copy", &snapshot_options);
+  assert_equal(CLASSIFIER_OK, item_cache_load(restarted));
+  assert_equal(10, item_cache_cached_size(restarted));
+  assert_equal(750, pool_num_tokens(item_cache_random_background(restarted)));
+  free_item_cache(restarted);
+} END_TEST
+
 /* Atomizer tests */
 START_TEST (test_atomize_a_token) {
   int atom = item_cache_atomize(item_cache, "one");
@@ -824,6 +1298,425 @@ START_TEST (test_globalize_a_new_token) {
   assert_equal_s("new", s);
 } END_TEST
 
+START_TEST (test_new_atoms_are_saved_to_the_database_when_the_cache_is_freed) {
+  ItemCache *atomizing_cache;
+  item_cache_create(&atomizing_cache, "/tmp/valid-copy", &item_cache_options);
+  int atom = item_cache_atomize(atomizing_cache, "written later");
+  free_item_cache(atomizing_cache);
+
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "select id from tokens where token = 'written later'", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal(atom, sqlite3_column_int(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
+START_TEST (test_collecting_atoms_deletes_unused_atoms) {
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "insert into tokens values (20000, 'unused')", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  ItemCache *collected_cache;
+  item_cache_create(&collected_cache, "/tmp/valid-copy", &item_cache_options);
+  assert_equal(CLASSIFIER_OK, item_cache_collect_atoms(collected_cache, false));
+  assert_null(item_cache_globalize(collected_cache, 20000));
+  assert_equal(1, item_cache_atomize(collected_cache, "one"));
+  assert_equal(3, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from tokens"));
+  free_item_cache(collected_cache);
+} END_TEST
+
+START_TEST (test_renumbering_atoms_fails_when_entries_use_missing_atoms) {
+  assert_equal(CLASSIFIER_FAIL, item_cache_collect_atoms(item_cache, true));
+  assert_equal(1246, item_cache_atomize(item_cache, "foo"));
+} END_TEST
+
+START_TEST (test_renumbering_atoms_gives_the_most_used_atoms_the_smallest_ids) {
+  /* Give every atom used by the fixture entries a token so they can all be renumbered. */
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "with recursive n(i) as (select 1 union all select i + 1 from n where i < 10000) "
+                   "insert or ignore into tokens select i, 't' || i from n", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  ItemCache *renumbered_cache;
+  item_cache_create(&renumbered_cache, "/tmp/valid-copy", &item_cache_options);
+  assert_equal(CLASSIFIER_OK, item_cache_collect_atoms(renumbered_cache, true));
+
+  assert_equal(1, item_cache_atomize(renumbered_cache, "t248"));
+  assert_equal(1281, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from tokens"));
+  assert_equal(1281, count_rows("/tmp/valid-copy/catalog.db", "select max(id) from tokens"));
+
+  int free_when_done;
+  Item *item = item_cache_fetch_item(renumbered_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, item_cache_atomize(renumbered_cache, "t9949")));
+  free_item(item);
+  free_item_cache(renumbered_cache);
+} END_TEST
+
+/* Token blob format tests */
+
+START_TEST (test_opening_a_version_5_database_upgrades_it) {
+  assert_equal(6, count_rows("/tmp/valid-copy/catalog.db", "pragma user_version"));
+} END_TEST
+
+START_TEST (test_migrating_token_blobs_rewrites_the_old_blobs) {
+  assert_equal(10, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens where substr(tokens, 1, 1) != x'57'"));
+  assert_equal(CLASSIFIER_OK, item_cache_migrate_token_blobs(item_cache));
+  assert_equal(0, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens where substr(tokens, 1, 1) != x'57'"));
+  assert_equal(1, count_rows("/tmp/valid-copy/tokens.db", "pragma user_version"));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, 9949));
+  free_item(item);
+} END_TEST
+
+START_TEST (test_loading_the_cache_migrates_the_old_token_blobs) {
+  assert_equal(CLASSIFIER_OK, item_cache_load(item_cache));
+  assert_equal(0, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens where substr(tokens, 1, 1) != x'57'"));
+  assert_equal(1, count_rows("/tmp/valid-copy/tokens.db", "pragma user_version"));
+} END_TEST
+
+START_TEST (test_token_blob_with_a_bad_checksum_is_rejected) {
+  sqlite3 *db;
+  item_cache_migrate_token_blobs(item_cache);
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "update entry_tokens set tokens = cast(substr(tokens, 1, 5) || x'7f' || substr(tokens, 7) as blob) where id = 890806", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_null(item);
+} END_TEST
+
+/* Segment store tests */
+
+static void setup_segment_store(void) {
+  item_cache_options.segment_store = true;
+  setup_modification();
+}
+
+static void teardown_segment_store(void) {
+  teardown_modification();
+  item_cache_options.segment_store = false;
+}
+
+START_TEST (test_segment_store_imports_the_tokens_from_tokens_db) {
+  assert_equal(0, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, 9949));
+  free_item(item);
+} END_TEST
+
+START_TEST (test_cache_with_a_segment_store_cant_be_opened_without_one) {
+  ItemCache *without_store;
+  free_item_cache(item_cache);
+  item_cache_options.segment_store = false;
+  assert_equal(CLASSIFIER_FAIL, item_cache_create(&without_store, "/tmp/valid-copy", &item_cache_options));
+  assert_equal_s("Item cache keeps its tokens in a segment store, it must be opened with --segment-store.", item_cache_errmsg(without_store));
+  free_item_cache(without_store);
+
+  item_cache_options.segment_store = true;
+  assert_equal(CLASSIFIER_OK, item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options));
+} END_TEST
+
+START_TEST (test_token_blobs_left_in_tokens_db_are_imported_when_opened) {
+  sqlite3 *db;
+  free_item_cache(item_cache);
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "attach 'fixtures/valid/tokens.db' as fixture; "
+                                           "insert into entry_tokens select * from fixture.entry_tokens where id = 890806",
+                                           NULL, NULL, NULL));
+  sqlite3_close(db);
+
+  assert_equal(CLASSIFIER_OK, item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options));
+  assert_equal(0, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  free_item(item);
+} END_TEST
+
+START_TEST (test_segment_store_loads_every_item_and_the_random_background) {
+  item_cache_load(item_cache);
+  assert_equal(10, item_cache_cached_size(item_cache));
+  assert_equal(750, pool_num_tokens(item_cache_random_background(item_cache)));
+} END_TEST
+
+START_TEST (test_added_entry_tokens_are_kept_in_the_segment_store) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(0, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_equal(2, item_get_token_frequency(item, 1252));
+  free_item(item);
+} END_TEST
+
+/* Gives every atom the fixture's entries use a token so they can be renumbered. */
+static void reopen_with_every_atom(void) {
+  sqlite3 *db;
+  free_item_cache(item_cache);
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "with recursive n(i) as (select 1 union all select i + 1 from n where i < 10000) "
+                   "insert or ignore into tokens select i, 't' || i from n", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+}
+
+START_TEST (test_renumbering_atoms_rewrites_the_segment_store) {
+  reopen_with_every_atom();
+  assert_equal(CLASSIFIER_OK, item_cache_collect_atoms(item_cache, true));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, item_cache_atomize(item_cache, "t9949")));
+  free_item(item);
+} END_TEST
+
+START_TEST (test_renumbering_atoms_leaves_only_the_new_segment_store) {
+  reopen_with_every_atom();
+  assert_equal(CLASSIFIER_OK, item_cache_collect_atoms(item_cache, true));
+  assert_equal(0, access("/tmp/valid-copy/segments", F_OK));
+  assert_equal(-1, access("/tmp/valid-copy/segments.new", F_OK));
+  assert_equal(-1, access("/tmp/valid-copy/segments.old", F_OK));
+  assert_equal(0, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from segment_swap"));
+} END_TEST
+
+START_TEST (test_interrupted_segment_swap_is_finished_when_opened) {
+  free_item_cache(item_cache);
+  /* As if the classifier died after moving the old store aside but before moving the new one in. */
+  system("mv /tmp/valid-copy/segments /tmp/valid-copy/segments.new && mkdir /tmp/valid-copy/segments.old");
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  assert_equal(SQLITE_OK, sqlite3_exec(db, "create table segment_swap (pending integer not null); "
+                                           "insert into segment_swap values (1)", NULL, NULL, NULL));
+  sqlite3_close(db);
+
+  assert_equal(CLASSIFIER_OK, item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options));
+  assert_equal(-1, access("/tmp/valid-copy/segments.new", F_OK));
+  assert_equal(-1, access("/tmp/valid-copy/segments.old", F_OK));
+  assert_equal(0, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from segment_swap"));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  free_item(item);
+} END_TEST
+
+START_TEST (test_unmarked_new_segment_store_is_deleted_when_opened) {
+  free_item_cache(item_cache);
+  system("cp -R /tmp/valid-copy/segments /tmp/valid-copy/segments.new");
+
+  assert_equal(CLASSIFIER_OK, item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options));
+  assert_equal(-1, access("/tmp/valid-copy/segments.new", F_OK));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(3, item_get_token_frequency(item, 9949));
+  free_item(item);
+} END_TEST
+
+/* Tokenizer tests */
+
+static void setup_tokenizers(void) {
+  item_cache_options.tokenizer_threads = 2;
+  setup_modification();
+}
+
+static void teardown_tokenizers(void) {
+  teardown_modification();
+  item_cache_options.tokenizer_threads = 0;
+}
+
+/* Waits up to 5 seconds for the tokenizers to pass items to the update queue. */
+static int wait_for_update_queue(int size) {
+  int tries;
+  for (tries = 0; tries < 50 && item_cache_update_queue_size(item_cache) < size; tries++) {
+    usleep(100000);
+  }
+  return item_cache_update_queue_size(item_cache);
+}
+
+START_TEST (test_tokenizers_tokenize_added_entries_after_they_are_stored) {
+  assert_equal(CLASSIFIER_OK, item_cache_start_tokenizers(item_cache));
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(11, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+  assert_equal(1, wait_for_update_queue(1));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_equal(2, item_get_token_frequency(item, 1252));
+  free_item(item);
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_tokenizers_tokenize_entries_stored_without_tokens_when_they_start) {
+  char sql[64];
+  sqlite3 *db;
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  free_item_cache(item_cache);
+
+  snprintf(sql, sizeof(sql), "delete from entry_tokens where id = %i", item_cache_entry_id(entry));
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_close(db);
+  assert_equal(10, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  assert_equal(CLASSIFIER_OK, item_cache_start_tokenizers(item_cache));
+  assert_equal(1, wait_for_update_queue(1));
+  assert_equal(11, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_equal(2, item_get_token_frequency(item, 1252));
+  free_item(item);
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_tokenizers_dont_retry_entries_without_features) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml("<?xml version=\"1.0\" ?>\n"
+                                                     "<entry xmlns=\"http://www.w3.org/2005/Atom\">"
+                                                     "<id>urn:peerworks.org:entry#empty</id>"
+                                                     "<updated>2005-07-31T12:29:29Z</updated></entry>");
+  assert_not_null(entry);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(CLASSIFIER_OK, item_cache_start_tokenizers(item_cache));
+  free_item_cache(item_cache);
+
+  /* Its empty tokens are saved so it isn't tokenized again. */
+  assert_equal(11, count_rows("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  assert_equal(CLASSIFIER_OK, item_cache_start_tokenizers(item_cache));
+  assert_equal(0, wait_for_update_queue(1));
+  free_entry(entry);
+} END_TEST
+
+/* Token hashing tests */
+
+static ItemCacheOptions hashed_options = {1, 3650, 2, NULL, 0, DURABILITY_FULL, 0, false, 0, true, true};
+
+static void setup_token_hashing(void) {
+  setup_modification();
+  free_item_cache(item_cache);
+  item_cache = NULL;
+}
+
+/* Empties the copied fixture so it can be opened with hashed tokens. */
+static ItemCache * create_empty_hashed_cache(const ItemCacheOptions *options) {
+  ItemCache *hashed_cache;
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "drop trigger entry_tokens_token_id; delete from random_backgrounds; "
+                   "delete from entries; delete from tokens", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  assert_equal(CLASSIFIER_OK, item_cache_create(&hashed_cache, "/tmp/valid-copy", options));
+  return hashed_cache;
+}
+
+START_TEST (test_opening_a_numbered_cache_with_hashed_tokens_fails) {
+  assert_equal(CLASSIFIER_FAIL, item_cache_create(&item_cache, "/tmp/valid-copy", &hashed_options));
+  assert_equal_s("Item cache numbers its tokens, convert it with --hash-atoms before using hashed tokens.", item_cache_errmsg(item_cache));
+} END_TEST
+
+START_TEST (test_hashed_atoms_are_the_hash_of_the_token) {
+  item_cache = create_empty_hashed_cache(&hashed_options);
+  assert_equal(token_hash("new"), item_cache_atomize(item_cache, "new"));
+  assert_equal(item_cache_atomize(item_cache, "new"), item_cache_atomize(item_cache, "new"));
+  assert_true(item_cache_atomize(item_cache, "new") > 0);
+} END_TEST
+
+START_TEST (test_hashed_token_strings_are_written_to_the_tokens_table_later) {
+  item_cache = create_empty_hashed_cache(&hashed_options);
+  int atom = item_cache_atomize(item_cache, "written later");
+  char *s = item_cache_globalize(item_cache, atom);
+  assert_equal_s("written later", s);
+  free(s);
+  assert_equal(0, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from tokens"));
+
+  free_item_cache(item_cache);
+  item_cache = NULL;
+  assert_equal(atom, count_rows("/tmp/valid-copy/catalog.db", "select id from tokens where token = 'written later'"));
+} END_TEST
+
+START_TEST (test_hashed_token_strings_are_not_kept_without_keep_token_strings) {
+  ItemCacheOptions options = hashed_options;
+  options.keep_token_strings = false;
+  item_cache = create_empty_hashed_cache(&options);
+  assert_null(item_cache_globalize(item_cache, item_cache_atomize(item_cache, "forgotten")));
+
+  free_item_cache(item_cache);
+  item_cache = NULL;
+  assert_equal(0, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from tokens"));
+} END_TEST
+
+START_TEST (test_added_entries_use_hashed_tokens) {
+  item_cache = create_empty_hashed_cache(&hashed_options);
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_true(item_get_num_tokens(item) > 0);
+
+  int i;
+  for (i = 0; i < item_get_num_tokens(item); i++) {
+    char *s = item_cache_globalize(item_cache, item_get_tokens(item)[i].id);
+    assert_not_null(s);
+    assert_equal(item_get_tokens(item)[i].id, token_hash(s));
+    free(s);
+  }
+  free_item(item);
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_hashing_atoms_gives_every_token_its_hash) {
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "with recursive n(i) as (select 1 union all select i + 1 from n where i < 10000) "
+                   "insert or ignore into tokens select i, 't' || i from n", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  assert_equal(CLASSIFIER_OK, item_cache_hash_atoms(item_cache));
+  free_item_cache(item_cache);
+
+  assert_equal(CLASSIFIER_FAIL, item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options));
+  assert_equal_s("Item cache uses hashed tokens, it must be opened with --hash-tokens.", item_cache_errmsg(item_cache));
+  free_item_cache(item_cache);
+
+  assert_equal(CLASSIFIER_OK, item_cache_create(&item_cache, "/tmp/valid-copy", &hashed_options));
+  assert_equal(1281, count_rows("/tmp/valid-copy/catalog.db", "select count(*) from tokens"));
+  assert_equal(token_hash("t248"), count_rows("/tmp/valid-copy/catalog.db", "select id from tokens where token = 't248'"));
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, item_cache_atomize(item_cache, "t9949")));
+  free_item(item);
+} END_TEST
+
 
 Suite *
 item_cache_suite(void) {
@@ -833,6 +1726,8 @@ item_cache_suite(void) {
   tcase_add_test(tc_case, creating_with_missing_db_file_fails);
    tcase_add_test(tc_case, creating_with_empty_db_file_fails);
    tcase_add_test(tc_case, create_with_valid_db);
+   tcase_add_test(tc_case, create_item_with_unordered_tokens_sorts_them);
+   tcase_add_test(tc_case, adding_a_token_twice_adds_the_frequencies);
    
    TCase *fetch_item_case = tcase_create("fetch_item");
    tcase_add_checked_fixture(fetch_item_case, setup_cache, teardown_item_cache);
@@ -843,7 +1738,10 @@ item_cache_suite(void) {
    tcase_add_test(fetch_item_case, test_fetch_item_contains_the_right_frequency_for_a_given_token);
    tcase_add_test(fetch_item_case, test_fetch_item_after_load);
    tcase_add_test(fetch_item_case, test_fetch_item_after_load_contains_tokens);
+   tcase_add_test(fetch_item_case, test_fetch_item_after_load_has_tokens_sorted_by_id);
    tcase_add_test(fetch_item_case, test_free_when_done_is_true_when_the_item_is_not_in_the_memory_cache);
+   tcase_add_test(fetch_item_case, test_fetch_item_from_several_threads_at_once);
+   tcase_add_test(fetch_item_case, test_fetch_item_from_more_threads_than_readers);
    tcase_add_test(fetch_item_case, test_free_when_done_is_false_when_the_item_is_in_the_memory_cache);
    tcase_add_test(fetch_item_case, test_fetch_item_should_update_the_last_used_tstamp);
    
@@ -852,12 +1750,14 @@ item_cache_suite(void) {
    tcase_add_test(load, test_load_loads_the_right_number_of_items);
    tcase_add_test(load, test_load_sets_cache_loaded_to_true);
    tcase_add_test(load, test_load_respects_min_tokens);
+   tcase_add_test(load, test_load_with_several_threads_loads_every_item_in_order);
    
    TCase *iteration = tcase_create("iteration");
    tcase_add_checked_fixture(iteration, setup_iteration, teardown_iteration);
    tcase_add_test(iteration, test_iterates_over_all_items);
    tcase_add_test(iteration, test_iteration_stops_when_iterator_returns_CLASSIFIER_FAIL);
    tcase_add_test(iteration, test_iteration_happens_in_reverse_updated_order);
+   tcase_add_test(iteration, test_parallel_iteration_visits_each_item_once_in_reverse_updated_order);
    
    TCase *rndbg = tcase_create("random background");
    tcase_add_checked_fixture(rndbg, setup_cache, teardown_item_cache);
@@ -865,6 +1765,7 @@ item_cache_suite(void) {
    tcase_add_test(rndbg, test_creates_random_background_after_load);
    tcase_add_test(rndbg, test_random_background_is_correct_size);
    tcase_add_test(rndbg, test_random_background_has_right_count_for_a_token);
+   tcase_add_test(rndbg, test_random_background_skips_items_without_tokens);
    
    TCase *modification = tcase_create("modification");
    tcase_add_checked_fixture(modification, setup_modification, teardown_modification);
@@ -872,7 +1773,12 @@ item_cache_suite(void) {
    tcase_add_test(modification, adding_an_entry_twice_does_not_add_a_duplicate);
    tcase_add_test(modification, adding_an_entry_saves_all_its_attributes);
    tcase_add_test(modification, adding_an_entry_saves_its_xml);
+   tcase_add_test(modification, parsing_an_entry_keeps_its_xml_without_copying_it);
+   tcase_add_test(modification, parsing_a_broken_entry_fails);
+   tcase_add_test(modification, parsing_an_entry_with_an_empty_id_fails);
+   tcase_add_test(modification, adding_a_parsed_entry_saves_its_tokens);
    tcase_add_test(modification, test_can_add_entry_without_a_feed_id);
+   tcase_add_test(modification, test_opening_the_cache_puts_the_database_in_wal_mode);
    tcase_add_test(modification, test_destroying_an_entry_removes_its_xml_document);
    tcase_add_test(modification, test_destroying_an_entry_removes_tokens);
    tcase_add_test(modification, test_destroying_an_entry_removes_it_from_the_database_file);
@@ -890,6 +1796,11 @@ item_cache_suite(void) {
    tcase_add_test(loaded_modification, test_add_item_puts_it_in_the_right_position);
    tcase_add_test(loaded_modification, test_add_item_puts_it_in_the_right_position_at_beginning);
    tcase_add_test(loaded_modification, test_add_item_puts_it_in_the_right_position_at_end);
+   tcase_add_test(loaded_modification, test_add_item_makes_it_a_candidate_for_its_tokens);
+   tcase_add_test(loaded_modification, test_candidate_items_are_iterated_once_in_reverse_updated_order);
+   tcase_add_test(loaded_modification, test_counting_candidate_items_counts_each_item_once);
+   tcase_add_test(loaded_modification, test_iterating_candidates_counts_them_first);
+   tcase_add_test(loaded_modification, test_purging_an_item_removes_it_from_the_candidates);
    tcase_add_test(loaded_modification, test_save_item_stores_it_in_the_database);
    tcase_add_test(loaded_modification, test_save_item_without_an_entry_wont_store_it_in_the_database);
    tcase_add_test(loaded_modification, test_save_item_stores_the_correct_tokens);
@@ -900,6 +1811,7 @@ item_cache_suite(void) {
    tcase_add_test(full_update, test_update_callback);
    tcase_add_test(full_update, test_adding_multiple_entries_causes_item_added_to_cache);
    tcase_add_test(full_update, test_adding_entry_causes_item_added_to_cache);
+   tcase_add_test(full_update, test_adding_entries_from_several_threads_adds_each_entry_once);
    tcase_add_test(full_update, test_adding_entry_causes_tokens_to_be_added_to_the_db);
  
   TCase *purging = tcase_create("purging");
@@ -912,6 +1824,20 @@ item_cache_suite(void) {
   tcase_add_test(purging, test_purging_half_cache_with_multiple_items_from_thread);
   tcase_add_test(purging, test_purge_loaded_cache_doesnt_crash);
 
+  TCase *database_purging = tcase_create("database purging");
+  tcase_add_checked_fixture(database_purging, setup_database_purging, teardown_database_purging);
+  tcase_add_test(database_purging, test_purging_old_entries_keeps_the_random_background);
+  tcase_add_test(database_purging, test_purging_old_entries_deletes_their_tokens);
+  tcase_add_test(database_purging, test_purging_old_entries_keeps_recently_used_entries);
+
+  TCase *snapshot = tcase_create("snapshot");
+  tcase_add_checked_fixture(snapshot, setup_snapshot, teardown_snapshot);
+  tcase_add_test(snapshot, test_restarted_item_cache_loads_its_items_from_the_snapshot);
+  tcase_add_test(snapshot, test_entries_added_after_the_snapshot_are_loaded_from_the_database);
+  tcase_add_test(snapshot, test_entries_removed_after_the_snapshot_are_not_loaded_from_it);
+  tcase_add_test(snapshot, test_purging_entries_keeps_the_snapshot_valid);
+  tcase_add_test(snapshot, test_invalid_snapshot_is_ignored);
+
   TCase *atomization = tcase_create("atomization");
   tcase_add_checked_fixture(atomization, setup_modification, teardown_modification);
   tcase_add_test(atomization, test_atomize_a_token);
@@ -919,6 +1845,44 @@ item_cache_suite(void) {
   tcase_add_test(atomization, test_globalize_a_token);
   tcase_add_test(atomization, test_globalize_a_missing_token_returns_NULL);
   tcase_add_test(atomization, test_globalize_a_new_token);
+  tcase_add_test(atomization, test_new_atoms_are_saved_to_the_database_when_the_cache_is_freed);
+  tcase_add_test(atomization, test_collecting_atoms_deletes_unused_atoms);
+  tcase_add_test(atomization, test_renumbering_atoms_fails_when_entries_use_missing_atoms);
+  tcase_add_test(atomization, test_renumbering_atoms_gives_the_most_used_atoms_the_smallest_ids);
+
+  TCase *token_blobs = tcase_create("token blobs");
+  tcase_add_checked_fixture(token_blobs, setup_modification, teardown_modification);
+  tcase_add_test(token_blobs, test_opening_a_version_5_database_upgrades_it);
+  tcase_add_test(token_blobs, test_migrating_token_blobs_rewrites_the_old_blobs);
+  tcase_add_test(token_blobs, test_loading_the_cache_migrates_the_old_token_blobs);
+  tcase_add_test(token_blobs, test_token_blob_with_a_bad_checksum_is_rejected);
+
+  TCase *segment_store = tcase_create("segment store");
+  tcase_add_checked_fixture(segment_store, setup_segment_store, teardown_segment_store);
+  tcase_add_test(segment_store, test_segment_store_imports_the_tokens_from_tokens_db);
+  tcase_add_test(segment_store, test_segment_store_loads_every_item_and_the_random_background);
+  tcase_add_test(segment_store, test_added_entry_tokens_are_kept_in_the_segment_store);
+  tcase_add_test(segment_store, test_cache_with_a_segment_store_cant_be_opened_without_one);
+  tcase_add_test(segment_store, test_token_blobs_left_in_tokens_db_are_imported_when_opened);
+  tcase_add_test(segment_store, test_renumbering_atoms_rewrites_the_segment_store);
+  tcase_add_test(segment_store, test_renumbering_atoms_leaves_only_the_new_segment_store);
+  tcase_add_test(segment_store, test_interrupted_segment_swap_is_finished_when_opened);
+  tcase_add_test(segment_store, test_unmarked_new_segment_store_is_deleted_when_opened);
+
+  TCase *tokenizers = tcase_create("tokenizers");
+  tcase_add_checked_fixture(tokenizers, setup_tokenizers, teardown_tokenizers);
+  tcase_add_test(tokenizers, test_tokenizers_tokenize_added_entries_after_they_are_stored);
+  tcase_add_test(tokenizers, test_tokenizers_tokenize_entries_stored_without_tokens_when_they_start);
+  tcase_add_test(tokenizers, test_tokenizers_dont_retry_entries_without_features);
+
+  TCase *token_hashing = tcase_create("token hashing");
+  tcase_add_checked_fixture(token_hashing, setup_token_hashing, teardown_modification);
+  tcase_add_test(token_hashing, test_opening_a_numbered_cache_with_hashed_tokens_fails);
+  tcase_add_test(token_hashing, test_hashed_atoms_are_the_hash_of_the_token);
+  tcase_add_test(token_hashing, test_hashed_token_strings_are_written_to_the_tokens_table_later);
+  tcase_add_test(token_hashing, test_hashed_token_strings_are_not_kept_without_keep_token_strings);
+  tcase_add_test(token_hashing, test_added_entries_use_hashed_tokens);
+  tcase_add_test(token_hashing, test_hashing_atoms_gives_every_token_its_hash);
 
   suite_add_tcase(s, tc_case);
   suite_add_tcase(s, fetch_item_case);
@@ -929,7 +1893,13 @@ item_cache_suite(void) {
   suite_add_tcase(s, loaded_modification);
   suite_add_tcase(s, full_update);
   suite_add_tcase(s, purging);
+  suite_add_tcase(s, database_purging);
+  suite_add_tcase(s, snapshot);
   suite_add_tcase(s, atomization);
+  suite_add_tcase(s, token_blobs);
+  suite_add_tcase(s, segment_store);
+  suite_add_tcase(s, tokenizers);
+  suite_add_tcase(s, token_hashing);
   return s;
 }
 
@@ -108,6 +108,27 @@ START_TEST (token_iteration) {
   free_pool(pool);
 } END_TEST
 
+START_TEST (fingerprint_changes_when_tokens_move_but_counts_dont) {
+  Pool *pool = new_pool();
+  Pool *same = new_pool();
+  Pool *moved = new_pool();
+  pool_add_token(pool, 1, 2);
+  pool_add_token(pool, 2, 1);
+  pool_add_token(same, 2, 1);
+  pool_add_token(same, 1, 2);
+  pool_add_token(moved, 1, 1);
+  pool_add_token(moved, 2, 2);
+
+  assert_equal(pool_fingerprint(pool), pool_fingerprint(same));
+  assert_equal(pool_total_tokens(pool), pool_total_tokens(moved));
+  assert_equal(pool_num_tokens(pool), pool_num_tokens(moved));
+  assert_not_equal(pool_fingerprint(pool), pool_fingerprint(moved));
+
+  free_pool(pool);
+  free_pool(same);
+  free_pool(moved);
+} END_TEST
+
 START_TEST (token_iteration_with_null_pool_doesnt_crash) {
   Token token;
   token.id = 0;
@@ -128,6 +149,7 @@ pool_suite(void) {
   tcase_add_test(tc_pool, add_1_item);
   tcase_add_test(tc_pool, add_2_items_with_same_tokens);
   tcase_add_test(tc_pool, token_iteration);
+  tcase_add_test(tc_pool, fingerprint_changes_when_tokens_move_but_counts_dont);
   tcase_add_test(tc_pool, token_iteration_with_null_pool_doesnt_crash);
   suite_add_tcase(s, tc_pool);
 
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <sqlite3.h>
 #include "../src/tagger.h"
 #include "../src/classifier.h"
@@ -130,10 +131,139 @@ START_TEST (precompute_creates_probabilities_for_each_token_in_the_pools) {
 //  assert_equal(542, clues);
 //} END_TEST
 
-START_TEST (test_precompute_clears_out_training) {
+START_TEST (test_precompute_keeps_the_training_for_updates) {
   precompute_tagger(tagger, random_background);
-  assert_null(tagger->positive_pool);
-  assert_null(tagger->negative_pool);
+  assert_not_null(tagger->positive_pool);
+  assert_not_null(tagger->negative_pool);
+} END_TEST
+
+/* Builds a tagger from the document using only the first few of its examples. */
+static Tagger * build_tagger_with_examples(int positive_examples, int negative_examples) {
+  Tagger *t = build_tagger(document, item_cache);
+  t->probability_function = &naive_bayes_probability;
+
+  while (t->positive_example_count > positive_examples) {
+    free(t->positive_examples[--t->positive_example_count]);
+  }
+
+  while (t->negative_example_count > negative_examples) {
+    free(t->negative_examples[--t->negative_example_count]);
+  }
+
+  return t;
+}
+
+static Tagger * precomputed_tagger_with_examples(int positive_examples, int negative_examples) {
+  Tagger *t = build_tagger_with_examples(positive_examples, negative_examples);
+  train_tagger(t, item_cache);
+  precompute_tagger(t, item_cache_random_background(item_cache));
+  return t;
+}
+
+static void assert_same_training(Tagger *expected, Tagger *updated) {
+  assert_equal(pool_total_tokens(expected->positive_pool), pool_total_tokens(updated->positive_pool));
+  assert_equal(pool_total_tokens(expected->negative_pool), pool_total_tokens(updated->negative_pool));
+  assert_equal(expected->clues->size, updated->clues->size);
+
+  int position = 0;
+  const Clue *clue;
+  while (NULL != (clue = next_clue(expected->clues, &position))) {
+    Clue *updated_clue = get_clue(updated->clues, clue->token_id);
+    assert_not_null(updated_clue);
+    assert_equal_f(clue->probability, updated_clue->probability);
+  }
+
+  assert_equal(expected->num_candidate_tokens, updated->num_candidate_tokens);
+}
+
+START_TEST (test_update_tagger_gives_the_same_clues_as_training_from_scratch) {
+  item_cache_load(item_cache);
+  Tagger *previous = precomputed_tagger_with_examples(3, 1);
+  Tagger *expected = precomputed_tagger_with_examples(4, 0);
+  Tagger *updated = build_tagger_with_examples(4, 0);
+
+  assert_equal(TAGGER_PRECOMPUTED, update_tagger(updated, previous, item_cache));
+  assert_null(previous->positive_pool);
+  assert_same_training(expected, updated);
+
+  free_tagger(previous);
+  free_tagger(expected);
+  free_tagger(updated);
+} END_TEST
+
+/* Precomputes a tagger whose last positive example was missing from the item cache when it was trained. */
+static Tagger * precomputed_tagger_with_missing_example(int positive_examples) {
+  Tagger *t = build_tagger_with_examples(positive_examples, 0);
+  char *example = t->positive_examples[positive_examples - 1];
+
+  t->positive_examples[positive_examples - 1] = "urn:peerworks.org:entry#missing";
+  train_tagger(t, item_cache);
+  precompute_tagger(t, item_cache_random_background(item_cache));
+  t->positive_examples[positive_examples - 1] = example;
+
+  return t;
+}
+
+START_TEST (test_update_tagger_doesnt_subtract_an_example_that_was_never_trained) {
+  item_cache_load(item_cache);
+  Tagger *previous = precomputed_tagger_with_missing_example(4);
+  Tagger *expected = precomputed_tagger_with_examples(3, 0);
+  Tagger *updated = build_tagger_with_examples(3, 0);
+
+  assert_equal(TAGGER_PRECOMPUTED, update_tagger(updated, previous, item_cache));
+  assert_same_training(expected, updated);
+
+  free_tagger(previous);
+  free_tagger(expected);
+  free_tagger(updated);
+} END_TEST
+
+START_TEST (test_update_tagger_retries_examples_that_were_missing) {
+  item_cache_load(item_cache);
+  Tagger *previous = precomputed_tagger_with_missing_example(4);
+  Tagger *expected = precomputed_tagger_with_examples(4, 0);
+  Tagger *updated = build_tagger_with_examples(4, 0);
+
+  assert_equal(TAGGER_PRECOMPUTED, update_tagger(updated, previous, item_cache));
+  assert_same_training(expected, updated);
+
+  free_tagger(previous);
+  free_tagger(expected);
+  free_tagger(updated);
+} END_TEST
+
+START_TEST (test_update_tagger_trains_from_scratch_when_a_removed_example_is_gone) {
+  item_cache_load(item_cache);
+  Tagger *previous = precomputed_tagger_with_examples(4, 0);
+  Tagger *expected = precomputed_tagger_with_examples(3, 0);
+  Tagger *updated = build_tagger_with_examples(3, 0);
+  PWord_t trained;
+
+  /* Pretend the last example was trained and has since been purged */
+  free(previous->positive_examples[3]);
+  previous->positive_examples[3] = strdup("urn:peerworks.org:entry#purged");
+  JSLI(trained, previous->positive_trained, (uint8_t*) previous->positive_examples[3]);
+
+  assert_equal(TAGGER_LOADED, update_tagger(updated, previous, item_cache));
+  assert_null(updated->positive_pool);
+  assert_null(updated->clues);
+  assert_equal(TAGGER_PRECOMPUTED, prepare_tagger(updated, item_cache));
+  assert_same_training(expected, updated);
+
+  free_tagger(previous);
+  free_tagger(expected);
+  free_tagger(updated);
+} END_TEST
+
+START_TEST (test_update_tagger_requires_a_precomputed_previous_tagger) {
+  Tagger *previous = build_tagger_with_examples(3, 1);
+  Tagger *updated = build_tagger_with_examples(4, 1);
+
+  assert_equal(TAGGER_LOADED, update_tagger(updated, previous, item_cache));
+  assert_null(updated->positive_pool);
+
+  free_tagger(previous);
+  free_tagger(updated);
 } END_TEST
 
 // TODO START_TEST (test_precompute_with_random_background_includes_tokens_in_the_random_background) {
@@ -189,7 +319,12 @@ tag_precompute_suite(void) {
   tcase_add_test(tc_precomputer, test_precompute_with_trained_tagger_returns_TAGGER_PRECOMPUTED);
   tcase_add_test(tc_precomputer, test_precompute_with_trained_tagger_sets_state_to_TAGGER_PRECOMPUTED);
   tcase_add_test(tc_precomputer, precompute_creates_probabilities_for_each_token_in_the_pools);
-  tcase_add_test(tc_precomputer, test_precompute_clears_out_training);
+  tcase_add_test(tc_precomputer, test_precompute_keeps_the_training_for_updates);
+  tcase_add_test(tc_precomputer, test_update_tagger_gives_the_same_clues_as_training_from_scratch);
+  tcase_add_test(tc_precomputer, test_update_tagger_doesnt_subtract_an_example_that_was_never_trained);
+  tcase_add_test(tc_precomputer, test_update_tagger_retries_examples_that_were_missing);
+  tcase_add_test(tc_precomputer, test_update_tagger_trains_from_scratch_when_a_removed_example_is_gone);
+  tcase_add_test(tc_precomputer, test_update_tagger_requires_a_precomputed_previous_tagger);
   //tcase_add_test(tc_precomputer, test_after_precompute_there_are_clues_for_every_token_in_the_pool);
   tcase_add_test(tc_precomputer, test_precomputing_a_tagger_with_no_probability_function_results_in_a_sequence_error);
 
@@ -0,0 +1,223 @@
+// General info: http://doc.winnowtag.org/open-source
+// Source code repository: http://github.com/winnowtag
+// Questions and feedback: contact@winnowtag.org
+//
+// Copyright (c) 2007-2011 The Kaphan Foundation
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// contact@winnowtag.org
+
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/segment_store.h"
+#include "../src/logging.h"
+#include "assertions.h"
+
+#define STORE_DIR "/tmp/segment-store"
+
+static SegmentStore *store;
+
+static void setup_store(void) {
+  system("rm -Rf " STORE_DIR);
+  store = segment_store_open(STORE_DIR);
+}
+
+static void teardown_store(void) {
+  segment_store_close(store);
+}
+
+static void reopen_store(void) {
+  segment_store_close(store);
+  store = segment_store_open(STORE_DIR);
+}
+
+static int copy_record(int entry_id, const char *data, int size, void *memo) {
+  memcpy(memo, data, size);
+  ((char*) memo)[size] = '\0';
+  return size;
+}
+
+START_TEST (test_read_passes_the_stored_data) {
+  char data[64];
+  assert_equal(0, segment_store_put(store, 1, "tokens", 6));
+  assert_equal(6, segment_store_read(store, 1, copy_record, data));
+  assert_equal_s("tokens", data);
+} END_TEST
+
+START_TEST (test_read_of_a_missing_entry_fails) {
+  char data[64];
+  assert_equal(-1, segment_store_read(store, 1, copy_record, data));
+  assert_false(segment_store_contains(store, 1));
+} END_TEST
+
+START_TEST (test_put_replaces_the_earlier_record) {
+  char data[64];
+  segment_store_put(store, 1, "first", 5);
+  segment_store_put(store, 1, "second", 6);
+  assert_equal(6, segment_store_read(store, 1, copy_record, data));
+  assert_equal_s("second", data);
+  assert_equal(1, segment_store_size(store));
+} END_TEST
+
+START_TEST (test_delete_removes_the_entry) {
+  segment_store_put(store, 1, "tokens", 6);
+  assert_equal(0, segment_store_delete(store, 1));
+  assert_false(segment_store_contains(store, 1));
+  assert_equal(0, segment_store_size(store));
+} END_TEST
+
+START_TEST (test_reopened_store_has_the_latest_records) {
+  char data[64];
+  segment_store_put(store, 1, "first", 5);
+  segment_store_put(store, 2, "other", 5);
+  segment_store_put(store, 1, "second", 6);
+  segment_store_delete(store, 2);
+  reopen_store();
+
+  assert_not_null(store);
+  assert_equal(1, segment_store_size(store));
+  assert_equal(6, segment_store_read(store, 1, copy_record, data));
+  assert_equal_s("second", data);
+  assert_false(segment_store_contains(store, 2));
+} END_TEST
+
+START_TEST (test_torn_record_is_truncated_when_opened) {
+  char data[64];
+  segment_store_put(store, 1, "tokens", 6);
+  segment_store_close(store);
+
+  /* A header claiming more data than was written, as if the process died mid-append. */
+  FILE *file = fopen(STORE_DIR "/segment-000001", "a");
+  fwrite("\0\0\0\2\0\0\0\100abc", 1, 11, file);
+  fclose(file);
+
+  store = segment_store_open(STORE_DIR);
+  assert_not_null(store);
+  assert_equal(1, segment_store_size(store));
+  assert_equal(0, segment_store_put(store, 2, "more", 4));
+  reopen_store();
+  assert_equal(4, segment_store_read(store, 2, copy_record, data));
+  assert_equal_s("more", data);
+} END_TEST
+
+START_TEST (test_compaction_deletes_mostly_dead_segments) {
+  char data[64];
+  int i;
+
+  for (i = 0; i < 10; i++) {
+    segment_store_put(store, 1, "tokens", 6);
+  }
+  segment_store_put(store, 2, "other", 5);
+
+  assert_equal(0, segment_store_compact(store));
+  assert_equal(-1, access(STORE_DIR "/segment-000001", F_OK));
+  assert_equal(6, segment_store_read(store, 1, copy_record, data));
+
+  reopen_store();
+  assert_equal(2, segment_store_size(store));
+  assert_equal(5, segment_store_read(store, 2, copy_record, data));
+  assert_equal_s("other", data);
+} END_TEST
+
+START_TEST (test_compaction_keeps_mostly_live_segments) {
+  segment_store_put(store, 1, "tokens", 6);
+  segment_store_put(store, 2, "other", 5);
+
+  assert_equal(0, segment_store_compact(store));
+  assert_equal(0, access(STORE_DIR "/segment-000001", F_OK));
+} END_TEST
+
+START_TEST (test_compaction_keeps_tombstones_for_records_in_older_segments) {
+  char data[64];
+  segment_store_put(store, 1, "a lot more tokens", 17);
+  segment_store_put(store, 2, "other", 5);
+  segment_store_close(store);
+
+  /* A second segment that only deletes entry 2, so it is compacted while the first is kept. */
+  FILE *file = fopen(STORE_DIR "/segment-000002", "w");
+  fwrite("\0\0\0\2\0\0\0\0", 1, 8, file);
+  fclose(file);
+  store = segment_store_open(STORE_DIR);
+  assert_false(segment_store_contains(store, 2));
+
+  assert_equal(0, segment_store_compact(store));
+  assert_equal(0, access(STORE_DIR "/segment-000001", F_OK));
+  assert_equal(-1, access(STORE_DIR "/segment-000002", F_OK));
+
+  reopen_store();
+  assert_equal(1, segment_store_size(store));
+  assert_false(segment_store_contains(store, 2));
+  assert_equal(17, segment_store_read(store, 1, copy_record, data));
+} END_TEST
+
+START_TEST (test_compaction_drops_tombstones_once_no_older_segment_has_the_entry) {
+  int i;
+
+  for (i = 0; i < 10; i++) {
+    segment_store_put(store, 1, "tokens", 6);
+  }
+  segment_store_delete(store, 1);
+  segment_store_put(store, 2, "other", 5);
+
+  assert_equal(0, segment_store_compact(store));
+  assert_equal(-1, access(STORE_DIR "/segment-000001", F_OK));
+
+  struct stat st;
+  assert_equal(0, stat(STORE_DIR "/segment-000002", &st));
+  assert_equal(13, st.st_size);
+} END_TEST
+
+Suite *
+segment_store_suite(void) {
+  Suite *s = suite_create("Segment Store");
+  TCase *tc_case = tcase_create("segment_store");
+
+  tcase_add_checked_fixture(tc_case, setup_store, teardown_store);
+  tcase_add_test(tc_case, test_read_passes_the_stored_data);
+  tcase_add_test(tc_case, test_read_of_a_missing_entry_fails);
+  tcase_add_test(tc_case, test_put_replaces_the_earlier_record);
+  tcase_add_test(tc_case, test_delete_removes_the_entry);
+  tcase_add_test(tc_case, test_reopened_store_has_the_latest_records);
+  tcase_add_test(tc_case, test_torn_record_is_truncated_when_opened);
+  tcase_add_test(tc_case, test_compaction_deletes_mostly_dead_segments);
+  tcase_add_test(tc_case, test_compaction_keeps_mostly_live_segments);
+  tcase_add_test(tc_case, test_compaction_keeps_tombstones_for_records_in_older_segments);
+  tcase_add_test(tc_case, test_compaction_drops_tombstones_once_no_older_segment_has_the_entry);
+
+  suite_add_tcase(s, tc_case);
+
+  return s;
+}
+
+int main(void) {
+  initialize_logging("test.log");
+  int number_failed;
+
+  SRunner *sr = srunner_create(segment_store_suite());
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  close_log();
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -126,7 +126,8 @@ static ItemCache *missing_item_cache;
 
 static void setup_item_cache_with_missing_items(void) {
   setup_fixture_path();
-  item_cache_create(&missing_item_cache, "fixtures/valid-with-missing", &item_cache_options);
+  system("rm -Rf /tmp/valid-with-missing && cp -R fixtures/valid-with-missing /tmp/valid-with-missing && chmod -R 755 /tmp/valid-with-missing");
+  item_cache_create(&missing_item_cache, "/tmp/valid-with-missing", &item_cache_options);
 }
 
 static void teardown_item_cache_with_missing_items(void) {
@@ -162,7 +163,8 @@ START_TEST (test_retraining_with_item_cache_that_includes_missing_items_adds_tho
 
 static void setup_item_cache_with_some_missing_items(void) {
   setup_fixture_path();
-  item_cache_create(&missing_item_cache, "fixtures/valid-with-some-missing", &item_cache_options);
+  system("rm -Rf /tmp/valid-with-some-missing && cp -R fixtures/valid-with-some-missing /tmp/valid-with-some-missing && chmod -R 755 /tmp/valid-with-some-missing");
+  item_cache_create(&missing_item_cache, "/tmp/valid-with-some-missing", &item_cache_options);
 }
 
 static void teardown_item_cache_with_some_missing_items(void) {